@@ -0,0 +1,82 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Bump allocator for memory that is given back all at once: the scene's
+// BVH, a frame's buffers, a render thread's tile scratch. Allocations are
+// carved, ARENA_ALIGNMENT aligned, out of blocks of at least min_block
+// bytes taken from malloc; when the current block is full, the rest of it
+// is left unused and a new one is taken. Nothing is freed on its own: a
+// mark rolls the arena back to where it was, a reset empties it but keeps
+// its memory for the next round, and arena_free gives the memory back.
+//
+// A zeroed Arena is an empty one with ARENA_MIN_BLOCK blocks. Arenas are
+// not thread safe; each thread takes its own.
+//
+// With huge_pages set, blocks of ARENA_HUGE_PAGE bytes or more are mapped
+// on their own (mmap), aligned to ARENA_HUGE_PAGE and advised for
+// transparent huge pages (madvise), which cuts the TLB misses of walking
+// large arrays at random. Their pages are only placed when first written,
+// and arena_calloc leaves fresh ones alone rather than zeroing them: on a
+// NUMA machine a frame buffer taken this way lands, huge page by huge page,
+// on the node of whichever thread renders into it first.
+
+#define ARENA_ALIGNMENT 64
+#define ARENA_MIN_BLOCK ((size_t)1 << 20)
+#define ARENA_HUGE_PAGE ((size_t)2 << 20)
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+  const char *name;  // for arena_report
+  ArenaBlock *head;  // where allocations come from; the blocks before it follow its link
+  size_t used;       // bytes handed out, alignment padding included
+  size_t peak;       // the most used has been since the last arena_free
+  size_t reserved;   // bytes of the blocks held
+  size_t min_block;  // 0 for ARENA_MIN_BLOCK
+  bool huge_pages;   // map large blocks for transparent huge pages; see above
+} Arena;
+
+// Where an arena was, for arena_release.
+typedef struct {
+  ArenaBlock *head;
+  size_t offset;
+  size_t used;
+} ArenaMark;
+
+void arena_init(Arena *arena, const char *name, size_t min_block);
+
+// size bytes, aligned to ARENA_ALIGNMENT; NULL when malloc fails. A size
+// of 0 still returns a distinct pointer.
+void *arena_alloc(Arena *arena, size_t size);
+
+// count * size zeroed bytes; NULL on overflow or when malloc fails.
+void *arena_calloc(Arena *arena, size_t count, size_t size);
+
+// Makes sure the next size bytes come from one block, taking a new one
+// now if the current one lacks the room; false when malloc fails.
+bool arena_reserve(Arena *arena, size_t size);
+
+ArenaMark arena_mark(const Arena *arena);
+
+// Rolls back to the mark, freeing the blocks taken since. Everything
+// allocated after the mark is invalid from here on.
+void arena_release(Arena *arena, ArenaMark mark);
+
+// Empties the arena. Its blocks are kept, merged into one when there are
+// several, so that the next round of the same allocations fits in a single
+// block.
+void arena_reset(Arena *arena);
+
+// Frees every block; the arena is empty, keeps its name, block size and
+// huge_pages, and may be used again.
+void arena_free(Arena *arena);
+
+// One line: peak and current use, and the blocks held and how many of
+// them are mapped for huge pages.
+void arena_report(const Arena *arena, FILE *out);
+
+#endif // __ARENA_H__
@@ -0,0 +1,115 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <stdint.h>
+#include "arena.h"
+#include "mesh.h"
+#include "sphere.h"
+#include "triangle.h"
+
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_STACK_SIZE 64
+// Deepest a leaf may be, the root being at depth 0. Traversal keeps at most
+// one deferred node per level above the current one, so trees no deeper
+// than this never fill the stack; the build stops splitting there, and
+// trees read from files deeper than this are rejected.
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 1)
+
+// Set in BVHNode.count for leaves holding triangles.
+#define BVH_LEAF_TRIANGLES 0x80000000u
+
+// Slab tests scale the exit distance by 1 + 2 * gamma(3) (Ize, "Robust BVH
+// Ray Traversal", JCGT 2013) to cover its rounding error: without it, a ray
+// through a mesh vertex or edge that lies on a box face can miss the box
+// and slip between triangles the watertight test would have hit.
+#define BVH_ROBUST_SCALE 1.00000036f
+
+// Binary BVH over the scene's spheres and mesh triangles. Primitive ids
+// number the spheres first: id < num_spheres is a sphere, anything above is
+// triangle id - num_spheres. Hit.prim_id uses the same numbering.
+//
+// Nodes are 32 bytes and stored in one array; the children of an interior
+// node are adjacent (left_first, left_first + 1). Every leaf holds one kind
+// of primitive. Sphere leaves reference a range of prim_indices, which in
+// turn index the scene's sphere array, so the spheres themselves are never
+// reordered. Triangle leaves reference a range of packets instead: their
+// triangles are copied into TrianglePackets at build time, so a leaf is
+// tested with SIMD and without touching the mesh's index buffer.
+typedef struct {
+  float bounds_min[3];
+  float bounds_max[3];
+  uint32_t left_first; // interior: left child index; leaf: first prim index or packet
+  uint32_t count;      // sphere leaf: prims; triangle leaf: packets | BVH_LEAF_TRIANGLES; 0 for interior nodes
+} BVHNode;
+
+// Bounds of a node at the end of the frame, in a BVH over moving spheres.
+typedef struct {
+  float bounds_min[3];
+  float bounds_max[3];
+} BVHBounds;
+
+// Moving spheres: the tree is built once, with SAH over each sphere's box
+// swept across the whole frame, and then every node gets two boxes, the
+// node's own at time 0 and end_bounds at time 1. Traversal tests the box
+// interpolated to the ray's time. The box of a sphere moving in a straight
+// line is exactly the interpolation of its end boxes, and a union of
+// interpolations lies inside the interpolation of the unions, so the
+// interpolated box always holds its subtree, and stays as tight as a
+// single frame's where the motion is coherent.
+typedef struct {
+  BVHNode *nodes;
+  BVHBounds *end_bounds; // NULL unless built over moving spheres; parallel to nodes
+  uint32_t *prim_indices;
+  TrianglePacket *packets;
+  uint32_t num_nodes;
+  uint32_t num_prims;
+  uint32_t num_packets;
+  bool owns_memory; // false when the arrays point into a mapped file or an arena
+  void *mapping;    // set when the BVH owns a mapping (BVH cache file)
+  size_t mapping_size;
+} BVH;
+
+// Binned SAH build over the spheres and the mesh's triangles (mesh may be
+// NULL). motion is NULL for still spheres, or per sphere the distance it
+// moves over the frame (see sphere_at). Returns false on allocation failure
+// or when there are more primitives than 32-bit indices can address.
+bool bvh_build(BVH *bvh, const Sphere *spheres, size_t num_spheres, const Vec3f *motion, const Mesh *mesh);
+void bvh_free(BVH *bvh);
+
+// bvh_build with the finished arrays allocated from the arena, side by
+// side in one block; the build's own scratch still comes from malloc and
+// is gone on return. bvh_free then leaves the arrays to the arena.
+bool bvh_build_in(BVH *bvh, Arena *arena, const Sphere *spheres, size_t num_spheres, const Vec3f *motion,
+                  const Mesh *mesh);
+
+// Copies the BVH's arrays into one block of the arena; the copy is freed
+// with the arena (bvh_free leaves it alone). False on allocation failure.
+bool bvh_copy_in(BVH *copy, Arena *arena, const BVH *bvh);
+
+// Checks a BVH read from a file (BVH cache, binary scene) against the
+// primitives it is meant for: every child, leaf range and packet range
+// stays inside the arrays, every index names an existing primitive (and
+// in a sphere leaf, a sphere), and no leaf is deeper than BVH_MAX_DEPTH,
+// so traversal can never read out of bounds or overflow its stack. False
+// on allocation failure too.
+bool bvh_validate(const BVH *bvh, size_t num_spheres, size_t num_triangles);
+
+// Builds over count axis-aligned boxes given as { min x, y, z, max x, y, z };
+// prim ids are the box indices. Used for trees over things bvh_intersect
+// doesn't know, such as instances.
+bool bvh_build_boxes(BVH *bvh, const float (*bounds)[6], size_t count);
+
+// Closest hit along the ray nearer than hit->t. On a hit, hit is updated
+// and true is returned. Triangles are read from the packets, so only the
+// spheres (and their motion, as given to bvh_build) are needed.
+bool bvh_intersect(const BVH *bvh, const Sphere *spheres, const Vec3f *motion, const Ray *ray, Hit *hit);
+
+// Tests one primitive of a box tree: like bvh_intersect, it only accepts a
+// hit nearer than hit->t and returns whether it updated hit.
+typedef bool (*BVHLeafFn)(const void *context, uint32_t prim_id, const Ray *ray, Hit *hit);
+
+// bvh_intersect for a tree from bvh_build_boxes, handing every primitive of
+// a visited leaf to leaf_fn.
+bool bvh_intersect_leaves(const BVH *bvh, BVHLeafFn leaf_fn, const void *context, const Ray *ray, Hit *hit);
+
+#endif // __BVH_H__
@@ -0,0 +1,32 @@
+#ifndef __BVH_CACHE_H__
+#define __BVH_CACHE_H__
+
+#include "bvh.h"
+
+// Scenes smaller than this (spheres plus triangles) build faster than the
+// cache lookup pays off.
+#define BVH_CACHE_MIN_PRIMS 10000
+
+// On-disk BVH cache keyed by a hash of the geometry (sphere centers and
+// radii, triangle corners; materials don't affect the tree). A hit maps the cached file and
+// uses it in place; a miss builds the BVH and writes it back atomically.
+// Cache files are validated structurally before use, so a truncated or
+// corrupt file is treated as a miss and rewritten. Only still spheres are
+// cached; BVHs over moving ones are always built.
+//
+// The directory is $RAYTRACER_CACHE_DIR, else $XDG_CACHE_HOME/raytracer,
+// else $HOME/.cache/raytracer. Hits, misses and timings go to stderr.
+bool bvh_cache_load_or_build(BVH *bvh, const Sphere *spheres, size_t num_spheres, const Mesh *mesh);
+
+// bvh_cache_load_or_build with the BVH's arrays in the arena: a miss builds
+// there (bvh_build_in), and a hit is copied there from the mapped file,
+// which is unmapped again. The copy reads the whole file up front where the
+// mapping would page it in on demand; in exchange the BVH is laid out, and
+// placed, like one that was built.
+bool bvh_cache_load_or_build_in(BVH *bvh, Arena *arena, const Sphere *spheres, size_t num_spheres,
+                                const Mesh *mesh);
+
+uint64_t bvh_hash_spheres(const Sphere *spheres, size_t num_spheres);
+uint64_t bvh_hash_mesh(const Mesh *mesh);
+
+#endif // __BVH_CACHE_H__
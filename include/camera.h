@@ -0,0 +1,63 @@
+#ifndef __CAMERA_H__
+#define __CAMERA_H__
+
+#include <math.h>
+#include "../lib/librayvector.h"
+
+typedef struct {
+  Vec3f position;
+  Vec3f look_at;
+  float fov; // vertical field of view in radians
+} Camera;
+
+// Orthonormal basis and screen scale derived from a Camera for one image
+// size, so generating a primary ray is a couple of multiply-adds.
+typedef struct {
+  Vec3f origin;
+  Vec3f right;
+  Vec3f up;
+  Vec3f forward;
+  float scale_x;
+  float scale_y;
+  int width;
+  int height;
+} CameraFrame;
+
+static inline Camera camera_default(void) {
+  Camera camera;
+  camera.position = vec3f_init_values(0.0f, 0.0f, 0.0f);
+  camera.look_at = vec3f_init_values(0.0f, 0.0f, -1.0f);
+  camera.fov = (float)M_PI / 2.0f; // Set the field of view to 90 degrees
+  return camera;
+}
+
+static inline void camera_frame_init(CameraFrame *frame, const Camera *camera, int width, int height) {
+  Vec3f world_up = vec3f_init_values(0.0f, 1.0f, 0.0f);
+  frame->origin = camera->position;
+  frame->forward = vec3f_normalize(vec3f_sub(camera->look_at, camera->position));
+  frame->right = vec3f_cross(frame->forward, world_up);
+  if (vec3f_norm(frame->right) < 1e-6f) {
+    // Looking straight up or down; any horizontal axis will do.
+    frame->right = vec3f_init_values(1.0f, 0.0f, 0.0f);
+  }
+  frame->right = vec3f_normalize(frame->right);
+  frame->up = vec3f_cross(frame->right, frame->forward);
+  frame->scale_y = tanf(camera->fov / 2);
+  frame->scale_x = frame->scale_y * width / (float)height;
+  frame->width = width;
+  frame->height = height;
+}
+
+// Normalized direction through image position (px, py), measured in pixels
+// from the top-left corner; pixel centers are at +0.5.
+static inline Vec3f camera_frame_direction(const CameraFrame *frame, float px, float py) {
+  float x = (2 * px / (float)frame->width - 1) * frame->scale_x;
+  float y = -(2 * py / (float)frame->height - 1) * frame->scale_y;
+  Vec3f dir;
+  for (int k = 0; k < DIMENSION; k++) {
+    dir.data[k] = frame->right.data[k] * x + frame->up.data[k] * y + frame->forward.data[k];
+  }
+  return vec3f_normalize(dir);
+}
+
+#endif // __CAMERA_H__
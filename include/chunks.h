@@ -0,0 +1,119 @@
+#ifndef __CHUNKS_H__
+#define __CHUNKS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "arena.h"
+#include "bvh.h"
+#include "ray.h"
+#include "sphere.h"
+
+// Sphere sets larger than memory, kept on disk in spatial chunks. The
+// writer splits the spheres at the median of the longer axis of their
+// centers' box until every part holds at most chunk_spheres, then stores
+// each part with its own BVH: the spheres, the nodes and the prim indices,
+// laid out like the arrays of an in-memory BVH and aligned to
+// CHUNKS_ALIGNMENT in the file. The chunk table and its bounds stay in
+// memory; a top-level BVH is built over those bounds when the file is
+// opened.
+//
+// A chunk is mapped (mmap) the first time a ray needs it and stays mapped
+// while the resident chunks fit in the budget; past it, the least recently
+// used chunks are unmapped. Rays are never traced one at a time against
+// the chunks: chunks_trace takes a whole batch, queues every ray on each
+// chunk its segment overlaps, and then visits every chunk with a queue
+// once, tracing the queue against that chunk alone. A chunk is therefore
+// paged in at most once per batch however many rays cross it, and one
+// whose rays have all found nearer hits meanwhile is not touched at all.
+//
+// Like binary scenes, files are expected to come from chunks_save: opening
+// validates the header and the chunk table, not the BVHs.
+
+#define CHUNKS_DEFAULT_SPHERES 65536
+#define CHUNKS_DEFAULT_BUDGET_MB 1024
+#define CHUNKS_ALIGNMENT 4096
+
+// Where a chunk lies in the file. Its spheres start at offset; the nodes
+// and prim indices follow, each 64-byte aligned (see chunks.c).
+typedef struct {
+  float bounds[6]; // { min x, y, z, max x, y, z } of its spheres
+  uint32_t num_spheres;
+  uint32_t num_nodes;
+  uint64_t first_sphere; // the chunk's spheres are numbered from here in the file
+  uint64_t offset;
+  uint64_t bytes;
+} ChunkRecord;
+
+// A mapped chunk, or an unmapped one (mapping NULL).
+typedef struct {
+  void *mapping;
+  size_t mapping_size; // from the page boundary at or before the chunk
+  const Sphere *spheres;
+  BVH bvh;       // points into the mapping
+  uint32_t prev; // LRU neighbours, toward the most and least recently used
+  uint32_t next;
+} ChunkSlot;
+
+typedef struct {
+  uint64_t batches;   // chunks_trace calls
+  uint64_t loads;     // chunks mapped
+  uint64_t evictions; // chunks unmapped to stay within the budget
+  uint64_t bytes_loaded;
+  uint64_t queued;    // (ray, chunk) pairs queued
+  uint64_t skipped;   // of those, dropped because the ray had found a nearer hit
+  size_t peak_bytes;  // most bytes mapped at once
+} ChunkStats;
+
+typedef struct {
+  int fd;
+  ChunkRecord *chunks;
+  ChunkSlot *slots;
+  size_t num_chunks;
+  uint64_t num_spheres;
+  BVH top; // over the chunk bounds
+  size_t budget;
+  size_t resident_bytes;
+  uint32_t lru_head; // most recently used resident chunk, UINT32_MAX when none
+  uint32_t lru_tail;
+  ChunkStats stats;
+} ChunkStore;
+
+// Partitions the spheres into chunks of at most chunk_spheres and writes
+// them with their BVHs. The spheres may themselves be a mapped file; they
+// are read chunk by chunk, and only a 32-bit index per sphere is held in
+// memory, which also limits a file to 2^32 - 1 spheres.
+bool chunks_save(const Sphere *spheres, size_t num_spheres, size_t chunk_spheres, const char *path);
+
+// Opens a chunk file without mapping any chunk; budget_bytes bounds what is
+// mapped at once (one chunk is always allowed, however large).
+bool chunks_open(ChunkStore *store, const char *path, size_t budget_bytes);
+void chunks_close(ChunkStore *store);
+
+// A ray of a chunks_trace batch: hit.t bounds the search on the way in
+// (e.g. the distance to the nearest in-memory hit) and holds the closest
+// chunk hit on the way out, if found. Sphere hits are resolved while their
+// chunk is mapped, since it may be gone when the batch returns; prim_id
+// numbers the spheres within the chunk.
+typedef struct {
+  Ray ray;
+  Hit hit;
+  Vec3f normal; // outward; this and the rest are valid when found
+  uint32_t material_index;
+  uint32_t chunk;
+  bool found;
+} ChunkRay;
+
+// Closest hit of every ray against the chunked spheres. Chunks already
+// mapped are visited first, so what the previous batch left resident is
+// used before it can be evicted; the rest in order of the mean distance at
+// which their rays enter them, so that near chunks shorten the rays
+// before far ones are paged in. The batch's queues are taken from scratch
+// and released before returning. False on allocation or mapping failure.
+bool chunks_trace(ChunkStore *store, Arena *scratch, ChunkRay *rays, size_t count);
+
+// Prints the store's counters as one line.
+void chunks_report(const ChunkStore *store, FILE *out);
+
+#endif // __CHUNKS_H__
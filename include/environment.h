@@ -0,0 +1,45 @@
+#ifndef __ENVIRONMENT_H__
+#define __ENVIRONMENT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "../lib/librayvector.h"
+#include "rng.h"
+
+// The background image used as a light surrounding the scene. The image is
+// read as an equirectangular (latitude/longitude) map: the top row looks
+// along +y, the bottom row along -y, and the middle column along -z (the
+// default camera direction). 8-bit sRGB texels are converted to linear
+// radiance once, at load; callers scale by settings.environment.
+//
+// Sampling uses an alias table over all texels, weighted by luminance times
+// sin(theta) (the solid angle a texel covers), so picking a texel is O(1)
+// whatever the image size. The direction is then jittered uniformly within
+// the texel. The table is built with the environment and reused by every
+// frame and pass.
+typedef struct {
+  Vec3f *radiance;    // width * height, row-major from the top
+  float *probability; // alias table: keep texel i with probability[i] ...
+  uint32_t *alias;    // ... and take alias[i] otherwise
+  float *pmf;         // chance of picking each texel
+  int width;
+  int height;
+} Environment;
+
+// Builds the map and its table from 8-bit texels with `channels` components
+// (the first three are RGB). Returns false on allocation failure or when
+// the image is black.
+bool environment_init(Environment *environment, const unsigned char *pixels, int width, int height, int channels);
+void environment_free(Environment *environment);
+
+// Radiance arriving from direction (unit length).
+Vec3f environment_radiance(const Environment *environment, Vec3f direction);
+
+// Picks a direction in proportion to the table. Returns its radiance and
+// sets *pdf to the probability density per unit solid angle.
+Vec3f environment_sample(const Environment *environment, Rng *rng, Vec3f *direction, float *pdf);
+
+// Density (per unit solid angle) of environment_sample producing direction.
+float environment_pdf(const Environment *environment, Vec3f direction);
+
+#endif // __ENVIRONMENT_H__
@@ -0,0 +1,72 @@
+#ifndef __GRID_H__
+#define __GRID_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sphere.h"
+
+// Uniform grid over still spheres, the alternative to the BVH for scenes
+// of many evenly spread spheres of similar size. Space is cut into cubic
+// cells and every cell lists the spheres whose boxes overlap it; rays walk
+// the cells they cross in order (3D DDA, as in shapes.h) and stop once the
+// closest hit so far lies before the next cell. Building is two linear
+// passes (count, then fill) with no sorting, so it is cheaper than a SAH
+// build.
+//
+// The dense grid stores a list per cell of the scene's bounding box, sized
+// to GRID_CELLS_PER_SPHERE cells per sphere. The hashed grid sizes its
+// cells to the spheres instead and stores only the occupied ones, in a
+// table indexed by a hash of the cell coordinates; cells that collide
+// share a list, which costs extra sphere tests but never a missed hit.
+// It suits sparse scenes, whose bounding box is mostly empty.
+//
+// Lists are ranges of refs (sphere indices) in compressed-row form:
+// list i is refs[cell_start[i] .. cell_start[i + 1]).
+
+#define GRID_CELLS_PER_SPHERE 1
+// Hashed cells are this many mean sphere diameters wide.
+#define GRID_HASHED_CELL_DIAMETERS 2.0f
+#define GRID_MAX_CELLS_PER_AXIS 4096
+
+// ACCEL_AUTO picks the dense grid from this many spheres on, when their
+// radii spread by no more than this (standard deviation over mean) and at
+// least this fraction of coarse cells is occupied (see grid_occupancy).
+#define GRID_AUTO_MIN_SPHERES 4096
+#define GRID_AUTO_MAX_RADIUS_SPREAD 0.5
+#define GRID_AUTO_MIN_OCCUPANCY 0.5
+// Spheres per cell of the coarse grid grid_occupancy counts over.
+#define GRID_OCCUPANCY_SPHERES_PER_CELL 8
+
+typedef struct {
+  float min[3];
+  float cell_size;
+  int32_t dims[3];
+  uint32_t *cell_start; // dense: one per cell, plus one; hashed: one per bucket, plus one
+  uint32_t *refs;
+  uint32_t num_refs;
+  uint32_t num_buckets; // 0 for a dense grid; else a power of two
+} Grid;
+
+// Builds the dense or hashed grid (replacing any existing one). False on
+// allocation failure or too many references for 32-bit indices.
+bool grid_build(Grid *grid, const Sphere *spheres, size_t num_spheres, bool hashed);
+void grid_free(Grid *grid);
+
+static inline bool grid_built(const Grid *grid) {
+  return grid->cell_start != NULL;
+}
+
+// Fraction of the cells of a coarse grid over the spheres' box, about one
+// per GRID_OCCUPANCY_SPHERES_PER_CELL spheres, that hold a sphere center.
+// Evenly spread spheres fill nearly all of them; clustered ones leave most
+// empty, and a dense grid would spend its cells on empty space.
+double grid_occupancy(const Sphere *spheres, size_t num_spheres);
+
+// Bytes of cell lists and refs.
+size_t grid_bytes(const Grid *grid);
+
+// Closest sphere along the ray nearer than hit->t, like bvh_intersect.
+bool grid_intersect(const Grid *grid, const Sphere *spheres, const Ray *ray, Hit *hit);
+
+#endif // __GRID_H__
@@ -0,0 +1,81 @@
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bvh.h"
+#include "mesh.h"
+#include "sphere.h"
+
+// Two-level acceleration structure. An object is geometry stored once in
+// its own coordinates (spheres and a mesh, with prim ids numbered like the
+// scene's) under its own bottom-level BVH. An instance places an object in
+// the world with an affine transform; the top-level BVH is built over the
+// instances' world bounds. A ray that reaches an instance is carried into
+// object space and traced through the object's BVH, so geometry memory
+// grows with the number of distinct objects, and each placement costs only
+// its Instance and a share of the top-level tree. Objects stand still; only
+// the scene's own spheres move.
+
+typedef struct {
+  Sphere *spheres;
+  size_t num_spheres;
+  size_t sphere_capacity; // 0 when the spheres live in a mapped file
+  Mesh mesh;
+  BVH bvh;         // bottom level, in object space; empty until scene_object_build
+  float bounds[6]; // object space { min x, y, z, max x, y, z }
+} SceneObject;
+
+// 3x4 row-major affine matrices: the last column is the translation.
+typedef struct {
+  float object_to_world[3][4];
+  float world_to_object[3][4];
+  uint32_t object; // index into the scene's objects
+} Instance;
+
+// Frees the BVH and whatever geometry the object owns.
+void scene_object_free(SceneObject *object);
+
+// (Re)builds the object's BVH and bounds.
+bool scene_object_build(SceneObject *object);
+
+// Bytes of geometry and BVH the object holds.
+size_t scene_object_bytes(const SceneObject *object);
+
+// Closest hit against the object's geometry in object space, through its
+// BVH when built.
+bool scene_object_intersect(const SceneObject *object, const Ray *ray, Hit *hit);
+
+// Closest hit by testing every sphere, at the ray's time when motion is not
+// NULL, and triangle (mesh may be NULL); triangle prim ids follow the
+// spheres.
+bool geometry_intersect_all(const Sphere *spheres, size_t num_spheres, const Vec3f *motion, const Mesh *mesh,
+                            const Ray *ray, Hit *hit);
+
+// Scale, then rotate by rotate_degrees about x, then y, then z, then
+// translate.
+void instance_transform(float matrix[3][4], float scale, const float rotate_degrees[3], const float translate[3]);
+
+// Sets the matrices from object_to_world; false when it is not invertible.
+bool instance_init(Instance *instance, uint32_t object, const float object_to_world[3][4]);
+
+// Carries a world ray into object space with a normalized direction and
+// returns the factor that converts world distances along it into object
+// distances (the length of the transformed direction).
+float instance_ray_to_object(const Instance *instance, const Ray *ray, Ray *local);
+
+// Object space normal to a normalized world normal (inverse transpose).
+Vec3f instance_normal_to_world(const Instance *instance, Vec3f normal);
+
+// Builds the top-level BVH over the instances' world bounds; the objects'
+// bounds must be current.
+bool instances_build_bvh(BVH *bvh, const Instance *instances, size_t num_instances, const SceneObject *objects);
+
+// Closest hit nearer than hit->t against every instance, through the
+// top-level BVH when built. A hit sets hit->instance_id and an object prim
+// id; hit->t stays a world distance.
+bool instances_intersect(const BVH *bvh, const Instance *instances, size_t num_instances, const SceneObject *objects,
+                         const Ray *ray, Hit *hit);
+
+#endif // __INSTANCE_H__
@@ -6,5 +6,40 @@
 typedef struct Light {
     Vec3f position;
     float intensity;
+    float radius; // 0 = point light; > 0 = spherical area light (path tracer)
+    float range;  // distance at which the light fades out; 0 = no falloff
 } Light;
+
+// Smooth window that takes a light from full strength at distance 0 to
+// nothing at `range` (as in Karis, "Real Shading in Unreal Engine 4"),
+// without the inverse-square term so that lights with no range keep the
+// old constant-irradiance behavior. Monotonic, so a lower bound on distance
+// gives an upper bound on the falloff.
+static inline float light_falloff(float range, float distance) {
+    if (range <= 0.0f) {
+        return 1.0f;
+    }
+    float x = distance / range;
+    if (x >= 1.0f) {
+        return 0.0f;
+    }
+    float x2 = x * x;
+    float window = 1.0f - x2 * x2;
+    return window * window;
+}
+
+// Irradiance one light delivers to a surface point (no shadowing); the
+// Lambert term scaled by the light's falloff.
+static inline float light_irradiance(const Light *light, Vec3f point, Vec3f normal) {
+    Vec3f to_light = vec3f_sub(light->position, point);
+    float distance = vec3f_norm(to_light);
+    if (distance <= 0.0f) {
+        return 0.0f;
+    }
+    float cos_theta = vec3f_dot(to_light, normal) / distance;
+    if (cos_theta <= 0.0f) {
+        return 0.0f;
+    }
+    return light->intensity * cos_theta * light_falloff(light->range, distance);
+}
 #endif // __LIGHT_H__
@@ -0,0 +1,78 @@
+#ifndef __LIGHT_BVH_H__
+#define __LIGHT_BVH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "light.h"
+#include "rng.h"
+
+#define LIGHT_BVH_MAX_LEAF_SIZE 4
+#define LIGHT_BVH_STACK_SIZE 64
+
+// Binary hierarchy over the scene's lights for many-light shading. Every node
+// stores a bounding box and sphere of its lights (including their radius),
+// their summed intensity and their largest range. From a shading point, that
+// gives an upper bound on the irradiance the whole subtree can deliver: the
+// power times the falloff at the nearest distance a light can be, times the
+// cosine between the normal and the cone the sphere subtends (0 when it lies
+// entirely below the horizon). Layout follows BVHNode: children are adjacent
+// at left_first, leaves reference a range of light_indices.
+typedef struct {
+  float bounds_min[3];
+  float bounds_max[3];
+  float center[3];
+  float radius;
+  float power;
+  float range; // 0 when some light below never fades out
+  uint32_t left_first;
+  uint32_t count;
+} LightNode;
+
+typedef struct {
+  LightNode *nodes;
+  uint32_t *light_indices;
+  uint32_t *parents;     // per node, UINT32_MAX for the root
+  uint32_t *light_leaf;  // per light, the leaf that holds it
+  uint32_t *area_lights; // lights with radius > 0, which rays can hit
+  uint32_t num_nodes;
+  uint32_t num_lights;
+  uint32_t num_area_lights;
+} LightBVH;
+
+bool light_bvh_build(LightBVH *tree, const Light *lights, size_t num_lights);
+void light_bvh_free(LightBVH *tree);
+
+// Upper bound on light_irradiance for one light, used for culling and as the
+// sampling weight of individual lights.
+float light_bound(const Light *light, Vec3f point, Vec3f normal);
+
+typedef void (*LightVisitor)(uint32_t light_index, float pmf, void *user);
+
+// Visits (with pmf 1) every light whose bound at (point, normal) reaches
+// threshold, skipping whole subtrees whose bound doesn't. Lights out of range
+// or below the horizon are skipped even with a threshold of 0. Returns the
+// number of lights visited.
+size_t light_bvh_cull(const LightBVH *tree, const Light *lights, Vec3f point, Vec3f normal, float threshold,
+                      LightVisitor visit, void *user);
+
+// Bound on light_irradiance for one light anywhere in the box [box_min,
+// box_max], at any orientation: its intensity times the falloff at the
+// box's nearest point.
+float light_box_bound(const Light *light, const float box_min[3], const float box_max[3]);
+
+// Writes to light_indices (room for tree->num_lights) every light whose
+// light_box_bound reaches threshold, skipping subtrees by their own box
+// bound, and returns how many there are. Used to build per-tile light lists.
+size_t light_bvh_collect_box(const LightBVH *tree, const Light *lights, const float box_min[3], const float box_max[3],
+                             float threshold, uint32_t *light_indices);
+
+// Picks one light by walking down the tree, choosing each child in
+// proportion to its bound. Returns false when no light can contribute.
+bool light_bvh_sample(const LightBVH *tree, const Light *lights, Vec3f point, Vec3f normal, Rng *rng,
+                      uint32_t *light_index, float *pmf);
+
+// Probability that light_bvh_sample picks light_index at (point, normal).
+float light_bvh_pmf(const LightBVH *tree, const Light *lights, Vec3f point, Vec3f normal, uint32_t light_index);
+
+#endif // __LIGHT_BVH_H__
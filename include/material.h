@@ -1,5 +1,48 @@
+#ifndef __MATERIAL_H__
+#define __MATERIAL_H__
+
+#include <stdbool.h>
 #include "../lib/librayvector.h"
 
+// A surface is a blend of diffuse, mirror and glass. reflectivity and
+// transparency are the fractions of light sent into the reflected and
+// refracted rays; whatever is left over is shaded as diffuse. roughness > 0
+// jitters the reflected direction for glossy surfaces.
+//
+// On top of that, the Whitted shader adds a Blinn-Phong highlight for every
+// light, specular_color * intensity * (n.h)^specular_exponent, and every
+// shader adds the surface's own emission.
 typedef struct Material {
   Vec3f material_color;
+  float reflectivity;
+  float transparency;
+  float refractive_index;
+  float roughness;
+  Vec3f specular_color;
+  float specular_exponent;
+  Vec3f emission;
 } Material;
+
+static inline Material material_diffuse(Vec3f color) {
+  Material material;
+  material.material_color = color;
+  material.reflectivity = 0.0f;
+  material.transparency = 0.0f;
+  material.refractive_index = 1.0f;
+  material.roughness = 0.0f;
+  material.specular_color = vec3f_init();
+  material.specular_exponent = 1.0f;
+  material.emission = vec3f_init();
+  return material;
+}
+
+static inline float material_diffuse_weight(const Material *material) {
+  float weight = 1.0f - material->reflectivity - material->transparency;
+  return weight > 0.0f ? weight : 0.0f;
+}
+
+static inline bool material_has_specular(const Material *material) {
+  const float *s = material->specular_color.data;
+  return s[0] > 0.0f || s[1] > 0.0f || s[2] > 0.0f;
+}
+#endif // __MATERIAL_H__
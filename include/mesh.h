@@ -0,0 +1,45 @@
+#ifndef __MESH_H__
+#define __MESH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../lib/librayvector.h"
+
+// Three indices into the mesh's vertex arrays; counter-clockwise seen from
+// the front.
+typedef struct {
+  uint32_t v[3];
+  uint32_t material_index; // into the scene's material table
+} Triangle;
+
+// All triangles of a scene in one indexed buffer: every triangle stores 16
+// bytes and vertices shared between triangles are stored once. normals is
+// NULL when no vertex has one; otherwise it parallels vertices and a zero
+// entry means "use the face normal".
+typedef struct {
+  Vec3f *vertices;
+  Vec3f *normals;
+  Triangle *triangles;
+  size_t num_vertices;
+  size_t num_triangles;
+  size_t vertex_capacity;   // 0 when the arrays live in a mapped file
+  size_t triangle_capacity;
+} Mesh;
+
+void mesh_free(Mesh *mesh);
+
+// Append one vertex (normal may be NULL) or triangle. Indices are not
+// checked here; callers validate them against num_vertices.
+bool mesh_add_vertex(Mesh *mesh, Vec3f position, const Vec3f *normal);
+bool mesh_add_triangle(Mesh *mesh, uint32_t a, uint32_t b, uint32_t c, uint32_t material_index);
+
+// Appends a Wavefront OBJ file to mesh: v, vn and f statements (faces with
+// more than three corners are fanned, negative indices count back from the
+// last vertex). Corners sharing a position and normal become one mesh
+// vertex. Every triangle gets material_index; usemtl/mtllib, texture
+// coordinates and other statements are ignored. Positions are scaled, then
+// translated. Errors go to stderr.
+bool mesh_load_obj(Mesh *mesh, const char *path, uint32_t material_index, float scale, Vec3f translate);
+
+#endif // __MESH_H__
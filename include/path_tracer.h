@@ -0,0 +1,56 @@
+#ifndef __PATH_TRACER_H__
+#define __PATH_TRACER_H__
+
+#include "render.h"
+
+// Unidirectional path tracer. Diffuse vertices sample the lights chosen by
+// settings.light_sampling directly (next-event estimation) and continue
+// along a cosine-weighted direction; mirror, glossy and glass lobes are
+// picked stochastically by their weights.
+//
+// Lights keep the Whitted shader's convention of no inverse-square falloff
+// (only the optional range window): a light delivers irradiance
+// pi * intensity at normal incidence, so a diffuse surface lit by one point
+// light matches cast_ray's direct term (plus shadows). Point lights
+// (radius 0) can only be reached by next-event estimation. Spherical lights (radius > 0) are also hit by BSDF-sampled
+// rays, and the two strategies are combined with multiple importance
+// sampling (power heuristic). Lights are not visible to camera rays.
+// Emissive materials add their emission wherever a path hits them; they are
+// not sampled directly. Blinn-Phong highlights are left to the Whitted
+// shader; here only roughness makes a surface glossy.
+//
+// With settings.environment set, diffuse vertices also take one sample from
+// the environment's table, combined the same way with bounces that escape
+// the scene. Camera rays that miss still show the stretched background.
+
+// Running sum of radiance per pixel; the image is sum / samples.
+typedef struct {
+  Vec3f *sum;
+  int width;
+  int height;
+  uint32_t samples;
+} Accumulator;
+
+// The sum is taken from arena (the frame's), zeroed; it lives as long as
+// the arena, and accumulator_free only forgets it. False when the arena
+// can't supply it. With the arena's huge_pages set, its pages are placed
+// by the threads of the first pass, which write them first.
+bool accumulator_init(Accumulator *accumulator, Arena *arena, int width, int height);
+void accumulator_free(Accumulator *accumulator);
+
+// Writes the current estimate into frame_buffer, on the render workers
+// when set (see render_set_workers) and OpenMP's team otherwise.
+void accumulator_resolve(const Accumulator *accumulator, Vec3f *frame_buffer);
+
+// Adds one jittered sample per pixel and returns the number of rays traced
+// (camera, bounce and shadow rays). Counts are added to *stats if non-NULL.
+uint64_t path_trace_pass(const Scene *scene, Accumulator *accumulator, RenderStats *stats);
+
+// Called after 1, 2, 4, 8, ... samples per pixel and after the last one.
+typedef void (*PathTraceProgress)(const Accumulator *accumulator, void *user);
+
+// Runs passes until the accumulator holds settings.samples samples per pixel.
+uint64_t path_trace_progressive(const Scene *scene, Accumulator *accumulator, RenderStats *stats,
+                                PathTraceProgress progress, void *user);
+
+#endif // __PATH_TRACER_H__
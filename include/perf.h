@@ -0,0 +1,43 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Hardware counters collected around a measured region. On Linux these come
+// from perf_event_open(2); elsewhere (or when the kernel refuses access, e.g.
+// perf_event_paranoid > 2) the counters are simply reported as unavailable and
+// only wall-clock time is measured.
+typedef enum {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_COUNTER_COUNT
+} PerfCounterId;
+
+typedef struct {
+  int fds[PERF_COUNTER_COUNT];
+  bool available[PERF_COUNTER_COUNT];
+  uint64_t values[PERF_COUNTER_COUNT];
+  double start_time;
+  double elapsed_seconds;
+} PerfCounters;
+
+// Monotonic wall-clock time in seconds.
+double perf_now_seconds(void);
+
+// Opens the hardware counters if enable_hardware is set. Counters are opened
+// with inherit, so threads spawned after this call are counted as well.
+void perf_counters_init(PerfCounters *counters, bool enable_hardware);
+void perf_counters_start(PerfCounters *counters);
+void perf_counters_stop(PerfCounters *counters);
+void perf_counters_close(PerfCounters *counters);
+
+// Prints one line: label, time, rays/s and every available counter (plus IPC
+// and per-ray figures). rays may be 0 when the region doesn't trace rays.
+void perf_counters_report(const PerfCounters *counters, const char *label, uint64_t rays, FILE *out);
+
+#endif // __PERF_H__
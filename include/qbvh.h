@@ -0,0 +1,116 @@
+#ifndef __QBVH_H__
+#define __QBVH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bvh.h"
+
+// A BVH with its node boxes quantized to 8 bits, to cut the memory and
+// bandwidth its nodes take on large scenes. It is made from a built BVH
+// and keeps its tree: same nodes, same order, same leaves.
+//
+// Each box is stored relative to its parent's: per axis, its min and max
+// as a number of QBVH_STEPS-ths of the parent box's extent, counted up from
+// the parent's min and down from its max. Traversal decodes the boxes on
+// the way down, keeping the decoded box of every node it defers on the
+// stack, so a node is 12 bytes instead of BVHNode's 32 and two siblings
+// share most of a cache line.
+//
+// Rounding is conservative: the encoder decodes with the same arithmetic
+// as traversal and picks the codes whose decoded box holds the node's true
+// box, so no ray can miss a primitive it would hit in the BVH. The decoded
+// box exceeds the true one by less than one step of its decoded parent,
+// 1/255 of the parent's extent, on each side; the loss is a few extra
+// nodes visited. (A sphere's own test is less exact than the box test for
+// rays that graze it, so a looser box can let through one of its false
+// hits the BVH would have culled; images differ in a few silhouette
+// pixels of small, distant spheres.) The root's box is kept in full.
+//
+// Decoding costs more arithmetic per node than the smaller fetches save on
+// the scenes measured so far (see raytracer_bench), so ACCEL_AUTO never
+// picks it: it trades speed for memory, for scenes whose full BVH would
+// not fit.
+//
+// Sphere leaves may go further and hold their spheres packed (see
+// qbvh_pack_spheres) in place of prim indices into the scene's array: 10
+// bytes a sphere, and 4 a leaf, instead of 20 plus a 4 byte index. A packed
+// center is stored per axis in QBVH_CENTER_STEPS-ths of its leaf's decoded
+// box, rounded to the nearest, and decoded by the leaf kernel from the box
+// traversal already holds; the radius is an IEEE half, also rounded to the
+// nearest. Decoded spheres are thus off by at most, per axis of the center,
+// half a step of 1/65535 of the leaf box's extent, and for the radius
+// 2^-11 of itself, so the surface moves by at most sqrt(3)/2 * extent /
+// 65535 + radius * 2^-11 (about 1.3e-5 of a 1 unit leaf plus 0.05% of the
+// radius). A packed sphere is not re-bounded: where the error pushes it past
+// its leaf's box, the box clips it, within that same bound of the true
+// surface. (Hit distances move by more than that along grazing rays, and
+// sphere_intersect_closer's own rounding for small, distant spheres is
+// about as sensitive, so such scenes render with scattered pixel changes.)
+
+#define QBVH_STEPS 255
+#define QBVH_CENTER_STEPS 65535
+
+// Set in QBVHNode.count for leaves holding triangles.
+#define QBVH_LEAF_TRIANGLES 0x8000u
+
+typedef struct {
+  uint8_t planes[6];   // { min x, y, z, max x, y, z }, in steps in from the parent's
+  uint16_t count;      // as BVHNode.count, with QBVH_LEAF_TRIANGLES
+  uint32_t left_first; // as BVHNode.left_first; into packed for packed sphere leaves
+} QBVHNode;
+
+typedef struct {
+  uint16_t center[3]; // in QBVH_CENTER_STEPS-ths of the leaf box's extent, up from its min
+  uint16_t radius;    // IEEE half precision
+  uint16_t material;  // material_index
+} PackedSphere;
+
+typedef struct {
+  float bounds[6]; // the root's, { min x, y, z, max x, y, z }
+  QBVHNode *nodes;
+  uint32_t *prim_indices; // NULL once the spheres are packed
+  PackedSphere *packed;   // NULL unless packed; ordered by leaf, so hits number spheres by slot here
+  uint32_t *packed_leaves; // the sphere leaves, in slot order
+  TrianglePacket *packets;
+  uint32_t num_nodes;
+  uint32_t num_prims;
+  uint32_t num_packets;
+  uint32_t num_packed;
+  uint32_t num_packed_leaves;
+} QBVH;
+
+// Quantizes the BVH's nodes and copies its prim indices and triangle
+// packets, so the BVH may be freed afterwards. BVHs over moving spheres
+// are not supported. False on allocation failure or a leaf too large for
+// 15 bits.
+bool qbvh_build(QBVH *qbvh, const BVH *bvh);
+
+// Whether every leaf of the BVH fits the 15 bits of a quantized node's
+// count. Leaves are small unless the build hit its depth cap
+// (BVH_MAX_DEPTH), where what is left becomes one leaf however large.
+bool qbvh_fits(const BVH *bvh);
+void qbvh_free(QBVH *qbvh);
+
+// Packs the spheres the prim indices refer to into the leaves and drops the
+// indices. Sphere leaves are renumbered to consecutive ranges of packed, and
+// a hit's prim_id becomes the sphere's slot there rather than its index in
+// spheres, which is no longer read. False, leaving the QBVH as it was, on
+// allocation failure, a radius outside the half range [2^-14, 65504], a
+// material index above 65535 or nodes not numbered as bvh_build numbers
+// them.
+bool qbvh_pack_spheres(QBVH *qbvh, const Sphere *spheres, size_t num_spheres);
+
+// The packed sphere in the given slot, decoded as the leaf kernel decodes
+// it: its leaf is found by binary search over packed_leaves, and its box
+// decoded on the way down to it.
+Sphere qbvh_packed_sphere(const QBVH *qbvh, uint32_t slot);
+
+// Bytes of nodes, prim indices, packed spheres and their leaves, and packets.
+size_t qbvh_bytes(const QBVH *qbvh);
+
+// Closest hit along the ray nearer than hit->t, like bvh_intersect over
+// still spheres; spheres is not read once they are packed.
+bool qbvh_intersect(const QBVH *qbvh, const Sphere *spheres, const Ray *ray, Hit *hit);
+
+#endif // __QBVH_H__
@@ -0,0 +1,47 @@
+#ifndef __RAY_H__
+#define __RAY_H__
+
+#include <stdint.h>
+#include "../lib/librayvector.h"
+
+typedef struct {
+  Vec3f origin;
+  Vec3f direction; // normalized
+  float time;      // when in the frame the ray is cast, in [0, 1]; moves moving spheres
+} Ray;
+
+// instance_id of a hit on the scene's own geometry.
+#define HIT_NO_INSTANCE UINT32_MAX
+
+// What traversal tracks: the closest distance so far and which primitive
+// produced it. Everything else about the surface is derived afterwards.
+typedef struct {
+  float t;
+  uint32_t prim_id;     // numbered within the scene, or within the instance's object
+  uint32_t instance_id; // HIT_NO_INSTANCE unless the primitive belongs to an instance
+} Hit;
+
+static inline Ray ray_init(Vec3f origin, Vec3f direction) {
+  Ray ray;
+  ray.origin = origin;
+  ray.direction = direction;
+  ray.time = 0.0f;
+  return ray;
+}
+
+// A ray cast at the given time; secondary rays take their parent's.
+static inline Ray ray_init_at(Vec3f origin, Vec3f direction, float time) {
+  Ray ray = ray_init(origin, direction);
+  ray.time = time;
+  return ray;
+}
+
+static inline Vec3f ray_at(const Ray *ray, float t) {
+  Vec3f point;
+  for (int k = 0; k < DIMENSION; k++) {
+    point.data[k] = ray->origin.data[k] + ray->direction.data[k] * t;
+  }
+  return point;
+}
+
+#endif // __RAY_H__
@@ -0,0 +1,142 @@
+#ifndef __RENDER_H__
+#define __RENDER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include "environment.h"
+#include "rng.h"
+#include "scene.h"
+#include "workers.h"
+
+// Defaults for scenes that don't specify their own render settings.
+#define WIDTH 1024
+#define HEIGHT 768
+#define SUPER_SAMPLING 4  // Adjust this for anti-aliasing level
+#define MAX_DEPTH 6
+#define RR_DEPTH 3
+#define PATH_SAMPLES 32
+#define LIGHT_THRESHOLD 1e-3f
+
+// render_frame works on square tiles of this many pixels per side.
+#define RENDER_TILE_SIZE 16
+
+// Upper bound for settings.max_depth; sizes the per-depth ray counters.
+#define RENDER_MAX_DEPTH_LIMIT 32
+
+// Upper bound for settings.width * settings.height, so that pixel indices
+// (i + j * width) stay within an int.
+#define RENDER_MAX_PIXELS (1 << 28)
+
+// Rays traced per depth (0 = primary) and why secondary paths ended.
+typedef struct {
+  uint64_t rays[RENDER_MAX_DEPTH_LIMIT + 1];
+  uint64_t shadow_rays;
+  uint64_t shading_points;  // light selections made
+  uint64_t lights_evaluated; // lights visited by those selections
+  uint64_t tiles;            // tile light lists built (LIGHTS_TILED)
+  uint64_t tile_lights;      // total length of those lists
+  uint64_t roulette_terminated;
+  uint64_t depth_terminated;
+  uint64_t scratch_peak;     // bytes, the most a render thread's (or a streamed frame's) scratch arena held
+} RenderStats;
+
+// Per-thread state threaded through the recursion: the sampler used for
+// Russian roulette and glossy jitter, and the counters to update.
+typedef struct {
+  Rng rng;
+  RenderStats *stats;
+} RenderContext;
+
+// The background image is stretched over the screen for primary rays that
+// miss every sphere. Loading is optional; without it the flat background
+// color is used. Loading also builds the environment map (and its sampling
+// table) from the image, once for every frame rendered afterwards.
+bool render_load_background(const char *path);
+void render_free_background(void);
+
+// The environment lighting the scene, or NULL when settings.environment is
+// 0 or no background is loaded. Radiance from it is scaled by
+// settings.environment.
+const Environment *render_environment(const Scene *scene);
+
+// Radiance for a secondary ray that leaves the scene: the environment when
+// there is one, the flat background color otherwise.
+Vec3f render_miss_color(const Scene *scene, const Ray *ray);
+
+// The stretched background image behind pixel (x, y), for primary misses.
+Vec3f render_screen_background(int x, int y, int width, int height);
+
+// Calls visit for the lights that shade (point, normal) according to
+// settings.light_sampling: every light with pmf 1 (exact), every light
+// whose bound passes light_threshold with pmf 1 (cull, and tiled away from
+// primary hits), or at most one light with the probability it was picked
+// (sample). Counts go to context->stats.
+void render_select_lights(const Scene *scene, Vec3f point, Vec3f normal, RenderContext *context,
+                          LightVisitor visit, void *user);
+
+// Probability that render_select_lights visits light_index at (point,
+// normal): 1 or 0 except in sample mode.
+float render_light_pmf(const Scene *scene, Vec3f point, Vec3f normal, uint32_t light_index);
+
+// When in the frame sample `index` at pixel (x, y) looks, within the open
+// shutter: the van der Corput sequence, so that every first 2^k samples of
+// a pixel split the shutter evenly, rotated by a hash of the pixel so that
+// neighbours fill in each other's gaps. Motion blur rides on the samples a
+// pixel takes anyway and needs no extra rays.
+float render_time_sample(const Scene *scene, int x, int y, uint32_t index);
+
+// Sub-pixel (s, t) of pixel (i, j); the same ray every time it is asked for.
+static inline Ray render_primary_ray(const Scene *scene, const CameraFrame *camera, int i, int j, int s, int t,
+                                     int super_sampling) {
+  float time = render_time_sample(scene, i, j, (uint32_t)(s * super_sampling + t));
+  return ray_init_at(camera->origin,
+                     camera_frame_direction(camera, i + (s + 0.5f) / super_sampling, j + (t + 0.5f) / super_sampling),
+                     time);
+}
+
+// Emitted plus directly reflected light at a hit, from the lights
+// render_select_lights picks; what cast_ray adds before mirror and glass.
+Vec3f render_direct_color(const Scene *scene, const Ray *ray, const HitRecord *record, RenderContext *context);
+
+// Returns the radiance along a ray at the given depth, or the flat
+// background color on a miss. Mirror and glass surfaces recurse up to
+// settings.max_depth; from settings.rr_depth on, a secondary ray survives
+// Russian roulette with probability max(throughput) and is reweighted by its
+// inverse. throughput is the ray's (unclamped) weight in the final pixel.
+Vec3f cast_ray(const Scene *scene, const Ray *ray, int depth, Vec3f throughput, RenderContext *context);
+
+// Renders the scene into frame_buffer (settings.width * settings.height
+// pixels, zero initialized) and returns the number of rays traced at all
+// depths. stats, when non-NULL, receives the per-depth breakdown.
+//
+// The image is processed tile by tile: all primary rays of a tile are traced
+// first, then shaded. With LIGHTS_TILED, the box around the tile's primary
+// hit points is tested against the light BVH in between (intensity times
+// falloff at the box, against light_threshold), and direct lighting of those
+// hits only loops over the resulting list. Mirror and glass rays leave the
+// box, so their hits select lights as in LIGHTS_CULL. When the primary hits
+// share a light list (LIGHTS_TILED and LIGHTS_EXACT), they are lit together
+// by the batched kernel in shading.h.
+//
+// Each thread traces through scene_for_thread's view of the scene, and only
+// writes the frame buffer's pixels of the tiles it renders, so a frame
+// buffer whose pages are not yet placed (see arena.h) is placed by the
+// threads rendering it.
+uint64_t render_frame(const Scene *scene, Vec3f *frame_buffer, RenderStats *stats);
+
+// Has render_frame spread its tiles, and path_trace_pass its rows, over
+// workers (see workers.h) rather than OpenMP's team; NULL goes back to
+// OpenMP. The workers are used by one frame (or pass) at a time, and must
+// outlive the frames rendered with them.
+void render_set_workers(Workers *workers);
+
+// The workers set by render_set_workers; NULL when there are none.
+Workers *render_get_workers(void);
+
+void render_stats_add(RenderStats *into, const RenderStats *from);
+uint64_t render_stats_total(const RenderStats *stats);
+void render_stats_report(const RenderStats *stats, FILE *out);
+
+bool write_ppm(const char *path, const Vec3f *frame_buffer, int width, int height);
+
+#endif // __RENDER_H__
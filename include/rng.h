@@ -0,0 +1,50 @@
+#ifndef __RNG_H__
+#define __RNG_H__
+
+#include <stdint.h>
+
+// PCG32 (O'Neill, pcg-random.org): small, fast and, most importantly for us,
+// fully deterministic for a given seed and stream on every platform.
+typedef struct {
+  uint64_t state;
+  uint64_t inc;
+} Rng;
+
+static inline uint32_t rng_next_u32(Rng *rng) {
+  uint64_t old = rng->state;
+  rng->state = old * 6364136223846793005ULL + rng->inc;
+  uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+  uint32_t rot = (uint32_t)(old >> 59u);
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+static inline void rng_seed(Rng *rng, uint64_t seed, uint64_t stream) {
+  rng->state = 0u;
+  rng->inc = (stream << 1u) | 1u;
+  rng_next_u32(rng);
+  rng->state += seed;
+  rng_next_u32(rng);
+}
+
+// Uniform float in [0, 1).
+static inline float rng_next_float(Rng *rng) {
+  return (float)(rng_next_u32(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Uniform float in [lo, hi).
+static inline float rng_range(Rng *rng, float lo, float hi) {
+  return lo + (hi - lo) * rng_next_float(rng);
+}
+
+// Uniform integer in [0, bound) without modulo bias.
+static inline uint32_t rng_bounded(Rng *rng, uint32_t bound) {
+  uint32_t threshold = (-bound) % bound;
+  for (;;) {
+    uint32_t r = rng_next_u32(rng);
+    if (r >= threshold) {
+      return r % bound;
+    }
+  }
+}
+
+#endif // __RNG_H__
@@ -0,0 +1,128 @@
+#ifndef __SCATTER_H__
+#define __SCATTER_H__
+
+#include <math.h>
+#include "material.h"
+#include "rng.h"
+
+// Scattering helpers shared by the Whitted shader (cast_ray) and the path
+// tracer, so both agree on how a material splits incoming light.
+
+// Secondary rays start this far off the surface so they don't hit it again.
+#define RAY_EPSILON 1e-3f
+
+static inline Vec3f scatter_scale(Vec3f v, float s) {
+  return vec3f_init_values(v.data[0] * s, v.data[1] * s, v.data[2] * s);
+}
+
+static inline Vec3f scatter_mul(Vec3f a, Vec3f b) {
+  return vec3f_init_values(a.data[0] * b.data[0], a.data[1] * b.data[1], a.data[2] * b.data[2]);
+}
+
+static inline Vec3f scatter_offset(Vec3f point, Vec3f normal, float distance) {
+  return vec3f_add(point, scatter_scale(normal, distance));
+}
+
+static inline float scatter_max_component(Vec3f v) {
+  float m = v.data[0] > v.data[1] ? v.data[0] : v.data[1];
+  return m > v.data[2] ? m : v.data[2];
+}
+
+static inline Vec3f scatter_random_in_unit_sphere(Rng *rng) {
+  for (;;) {
+    Vec3f v = vec3f_init_values(rng_range(rng, -1.0f, 1.0f), rng_range(rng, -1.0f, 1.0f), rng_range(rng, -1.0f, 1.0f));
+    if (vec3f_dot(v, v) <= 1.0f) {
+      return v;
+    }
+  }
+}
+
+// Orthonormal basis around a unit vector (Duff et al. 2017).
+static inline void scatter_basis(Vec3f n, Vec3f *tangent, Vec3f *bitangent) {
+  float sign = copysignf(1.0f, n.data[2]);
+  float a = -1.0f / (sign + n.data[2]);
+  float b = n.data[0] * n.data[1] * a;
+  *tangent = vec3f_init_values(1.0f + sign * n.data[0] * n.data[0] * a, sign * b, -sign * n.data[0]);
+  *bitangent = vec3f_init_values(b, sign + n.data[1] * n.data[1] * a, -n.data[1]);
+}
+
+// Direction at angle acos(cos_theta) from axis, rotated by phi around it.
+static inline Vec3f scatter_around(Vec3f axis, float cos_theta, float phi) {
+  Vec3f tangent, bitangent;
+  scatter_basis(axis, &tangent, &bitangent);
+  float sin_theta = sqrtf(fmaxf(0.0f, 1.0f - cos_theta * cos_theta));
+  return vec3f_add(vec3f_add(scatter_scale(tangent, sin_theta * cosf(phi)), scatter_scale(bitangent, sin_theta * sinf(phi))),
+                   scatter_scale(axis, cos_theta));
+}
+
+// Cosine-weighted direction in the hemisphere around n; pdf = cos / pi.
+static inline Vec3f scatter_cosine_hemisphere(Vec3f n, Rng *rng) {
+  float u = rng_next_float(rng);
+  return scatter_around(n, sqrtf(1.0f - u), 2.0f * (float)M_PI * rng_next_float(rng));
+}
+
+// How a surface hit splits into diffuse, reflected and refracted light. The
+// normal is flipped to face the incoming ray; for glass the transparent part
+// is divided between reflection and refraction by Schlick's Fresnel term,
+// all of it reflecting under total internal reflection.
+typedef struct {
+  Vec3f normal;
+  float cos_i;
+  float diffuse;
+  float reflect;
+  float refract;
+  Vec3f refracted; // unit length; valid when refract > 0
+} SurfaceLobes;
+
+static inline void scatter_lobes(const Material *material, Vec3f direction, Vec3f normal, SurfaceLobes *lobes) {
+  // Hitting the back side means the ray is leaving the object.
+  float cos_i = -vec3f_dot(direction, normal);
+  float eta = 1.0f / material->refractive_index;
+  if (cos_i < 0.0f) {
+    normal = scatter_scale(normal, -1.0f);
+    cos_i = -cos_i;
+    eta = material->refractive_index;
+  }
+
+  lobes->normal = normal;
+  lobes->cos_i = cos_i;
+  lobes->diffuse = material_diffuse_weight(material);
+  lobes->reflect = material->reflectivity;
+  lobes->refract = 0.0f;
+  lobes->refracted = vec3f_init();
+  if (material->transparency <= 0.0f) {
+    return;
+  }
+
+  float sin2_t = eta * eta * (1.0f - cos_i * cos_i);
+  if (sin2_t >= 1.0f) {
+    lobes->reflect += material->transparency;
+    return;
+  }
+  float cos_t = sqrtf(1.0f - sin2_t);
+  lobes->refracted = vec3f_normalize(vec3f_add(scatter_scale(direction, eta), scatter_scale(normal, eta * cos_i - cos_t)));
+
+  // Schlick's approximation, evaluated on the side with the larger angle.
+  float r0 = (1.0f - material->refractive_index) / (1.0f + material->refractive_index);
+  r0 *= r0;
+  float c = 1.0f - (eta < 1.0f ? cos_i : cos_t);
+  float fresnel = r0 + (1.0f - r0) * c * c * c * c * c;
+  lobes->reflect += material->transparency * fresnel;
+  lobes->refract = material->transparency * (1.0f - fresnel);
+}
+
+// Mirror direction, jittered by the material's roughness for glossy
+// surfaces (falling back to the mirror direction if the jitter would send
+// it below the surface).
+static inline Vec3f scatter_reflect(const Material *material, Vec3f direction, const SurfaceLobes *lobes, Rng *rng) {
+  Vec3f reflected = vec3f_add(direction, scatter_scale(lobes->normal, 2.0f * lobes->cos_i));
+  if (material->roughness > 0.0f) {
+    Vec3f glossy = vec3f_normalize(vec3f_add(reflected, scatter_scale(scatter_random_in_unit_sphere(rng), material->roughness)));
+    if (vec3f_dot(glossy, lobes->normal) > 0.0f) {
+      reflected = glossy;
+    }
+  }
+  return reflected;
+}
+
+#endif // __SCATTER_H__
@@ -0,0 +1,201 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <stdint.h>
+#include "bvh.h"
+#include "camera.h"
+#include "grid.h"
+#include "instance.h"
+#include "light_bvh.h"
+#include "mesh.h"
+#include "qbvh.h"
+#include "shapes.h"
+#include "sphere.h"
+
+// Hits farther than this are treated as misses.
+#define SCENE_MAX_DISTANCE 1000.0f
+
+typedef enum {
+  INTEGRATOR_WHITTED, // cast_ray: direct diffuse plus mirror/glass recursion
+  INTEGRATOR_PATH     // path tracer: global illumination, progressive
+} Integrator;
+
+// How shading points pick the lights they evaluate.
+typedef enum {
+  LIGHTS_EXACT,  // every light, every time (reference for validation)
+  LIGHTS_CULL,   // light BVH; skips lights whose bound is below light_threshold
+  LIGHTS_SAMPLE, // light BVH; one light per shading point, picked by importance
+  LIGHTS_TILED   // per-tile light lists for primary hits, LIGHTS_CULL elsewhere
+} LightSampling;
+
+// What the scene's own spheres and triangles are traced through.
+typedef enum {
+  ACCEL_AUTO,        // scene_select_accel picks one of the others
+  ACCEL_BVH,         // SAH BVH; anything the scene holds
+  ACCEL_GRID,        // dense uniform grid; still spheres only
+  ACCEL_HASHED_GRID, // hashed grid; still spheres only
+  ACCEL_QBVH,        // the BVH with quantized nodes (qbvh.h); still geometry only
+  ACCEL_COMPACT      // ACCEL_QBVH with the spheres packed into its leaves (qbvh_pack_spheres)
+} Accel;
+
+typedef struct {
+  int width;
+  int height;
+  int super_sampling; // sub-pixels per axis
+  int max_depth;      // bounces after the primary hit; 0 = direct lighting only
+  int rr_depth;       // Russian roulette kicks in from this bounce on
+  Integrator integrator;
+  int samples;        // path tracer samples per pixel
+  LightSampling light_sampling;
+  float light_threshold; // irradiance below which LIGHTS_CULL/TILED drop a light
+  float environment;     // background image as a light, scaled by this; 0 = off
+  float shutter;         // fraction of the frame the shutter is open for; 0 = no motion blur
+  Accel accel;
+} RenderSettings;
+
+typedef struct {
+  Sphere *spheres;
+  size_t num_spheres;
+  Vec3f *sphere_motion; // NULL when no sphere moves, else per sphere; see sphere_at
+  Mesh mesh;            // triangles; prim ids continue after the spheres
+  Shapes shapes;        // analytic shapes and sphere fields; prim ids continue after the triangles
+  SceneObject *objects; // geometry placed only through instances
+  size_t num_objects;
+  Instance *instances;
+  size_t num_instances;
+  Material *materials;  // shared table, indexed by Sphere/Triangle.material_index
+  size_t num_materials;
+  Light *lights;
+  size_t num_lights;
+  Camera camera;
+  RenderSettings settings;
+  BVH bvh;              // empty until scene_build_bvh or a binary load
+  Arena arena;          // the arrays of the BVH scene_build_bvh built or loaded; freed with it
+  BVH *bvh_replicas;    // per NUMA node when scene_replicate_bvh made copies, else NULL
+  Arena *replica_arenas; // their arrays, each placed on its node
+  uint32_t num_replicas;
+  Grid grid;            // replaces the BVH when scene_build_accel picks a grid
+  QBVH qbvh;            // replaces the BVH when scene_build_accel picks ACCEL_QBVH or ACCEL_COMPACT
+  BVH instance_bvh;     // top level over the instances; see scene_build_instances
+  LightBVH light_bvh;   // empty until scene_build_light_bvh
+  void *mapping;        // non-NULL when the arrays live in a mapped binary scene
+  size_t mapping_size;
+} Scene;
+
+// Camera and render settings every scene starts from.
+void scene_set_defaults(Scene *scene);
+
+// Fills scene with the built-in demo: 11 spheres and one light.
+bool scene_init_demo(Scene *scene);
+void scene_free(Scene *scene);
+
+// Builds the BVH over spheres and triangles (replacing any existing one)
+// in the scene's arena and logs build time, then rebuilds the instance and
+// shape BVHs.
+// With use_cache, large scenes without moving spheres go through the
+// on-disk BVH cache instead, which also leaves the BVH in the arena (see
+// bvh_cache_load_or_build_in).
+bool scene_build_bvh(Scene *scene, bool use_cache);
+
+// Copies the BVH to every NUMA node (see topology.h), each copy made by
+// the calling thread while it runs on the node so that its pages are placed
+// there, for scene_for_thread to hand out. Only the scene BVH is copied; the
+// instance and shape BVHs, quantized BVHs and grids are shared as they are.
+// Does nothing on a single node or without a BVH; the copies go when the BVH
+// is rebuilt or dropped. False on allocation failure or when the thread
+// cannot run on a node.
+bool scene_replicate_bvh(Scene *scene);
+
+// The scene as the calling thread should trace it: scene itself, or with
+// replicas a copy of it in view using the replica of the node the thread is
+// on. Meant to be called once per thread per frame; a thread that moves to
+// another node afterwards keeps reading the first node's copy.
+const Scene *scene_for_thread(const Scene *scene, Scene *view);
+
+// settings.accel, with ACCEL_AUTO resolved: a grid for still spheres only,
+// at least GRID_AUTO_MIN_SPHERES of them, with radii within
+// GRID_AUTO_MAX_RADIUS_SPREAD of their mean (standard deviation over mean)
+// and spread evenly enough (grid_occupancy at least
+// GRID_AUTO_MIN_OCCUPANCY), else the BVH. A grid asked for in a scene with triangles or moving
+// spheres falls back to the BVH as well, and so do the quantized BVH and
+// packed spheres with moving spheres.
+Accel scene_select_accel(const Scene *scene);
+
+// Builds what scene_select_accel picks, keeping a BVH that is already
+// there (from a binary load) when that is the pick or is to be quantized,
+// then the instance and shape BVHs; use_cache as for scene_build_bvh. A
+// kept BVH is copied out of the scene file into the arena when the arena
+// takes huge pages, so the policy covers it as well.
+// With ACCEL_COMPACT the scene's sphere array is freed once packed (unless
+// mapped) and spheres is NULL from then on; num_spheres stays, and sphere
+// prim ids number the packed slots. Spheres that can't be packed stay in
+// full, behind the quantized BVH. A BVH with a leaf too large to quantize
+// (see qbvh_fits) is kept and traced as it is.
+bool scene_build_accel(Scene *scene, bool use_cache);
+
+// Builds the BVHs of the shape kinds that need one (see shapes.h); does
+// nothing once built.
+bool scene_build_shapes(Scene *scene);
+
+// Builds every object's BVH and the top-level BVH over the instances, and
+// logs the memory they take against a flattened copy of every instance.
+// Does nothing when there are no instances or the top level already exists
+// (a binary load stores only the scene's own BVH).
+bool scene_build_instances(Scene *scene);
+
+// Builds the light hierarchy used by every mode but LIGHTS_EXACT; without
+// it every mode falls back to visiting every light.
+bool scene_build_light_bvh(Scene *scene);
+
+// Surface information for a hit, resolved once after traversal.
+typedef struct {
+  Vec3f point;
+  Vec3f normal;
+  const Material *material;
+} HitRecord;
+
+// Closest hit against the scene, through the grid or the BVHs when present
+// and by testing every sphere, triangle and instance otherwise; shapes go through
+// their own kernels. Traversal only tracks (t,
+// primitive id); scene_resolve_hit turns the final Hit into a HitRecord
+// exactly once. Triangle normals are interpolated from the vertex normals
+// when the mesh has them; for opaque materials they are turned toward the
+// ray, so open meshes are lit from both sides, while glass keeps the
+// winding's outward normal to tell entering from leaving. Instanced hits
+// are resolved in object space and carried back to the world. Moving
+// spheres are where they are at the ray's time.
+bool scene_trace(const Scene *scene, const Ray *ray, Hit *hit);
+void scene_resolve_hit(const Scene *scene, const Ray *ray, const Hit *hit, HitRecord *record);
+
+// True if anything lies along the ray closer than max_t (shadow rays).
+bool scene_occluded(const Scene *scene, const Ray *ray, float max_t);
+
+// Deterministic random scenes for scalability testing. The same parameters
+// always produce the same scene, independent of platform or thread count.
+typedef enum {
+  SCENE_DIST_UNIFORM,   // centers uniform in the scene volume
+  SCENE_DIST_CLUSTERED, // gaussian blobs around uniformly placed cluster centers
+  SCENE_DIST_NESTED     // clusters of clusters, several levels deep
+} SceneDistribution;
+
+typedef struct {
+  uint64_t seed;
+  size_t num_spheres;
+  size_t num_lights;
+  size_t num_materials;
+  float light_range; // 0 = lights without falloff, high above the spheres
+  float motion;      // 0 = still spheres; else each moves up to this far, in a random direction, over the frame
+  SceneDistribution distribution;
+} SceneGenParams;
+
+void scene_gen_params_default(SceneGenParams *params);
+bool scene_generate(Scene *scene, const SceneGenParams *params);
+
+// Parses the generator options shared by raytracer and raytracer_bench:
+//   --generate <uniform|clustered|nested> --spheres N --lights N
+//   --light-range D --materials N --seed S --motion D
+// Returns true and advances *i past the option's value when argv[*i] is one
+// of them; *enabled is set once --generate is seen.
+bool scene_gen_parse_option(SceneGenParams *params, bool *enabled, int argc, char **argv, int *i);
+
+#endif // __SCENE_H__
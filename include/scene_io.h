@@ -0,0 +1,94 @@
+#ifndef __SCENE_IO_H__
+#define __SCENE_IO_H__
+
+#include "scene.h"
+
+// Text scene format. One statement per line, '#' starts a comment:
+//
+//   render   width 1024 height 768 samples 4 max_depth 6 rr_depth 3
+//            integrator <whitted|path> spp 32
+//            lights <exact|cull|sample|tiled> light_threshold 0.001
+//            environment 0 shutter 1 accel <auto|bvh|grid|hashgrid|qbvh|compact>
+//   camera   position 0 0 0 look_at 0 0 -1 fov 90
+//   material <name> <r> <g> <b> [reflect R] [transparency T] [ior N] [roughness G]
+//            [specular R G B] [exponent E] [emission R G B]
+//   sphere   <x> <y> <z> <radius> <material name> [to <x> <y> <z>]
+//   light    <x> <y> <z> <intensity> [radius R] [range D]
+//   plane    <x> <y> <z> <nx> <ny> <nz> <material name>
+//   box      <min x> <min y> <min z> <max x> <max y> <max z> <material name>
+//   disc     <x> <y> <z> <nx> <ny> <nz> <radius> <material name>
+//   cylinder <x0> <y0> <z0> <x1> <y1> <z1> <radius> <material name>
+//   field    <x> <y> <z> <cells x> <cells y> <cells z> <spacing> <radius>
+//            <material name> [variation V] [jitter J] [fill F] [materials N]
+//            [seed S]
+//   vertex   <x> <y> <z> [normal <nx> <ny> <nz>]
+//   triangle <a> <b> <c> <material name>
+//   mesh     <file.obj> <material name> [scale S] [translate X Y Z]
+//   object   <name>
+//   end
+//   instance <object name> [scale S] [rotate X Y Z] [translate X Y Z]
+//   instance <object name> matrix <m00> <m01> ... <m23>
+//
+// render and camera take keyword/value pairs in any order and may be omitted
+// (the defaults are the ones the demo scene uses); fov is in degrees; samples
+// is the Whitted sub-pixel grid per axis, spp the path tracer's samples per
+// pixel. environment > 0 turns the background image into a light of that
+// strength (see environment.h). A sphere with `to` moves in a straight line
+// from its center to that point over the frame, and shutter is the fraction
+// of the frame, from its start, that the image sees (0 renders the spheres
+// where they start). accel picks what the spheres and triangles are traced
+// through (see scene_select_accel). A material must be declared before the
+// first sphere or triangle that uses it; without options it is purely
+// diffuse. Triangle corners are 0-based indices into the vertices declared so
+// far, counting those added by mesh statements; mesh appends a Wavefront OBJ
+// file (see mesh_load_obj), resolving a relative path against the scene
+// file's directory. The writer stores meshes as inline vertex and triangle
+// statements. A plane passes through the point and faces along the normal; a
+// cylinder is solid and capped, and runs between the two centers (see
+// shapes.h). A field is a procedural sphere lattice from the corner <x y z>;
+// its spheres draw their materials from the named one and the N - 1 declared
+// right after it, all before the field.
+//
+// Sphere, vertex, triangle and mesh statements between object and end go
+// into that object rather than the scene (materials stay global, and
+// vertex indices count from the object's first vertex); the object shows up
+// only where instance statements place it (see instance.h). An instance
+// scales, then rotates in degrees about x, y and z in turn, then
+// translates, or takes a 3x4 row-major object-to-world matrix, which is
+// what the writer emits. Objects must be declared before their instances.
+//
+// The loader maps the file and parses it in a single pass without copying
+// it or allocating per statement; material names point into the mapping.
+// Throughput is printed to stderr.
+bool scene_load_text(Scene *scene, const char *path);
+bool scene_save_text(const Scene *scene, const char *path);
+
+// Binary scene format, meant to be mmap'ed and used in place. A fixed header
+// (magic, version, byte order, camera, render settings) is followed by a
+// table of sections; every section is a raw array of the in-memory struct
+// (Sphere, Material, Light, mesh vertices, normals and Triangles, BVHNode,
+// uint32_t prim index, TrianglePacket, Instance, sphere motion Vec3f,
+// BVHBounds, Plane, Box, Disc, Cylinder, SphereField), 64-byte aligned in the file. The
+// mesh, BVH, object, motion and shape sections are optional, except that a BVH over moving spheres comes with
+// its end of frame bounds. Objects share one
+// set of sphere, vertex, normal and triangle sections, with a table of
+// ranges into them; their BVHs and the instance BVH are rebuilt after
+// loading (scene_build_instances).
+//
+// Loading validates the header and the section table (sizes, alignment,
+// bounds), the object ranges and instances' objects, and then, once, every
+// index the arrays hold: each sphere, triangle, shape and object's material,
+// each triangle's vertices, and the prebuilt BVH (bvh_validate). Other
+// values (positions, radii, colors) are used as stored; files are expected
+// to come from scene_save_binary. The version is bumped whenever one of the
+// stored structs changes layout, and element sizes are checked as a second
+// guard.
+#define SCENE_BINARY_VERSION 13
+
+bool scene_load_binary(Scene *scene, const char *path);
+bool scene_save_binary(const Scene *scene, const char *path);
+
+// Loads either format, telling them apart by the binary magic.
+bool scene_load(Scene *scene, const char *path);
+
+#endif // __SCENE_IO_H__
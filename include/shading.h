@@ -0,0 +1,80 @@
+#ifndef __SHADING_H__
+#define __SHADING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "light.h"
+#include "material.h"
+
+// Direct lighting at a surface point, split by what it gets multiplied
+// with: irradiance by the diffuse color (times the diffuse weight) and
+// highlight by the specular color.
+typedef struct {
+  float irradiance;
+  float highlight;
+} LightTerms;
+
+// One light's contribution at point, seen along view (unit vector toward
+// the viewer): intensity * cos * falloff, and intensity * falloff *
+// (n.h)^exponent for the Blinn-Phong half vector h. Both are 0 when the
+// light is behind the surface.
+LightTerms shading_light_terms(const Light *light, Vec3f point, Vec3f normal, Vec3f view, float exponent);
+
+// Final direct color of a surface: emission plus the diffuse and specular
+// colors scaled by the summed terms.
+static inline Vec3f shading_combine(const Material *material, LightTerms terms) {
+  float diffuse = material_diffuse_weight(material) * terms.irradiance;
+  Vec3f color;
+  for (int k = 0; k < 3; k++) {
+    color.data[k] = material->emission.data[k] + material->material_color.data[k] * diffuse +
+                    material->specular_color.data[k] * terms.highlight;
+  }
+  return color;
+}
+
+// A batch of hits laid out one array per component, so that the per-light
+// loop in shading_batch_lights runs across hits with SIMD. Every hit in a
+// batch is lit by the same lights, e.g. the primary hits of one tile and
+// the tile's light list.
+typedef struct {
+  float *px, *py, *pz;    // points
+  float *nx, *ny, *nz;    // normals
+  float *vx, *vy, *vz;    // toward the viewer
+  float *exponent;
+  float *irradiance;      // outputs, summed over lights
+  float *highlight;
+  float *light_scale;     // per-light scratch: intensity * falloff, 0 if unlit
+  float *cos_half;        // per-light scratch: n.h
+  size_t count;
+  size_t capacity;
+  bool any_specular;
+} ShadingBatch;
+
+bool shading_batch_init(ShadingBatch *batch, size_t capacity);
+void shading_batch_free(ShadingBatch *batch);
+
+// As shading_batch_init, with the arrays taken from the arena; they go with
+// it, and the batch is not passed to shading_batch_free.
+bool shading_batch_init_in(ShadingBatch *batch, Arena *arena, size_t capacity);
+
+// Empties the batch for the next group of hits.
+static inline void shading_batch_reset(ShadingBatch *batch) {
+  batch->count = 0;
+  batch->any_specular = false;
+}
+
+// Appends a hit and returns its slot. The caller keeps count below capacity.
+size_t shading_batch_add(ShadingBatch *batch, Vec3f point, Vec3f normal, Vec3f view, const Material *material);
+
+// Adds the terms of lights[indices[0..count)] (of lights[0..count) when
+// indices is NULL) to every hit in the batch.
+void shading_batch_lights(ShadingBatch *batch, const Light *lights, const uint32_t *indices, size_t count);
+
+static inline LightTerms shading_batch_terms(const ShadingBatch *batch, size_t slot) {
+  LightTerms terms = { batch->irradiance[slot], batch->highlight[slot] };
+  return terms;
+}
+
+#endif // __SHADING_H__
@@ -0,0 +1,123 @@
+#ifndef __SHAPES_H__
+#define __SHAPES_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../lib/librayvector.h"
+#include "bvh.h"
+#include "ray.h"
+#include "sphere.h"
+
+// Analytic primitives besides spheres: infinite planes, axis-aligned boxes,
+// discs, capped cylinders and procedural sphere fields. Each kind lives in its own array and is
+// intersected by its own kernel, a plain loop over structs of one layout,
+// so there is no per-primitive dispatch, and a scene without a kind never
+// touches it. Planes are unbounded and always tested one by one (scenes
+// hold a handful: floors, walls). A bounded kind with at least
+// SHAPES_BVH_MIN_COUNT members gets a BVH of its own whose leaves run that
+// kind's kernel.
+//
+// Hit prim ids number the planes, then the boxes, discs, cylinders and
+// fields, from an offset the caller chooses (the scene starts them after
+// its triangles). A hit on a field's sphere carries the field's id.
+
+#define SHAPES_BVH_MIN_COUNT 16
+
+// Points p with dot(normal, p) == offset.
+typedef struct {
+  Vec3f normal; // normalized
+  float offset;
+  uint32_t material_index; // into the scene's material table
+} Plane;
+
+typedef struct {
+  float min[3];
+  float max[3];
+  uint32_t material_index;
+} Box;
+
+typedef struct {
+  Vec3f center;
+  Vec3f normal; // normalized
+  float radius;
+  uint32_t material_index;
+} Disc;
+
+// Solid, with flat caps at base and base + axis * height.
+typedef struct {
+  Vec3f base;
+  Vec3f axis; // normalized
+  float radius;
+  float height;
+  uint32_t material_index;
+} Cylinder;
+
+// A box of cells[0] x cells[1] x cells[2] cubic cells, each holding at most
+// one sphere, described by these parameters alone: whether a cell holds a
+// sphere, its radius, where it sits and its material all come from a hash
+// of the cell coordinates and the seed. Nothing is stored per sphere, so
+// memory is constant however many cells there are. Rays walk the cells
+// they pass through in order (3D DDA; Amanatides and Woo, "A Fast Voxel
+// Traversal Algorithm for Ray Tracing", Eurographics 1987) and test the one
+// sphere each holds. Every sphere stays inside its cell, so the first hit
+// found is the closest. Coordinates far from the origin lose float
+// precision like any other geometry; keep min + cells * spacing within
+// about 1e5 cells of spacing for clean edges.
+#define SPHERE_FIELD_MAX_CELLS (1 << 24) // per axis, so cell indices stay exact as floats
+
+typedef struct {
+  float min[3]; // corner of cell (0, 0, 0)
+  int32_t cells[3];
+  float spacing;          // cell edge
+  float radius;           // largest radius, below spacing / 2
+  float radius_variation; // 0..1: radii are drawn from radius * [1 - v, 1]
+  float jitter;           // 0..1 of the room a sphere has to move in its cell
+  float fill;             // 0..1: the fraction of cells holding a sphere
+  uint32_t seed;
+  uint32_t material_index; // first of material_count consecutive materials
+  uint32_t material_count; // each sphere picks one
+} SphereField;
+
+typedef enum { SHAPE_PLANE, SHAPE_BOX, SHAPE_DISC, SHAPE_CYLINDER, SHAPE_FIELD, SHAPE_KINDS } ShapeKind;
+
+typedef struct {
+  Plane *planes;
+  Box *boxes;
+  Disc *discs;
+  Cylinder *cylinders;
+  SphereField *fields;
+  size_t count[SHAPE_KINDS];
+  size_t capacity[SHAPE_KINDS]; // all 0 when the arrays live in a mapped file
+  BVH bvh[SHAPE_KINDS];         // per bounded kind; empty until shapes_build, and for small kinds
+} Shapes;
+
+// Frees the BVHs and whatever arrays the set owns.
+void shapes_free(Shapes *shapes);
+
+size_t shapes_total(const Shapes *shapes);
+
+// Appends one shape.
+bool shapes_add_plane(Shapes *shapes, const Plane *plane);
+bool shapes_add_box(Shapes *shapes, const Box *box);
+bool shapes_add_disc(Shapes *shapes, const Disc *disc);
+bool shapes_add_cylinder(Shapes *shapes, const Cylinder *cylinder);
+bool shapes_add_field(Shapes *shapes, const SphereField *field);
+
+// The sphere of cell (x, y, z) of a field; false for an empty cell or one
+// outside the field.
+bool sphere_field_cell(const SphereField *field, int32_t x, int32_t y, int32_t z, Sphere *sphere);
+
+// (Re)builds the BVHs of the bounded kinds large enough to need one.
+bool shapes_build(Shapes *shapes);
+
+// Closest hit nearer than hit->t against every shape; prim ids start at
+// first_id.
+bool shapes_intersect(const Shapes *shapes, uint32_t first_id, const Ray *ray, Hit *hit);
+
+// Surface at point of shape `index` (counted from the first plane): the
+// outward normal for boxes, cylinders and field spheres, the stored normal
+// for planes and discs, and the material.
+void shapes_resolve(const Shapes *shapes, uint32_t index, Vec3f point, Vec3f *normal, uint32_t *material_index);
+
+#endif // __SHAPES_H__
@@ -4,19 +4,32 @@
 #include "../lib/librayvector.h"
 #include "material.h"
 #include "light.h"
+#include "ray.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 
 typedef struct {
   Vec3f center;
   float radius;
-  Material material;
+  uint32_t material_index; // into the scene's material table
 } Sphere;
 
-Sphere sphere_init(Vec3f, float, Material);
-bool sphere_ray_intersect(Sphere *, Vec3f *, Vec3f *, float *);
-Vec3f cast_ray(const Vec3f *, const Vec3f *, const Sphere *, size_t, Light*, size_t);
-bool scene_intersect(const Vec3f *, const Vec3f *, const Sphere *, size_t , Vec3f *, Vec3f *, Material *);
-Vec3f calculate_diffuse_reflection(Vec3f , Vec3f , Material , Light* , size_t);
+// A moving sphere travels in a straight line from its center at time 0 to
+// center + motion at time 1.
+static inline Sphere sphere_at(const Sphere *sphere, Vec3f motion, float time) {
+  Sphere moved = *sphere;
+  for (int k = 0; k < DIMENSION; k++) {
+    moved.center.data[k] += motion.data[k] * time;
+  }
+  return moved;
+}
+
+Sphere sphere_init(Vec3f, float, uint32_t);
+bool sphere_ray_intersect(const Sphere *, const Vec3f *, const Vec3f *, float *);
+bool sphere_intersect_closer(const Sphere *, const Ray *, uint32_t, Hit *);
+bool scene_intersect(const Ray *, const Sphere *, size_t, Hit *);
+Vec3f calculate_diffuse_reflection(Vec3f , Vec3f , const Material *, const Light *, size_t);
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include "chunks.h"
+#include "render.h"
+
+// Rendering with the spheres streamed from a chunk file (see chunks.h), for
+// sphere sets that don't fit in memory. The scene supplies everything else:
+// camera, settings, materials, lights, and any other geometry, which stays
+// in memory and is traced as usual.
+//
+// Rays are traced breadth first, in waves: a pass takes the primary rays
+// of a band of rows, at most STREAM_PASS_SAMPLES of them, traces them all
+// through the scene and then as one chunks_trace batch, and shades every
+// hit; the mirror and glass rays it spawns form the next wave, until none
+// are left. Chunks are thus paged in once per wave rather than once per
+// ray, and larger passes mean fewer waves per frame at the cost of memory
+// for the rays in flight (a few hundred bytes per sample).
+//
+// The shading is the Whitted shader's (cast_ray): direct light from the
+// lights render_select_lights picks (LIGHTS_TILED acts as LIGHTS_CULL), and
+// mirror and glass rays up to settings.max_depth with Russian roulette from
+// settings.rr_depth. The random numbers for roulette, glossy jitter and
+// light sampling are drawn per ray rather than per pixel, so only those
+// parts of the image differ from render_frame's.
+#define STREAM_PASS_SAMPLES (1 << 19)
+
+// Renders like render_frame, with the store's spheres in addition to the
+// scene's geometry. Returns the number of rays traced; 0 on allocation or
+// chunk mapping failure.
+uint64_t stream_render_frame(const Scene *scene, ChunkStore *store, Vec3f *frame_buffer, RenderStats *stats);
+
+#endif // __STREAM_H__
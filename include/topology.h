@@ -0,0 +1,45 @@
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The machine's NUMA nodes and which CPUs belong to them, as Linux lists
+// them under /sys/devices/system/node, and its cores and their hardware
+// (SMT) threads, from /sys/devices/system/cpu/cpu*/topology. Nodes and cores
+// are numbered densely here, in the order of their ids there, so that
+// per-node and per-core arrays have no holes. Machines (or kernels) without
+// those directories are a single node with a core per CPU.
+typedef struct {
+  uint32_t num_cpus;    // CPU ids run from 0 to num_cpus - 1
+  uint32_t num_nodes;   // at least 1
+  uint32_t num_cores;   // physical cores, over every package
+  uint32_t *cpu_node;   // per CPU id; 0 for CPUs no node lists
+  uint32_t *cpu_core;   // per CPU id
+  uint32_t *cpu_thread; // per CPU id: its rank among its core's CPUs, 0 for the first
+} Topology;
+
+// Read from /sys on the first call and kept for the process. The first
+// call must not race with others: make it before rendering starts.
+const Topology *topology_get(void);
+
+// The node of the CPU the calling thread is running on right now; 0 when
+// that cannot be told. Unpinned threads may move to another node later.
+uint32_t topology_current_node(const Topology *topology);
+
+// Writes the CPUs the process may run on (its affinity mask) to cpus, at
+// most max of them, and returns how many there are: the first hardware
+// thread of every core, by node and core, then the second ones, and so on,
+// so that the first num_cores take a core each before any core takes two.
+uint32_t topology_worker_cpus(const Topology *topology, uint32_t *cpus, uint32_t max);
+
+// Restricts the calling thread to one CPU; false when it cannot be moved.
+bool topology_pin(uint32_t cpu);
+
+// Runs fn(arg) on the calling thread restricted to the node's CPUs, so that
+// the memory it touches first is placed on that node, and then gives the
+// thread back the CPUs it had. False, without calling fn, when the thread
+// cannot be moved there.
+bool topology_run_on_node(const Topology *topology, uint32_t node, void (*fn)(void *arg), void *arg);
+
+#endif // __TOPOLOGY_H__
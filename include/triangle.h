@@ -0,0 +1,56 @@
+#ifndef __TRIANGLE_H__
+#define __TRIANGLE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "../lib/librayvector.h"
+#include "ray.h"
+
+// Watertight ray/triangle intersection (Woop, Benthin and Wald, "Watertight
+// Ray/Triangle Intersection", JCGT 2013). The ray is turned into a shear
+// that maps it onto the +z axis, so the 2D edge tests of every triangle are
+// made against the same projected origin: a ray through a shared edge or
+// vertex hits at least one of the triangles around it, never none. Edge
+// functions that come out exactly 0 are recomputed in double precision.
+
+// Per-ray setup, computed once and shared by every triangle test.
+typedef struct {
+  Vec3f origin;
+  int kx, ky, kz; // kz is the dominant axis of the direction
+  float sx, sy, sz;
+} TriangleRay;
+
+void triangle_ray_init(TriangleRay *tray, const Ray *ray);
+
+// True when the ray hits triangle (a, b, c) at a distance in (0, t_max);
+// sets *t and, when barycentric is not NULL, the weights of a, b and c.
+// Both sides of the triangle are hit.
+bool triangle_intersect(const TriangleRay *tray, Vec3f a, Vec3f b, Vec3f c, float t_max, float *t,
+                        float barycentric[3]);
+
+// Triangles are tested TRIANGLE_PACKET_WIDTH at a time by BVH leaves: the
+// packet stores the vertices lane by lane, so the projection and edge
+// functions run across lanes as one SIMD loop. The width matches the
+// vector registers the build targets (8 floats with AVX, else 4).
+#ifdef __AVX__
+#define TRIANGLE_PACKET_WIDTH 8
+#else
+#define TRIANGLE_PACKET_WIDTH 4
+#endif
+
+// Unused lanes have NaN vertices, which no test accepts, and a prim_id of
+// UINT32_MAX.
+typedef struct {
+  float vertices[3][3][TRIANGLE_PACKET_WIDTH]; // [corner][axis][lane]
+  uint32_t prim_ids[TRIANGLE_PACKET_WIDTH];
+} TrianglePacket;
+
+// Fills lane `lane` of packet.
+void triangle_packet_set(TrianglePacket *packet, int lane, Vec3f a, Vec3f b, Vec3f c, uint32_t prim_id);
+void triangle_packet_clear(TrianglePacket *packet);
+
+// Closest-hit test of every lane against hit->t; updates hit (prim_id from
+// the packet) and returns true when a lane is nearer.
+bool triangle_packet_intersect(const TrianglePacket *packet, const TriangleRay *tray, Hit *hit);
+
+#endif // __TRIANGLE_H__
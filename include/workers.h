@@ -0,0 +1,62 @@
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "topology.h"
+
+// A set of worker threads for render_frame and path_trace_pass, in place
+// of OpenMP's team, placed by the machine's topology (topology.h). Pinned,
+// worker w runs on the w-th CPU of topology_worker_cpus (wrapping around
+// past the last), so the first workers take a core each and the later ones
+// their SMT siblings. Workers on one core form a group, and the items of a
+// run (render_frame's tiles, path_trace_pass's rows) are handed out in runs of adjacent items per
+// group: the siblings of a core work on neighbouring tiles and share the
+// cache lines of the geometry those tiles see. A group takes its next run
+// from a counter shared by all groups once its own is done, which keeps
+// the load balanced. Unpinned, every worker is a group of its own.
+//
+// Threads are started for each workers_run and joined before it returns;
+// a frame is long enough that this costs nothing measurable.
+
+typedef struct WorkerGroup WorkerGroup;
+
+typedef struct {
+  int num_workers;
+  bool pinned;
+  int *cpus;             // per worker, -1 when not pinned
+  uint32_t *group;       // per worker
+  WorkerGroup *groups;
+  uint32_t num_groups;
+  uint32_t run_length;   // items a group takes at once
+  uint32_t num_items;    // of the current run
+  atomic_uint next_run;  // first item not yet handed to a group
+  uint64_t *work;        // per worker, what fn returned, summed over runs
+  double *seconds;       // per worker, time spent in fn, summed over runs
+} Workers;
+
+// num_workers threads (0 for one per usable CPU), pinned when pin is set.
+// Returns false on allocation failure.
+bool workers_init(Workers *workers, int num_workers, bool pin);
+void workers_free(Workers *workers);
+
+// Runs fn(worker, arg) on every worker and waits for all of them, handing
+// out the items [0, num_items) through workers_next_item. What fn returns
+// (render_frame: rays traced) is added to the worker's work. Returns how
+// many workers ran: fewer than num_workers when a thread can't be started,
+// in which case the ones that did still take every item, and 0 when none
+// could be, or on allocation failure.
+int workers_run(Workers *workers, uint32_t num_items, uint64_t (*fn)(int worker, void *arg), void *arg);
+
+// The next item for the worker, from its group's run; false when every
+// item has been handed out.
+bool workers_next_item(Workers *workers, int worker, uint32_t *item);
+
+// Work per second of every worker, with its CPU, and per core the sum over
+// its workers, so that SMT siblings can be compared with cores running one
+// worker; label names the work (e.g. "rays").
+void workers_report(const Workers *workers, const char *label, FILE *out);
+
+#endif // __WORKERS_H__
@@ -0,0 +1,221 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/arena.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+struct ArenaBlock {
+  ArenaBlock *prev;
+  unsigned char *data; // ARENA_ALIGNMENT aligned; within the same allocation unless mapped
+  size_t size;
+  size_t offset;       // first free byte of data
+  size_t dirty;        // bytes of data that may not be zero: all of them, unless mapped
+  void *mapping;       // NULL for blocks from malloc
+  size_t mapping_size;
+};
+
+static size_t align_up(size_t value) {
+  return (value + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+// Maps size bytes, rounded up to ARENA_HUGE_PAGE, at an ARENA_HUGE_PAGE
+// boundary; the header comes from malloc so that no page is touched yet.
+static ArenaBlock *map_block(size_t size) {
+#ifdef __linux__
+  if (size > SIZE_MAX - 2 * ARENA_HUGE_PAGE) {
+    return NULL;
+  }
+  size = (size + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+  ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock));
+  if (block == NULL) {
+    return NULL;
+  }
+  // Over-map by a huge page and trim both ends to the aligned part.
+  size_t over = size + ARENA_HUGE_PAGE;
+  void *mapping = mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    free(block);
+    return NULL;
+  }
+  uintptr_t start = ((uintptr_t)mapping + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1);
+  size_t head = start - (uintptr_t)mapping;
+  if (head > 0) {
+    munmap(mapping, head);
+  }
+  if (over - head > size) {
+    munmap((void *)(start + size), over - head - size);
+  }
+#ifdef MADV_HUGEPAGE
+  // Only advice: without THP the block still works with small pages.
+  madvise((void *)start, size, MADV_HUGEPAGE);
+#endif
+  block->data = (unsigned char *)start;
+  block->size = size;
+  block->dirty = 0;
+  block->mapping = (void *)start;
+  block->mapping_size = size;
+  return block;
+#else
+  (void)size;
+  return NULL;
+#endif
+}
+
+// A block with room for at least size bytes, pushed as the new head.
+static bool push_block(Arena *arena, size_t size) {
+  size_t min_block = arena->min_block > 0 ? arena->min_block : ARENA_MIN_BLOCK;
+  if (size < min_block) {
+    size = min_block;
+  }
+  if (size > SIZE_MAX - sizeof(ArenaBlock) - ARENA_ALIGNMENT) {
+    return false;
+  }
+  size = align_up(size);
+  ArenaBlock *block = arena->huge_pages && size >= ARENA_HUGE_PAGE ? map_block(size) : NULL;
+  if (block == NULL) {
+    block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + ARENA_ALIGNMENT + size);
+    if (block == NULL) {
+      return false;
+    }
+    uintptr_t data = ((uintptr_t)(block + 1) + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1);
+    block->data = (unsigned char *)data;
+    block->size = size;
+    block->dirty = size;
+    block->mapping = NULL;
+    block->mapping_size = 0;
+  }
+  block->prev = arena->head;
+  block->offset = 0;
+  arena->head = block;
+  arena->reserved += block->size;
+  return true;
+}
+
+static void pop_block(Arena *arena) {
+  ArenaBlock *block = arena->head;
+  arena->head = block->prev;
+  arena->reserved -= block->size;
+#ifdef __linux__
+  if (block->mapping != NULL) {
+    munmap(block->mapping, block->mapping_size);
+  }
+#endif
+  free(block);
+}
+
+void arena_init(Arena *arena, const char *name, size_t min_block) {
+  memset(arena, 0, sizeof(*arena));
+  arena->name = name;
+  arena->min_block = min_block;
+}
+
+// arena_alloc, also telling how many of the bytes handed out, from the
+// start, may not be zero.
+static void *allocate(Arena *arena, size_t size, size_t *dirty) {
+  if (size == 0) {
+    size = 1;
+  }
+  ArenaBlock *block = arena->head;
+  size_t start = block != NULL ? align_up(block->offset) : 0;
+  if (block == NULL || start > block->size || size > block->size - start) {
+    if (!push_block(arena, size)) {
+      return NULL;
+    }
+    block = arena->head;
+    start = 0;
+  }
+  arena->used += start - block->offset + size;
+  if (arena->used > arena->peak) {
+    arena->peak = arena->used;
+  }
+  block->offset = start + size;
+  *dirty = block->dirty <= start ? 0 : block->dirty - start < size ? block->dirty - start : size;
+  if (block->dirty < block->offset) {
+    block->dirty = block->offset;
+  }
+  return block->data + start;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size_t dirty;
+  return allocate(arena, size, &dirty);
+}
+
+void *arena_calloc(Arena *arena, size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  size_t dirty;
+  void *memory = allocate(arena, count * size, &dirty);
+  if (memory != NULL) {
+    // What was never handed out of a mapped block is still untouched zero
+    // pages; writing zeros there would place them now.
+    memset(memory, 0, dirty);
+  }
+  return memory;
+}
+
+bool arena_reserve(Arena *arena, size_t size) {
+  const ArenaBlock *block = arena->head;
+  if (block != NULL && align_up(block->offset) <= block->size && size <= block->size - align_up(block->offset)) {
+    return true;
+  }
+  return push_block(arena, size);
+}
+
+ArenaMark arena_mark(const Arena *arena) {
+  ArenaMark mark = { arena->head, arena->head != NULL ? arena->head->offset : 0, arena->used };
+  return mark;
+}
+
+void arena_release(Arena *arena, ArenaMark mark) {
+  while (arena->head != mark.head) {
+    pop_block(arena);
+  }
+  if (arena->head != NULL) {
+    arena->head->offset = mark.offset;
+  }
+  arena->used = mark.used;
+}
+
+void arena_reset(Arena *arena) {
+  if (arena->head != NULL && arena->head->prev != NULL) {
+    size_t total = arena->reserved;
+    while (arena->head != NULL) {
+      pop_block(arena);
+    }
+    // Without the merged block the next round just starts from scratch.
+    push_block(arena, total);
+  }
+  if (arena->head != NULL) {
+    arena->head->offset = 0;
+  }
+  arena->used = 0;
+}
+
+void arena_free(Arena *arena) {
+  while (arena->head != NULL) {
+    pop_block(arena);
+  }
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+void arena_report(const Arena *arena, FILE *out) {
+  size_t blocks = 0;
+  size_t mapped = 0;
+  for (const ArenaBlock *block = arena->head; block != NULL; block = block->prev) {
+    blocks++;
+    mapped += block->mapping != NULL;
+  }
+  fprintf(out, "%s arena: %.2f MB peak, %.2f MB in use, %.2f MB in %zu block%s",
+          arena->name != NULL ? arena->name : "unnamed", arena->peak / 1e6, arena->used / 1e6,
+          arena->reserved / 1e6, blocks, blocks == 1 ? "" : "s");
+  if (mapped > 0) {
+    fprintf(out, " (%zu for huge pages)", mapped);
+  }
+  fprintf(out, "\n");
+}
@@ -0,0 +1,557 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/path_tracer.h"
+#include "../include/perf.h"
+#include "../include/render.h"
+#include "../include/scene_io.h"
+#include "../include/shading.h"
+
+// Micro-benchmarks for the intersection and shading kernels plus a full
+// frame. Every measurement is reported with wall-clock rays/s and, when the
+// kernel allows it, the perf_event hardware counters for the same region.
+
+typedef struct {
+    Vec3f origin;
+    Vec3f *directions;
+    size_t count;
+} RaySet;
+
+static volatile float sink;
+
+// Light selection counts from the last bench_light_selection run.
+static RenderStats light_stats;
+
+// Hits per shading_batch_lights call in bench_blinn_phong_batched.
+#define BENCH_BATCH_SIZE 1024
+static ShadingBatch shading_batch;
+static const Material *batch_materials[BENCH_BATCH_SIZE];
+
+// Primary rays through pixel centers. With max_rays below the pixel count the
+// pixels are strided evenly so the rays still cover the whole image.
+static bool make_primary_rays(const Scene *scene, RaySet *rays, size_t max_rays) {
+    const int width = scene->settings.width;
+    CameraFrame camera;
+    camera_frame_init(&camera, &scene->camera, width, scene->settings.height);
+    size_t pixels = (size_t)width * scene->settings.height;
+    size_t stride = (max_rays > 0 && max_rays < pixels) ? pixels / max_rays : 1;
+    rays->origin = camera.origin;
+    rays->count = 0;
+    rays->directions = (Vec3f *)malloc((pixels / stride + 1) * sizeof(Vec3f));
+    if (rays->directions == NULL) {
+        return false;
+    }
+    for (size_t p = 0; p < pixels; p += stride) {
+        float px = (float)(p % width) + 0.5f;
+        float py = (float)(p / width) + 0.5f;
+        rays->directions[rays->count++] = camera_frame_direction(&camera, px, py);
+    }
+    return true;
+}
+
+static uint64_t bench_sphere_intersect(const Scene *scene, const RaySet *rays) {
+    Vec3f origin = rays->origin;
+    float acc = 0.0f;
+    for (size_t r = 0; r < rays->count; r++) {
+        for (size_t s = 0; s < scene->num_spheres; s++) {
+            float t;
+            if (sphere_ray_intersect(&scene->spheres[s], &origin, &rays->directions[r], &t)) {
+                acc += t;
+            }
+        }
+    }
+    sink = acc;
+    return (uint64_t)rays->count * scene->num_spheres;
+}
+
+static uint64_t bench_scene_intersect(const Scene *scene, const RaySet *rays) {
+    float acc = 0.0f;
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        Hit hit = { SCENE_MAX_DISTANCE, 0, HIT_NO_INSTANCE };
+        if (scene_intersect(&ray, scene->spheres, scene->num_spheres, &hit)) {
+            acc += hit.t;
+        }
+    }
+    sink = acc;
+    return rays->count;
+}
+
+// Every ray against every triangle, first one at a time and then through
+// the BVH's packets (which hold the same triangles), to compare the scalar
+// and SIMD forms of the watertight test.
+static uint64_t bench_triangle_scalar(const Scene *scene, const RaySet *rays) {
+    const Mesh *mesh = &scene->mesh;
+    float acc = 0.0f;
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        TriangleRay tray;
+        triangle_ray_init(&tray, &ray);
+        float nearest = SCENE_MAX_DISTANCE;
+        for (size_t i = 0; i < mesh->num_triangles; i++) {
+            const uint32_t *v = mesh->triangles[i].v;
+            triangle_intersect(&tray, mesh->vertices[v[0]], mesh->vertices[v[1]], mesh->vertices[v[2]], nearest,
+                               &nearest, NULL);
+        }
+        acc += nearest;
+    }
+    sink = acc;
+    return (uint64_t)rays->count * mesh->num_triangles;
+}
+
+static uint64_t bench_triangle_packets(const Scene *scene, const RaySet *rays) {
+    const BVH *bvh = &scene->bvh;
+    float acc = 0.0f;
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        TriangleRay tray;
+        triangle_ray_init(&tray, &ray);
+        Hit hit = { SCENE_MAX_DISTANCE, 0, HIT_NO_INSTANCE };
+        for (uint32_t p = 0; p < bvh->num_packets; p++) {
+            triangle_packet_intersect(&bvh->packets[p], &tray, &hit);
+        }
+        acc += hit.t;
+    }
+    sink = acc;
+    return (uint64_t)rays->count * scene->mesh.num_triangles;
+}
+
+static uint64_t bench_scene_trace(const Scene *scene, const RaySet *rays) {
+    float acc = 0.0f;
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        Hit hit;
+        if (scene_trace(scene, &ray, &hit)) {
+            acc += hit.t;
+        }
+    }
+    sink = acc;
+    return rays->count;
+}
+
+static uint64_t bench_shading(const Scene *scene, const RaySet *rays) {
+    float acc = 0.0f;
+    uint64_t shaded = 0;
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        Hit hit;
+        if (scene_trace(scene, &ray, &hit)) {
+            HitRecord record;
+            scene_resolve_hit(scene, &ray, &hit, &record);
+            Vec3f color = calculate_diffuse_reflection(record.point, record.normal, record.material, scene->lights, scene->num_lights);
+            acc += color.data[0];
+            shaded++;
+        }
+    }
+    sink = acc;
+    return shaded;
+}
+
+// Blinn-Phong direct lighting from every light, one hit at a time.
+static uint64_t bench_blinn_phong(const Scene *scene, const RaySet *rays) {
+    float acc = 0.0f;
+    uint64_t shaded = 0;
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        Hit hit;
+        if (scene_trace(scene, &ray, &hit)) {
+            HitRecord record;
+            scene_resolve_hit(scene, &ray, &hit, &record);
+            Vec3f view = vec3f_normalize(vec3f_sub(rays->origin, record.point));
+            LightTerms terms = { 0.0f, 0.0f };
+            for (size_t l = 0; l < scene->num_lights; l++) {
+                LightTerms light = shading_light_terms(&scene->lights[l], record.point, record.normal, view,
+                                                       record.material->specular_exponent);
+                terms.irradiance += light.irradiance;
+                terms.highlight += light.highlight;
+            }
+            acc += shading_combine(record.material, terms).data[0];
+            shaded++;
+        }
+    }
+    sink = acc;
+    return shaded;
+}
+
+static float flush_batch(const Scene *scene) {
+    float acc = 0.0f;
+    shading_batch_lights(&shading_batch, scene->lights, NULL, scene->num_lights);
+    for (size_t slot = 0; slot < shading_batch.count; slot++) {
+        acc += shading_combine(batch_materials[slot], shading_batch_terms(&shading_batch, slot)).data[0];
+    }
+    shading_batch_reset(&shading_batch);
+    return acc;
+}
+
+// The same lighting through the SoA kernel, BENCH_BATCH_SIZE hits per call.
+static uint64_t bench_blinn_phong_batched(const Scene *scene, const RaySet *rays) {
+    float acc = 0.0f;
+    uint64_t shaded = 0;
+    shading_batch_reset(&shading_batch);
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        Hit hit;
+        if (scene_trace(scene, &ray, &hit)) {
+            HitRecord record;
+            scene_resolve_hit(scene, &ray, &hit, &record);
+            Vec3f view = vec3f_normalize(vec3f_sub(rays->origin, record.point));
+            size_t slot = shading_batch_add(&shading_batch, record.point, record.normal, view, record.material);
+            batch_materials[slot] = record.material;
+            if (shading_batch.count == BENCH_BATCH_SIZE) {
+                acc += flush_batch(scene);
+            }
+            shaded++;
+        }
+    }
+    acc += flush_batch(scene);
+    sink = acc;
+    return shaded;
+}
+
+typedef struct {
+    const Light *lights;
+    Vec3f point;
+    Vec3f normal;
+    float irradiance;
+} DirectSum;
+
+static void add_light(uint32_t light_index, float pmf, void *user) {
+    DirectSum *sum = (DirectSum *)user;
+    sum->irradiance += light_irradiance(&sum->lights[light_index], sum->point, sum->normal) / pmf;
+}
+
+// Direct diffuse lighting through render_select_lights, in whichever
+// settings.light_sampling mode the scene carries.
+static uint64_t bench_light_selection(const Scene *scene, const RaySet *rays) {
+    RenderStats stats;
+    memset(&stats, 0, sizeof(stats));
+    RenderContext context;
+    context.stats = &stats;
+    rng_seed(&context.rng, 1, 1);
+
+    float acc = 0.0f;
+    uint64_t shaded = 0;
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        Hit hit;
+        if (scene_trace(scene, &ray, &hit)) {
+            HitRecord record;
+            scene_resolve_hit(scene, &ray, &hit, &record);
+            DirectSum sum = { scene->lights, record.point, record.normal, 0.0f };
+            render_select_lights(scene, record.point, record.normal, &context, add_light, &sum);
+            acc += sum.irradiance * record.material->material_color.data[0];
+            shaded++;
+        }
+    }
+    sink = acc;
+    light_stats = stats;
+    return shaded;
+}
+
+// The pre-deferral closest-hit loop, kept as a baseline: hit point, a
+// normalized normal and a Material copy are produced on every closer hit.
+static uint64_t bench_eager_hit_record(const Scene *scene, const RaySet *rays) {
+    float acc = 0.0f;
+    for (size_t r = 0; r < rays->count; r++) {
+        const Vec3f *dir = &rays->directions[r];
+        float nearest = FLT_MAX;
+        Vec3f hit_point = vec3f_init();
+        Vec3f normal = vec3f_init();
+        Material material = material_diffuse(vec3f_init());
+        for (size_t s = 0; s < scene->num_spheres; s++) {
+            float t;
+            if (sphere_ray_intersect(&scene->spheres[s], &rays->origin, dir, &t) && t < nearest) {
+                nearest = t;
+                for (int k = 0; k < DIMENSION; k++) {
+                    hit_point.data[k] = rays->origin.data[k] + dir->data[k] * t;
+                }
+                normal = vec3f_normalize(vec3f_sub(hit_point, scene->spheres[s].center));
+                material = scene->materials[scene->spheres[s].material_index];
+            }
+        }
+        if (nearest < SCENE_MAX_DISTANCE) {
+            acc += hit_point.data[0] + normal.data[1] + material.material_color.data[2];
+        }
+    }
+    sink = acc;
+    return rays->count;
+}
+
+// Same result through the deferred path: (t, id) during the search and one
+// scene_resolve_hit for the winner.
+static uint64_t bench_deferred_hit_record(const Scene *scene, const RaySet *rays) {
+    float acc = 0.0f;
+    for (size_t r = 0; r < rays->count; r++) {
+        Ray ray = ray_init(rays->origin, rays->directions[r]);
+        Hit hit = { SCENE_MAX_DISTANCE, 0, HIT_NO_INSTANCE };
+        if (scene_intersect(&ray, scene->spheres, scene->num_spheres, &hit)) {
+            HitRecord record;
+            scene_resolve_hit(scene, &ray, &hit, &record);
+            acc += record.point.data[0] + record.normal.data[1] + record.material->material_color.data[2];
+        }
+    }
+    sink = acc;
+    return rays->count;
+}
+
+// Rays from the camera aimed on a grid over the bounding box of spheres
+// [first, first + count), so nearly every ray crosses several of them.
+static bool make_cluster_rays(const Scene *scene, size_t first, size_t count, RaySet *rays) {
+    const int grid = 512;
+    float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (size_t i = first; i < first + count; i++) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = fminf(lo[k], scene->spheres[i].center.data[k] - scene->spheres[i].radius);
+            hi[k] = fmaxf(hi[k], scene->spheres[i].center.data[k] + scene->spheres[i].radius);
+        }
+    }
+    rays->origin = scene->camera.position;
+    rays->count = 0;
+    rays->directions = (Vec3f *)malloc((size_t)grid * grid * sizeof(Vec3f));
+    if (rays->directions == NULL) {
+        return false;
+    }
+    for (int v = 0; v < grid; v++) {
+        for (int u = 0; u < grid; u++) {
+            Vec3f target = vec3f_init_values(lo[0] + (hi[0] - lo[0]) * (u + 0.5f) / grid,
+                                             lo[1] + (hi[1] - lo[1]) * (v + 0.5f) / grid,
+                                             0.5f * (lo[2] + hi[2]));
+            rays->directions[rays->count++] = vec3f_normalize(vec3f_sub(target, rays->origin));
+        }
+    }
+    return true;
+}
+
+static void run_kernel(const char *label, uint64_t (*kernel)(const Scene *, const RaySet *),
+                       const Scene *scene, const RaySet *rays, int iterations, bool use_counters) {
+    PerfCounters counters;
+    perf_counters_init(&counters, use_counters);
+
+    // Warm-up pass so the first measured iteration isn't paying for page faults.
+    kernel(scene, rays);
+
+    uint64_t total = 0;
+    perf_counters_start(&counters);
+    for (int i = 0; i < iterations; i++) {
+        total += kernel(scene, rays);
+    }
+    perf_counters_stop(&counters);
+    perf_counters_report(&counters, label, total, stdout);
+    perf_counters_close(&counters);
+}
+
+static void run_render(const Scene *scene, int iterations, bool use_counters) {
+    size_t pixels = (size_t)scene->settings.width * scene->settings.height;
+    Vec3f *frame_buffer = (Vec3f *)malloc(pixels * sizeof(Vec3f));
+    if (frame_buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return;
+    }
+
+    PerfCounters counters;
+    perf_counters_init(&counters, use_counters);
+    RenderStats stats;
+    uint64_t total = 0;
+    perf_counters_start(&counters);
+    for (int i = 0; i < iterations; i++) {
+        memset(frame_buffer, 0, pixels * sizeof(Vec3f));
+        total += render_frame(scene, frame_buffer, &stats);
+    }
+    perf_counters_stop(&counters);
+    perf_counters_report(&counters, "render_frame", total, stdout);
+    render_stats_report(&stats, stdout);
+    perf_counters_close(&counters);
+    free(frame_buffer);
+}
+
+// One path-traced sample per pixel per iteration, accumulated.
+static void run_path_passes(const Scene *scene, int iterations, bool use_counters) {
+    Arena frame;
+    arena_init(&frame, "frame", 0);
+    Accumulator accumulator;
+    if (!accumulator_init(&accumulator, &frame, scene->settings.width, scene->settings.height)) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        arena_free(&frame);
+        return;
+    }
+
+    PerfCounters counters;
+    perf_counters_init(&counters, use_counters);
+    RenderStats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint64_t total = 0;
+    perf_counters_start(&counters);
+    for (int i = 0; i < iterations; i++) {
+        total += path_trace_pass(scene, &accumulator, &stats);
+    }
+    perf_counters_stop(&counters);
+    perf_counters_report(&counters, "path_trace_pass", total, stdout);
+    render_stats_report(&stats, stdout);
+    perf_counters_close(&counters);
+    accumulator_free(&accumulator);
+    arena_free(&frame);
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--iterations N] [--rays N] [--no-counters] [--no-render] [--no-brute-force]\n"
+                    "          [--scene file.scene]\n"
+                    "          [--generate <uniform|clustered|nested> [--spheres N] [--lights N]\n"
+                    "          [--light-range D] [--materials N] [--seed S] [--motion D]]\n", program);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 5;
+    bool use_counters = true;
+    bool run_full_frame = true;
+    bool run_brute_force = true;
+    size_t max_rays = 0;
+    const char *scene_path = NULL;
+    SceneGenParams gen_params;
+    bool generate = false;
+    scene_gen_params_default(&gen_params);
+
+    for (int i = 1; i < argc; i++) {
+        if (scene_gen_parse_option(&gen_params, &generate, argc, argv, &i)) {
+            continue;
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rays") == 0 && i + 1 < argc) {
+            max_rays = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            scene_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-brute-force") == 0) {
+            run_brute_force = false;
+        } else if (strcmp(argv[i], "--no-render") == 0) {
+            run_full_frame = false;
+        } else if (strcmp(argv[i], "--no-counters") == 0) {
+            use_counters = false;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    Scene scene;
+    double build_start = perf_now_seconds();
+    bool loaded;
+    if (scene_path != NULL) {
+        loaded = scene_load(&scene, scene_path);
+    } else if (generate) {
+        loaded = scene_generate(&scene, &gen_params);
+    } else {
+        loaded = scene_init_demo(&scene);
+    }
+    if (!loaded) {
+        return 1;
+    }
+    double build_seconds = perf_now_seconds() - build_start;
+    if ((scene.bvh.num_nodes == 0 && !scene_build_bvh(&scene, false)) || !scene_build_instances(&scene) ||
+        !scene_build_shapes(&scene) || !scene_build_light_bvh(&scene)) {
+        scene_free(&scene);
+        return 1;
+    }
+    RaySet rays;
+    if (!make_primary_rays(&scene, &rays, max_rays)) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        scene_free(&scene);
+        return 1;
+    }
+    render_load_background("../doc/background.jpg");
+
+    printf("scene: %zu spheres, %zu triangles, %zu instances, %zu lights (%s, %.3f ms), %zu rays, %d iterations\n",
+           scene.num_spheres, scene.mesh.num_triangles, scene.num_instances, scene.num_lights, scene_path ? scene_path : generate ? "generated" : "demo", build_seconds * 1e3,
+           rays.count, iterations);
+    if (run_brute_force) {
+        run_kernel("sphere_ray_intersect", bench_sphere_intersect, &scene, &rays, iterations, use_counters);
+        run_kernel("scene_intersect", bench_scene_intersect, &scene, &rays, iterations, use_counters);
+        if (scene.bvh.num_packets > 0) {
+            run_kernel("triangle_intersect", bench_triangle_scalar, &scene, &rays, iterations, use_counters);
+            run_kernel("triangle_packet_intersect", bench_triangle_packets, &scene, &rays, iterations, use_counters);
+        }
+    }
+    run_kernel("scene_trace (bvh)", bench_scene_trace, &scene, &rays, iterations, use_counters);
+    printf("%-24s %10.2f MB nodes\n", "", scene.bvh.num_nodes * sizeof(BVHNode) / 1e6);
+    // The same tree with quantized nodes.
+    if (scene.sphere_motion == NULL) {
+        Scene quantized = scene;
+        memset(&quantized.bvh, 0, sizeof(quantized.bvh));
+        double start = perf_now_seconds();
+        if (qbvh_build(&quantized.qbvh, &scene.bvh)) {
+            double seconds = perf_now_seconds() - start;
+            run_kernel("scene_trace (qbvh)", bench_scene_trace, &quantized, &rays, iterations, use_counters);
+            printf("%-24s %10.2f ms build, %.2f MB nodes\n", "", seconds * 1e3,
+                   quantized.qbvh.num_nodes * sizeof(QBVHNode) / 1e6);
+            // And with the spheres packed into its leaves.
+            start = perf_now_seconds();
+            if (qbvh_pack_spheres(&quantized.qbvh, scene.spheres, scene.num_spheres)) {
+                seconds = perf_now_seconds() - start;
+                quantized.spheres = NULL;
+                run_kernel("scene_trace (compact)", bench_scene_trace, &quantized, &rays, iterations, use_counters);
+                printf("%-24s %10.2f ms packing, %.2f MB spheres (%.2f MB in full)\n", "", seconds * 1e3,
+                       quantized.qbvh.num_packed * sizeof(PackedSphere) / 1e6,
+                       scene.num_spheres * (sizeof(Sphere) + sizeof(uint32_t)) / 1e6);
+            }
+            qbvh_free(&quantized.qbvh);
+        }
+    }
+    // The same rays through both grids, which only take still spheres.
+    if (scene.mesh.num_triangles == 0 && scene.sphere_motion == NULL) {
+        static const char *grid_labels[] = { "scene_trace (grid)", "scene_trace (hashed grid)" };
+        for (int hashed = 0; hashed < 2; hashed++) {
+            Scene gridded = scene;
+            memset(&gridded.grid, 0, sizeof(gridded.grid));
+            double start = perf_now_seconds();
+            if (!grid_build(&gridded.grid, scene.spheres, scene.num_spheres, hashed)) {
+                continue;
+            }
+            double seconds = perf_now_seconds() - start;
+            run_kernel(grid_labels[hashed], bench_scene_trace, &gridded, &rays, iterations, use_counters);
+            printf("%-24s %10.2f ms build, %.1f MB\n", "", seconds * 1e3, grid_bytes(&gridded.grid) / 1e6);
+            grid_free(&gridded.grid);
+        }
+    }
+    run_kernel("diffuse_shading", bench_shading, &scene, &rays, iterations, use_counters);
+    if (shading_batch_init(&shading_batch, BENCH_BATCH_SIZE)) {
+        run_kernel("blinn_phong (per hit)", bench_blinn_phong, &scene, &rays, iterations, use_counters);
+        run_kernel("blinn_phong (batched)", bench_blinn_phong_batched, &scene, &rays, iterations, use_counters);
+        shading_batch_free(&shading_batch);
+    }
+
+    static const char *light_labels[] = { "direct (exact)", "direct (cull)", "direct (sample)" };
+    for (int mode = LIGHTS_EXACT; mode <= LIGHTS_SAMPLE; mode++) {
+        Scene lighting = scene;
+        lighting.settings.light_sampling = (LightSampling)mode;
+        run_kernel(light_labels[mode], bench_light_selection, &lighting, &rays, iterations, use_counters);
+        printf("%-24s %10.2f lights/shade\n", "",
+               (double)light_stats.lights_evaluated / (double)(light_stats.shading_points ? light_stats.shading_points : 1));
+    }
+
+    // Overlapping cluster of the demo scene: spheres 5-8 share centers and
+    // nest inside each other, so most rays find several closer hits.
+    if (!generate && scene_path == NULL) {
+        Scene cluster = scene;
+        cluster.spheres = scene.spheres + 5;
+        cluster.num_spheres = 4;
+        RaySet cluster_rays;
+        if (make_cluster_rays(&scene, 5, 4, &cluster_rays)) {
+            run_kernel("cluster 5-8 eager", bench_eager_hit_record, &cluster, &cluster_rays, iterations, use_counters);
+            run_kernel("cluster 5-8 deferred", bench_deferred_hit_record, &cluster, &cluster_rays, iterations, use_counters);
+            free(cluster_rays.directions);
+        }
+    }
+    if (run_full_frame) {
+        run_render(&scene, iterations, use_counters);
+        run_path_passes(&scene, iterations, use_counters);
+    }
+
+    render_free_background();
+    free(rays.directions);
+    scene_free(&scene);
+    return 0;
+}
@@ -0,0 +1,697 @@
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "../include/bvh.h"
+
+#define BVH_BINS 16
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECT_COST 1.0f
+
+// fminf/fmaxf honour NaN rules that keep compilers from emitting a single
+// min/max instruction; the plain comparisons below compile to minss/maxss.
+static inline float min_f(float a, float b) { return a < b ? a : b; }
+static inline float max_f(float a, float b) { return a > b ? a : b; }
+
+typedef struct {
+  float min[3];
+  float max[3];
+} Bounds;
+
+typedef struct {
+  BVH *bvh;
+  const Sphere *spheres;
+  const Vec3f *motion; // NULL when the spheres stand still
+  const Mesh *mesh;
+  uint32_t num_spheres; // prim ids from here on are triangles
+  Bounds *prim_bounds;  // per prim id
+  float (*centroids)[3];
+  Arena *arena;         // where the finished arrays go; NULL for malloc
+} BuildContext;
+
+static void bounds_empty(Bounds *b) {
+  for (int k = 0; k < 3; k++) {
+    b->min[k] = FLT_MAX;
+    b->max[k] = -FLT_MAX;
+  }
+}
+
+static void bounds_grow_point(Bounds *b, const float *p) {
+  for (int k = 0; k < 3; k++) {
+    b->min[k] = min_f(b->min[k], p[k]);
+    b->max[k] = max_f(b->max[k], p[k]);
+  }
+}
+
+static void bounds_grow(Bounds *b, const Bounds *other) {
+  for (int k = 0; k < 3; k++) {
+    b->min[k] = min_f(b->min[k], other->min[k]);
+    b->max[k] = max_f(b->max[k], other->max[k]);
+  }
+}
+
+static float bounds_area(const Bounds *b) {
+  float ex = b->max[0] - b->min[0];
+  float ey = b->max[1] - b->min[1];
+  float ez = b->max[2] - b->min[2];
+  if (ex < 0.0f) {
+    return 0.0f;
+  }
+  return 2.0f * (ex * ey + ey * ez + ez * ex);
+}
+
+static void build_node(BuildContext *ctx, uint32_t node_index, uint32_t first, uint32_t count, uint32_t depth) {
+  BVH *bvh = ctx->bvh;
+  BVHNode *node = &bvh->nodes[node_index];
+  uint32_t *indices = bvh->prim_indices;
+
+  Bounds bounds, centroid_bounds;
+  bounds_empty(&bounds);
+  bounds_empty(&centroid_bounds);
+  uint32_t num_triangles = 0;
+  for (uint32_t i = first; i < first + count; i++) {
+    bounds_grow(&bounds, &ctx->prim_bounds[indices[i]]);
+    bounds_grow_point(&centroid_bounds, ctx->centroids[indices[i]]);
+    num_triangles += indices[i] >= ctx->num_spheres;
+  }
+  memcpy(node->bounds_min, bounds.min, sizeof(bounds.min));
+  memcpy(node->bounds_max, bounds.max, sizeof(bounds.max));
+  node->left_first = first;
+  node->count = count;
+
+  if (count <= 1) {
+    return;
+  }
+
+  // Evaluate SAH over BVH_BINS centroid bins on every axis.
+  float best_cost = FLT_MAX;
+  int best_axis = -1;
+  int best_split = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+    if (extent <= 0.0f) {
+      continue;
+    }
+    Bounds bin_bounds[BVH_BINS];
+    uint32_t bin_counts[BVH_BINS] = { 0 };
+    for (int b = 0; b < BVH_BINS; b++) {
+      bounds_empty(&bin_bounds[b]);
+    }
+    float scale = BVH_BINS / extent;
+    for (uint32_t i = first; i < first + count; i++) {
+      int b = (int)((ctx->centroids[indices[i]][axis] - centroid_bounds.min[axis]) * scale);
+      b = b < BVH_BINS - 1 ? b : BVH_BINS - 1;
+      bin_counts[b]++;
+      bounds_grow(&bin_bounds[b], &ctx->prim_bounds[indices[i]]);
+    }
+
+    // Sweep from the right to get the cost of every right-hand side, then
+    // from the left to combine.
+    float right_area[BVH_BINS];
+    uint32_t right_count[BVH_BINS];
+    Bounds acc;
+    bounds_empty(&acc);
+    uint32_t acc_count = 0;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+      bounds_grow(&acc, &bin_bounds[b]);
+      acc_count += bin_counts[b];
+      right_area[b] = bounds_area(&acc);
+      right_count[b] = acc_count;
+    }
+    bounds_empty(&acc);
+    acc_count = 0;
+    for (int b = 0; b < BVH_BINS - 1; b++) {
+      bounds_grow(&acc, &bin_bounds[b]);
+      acc_count += bin_counts[b];
+      if (acc_count == 0 || right_count[b + 1] == 0) {
+        continue;
+      }
+      float cost = bounds_area(&acc) * acc_count + right_area[b + 1] * right_count[b + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
+      }
+    }
+  }
+
+  // Triangle leaves are tested a packet at a time, so up to a packet's
+  // worth of triangles costs one test.
+  bool all_triangles = num_triangles == count;
+  bool mixed = num_triangles > 0 && !all_triangles;
+  uint32_t max_leaf_size = all_triangles ? TRIANGLE_PACKET_WIDTH : BVH_MAX_LEAF_SIZE;
+  uint32_t leaf_tests = all_triangles ? (count + TRIANGLE_PACKET_WIDTH - 1) / TRIANGLE_PACKET_WIDTH : count;
+  float parent_area = bounds_area(&bounds);
+  float leaf_cost = BVH_INTERSECT_COST * leaf_tests;
+  float split_cost = BVH_TRAVERSAL_COST + (parent_area > 0.0f ? BVH_INTERSECT_COST * best_cost / parent_area : 0.0f);
+  // Past BVH_MAX_DEPTH - 1 everything left becomes a leaf, however large;
+  // a mixed one still splits by kind, which puts its children at the cap.
+  bool make_leaf = depth >= BVH_MAX_DEPTH - 1 ||
+                   (count <= max_leaf_size && (best_axis < 0 || leaf_cost <= split_cost));
+
+  uint32_t left_count;
+  if (mixed && (make_leaf || best_axis < 0)) {
+    // Leaves hold one kind of primitive: where this would become a leaf,
+    // or SAH can't separate the centroids, split spheres from triangles.
+    uint32_t i = first;
+    uint32_t j = first + count;
+    while (i < j) {
+      if (indices[i] < ctx->num_spheres) {
+        i++;
+      } else {
+        uint32_t tmp = indices[i];
+        indices[i] = indices[--j];
+        indices[j] = tmp;
+      }
+    }
+    left_count = i - first;
+  } else if (best_axis >= 0) {
+    if (make_leaf) {
+      return;
+    }
+    // Partition by bin; same formula as the binning pass so prims land on
+    // the side they were counted on.
+    float scale = BVH_BINS / (centroid_bounds.max[best_axis] - centroid_bounds.min[best_axis]);
+    uint32_t i = first;
+    uint32_t j = first + count;
+    while (i < j) {
+      int b = (int)((ctx->centroids[indices[i]][best_axis] - centroid_bounds.min[best_axis]) * scale);
+      b = b < BVH_BINS - 1 ? b : BVH_BINS - 1;
+      if (b <= best_split) {
+        i++;
+      } else {
+        uint32_t tmp = indices[i];
+        indices[i] = indices[--j];
+        indices[j] = tmp;
+      }
+    }
+    left_count = i - first;
+  } else {
+    // All centroids coincide; SAH can't separate them.
+    if (make_leaf) {
+      return;
+    }
+    left_count = count / 2;
+  }
+
+  uint32_t left = bvh->num_nodes;
+  bvh->num_nodes += 2;
+  node->left_first = left;
+  node->count = 0;
+  build_node(ctx, left, first, left_count, depth + 1);
+  build_node(ctx, left + 1, first + left_count, count - left_count, depth + 1);
+}
+
+static void sphere_bounds(const Sphere *sphere, Bounds *b) {
+  for (int k = 0; k < 3; k++) {
+    b->min[k] = sphere->center.data[k] - sphere->radius;
+    b->max[k] = sphere->center.data[k] + sphere->radius;
+  }
+}
+
+static void triangle_bounds(const Mesh *mesh, size_t triangle, Bounds *b) {
+  bounds_empty(b);
+  for (int corner = 0; corner < 3; corner++) {
+    bounds_grow_point(b, mesh->vertices[mesh->triangles[triangle].v[corner]].data);
+  }
+}
+
+// A moving sphere is split by the box it sweeps over the frame and by its
+// center halfway through.
+static void prim_bounds_init(BuildContext *ctx) {
+  const Sphere *spheres = ctx->spheres;
+  for (uint32_t i = 0; i < ctx->num_spheres; i++) {
+    Bounds *b = &ctx->prim_bounds[i];
+    sphere_bounds(&spheres[i], b);
+    for (int k = 0; k < 3; k++) {
+      ctx->centroids[i][k] = spheres[i].center.data[k];
+    }
+    if (ctx->motion != NULL) {
+      Sphere end = sphere_at(&spheres[i], ctx->motion[i], 1.0f);
+      Bounds end_bounds;
+      sphere_bounds(&end, &end_bounds);
+      bounds_grow(b, &end_bounds);
+      for (int k = 0; k < 3; k++) {
+        ctx->centroids[i][k] += 0.5f * ctx->motion[i].data[k];
+      }
+    }
+  }
+  const Mesh *mesh = ctx->mesh;
+  for (size_t t = 0; t < (mesh != NULL ? mesh->num_triangles : 0); t++) {
+    uint32_t id = ctx->num_spheres + (uint32_t)t;
+    Bounds *b = &ctx->prim_bounds[id];
+    triangle_bounds(mesh, t, b);
+    for (int k = 0; k < 3; k++) {
+      ctx->centroids[id][k] = 0.5f * (b->min[k] + b->max[k]);
+    }
+  }
+}
+
+// Replaces the swept boxes build_node left in the subtree with the boxes at
+// time 0, and fills end_bounds with those at time 1. Runs before
+// build_packets, while triangle leaves still reference prim ranges.
+static void refit_motion(BuildContext *ctx, uint32_t node_index, Bounds *start, Bounds *end) {
+  BVH *bvh = ctx->bvh;
+  BVHNode *node = &bvh->nodes[node_index];
+  bounds_empty(start);
+  bounds_empty(end);
+  if (node->count > 0) {
+    for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+      uint32_t id = bvh->prim_indices[i];
+      Bounds b;
+      if (id < ctx->num_spheres) {
+        sphere_bounds(&ctx->spheres[id], &b);
+        bounds_grow(start, &b);
+        Sphere moved = sphere_at(&ctx->spheres[id], ctx->motion[id], 1.0f);
+        sphere_bounds(&moved, &b);
+        bounds_grow(end, &b);
+      } else {
+        triangle_bounds(ctx->mesh, id - ctx->num_spheres, &b);
+        bounds_grow(start, &b);
+        bounds_grow(end, &b);
+      }
+    }
+  } else {
+    Bounds child_start, child_end;
+    for (uint32_t child = node->left_first; child < node->left_first + 2; child++) {
+      refit_motion(ctx, child, &child_start, &child_end);
+      bounds_grow(start, &child_start);
+      bounds_grow(end, &child_end);
+    }
+  }
+  memcpy(node->bounds_min, start->min, sizeof(start->min));
+  memcpy(node->bounds_max, start->max, sizeof(start->max));
+  memcpy(bvh->end_bounds[node_index].bounds_min, end->min, sizeof(end->min));
+  memcpy(bvh->end_bounds[node_index].bounds_max, end->max, sizeof(end->max));
+}
+
+static inline Vec3f triangle_corner(const Mesh *mesh, uint32_t triangle, int corner) {
+  return mesh->vertices[mesh->triangles[triangle].v[corner]];
+}
+
+static void *build_alloc(BuildContext *ctx, size_t size) {
+  return ctx->arena != NULL ? arena_alloc(ctx->arena, size) : malloc(size);
+}
+
+static uint32_t count_packets(const BuildContext *ctx) {
+  const BVH *bvh = ctx->bvh;
+  uint32_t num_packets = 0;
+  for (uint32_t n = 0; n < bvh->num_nodes; n++) {
+    const BVHNode *node = &bvh->nodes[n];
+    if (node->count > 0 && bvh->prim_indices[node->left_first] >= ctx->num_spheres) {
+      num_packets += (node->count + TRIANGLE_PACKET_WIDTH - 1) / TRIANGLE_PACKET_WIDTH;
+    }
+  }
+  return num_packets;
+}
+
+// Turns every triangle leaf's prim range into packets.
+static bool build_packets(BuildContext *ctx) {
+  BVH *bvh = ctx->bvh;
+  uint32_t num_packets = count_packets(ctx);
+  if (num_packets == 0) {
+    return true;
+  }
+  bvh->packets = (TrianglePacket *)build_alloc(ctx, num_packets * sizeof(TrianglePacket));
+  if (bvh->packets == NULL) {
+    return false;
+  }
+
+  for (uint32_t n = 0; n < bvh->num_nodes; n++) {
+    BVHNode *node = &bvh->nodes[n];
+    if (node->count == 0 || bvh->prim_indices[node->left_first] < ctx->num_spheres) {
+      continue;
+    }
+    uint32_t first_packet = bvh->num_packets;
+    for (uint32_t i = 0; i < node->count; i++) {
+      int lane = (int)(i % TRIANGLE_PACKET_WIDTH);
+      TrianglePacket *packet = &bvh->packets[first_packet + i / TRIANGLE_PACKET_WIDTH];
+      if (lane == 0) {
+        triangle_packet_clear(packet);
+        bvh->num_packets++;
+      }
+      uint32_t id = bvh->prim_indices[node->left_first + i];
+      uint32_t t = id - ctx->num_spheres;
+      triangle_packet_set(packet, lane, triangle_corner(ctx->mesh, t, 0), triangle_corner(ctx->mesh, t, 1),
+                          triangle_corner(ctx->mesh, t, 2), id);
+    }
+    node->left_first = first_packet;
+    node->count = (bvh->num_packets - first_packet) | BVH_LEAF_TRIANGLES;
+  }
+  return true;
+}
+
+// Allocates the arrays for num_prims primitives; the caller fills
+// ctx->prim_bounds and ctx->centroids before build_tree.
+static bool build_init(BuildContext *ctx, size_t num_prims) {
+  BVH *bvh = ctx->bvh;
+  if (num_prims > UINT32_MAX / 2) {
+    fprintf(stderr, "Too many primitives for a 32-bit BVH.\n");
+    return false;
+  }
+  bvh->owns_memory = true;
+  bvh->nodes = (BVHNode *)malloc((2 * num_prims - 1) * sizeof(BVHNode));
+  bvh->prim_indices = (uint32_t *)malloc(num_prims * sizeof(uint32_t));
+  ctx->prim_bounds = (Bounds *)malloc(num_prims * sizeof(Bounds));
+  ctx->centroids = (float (*)[3])malloc(num_prims * sizeof(*ctx->centroids));
+  if (bvh->nodes == NULL || bvh->prim_indices == NULL || ctx->prim_bounds == NULL || ctx->centroids == NULL) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    free(ctx->prim_bounds);
+    free(ctx->centroids);
+    bvh_free(bvh);
+    return false;
+  }
+  for (uint32_t i = 0; i < num_prims; i++) {
+    bvh->prim_indices[i] = i;
+  }
+  bvh->num_prims = (uint32_t)num_prims;
+  bvh->num_nodes = 1;
+  return true;
+}
+
+// Copies the finished nodes and prim indices into the arena, in one block
+// with room for the end bounds and packets still to come, and drops the
+// malloc'ed ones. The build itself runs in malloc'ed memory: the nodes are
+// allocated for the worst case, which only a copy can trim in an arena.
+static bool move_to_arena(BuildContext *ctx) {
+  BVH *bvh = ctx->bvh;
+  size_t node_bytes = bvh->num_nodes * sizeof(BVHNode);
+  size_t index_bytes = bvh->num_prims * sizeof(uint32_t);
+  size_t end_bytes = ctx->motion != NULL ? bvh->num_nodes * sizeof(BVHBounds) : 0;
+  size_t packet_bytes = count_packets(ctx) * sizeof(TrianglePacket);
+  if (!arena_reserve(ctx->arena, node_bytes + index_bytes + end_bytes + packet_bytes + 4 * ARENA_ALIGNMENT)) {
+    return false;
+  }
+  BVHNode *nodes = (BVHNode *)arena_alloc(ctx->arena, node_bytes);
+  uint32_t *prim_indices = (uint32_t *)arena_alloc(ctx->arena, index_bytes);
+  memcpy(nodes, bvh->nodes, node_bytes);
+  memcpy(prim_indices, bvh->prim_indices, index_bytes);
+  free(bvh->nodes);
+  free(bvh->prim_indices);
+  bvh->nodes = nodes;
+  bvh->prim_indices = prim_indices;
+  bvh->owns_memory = false;
+  return true;
+}
+
+static bool build_tree(BuildContext *ctx) {
+  BVH *bvh = ctx->bvh;
+  build_node(ctx, 0, 0, bvh->num_prims, 0);
+  free(ctx->prim_bounds);
+  free(ctx->centroids);
+
+  if (ctx->arena != NULL) {
+    if (!move_to_arena(ctx)) {
+      fprintf(stderr, "Memory allocation failed.\n");
+      bvh_free(bvh);
+      return false;
+    }
+  } else {
+    BVHNode *shrunk = (BVHNode *)realloc(bvh->nodes, bvh->num_nodes * sizeof(BVHNode));
+    if (shrunk != NULL) {
+      bvh->nodes = shrunk;
+    }
+  }
+  if (ctx->motion != NULL) {
+    bvh->end_bounds = (BVHBounds *)build_alloc(ctx, bvh->num_nodes * sizeof(BVHBounds));
+    if (bvh->end_bounds == NULL) {
+      fprintf(stderr, "Memory allocation failed.\n");
+      bvh_free(bvh);
+      return false;
+    }
+    Bounds start, end;
+    refit_motion(ctx, 0, &start, &end);
+  }
+  if (!build_packets(ctx)) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    bvh_free(bvh);
+    return false;
+  }
+  return true;
+}
+
+bool bvh_build(BVH *bvh, const Sphere *spheres, size_t num_spheres, const Vec3f *motion, const Mesh *mesh) {
+  return bvh_build_in(bvh, NULL, spheres, num_spheres, motion, mesh);
+}
+
+bool bvh_build_in(BVH *bvh, Arena *arena, const Sphere *spheres, size_t num_spheres, const Vec3f *motion,
+                  const Mesh *mesh) {
+  memset(bvh, 0, sizeof(*bvh));
+  size_t num_prims = num_spheres + (mesh != NULL ? mesh->num_triangles : 0);
+  if (num_prims == 0) {
+    return true;
+  }
+  BuildContext ctx = { bvh, spheres, num_spheres > 0 ? motion : NULL, mesh, (uint32_t)num_spheres, NULL, NULL,
+                       arena };
+  if (!build_init(&ctx, num_prims)) {
+    return false;
+  }
+  prim_bounds_init(&ctx);
+  return build_tree(&ctx);
+}
+
+bool bvh_build_boxes(BVH *bvh, const float (*bounds)[6], size_t count) {
+  memset(bvh, 0, sizeof(*bvh));
+  if (count == 0) {
+    return true;
+  }
+  // Without a mesh every prim is a "sphere": leaves are plain index ranges.
+  BuildContext ctx = { bvh, NULL, NULL, NULL, (uint32_t)count, NULL, NULL, NULL };
+  if (!build_init(&ctx, count)) {
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    for (int k = 0; k < 3; k++) {
+      ctx.prim_bounds[i].min[k] = bounds[i][k];
+      ctx.prim_bounds[i].max[k] = bounds[i][3 + k];
+      ctx.centroids[i][k] = 0.5f * (bounds[i][k] + bounds[i][3 + k]);
+    }
+  }
+  return build_tree(&ctx);
+}
+
+void bvh_free(BVH *bvh) {
+  if (bvh->mapping != NULL) {
+    munmap(bvh->mapping, bvh->mapping_size);
+  } else if (bvh->owns_memory) {
+    free(bvh->nodes);
+    free(bvh->end_bounds);
+    free(bvh->prim_indices);
+    free(bvh->packets);
+  }
+  memset(bvh, 0, sizeof(*bvh));
+}
+
+bool bvh_copy_in(BVH *copy, Arena *arena, const BVH *bvh) {
+  memset(copy, 0, sizeof(*copy));
+  size_t node_bytes = bvh->num_nodes * sizeof(BVHNode);
+  size_t end_bytes = bvh->end_bounds != NULL ? bvh->num_nodes * sizeof(BVHBounds) : 0;
+  size_t index_bytes = bvh->num_prims * sizeof(uint32_t);
+  size_t packet_bytes = bvh->num_packets * sizeof(TrianglePacket);
+  if (!arena_reserve(arena, node_bytes + end_bytes + index_bytes + packet_bytes + 4 * ARENA_ALIGNMENT)) {
+    return false;
+  }
+  *copy = *bvh;
+  copy->owns_memory = false;
+  copy->mapping = NULL;
+  copy->mapping_size = 0;
+  copy->nodes = (BVHNode *)arena_alloc(arena, node_bytes);
+  copy->end_bounds = end_bytes > 0 ? (BVHBounds *)arena_alloc(arena, end_bytes) : NULL;
+  copy->prim_indices = (uint32_t *)arena_alloc(arena, index_bytes);
+  copy->packets = packet_bytes > 0 ? (TrianglePacket *)arena_alloc(arena, packet_bytes) : NULL;
+  memcpy(copy->nodes, bvh->nodes, node_bytes);
+  if (end_bytes > 0) {
+    memcpy(copy->end_bounds, bvh->end_bounds, end_bytes);
+  }
+  memcpy(copy->prim_indices, bvh->prim_indices, index_bytes);
+  if (packet_bytes > 0) {
+    memcpy(copy->packets, bvh->packets, packet_bytes);
+  }
+  return true;
+}
+
+bool bvh_validate(const BVH *bvh, size_t num_spheres, size_t num_triangles) {
+  uint64_t num_nodes = bvh->num_nodes;
+  uint64_t num_prims = (uint64_t)num_spheres + num_triangles;
+  if (num_nodes == 0 || num_nodes >= 2 * num_prims || bvh->num_prims != num_prims ||
+      bvh->num_packets > num_triangles) {
+    return false;
+  }
+  // Children come after their parent, so one pass in order sees every
+  // parent's depth before its children's.
+  uint8_t *depths = (uint8_t *)calloc(num_nodes, sizeof(uint8_t));
+  if (depths == NULL) {
+    return false;
+  }
+  bool valid = true;
+  for (uint64_t i = 0; i < num_nodes && valid; i++) {
+    const BVHNode *node = &bvh->nodes[i];
+    if (node->count & BVH_LEAF_TRIANGLES) {
+      valid = (uint64_t)node->left_first + (node->count & ~BVH_LEAF_TRIANGLES) <= bvh->num_packets;
+    } else if (node->count > 0) {
+      // Traversal reads spheres[prim_indices[i]] for every i of the leaf.
+      valid = (uint64_t)node->left_first + node->count <= num_prims;
+      for (uint32_t p = 0; p < node->count && valid; p++) {
+        valid = bvh->prim_indices[node->left_first + p] < num_spheres;
+      }
+    } else if ((uint64_t)node->left_first + 1 >= num_nodes || node->left_first <= i || depths[i] >= BVH_MAX_DEPTH) {
+      valid = false;
+    } else {
+      for (uint32_t c = node->left_first; c <= node->left_first + 1; c++) {
+        if (depths[c] < depths[i] + 1) {
+          depths[c] = (uint8_t)(depths[i] + 1);
+        }
+      }
+    }
+  }
+  free(depths);
+  for (uint64_t i = 0; i < num_prims && valid; i++) {
+    valid = bvh->prim_indices[i] < num_prims;
+  }
+  for (uint64_t p = 0; p < bvh->num_packets && valid; p++) {
+    for (int lane = 0; lane < TRIANGLE_PACKET_WIDTH; lane++) {
+      uint32_t id = bvh->packets[p].prim_ids[lane];
+      if (id != UINT32_MAX && (id < num_spheres || id >= num_prims)) {
+        valid = false;
+      }
+    }
+  }
+  return valid;
+}
+
+// Slab test; returns the entry distance or FLT_MAX on a miss. The exit
+// distance is scaled by BVH_ROBUST_SCALE.
+static inline float ray_box(const BVHNode *node, const float *origin, const float *inv_dir, float t_max) {
+  float t_near = 0.0f;
+  float t_far = t_max;
+  for (int k = 0; k < 3; k++) {
+    // The near plane is picked by the direction's sign rather than by
+    // comparing the distances, so that a ray lying in a slab's plane
+    // (0 * inf = NaN) fails the comparisons in max_f/min_f and leaves the
+    // axis unconstrained instead of rejecting the box.
+    bool negative = inv_dir[k] < 0.0f;
+    float t0 = ((negative ? node->bounds_max[k] : node->bounds_min[k]) - origin[k]) * inv_dir[k];
+    float t1 = ((negative ? node->bounds_min[k] : node->bounds_max[k]) - origin[k]) * inv_dir[k];
+    t_near = max_f(t0, t_near);
+    t_far = min_f(t1, t_far);
+  }
+  return t_near <= t_far * BVH_ROBUST_SCALE ? t_near : FLT_MAX;
+}
+
+// ray_box against the node's box at the given time.
+static inline float ray_box_at(const BVHNode *node, const BVHBounds *end, float time, const float *origin,
+                               const float *inv_dir, float t_max) {
+  BVHNode box;
+  for (int k = 0; k < 3; k++) {
+    box.bounds_min[k] = node->bounds_min[k] + (end->bounds_min[k] - node->bounds_min[k]) * time;
+    box.bounds_max[k] = node->bounds_max[k] + (end->bounds_max[k] - node->bounds_max[k]) * time;
+  }
+  return ray_box(&box, origin, inv_dir, t_max);
+}
+
+// Shared by bvh_intersect and bvh_intersect_leaves. Index leaves go to
+// leaf_fn, or straight to the spheres when it is NULL; that check, and
+// whether the tree moves, go the same way for a whole traversal, so they
+// predict perfectly.
+static bool traverse(const BVH *bvh, const Sphere *spheres, const Vec3f *motion, BVHLeafFn leaf_fn,
+                     const void *context, const Ray *ray, Hit *hit) {
+  if (bvh->num_nodes == 0) {
+    return false;
+  }
+
+  float inv_dir[3];
+  for (int k = 0; k < 3; k++) {
+    // -0 becomes +0 (and +inf), which ray_box's plane choice relies on.
+    float d = ray->direction.data[k];
+    inv_dir[k] = 1.0f / (d == 0.0f ? 0.0f : d);
+  }
+  const float *origin = ray->origin.data;
+  TriangleRay tray;
+  if (bvh->num_packets > 0) {
+    triangle_ray_init(&tray, ray);
+  }
+
+  bool found = false;
+  uint32_t stack[BVH_STACK_SIZE];
+  float stack_t[BVH_STACK_SIZE];
+  int stack_size = 0;
+  const BVHBounds *end_bounds = bvh->end_bounds;
+  const float time = ray->time;
+  const BVHNode *node = &bvh->nodes[0];
+  float t_root = end_bounds != NULL ? ray_box_at(node, end_bounds, time, origin, inv_dir, hit->t)
+                                    : ray_box(node, origin, inv_dir, hit->t);
+  if (t_root == FLT_MAX) {
+    return false;
+  }
+
+  for (;;) {
+    if (node->count & BVH_LEAF_TRIANGLES) {
+      uint32_t end = node->left_first + (node->count & ~BVH_LEAF_TRIANGLES);
+      for (uint32_t p = node->left_first; p < end; p++) {
+        found |= triangle_packet_intersect(&bvh->packets[p], &tray, hit);
+      }
+    } else if (node->count > 0) {
+      for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+        uint32_t index = bvh->prim_indices[i];
+        if (leaf_fn != NULL) {
+          found |= leaf_fn(context, index, ray, hit);
+        } else if (motion != NULL) {
+          Sphere moved = sphere_at(&spheres[index], motion[index], time);
+          found |= sphere_intersect_closer(&moved, ray, index, hit);
+        } else {
+          found |= sphere_intersect_closer(&spheres[index], ray, index, hit);
+        }
+      }
+    } else {
+      // Visit the nearer child first and defer the other.
+      const BVHNode *left = &bvh->nodes[node->left_first];
+      const BVHNode *right = left + 1;
+      float t_left, t_right;
+      if (end_bounds != NULL) {
+        const BVHBounds *end = &end_bounds[node->left_first];
+        t_left = ray_box_at(left, end, time, origin, inv_dir, hit->t);
+        t_right = ray_box_at(right, end + 1, time, origin, inv_dir, hit->t);
+      } else {
+        t_left = ray_box(left, origin, inv_dir, hit->t);
+        t_right = ray_box(right, origin, inv_dir, hit->t);
+      }
+      if (t_left > t_right) {
+        const BVHNode *tmp_node = left;
+        left = right;
+        right = tmp_node;
+        float tmp = t_left;
+        t_left = t_right;
+        t_right = tmp;
+      }
+      if (t_left != FLT_MAX) {
+        // Trees are at most BVH_MAX_DEPTH deep, so this never overflows.
+        if (t_right != FLT_MAX) {
+          stack[stack_size] = (uint32_t)(right - bvh->nodes);
+          stack_t[stack_size++] = t_right;
+        }
+        node = left;
+        continue;
+      }
+    }
+
+    // Pop, skipping nodes the current closest hit already rules out.
+    for (;;) {
+      if (stack_size == 0) {
+        return found;
+      }
+      stack_size--;
+      if (stack_t[stack_size] < hit->t) {
+        node = &bvh->nodes[stack[stack_size]];
+        break;
+      }
+    }
+  }
+}
+
+bool bvh_intersect(const BVH *bvh, const Sphere *spheres, const Vec3f *motion, const Ray *ray, Hit *hit) {
+  return traverse(bvh, spheres, motion, NULL, NULL, ray, hit);
+}
+
+bool bvh_intersect_leaves(const BVH *bvh, BVHLeafFn leaf_fn, const void *context, const Ray *ray, Hit *hit) {
+  return traverse(bvh, NULL, NULL, leaf_fn, context, ray, hit);
+}
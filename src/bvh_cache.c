@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/bvh_cache.h"
+#include "../include/perf.h"
+
+#define BVH_CACHE_MAGIC "RTBVH"
+#define BVH_CACHE_BYTE_ORDER 0x01020304u
+// Bump when BVHNode or the builder changes; old cache files then miss.
+#define BVH_CACHE_VERSION 2
+#define BVH_CACHE_ALIGNMENT 64
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t node_size;
+  uint32_t max_leaf_size;
+  uint32_t packet_size;
+  uint32_t reserved;
+  uint64_t hash;
+  uint64_t num_spheres;
+  uint64_t num_triangles;
+  uint64_t num_nodes;
+  uint64_t num_prims;
+  uint64_t num_packets;
+  uint64_t nodes_offset;
+  uint64_t indices_offset;
+  uint64_t packets_offset;
+} BVHCacheHeader;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// xxHash64-style accumulation in four independent lanes, one sphere (two
+// 64-bit words: center xy, center z + radius) per lane step.
+uint64_t bvh_hash_spheres(const Sphere *spheres, size_t num_spheres) {
+  const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+  uint64_t lanes[4] = { p1 + p2, p2, 0, (uint64_t)0 - p1 };
+
+  for (size_t i = 0; i < num_spheres; i++) {
+    uint32_t bits[4];
+    memcpy(&bits[0], &spheres[i].center.data[0], sizeof(float));
+    memcpy(&bits[1], &spheres[i].center.data[1], sizeof(float));
+    memcpy(&bits[2], &spheres[i].center.data[2], sizeof(float));
+    memcpy(&bits[3], &spheres[i].radius, sizeof(float));
+    uint64_t w0 = (uint64_t)bits[0] | ((uint64_t)bits[1] << 32);
+    uint64_t w1 = (uint64_t)bits[2] | ((uint64_t)bits[3] << 32);
+    uint64_t *lane = &lanes[i & 3];
+    *lane = rotl64(*lane + w0 * p2, 31) * p1;
+    *lane = rotl64(*lane + w1 * p2, 31) * p1;
+  }
+
+  uint64_t h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+  h += (uint64_t)num_spheres;
+  h ^= h >> 33;
+  h *= p2;
+  h ^= h >> 29;
+  h *= p1;
+  h ^= h >> 32;
+  return h;
+}
+
+// The same accumulation over every triangle's corner positions, in triangle
+// order (which fixes the prim ids stored in the packets).
+uint64_t bvh_hash_mesh(const Mesh *mesh) {
+  const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+  uint64_t lanes[4] = { p1 + p2, p2, 0, (uint64_t)0 - p1 };
+
+  for (size_t i = 0; i < mesh->num_triangles; i++) {
+    uint32_t bits[9];
+    for (int corner = 0; corner < 3; corner++) {
+      memcpy(&bits[3 * corner], mesh->vertices[mesh->triangles[i].v[corner]].data, 3 * sizeof(float));
+    }
+    uint64_t *lane = &lanes[i & 3];
+    for (int w = 0; w < 9; w += 2) {
+      uint64_t word = (uint64_t)bits[w] | (w + 1 < 9 ? (uint64_t)bits[w + 1] << 32 : 0);
+      *lane = rotl64(*lane + word * p2, 31) * p1;
+    }
+  }
+
+  uint64_t h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+  h += (uint64_t)mesh->num_triangles;
+  h ^= h >> 33;
+  h *= p2;
+  h ^= h >> 29;
+  h *= p1;
+  h ^= h >> 32;
+  return h;
+}
+
+static bool make_dirs(char *path) {
+  for (char *p = path + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        *p = '/';
+        return false;
+      }
+      *p = '/';
+    }
+  }
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static bool cache_dir(char *buffer, size_t size) {
+  const char *dir = getenv("RAYTRACER_CACHE_DIR");
+  int n;
+  if (dir != NULL && dir[0] != '\0') {
+    n = snprintf(buffer, size, "%s", dir);
+  } else if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0') {
+    n = snprintf(buffer, size, "%s/raytracer", dir);
+  } else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+    n = snprintf(buffer, size, "%s/.cache/raytracer", dir);
+  } else {
+    return false;
+  }
+  return n > 0 && (size_t)n < size && make_dirs(buffer);
+}
+
+// Whether count elements of element_size bytes at offset lie inside a file
+// of size bytes, without the sum or product wrapping around.
+static bool section_fits(uint64_t offset, uint64_t count, size_t element_size, size_t size) {
+  return offset <= size && count <= (size - offset) / element_size;
+}
+
+static bool try_load(BVH *bvh, const char *path, uint64_t hash, size_t num_spheres, size_t num_triangles) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BVHCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+
+  const BVHCacheHeader *header = (const BVHCacheHeader *)mapping;
+  uint64_t num_prims = (uint64_t)num_spheres + num_triangles;
+  bool valid = memcmp(header->magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC)) == 0 &&
+               header->version == BVH_CACHE_VERSION &&
+               header->byte_order == BVH_CACHE_BYTE_ORDER &&
+               header->node_size == sizeof(BVHNode) &&
+               header->max_leaf_size == BVH_MAX_LEAF_SIZE &&
+               header->packet_size == sizeof(TrianglePacket) &&
+               header->hash == hash &&
+               header->num_spheres == num_spheres &&
+               header->num_triangles == num_triangles &&
+               header->num_prims == num_prims &&
+               header->num_nodes > 0 && header->num_nodes < 2 * num_prims &&
+               header->num_packets <= num_triangles &&
+               header->nodes_offset % BVH_CACHE_ALIGNMENT == 0 &&
+               header->indices_offset % BVH_CACHE_ALIGNMENT == 0 &&
+               header->packets_offset % BVH_CACHE_ALIGNMENT == 0 &&
+               section_fits(header->nodes_offset, header->num_nodes, sizeof(BVHNode), size) &&
+               section_fits(header->indices_offset, header->num_prims, sizeof(uint32_t), size) &&
+               section_fits(header->packets_offset, header->num_packets, sizeof(TrianglePacket), size);
+  memset(bvh, 0, sizeof(*bvh));
+  if (valid) {
+    char *base = (char *)mapping;
+    bvh->nodes = (BVHNode *)(base + header->nodes_offset);
+    bvh->prim_indices = (uint32_t *)(base + header->indices_offset);
+    bvh->packets = header->num_packets > 0 ? (TrianglePacket *)(base + header->packets_offset) : NULL;
+    bvh->num_nodes = (uint32_t)header->num_nodes;
+    bvh->num_prims = (uint32_t)header->num_prims;
+    bvh->num_packets = (uint32_t)header->num_packets;
+  }
+  if (!valid || !bvh_validate(bvh, num_spheres, num_triangles)) {
+    fprintf(stderr, "BVH cache: ignoring invalid %s\n", path);
+    memset(bvh, 0, sizeof(*bvh));
+    munmap(mapping, size);
+    return false;
+  }
+  bvh->owns_memory = true;
+  bvh->mapping = mapping;
+  bvh->mapping_size = size;
+  return true;
+}
+
+static uint64_t align_up(uint64_t value) {
+  return (value + BVH_CACHE_ALIGNMENT - 1) & ~(uint64_t)(BVH_CACHE_ALIGNMENT - 1);
+}
+
+static bool write_padded(FILE *out, uint64_t *written, uint64_t offset, const void *data, size_t bytes) {
+  static const char padding[BVH_CACHE_ALIGNMENT] = { 0 };
+  size_t pad = (size_t)(offset - *written);
+  *written = offset + bytes;
+  return fwrite(padding, 1, pad, out) == pad && (bytes == 0 || fwrite(data, 1, bytes, out) == bytes);
+}
+
+static bool write_back(const BVH *bvh, const char *path, uint64_t hash, size_t num_spheres, size_t num_triangles) {
+  BVHCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+  header.version = BVH_CACHE_VERSION;
+  header.byte_order = BVH_CACHE_BYTE_ORDER;
+  header.node_size = sizeof(BVHNode);
+  header.max_leaf_size = BVH_MAX_LEAF_SIZE;
+  header.packet_size = sizeof(TrianglePacket);
+  header.hash = hash;
+  header.num_spheres = num_spheres;
+  header.num_triangles = num_triangles;
+  header.num_nodes = bvh->num_nodes;
+  header.num_prims = bvh->num_prims;
+  header.num_packets = bvh->num_packets;
+  header.nodes_offset = align_up(sizeof(header));
+  header.indices_offset = align_up(header.nodes_offset + header.num_nodes * sizeof(BVHNode));
+  header.packets_offset = align_up(header.indices_offset + header.num_prims * sizeof(uint32_t));
+
+  // Write to a private temporary and rename, so concurrent runs never see a
+  // half-written cache file.
+  char tmp_path[PATH_MAX];
+  int n = snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+  if (n < 0 || (size_t)n >= sizeof(tmp_path)) {
+    return false;
+  }
+  FILE *out = fopen(tmp_path, "wb");
+  if (out == NULL) {
+    return false;
+  }
+  uint64_t written = 0;
+  bool ok = write_padded(out, &written, 0, &header, sizeof(header)) &&
+            write_padded(out, &written, header.nodes_offset, bvh->nodes, header.num_nodes * sizeof(BVHNode)) &&
+            write_padded(out, &written, header.indices_offset, bvh->prim_indices, header.num_prims * sizeof(uint32_t)) &&
+            write_padded(out, &written, header.packets_offset, bvh->packets,
+                         header.num_packets * sizeof(TrianglePacket));
+  if (fclose(out) != 0) {
+    ok = false;
+  }
+  if (!ok || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+bool bvh_cache_load_or_build(BVH *bvh, const Sphere *spheres, size_t num_spheres, const Mesh *mesh) {
+  return bvh_cache_load_or_build_in(bvh, NULL, spheres, num_spheres, mesh);
+}
+
+bool bvh_cache_load_or_build_in(BVH *bvh, Arena *arena, const Sphere *spheres, size_t num_spheres,
+                                const Mesh *mesh) {
+  char dir[PATH_MAX];
+  char path[PATH_MAX];
+  size_t num_triangles = mesh != NULL ? mesh->num_triangles : 0;
+  if (num_spheres + num_triangles == 0 || !cache_dir(dir, sizeof(dir))) {
+    return bvh_build_in(bvh, arena, spheres, num_spheres, NULL, mesh);
+  }
+
+  double start = perf_now_seconds();
+  uint64_t hash = bvh_hash_spheres(spheres, num_spheres);
+  if (num_triangles > 0) {
+    hash = rotl64(hash, 17) ^ bvh_hash_mesh(mesh);
+  }
+  double hash_seconds = perf_now_seconds() - start;
+  int n = snprintf(path, sizeof(path), "%s/bvh-%016llx.bin", dir, (unsigned long long)hash);
+  if (n < 0 || (size_t)n >= sizeof(path)) {
+    return bvh_build_in(bvh, arena, spheres, num_spheres, NULL, mesh);
+  }
+
+  if (try_load(bvh, path, hash, num_spheres, num_triangles)) {
+    if (arena != NULL) {
+      BVH mapped = *bvh;
+      bool copied = bvh_copy_in(bvh, arena, &mapped);
+      bvh_free(&mapped);
+      if (!copied) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        memset(bvh, 0, sizeof(*bvh));
+        return false;
+      }
+    }
+    fprintf(stderr, "BVH cache hit: %s, %u nodes, hash %.1f ms, load %.1f ms\n", path, bvh->num_nodes,
+            hash_seconds * 1e3, (perf_now_seconds() - start - hash_seconds) * 1e3);
+    return true;
+  }
+
+  double build_start = perf_now_seconds();
+  if (!bvh_build_in(bvh, arena, spheres, num_spheres, NULL, mesh)) {
+    return false;
+  }
+  double build_seconds = perf_now_seconds() - build_start;
+  bool written = write_back(bvh, path, hash, num_spheres, num_triangles);
+  fprintf(stderr, "BVH cache miss: built %u nodes in %.1f ms (hash %.1f ms), %s %s\n", bvh->num_nodes,
+          build_seconds * 1e3, hash_seconds * 1e3, written ? "wrote" : "failed to write", path);
+  return true;
+}
@@ -0,0 +1,625 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/chunks.h"
+#include "../include/perf.h"
+
+#define CHUNKS_MAGIC "RTCHUNK"
+#define CHUNKS_BYTE_ORDER 0x01020304u
+// Bump when Sphere, BVHNode or the layout below changes.
+#define CHUNKS_VERSION 1
+// Alignment of the nodes and indices within a chunk.
+#define CHUNKS_ARRAY_ALIGNMENT 64
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t sphere_size;
+  uint32_t node_size;
+  uint32_t record_size;
+  uint32_t reserved;
+  uint64_t num_chunks;
+  uint64_t num_spheres;
+  uint64_t table_offset; // ChunkRecord[num_chunks], after the last chunk
+} ChunkFileHeader;
+
+static inline uint64_t align_to(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Offsets of a chunk's nodes and prim indices from its start, and its size.
+static void chunk_layout(uint64_t num_spheres, uint64_t num_nodes, uint64_t *nodes_offset, uint64_t *indices_offset,
+                         uint64_t *bytes) {
+  *nodes_offset = align_to(num_spheres * sizeof(Sphere), CHUNKS_ARRAY_ALIGNMENT);
+  *indices_offset = align_to(*nodes_offset + num_nodes * sizeof(BVHNode), CHUNKS_ARRAY_ALIGNMENT);
+  *bytes = *indices_offset + num_spheres * sizeof(uint32_t);
+}
+
+typedef struct {
+  FILE *out;
+  uint64_t written;
+  const Sphere *spheres;
+  uint32_t *indices; // sphere order in the file, partitioned in place
+  Sphere *buffer;    // one chunk's spheres
+  ChunkRecord *records;
+  size_t num_records;
+  size_t chunk_spheres;
+} ChunkWriter;
+
+static bool write_at(ChunkWriter *writer, uint64_t offset, const void *data, size_t bytes) {
+  static const char padding[CHUNKS_ALIGNMENT] = { 0 };
+  while (writer->written < offset) {
+    size_t pad = (size_t)(offset - writer->written < CHUNKS_ALIGNMENT ? offset - writer->written : CHUNKS_ALIGNMENT);
+    if (fwrite(padding, 1, pad, writer->out) != pad) {
+      return false;
+    }
+    writer->written += pad;
+  }
+  writer->written += bytes;
+  return bytes == 0 || fwrite(data, 1, bytes, writer->out) == bytes;
+}
+
+static inline float center(const ChunkWriter *writer, uint32_t index, int axis) {
+  return writer->spheres[index].center.data[axis];
+}
+
+// Moves the index of the nth smallest center along axis to indices[nth],
+// smaller ones before it and larger ones after (quickselect with a
+// three-way partition, so runs of equal centers end quickly).
+static void select_nth(const ChunkWriter *writer, size_t begin, size_t end, size_t nth, int axis) {
+  uint32_t *idx = writer->indices;
+  while (end - begin > 1) {
+    float a = center(writer, idx[begin], axis);
+    float b = center(writer, idx[begin + (end - begin) / 2], axis);
+    float c = center(writer, idx[end - 1], axis);
+    float pivot = fmaxf(fminf(a, b), fminf(fmaxf(a, b), c));
+    size_t lt = begin, i = begin, gt = end;
+    while (i < gt) {
+      float v = center(writer, idx[i], axis);
+      if (v < pivot) {
+        uint32_t t = idx[lt];
+        idx[lt++] = idx[i];
+        idx[i++] = t;
+      } else if (v > pivot) {
+        uint32_t t = idx[--gt];
+        idx[gt] = idx[i];
+        idx[i] = t;
+      } else {
+        i++;
+      }
+    }
+    if (nth < lt) {
+      end = lt;
+    } else if (nth >= gt) {
+      begin = gt;
+    } else {
+      return;
+    }
+  }
+}
+
+static bool write_chunk(ChunkWriter *writer, size_t begin, size_t end) {
+  size_t count = end - begin;
+  for (size_t i = 0; i < count; i++) {
+    writer->buffer[i] = writer->spheres[writer->indices[begin + i]];
+  }
+  BVH bvh;
+  if (!bvh_build(&bvh, writer->buffer, count, NULL, NULL)) {
+    return false;
+  }
+
+  ChunkRecord *record = &writer->records[writer->num_records++];
+  memcpy(record->bounds, bvh.nodes[0].bounds_min, 3 * sizeof(float));
+  memcpy(record->bounds + 3, bvh.nodes[0].bounds_max, 3 * sizeof(float));
+  record->num_spheres = (uint32_t)count;
+  record->num_nodes = bvh.num_nodes;
+  record->first_sphere = begin;
+  record->offset = align_to(writer->written, CHUNKS_ALIGNMENT);
+  uint64_t nodes_offset, indices_offset;
+  chunk_layout(count, bvh.num_nodes, &nodes_offset, &indices_offset, &record->bytes);
+  bool ok = write_at(writer, record->offset, writer->buffer, count * sizeof(Sphere)) &&
+            write_at(writer, record->offset + nodes_offset, bvh.nodes, bvh.num_nodes * sizeof(BVHNode)) &&
+            write_at(writer, record->offset + indices_offset, bvh.prim_indices, count * sizeof(uint32_t));
+  bvh_free(&bvh);
+  return ok;
+}
+
+// Splits [begin, end) at the median of the longer axis of its centers' box
+// (rounded to a whole number of chunks, so that only the last chunk can be
+// short) and writes the parts left to right.
+static bool partition(ChunkWriter *writer, size_t begin, size_t end) {
+  size_t count = end - begin;
+  if (count <= writer->chunk_spheres) {
+    return write_chunk(writer, begin, end);
+  }
+  float lo[3] = { INFINITY, INFINITY, INFINITY };
+  float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+  for (size_t i = begin; i < end; i++) {
+    for (int k = 0; k < 3; k++) {
+      float c = center(writer, writer->indices[i], k);
+      lo[k] = fminf(lo[k], c);
+      hi[k] = fmaxf(hi[k], c);
+    }
+  }
+  int axis = 0;
+  for (int k = 1; k < 3; k++) {
+    if (hi[k] - lo[k] > hi[axis] - lo[axis]) {
+      axis = k;
+    }
+  }
+  size_t parts = (count + writer->chunk_spheres - 1) / writer->chunk_spheres;
+  size_t mid = begin + parts / 2 * writer->chunk_spheres;
+  select_nth(writer, begin, end, mid, axis);
+  return partition(writer, begin, mid) && partition(writer, mid, end);
+}
+
+bool chunks_save(const Sphere *spheres, size_t num_spheres, size_t chunk_spheres, const char *path) {
+  if (num_spheres == 0 || num_spheres >= UINT32_MAX || chunk_spheres == 0) {
+    fprintf(stderr, "Can't write %zu spheres in chunks of %zu.\n", num_spheres, chunk_spheres);
+    return false;
+  }
+  double start = perf_now_seconds();
+  size_t num_chunks = (num_spheres + chunk_spheres - 1) / chunk_spheres;
+  ChunkWriter writer = { NULL, 0, spheres, NULL, NULL, NULL, 0, chunk_spheres };
+  writer.indices = (uint32_t *)malloc(num_spheres * sizeof(uint32_t));
+  writer.buffer = (Sphere *)malloc(chunk_spheres * sizeof(Sphere));
+  writer.records = (ChunkRecord *)calloc(num_chunks, sizeof(ChunkRecord));
+  if (writer.indices == NULL || writer.buffer == NULL || writer.records == NULL) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    free(writer.indices);
+    free(writer.buffer);
+    free(writer.records);
+    return false;
+  }
+  for (size_t i = 0; i < num_spheres; i++) {
+    writer.indices[i] = (uint32_t)i;
+  }
+
+  // Write to a temporary and rename, as the BVH cache does, so a reader
+  // never sees a half-written file.
+  char tmp_path[PATH_MAX];
+  int n = snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+  writer.out = n > 0 && (size_t)n < sizeof(tmp_path) ? fopen(tmp_path, "wb") : NULL;
+  bool ok = writer.out != NULL;
+  if (ok) {
+    // The header is written last, once the table's place is known.
+    ok = write_at(&writer, sizeof(ChunkFileHeader), NULL, 0) && partition(&writer, 0, num_spheres);
+  }
+  ChunkFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CHUNKS_MAGIC, sizeof(CHUNKS_MAGIC));
+  header.version = CHUNKS_VERSION;
+  header.byte_order = CHUNKS_BYTE_ORDER;
+  header.sphere_size = sizeof(Sphere);
+  header.node_size = sizeof(BVHNode);
+  header.record_size = sizeof(ChunkRecord);
+  header.num_chunks = writer.num_records;
+  header.num_spheres = num_spheres;
+  header.table_offset = align_to(writer.written, CHUNKS_ARRAY_ALIGNMENT);
+  if (ok) {
+    ok = write_at(&writer, header.table_offset, writer.records, writer.num_records * sizeof(ChunkRecord)) &&
+         fseek(writer.out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, writer.out) == 1;
+  }
+  if (writer.out != NULL && fclose(writer.out) != 0) {
+    ok = false;
+  }
+  if (writer.out != NULL && (!ok || rename(tmp_path, path) != 0)) {
+    unlink(tmp_path);
+    ok = false;
+  }
+  if (ok) {
+    fprintf(stderr, "Wrote %s: %zu spheres in %zu chunks of up to %zu, %.1f MB in %.1f ms\n", path, num_spheres,
+            writer.num_records, chunk_spheres, (header.table_offset + num_chunks * sizeof(ChunkRecord)) / 1e6,
+            (perf_now_seconds() - start) * 1e3);
+  } else {
+    fprintf(stderr, "Failed to write chunk file %s\n", path);
+  }
+  free(writer.indices);
+  free(writer.buffer);
+  free(writer.records);
+  return ok;
+}
+
+static bool read_at(int fd, uint64_t offset, void *data, size_t bytes) {
+  char *out = (char *)data;
+  while (bytes > 0) {
+    ssize_t n = pread(fd, out, bytes, (off_t)offset);
+    if (n <= 0) {
+      return false;
+    }
+    out += n;
+    offset += (uint64_t)n;
+    bytes -= (size_t)n;
+  }
+  return true;
+}
+
+// Every chunk lies inside the file where its layout says, holds spheres, has
+// finite bounds for the top-level tree to be built from, and together they
+// number the spheres without gaps.
+static bool validate_table(const ChunkFileHeader *header, const ChunkRecord *records, uint64_t file_size) {
+  uint64_t next_sphere = 0;
+  for (uint64_t i = 0; i < header->num_chunks; i++) {
+    const ChunkRecord *record = &records[i];
+    for (int k = 0; k < 6; k++) {
+      if (!isfinite(record->bounds[k])) {
+        return false;
+      }
+    }
+    uint64_t nodes_offset, indices_offset, bytes;
+    chunk_layout(record->num_spheres, record->num_nodes, &nodes_offset, &indices_offset, &bytes);
+    if (record->num_spheres == 0 || record->num_nodes == 0 || record->num_nodes >= 2 * (uint64_t)record->num_spheres ||
+        record->first_sphere != next_sphere || record->offset % CHUNKS_ALIGNMENT != 0 || record->bytes != bytes ||
+        record->offset < sizeof(ChunkFileHeader) || record->offset + bytes > header->table_offset ||
+        !(record->bounds[0] <= record->bounds[3] && record->bounds[1] <= record->bounds[4] &&
+          record->bounds[2] <= record->bounds[5])) {
+      return false;
+    }
+    next_sphere += record->num_spheres;
+  }
+  return next_sphere == header->num_spheres &&
+         header->table_offset + header->num_chunks * sizeof(ChunkRecord) <= file_size;
+}
+
+bool chunks_open(ChunkStore *store, const char *path, size_t budget_bytes) {
+  memset(store, 0, sizeof(*store));
+  store->lru_head = store->lru_tail = UINT32_MAX;
+  store->budget = budget_bytes;
+  store->fd = open(path, O_RDONLY);
+  if (store->fd < 0) {
+    fprintf(stderr, "Failed to open chunk file %s\n", path);
+    return false;
+  }
+  struct stat st;
+  ChunkFileHeader header;
+  bool valid = fstat(store->fd, &st) == 0 && read_at(store->fd, 0, &header, sizeof(header)) &&
+               memcmp(header.magic, CHUNKS_MAGIC, sizeof(CHUNKS_MAGIC)) == 0 && header.version == CHUNKS_VERSION &&
+               header.byte_order == CHUNKS_BYTE_ORDER && header.sphere_size == sizeof(Sphere) &&
+               header.node_size == sizeof(BVHNode) && header.record_size == sizeof(ChunkRecord) &&
+               header.num_chunks > 0 && header.num_chunks < UINT32_MAX &&
+               header.table_offset <= (uint64_t)st.st_size &&
+               header.num_chunks <= ((uint64_t)st.st_size - header.table_offset) / sizeof(ChunkRecord);
+  if (!valid) {
+    fprintf(stderr, "Not a valid chunk file: %s\n", path);
+    chunks_close(store);
+    return false;
+  }
+
+  store->num_chunks = (size_t)header.num_chunks;
+  store->num_spheres = header.num_spheres;
+  store->chunks = (ChunkRecord *)malloc(store->num_chunks * sizeof(ChunkRecord));
+  store->slots = (ChunkSlot *)calloc(store->num_chunks, sizeof(ChunkSlot));
+  float (*bounds)[6] = (float (*)[6])malloc(store->num_chunks * sizeof(*bounds));
+  if (store->chunks == NULL || store->slots == NULL || bounds == NULL) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    free(bounds);
+    chunks_close(store);
+    return false;
+  }
+  if (!read_at(store->fd, header.table_offset, store->chunks, store->num_chunks * sizeof(ChunkRecord)) ||
+      !validate_table(&header, store->chunks, (uint64_t)st.st_size)) {
+    fprintf(stderr, "Not a valid chunk file: %s\n", path);
+    free(bounds);
+    chunks_close(store);
+    return false;
+  }
+  for (size_t i = 0; i < store->num_chunks; i++) {
+    memcpy(bounds[i], store->chunks[i].bounds, sizeof(bounds[i]));
+    store->slots[i].prev = store->slots[i].next = UINT32_MAX;
+  }
+  bool built = bvh_build_boxes(&store->top, (const float (*)[6])bounds, store->num_chunks);
+  free(bounds);
+  if (!built) {
+    chunks_close(store);
+    return false;
+  }
+  fprintf(stderr, "Opened %s: %llu spheres in %zu chunks, %.1f MB budget\n", path,
+          (unsigned long long)store->num_spheres, store->num_chunks, store->budget / 1e6);
+  return true;
+}
+
+static void lru_unlink(ChunkStore *store, uint32_t chunk) {
+  ChunkSlot *slot = &store->slots[chunk];
+  if (slot->prev != UINT32_MAX) {
+    store->slots[slot->prev].next = slot->next;
+  } else {
+    store->lru_head = slot->next;
+  }
+  if (slot->next != UINT32_MAX) {
+    store->slots[slot->next].prev = slot->prev;
+  } else {
+    store->lru_tail = slot->prev;
+  }
+  slot->prev = slot->next = UINT32_MAX;
+}
+
+static void lru_push_front(ChunkStore *store, uint32_t chunk) {
+  ChunkSlot *slot = &store->slots[chunk];
+  slot->prev = UINT32_MAX;
+  slot->next = store->lru_head;
+  if (store->lru_head != UINT32_MAX) {
+    store->slots[store->lru_head].prev = chunk;
+  } else {
+    store->lru_tail = chunk;
+  }
+  store->lru_head = chunk;
+}
+
+static void unmap_chunk(ChunkStore *store, uint32_t chunk) {
+  ChunkSlot *slot = &store->slots[chunk];
+  lru_unlink(store, chunk);
+  munmap(slot->mapping, slot->mapping_size);
+  store->resident_bytes -= slot->mapping_size;
+  slot->mapping = NULL;
+  slot->mapping_size = 0;
+  slot->spheres = NULL;
+  memset(&slot->bvh, 0, sizeof(slot->bvh));
+}
+
+void chunks_close(ChunkStore *store) {
+  while (store->lru_head != UINT32_MAX) {
+    unmap_chunk(store, store->lru_head);
+  }
+  if (store->fd >= 0) {
+    close(store->fd);
+  }
+  bvh_free(&store->top);
+  free(store->chunks);
+  free(store->slots);
+  memset(store, 0, sizeof(*store));
+  store->fd = -1;
+  store->lru_head = store->lru_tail = UINT32_MAX;
+}
+
+// Makes the chunk resident and most recently used, first unmapping the
+// least recently used chunks that would push it past the budget.
+static bool acquire_chunk(ChunkStore *store, uint32_t chunk) {
+  ChunkSlot *slot = &store->slots[chunk];
+  if (slot->mapping != NULL) {
+    lru_unlink(store, chunk);
+    lru_push_front(store, chunk);
+    return true;
+  }
+
+  const ChunkRecord *record = &store->chunks[chunk];
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t start = record->offset / page * page;
+  size_t size = (size_t)(record->offset + record->bytes - start);
+  while (store->lru_tail != UINT32_MAX && store->resident_bytes + size > store->budget) {
+    unmap_chunk(store, store->lru_tail);
+    store->stats.evictions++;
+  }
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, store->fd, (off_t)start);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Failed to map chunk %u.\n", chunk);
+    return false;
+  }
+  // Ask for the whole chunk at once rather than a page per fault; its
+  // queue is about to touch most of it.
+  madvise(mapping, size, MADV_WILLNEED);
+
+  const char *base = (const char *)mapping + (record->offset - start);
+  uint64_t nodes_offset, indices_offset, bytes;
+  chunk_layout(record->num_spheres, record->num_nodes, &nodes_offset, &indices_offset, &bytes);
+  slot->mapping = mapping;
+  slot->mapping_size = size;
+  slot->spheres = (const Sphere *)base;
+  memset(&slot->bvh, 0, sizeof(slot->bvh));
+  slot->bvh.nodes = (BVHNode *)(base + nodes_offset);
+  slot->bvh.prim_indices = (uint32_t *)(base + indices_offset);
+  slot->bvh.num_nodes = record->num_nodes;
+  slot->bvh.num_prims = record->num_spheres;
+  lru_push_front(store, chunk);
+  store->resident_bytes += size;
+  store->stats.loads++;
+  store->stats.bytes_loaded += record->bytes;
+  if (store->resident_bytes > store->stats.peak_bytes) {
+    store->stats.peak_bytes = store->resident_bytes;
+  }
+  return true;
+}
+
+// Where a ray enters a chunk's bounds.
+typedef struct {
+  uint32_t chunk;
+  float t;
+} ChunkEntry;
+
+static inline bool box_entry(const float *lo, const float *hi, const Ray *ray, const float inv[3], float max_t,
+                             float *t) {
+  float t_enter = 0.0f;
+  float t_exit = max_t;
+  for (int k = 0; k < 3; k++) {
+    // Near plane by the direction's sign and plain comparisons, as in
+    // bvh.c: fminf/fmaxf would be library calls.
+    bool negative = inv[k] < 0.0f;
+    float t0 = ((negative ? hi[k] : lo[k]) - ray->origin.data[k]) * inv[k];
+    float t1 = ((negative ? lo[k] : hi[k]) - ray->origin.data[k]) * inv[k];
+    t_enter = t0 > t_enter ? t0 : t_enter;
+    t_exit = t1 < t_exit ? t1 : t_exit;
+  }
+  *t = t_enter;
+  return t_enter <= t_exit;
+}
+
+// The chunks the ray's segment [0, max_t) overlaps, written to out when it
+// is not NULL; returns how many.
+static size_t collect_chunks(const ChunkStore *store, const Ray *ray, float max_t, ChunkEntry *out) {
+  const BVH *top = &store->top;
+  float inv[3];
+  for (int k = 0; k < 3; k++) {
+    inv[k] = 1.0f / ray->direction.data[k];
+  }
+  // Both children of a node go on the stack, so it holds at most one node
+  // per level plus the deepest pair: BVH_MAX_DEPTH + 1 for the tree
+  // bvh_build_boxes makes, however the file's chunks are placed.
+  uint32_t stack[BVH_MAX_DEPTH + 1];
+  int depth = 0;
+  stack[depth++] = 0;
+  size_t count = 0;
+  while (depth > 0) {
+    const BVHNode *node = &top->nodes[stack[--depth]];
+    float t;
+    if (!box_entry(node->bounds_min, node->bounds_max, ray, inv, max_t, &t)) {
+      continue;
+    }
+    if (node->count == 0) {
+      stack[depth++] = node->left_first;
+      stack[depth++] = node->left_first + 1;
+      continue;
+    }
+    for (uint32_t p = 0; p < node->count; p++) {
+      uint32_t chunk = top->prim_indices[node->left_first + p];
+      const float *bounds = store->chunks[chunk].bounds;
+      if (box_entry(bounds, bounds + 3, ray, inv, max_t, &t)) {
+        if (out != NULL) {
+          out[count] = (ChunkEntry){ chunk, t };
+        }
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+// A ray waiting on a chunk.
+typedef struct {
+  uint32_t ray;
+  float t;
+} QueueEntry;
+
+typedef struct {
+  uint32_t chunk;
+  bool resident;
+  float mean_t;
+} ChunkVisit;
+
+static int compare_visits(const void *a, const void *b) {
+  const ChunkVisit *x = (const ChunkVisit *)a;
+  const ChunkVisit *y = (const ChunkVisit *)b;
+  if (x->resident != y->resident) {
+    return x->resident ? -1 : 1;
+  }
+  return x->mean_t < y->mean_t ? -1 : x->mean_t > y->mean_t ? 1 : 0;
+}
+
+// Traces the rays queued on one resident chunk; each ray is queued at most
+// once per chunk, so the queue can be split across threads freely.
+static uint64_t trace_queue(const ChunkStore *store, uint32_t chunk, const QueueEntry *queue, size_t count,
+                            ChunkRay *rays) {
+  const ChunkSlot *slot = &store->slots[chunk];
+  uint64_t skipped = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : skipped)
+  for (size_t q = 0; q < count; q++) {
+    ChunkRay *r = &rays[queue[q].ray];
+    if (queue[q].t >= r->hit.t) {
+      skipped++;
+      continue;
+    }
+    Hit hit = r->hit;
+    if (!bvh_intersect(&slot->bvh, slot->spheres, NULL, &r->ray, &hit)) {
+      continue;
+    }
+    const Sphere *sphere = &slot->spheres[hit.prim_id];
+    Vec3f point = ray_at(&r->ray, hit.t);
+    float inv_radius = 1.0f / sphere->radius;
+    for (int k = 0; k < 3; k++) {
+      r->normal.data[k] = (point.data[k] - sphere->center.data[k]) * inv_radius;
+    }
+    r->material_index = sphere->material_index;
+    r->chunk = chunk;
+    r->hit = hit;
+    r->found = true;
+  }
+  return skipped;
+}
+
+bool chunks_trace(ChunkStore *store, Arena *scratch, ChunkRay *rays, size_t count) {
+  store->stats.batches++;
+  ArenaMark mark = arena_mark(scratch);
+  size_t *first = (size_t *)arena_alloc(scratch, (count + 1) * sizeof(size_t));
+  size_t *queue_start = (size_t *)arena_calloc(scratch, store->num_chunks + 1, sizeof(size_t));
+  size_t *cursor = (size_t *)arena_alloc(scratch, store->num_chunks * sizeof(size_t));
+  double *t_sum = (double *)arena_calloc(scratch, store->num_chunks, sizeof(double));
+  ChunkVisit *visits = (ChunkVisit *)arena_alloc(scratch, store->num_chunks * sizeof(ChunkVisit));
+  if (first == NULL || queue_start == NULL || cursor == NULL || t_sum == NULL || visits == NULL) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    arena_release(scratch, mark);
+    return false;
+  }
+
+  // Every ray's chunks, in ray order: counted, then collected.
+#pragma omp parallel for schedule(dynamic, 256)
+  for (size_t i = 0; i < count; i++) {
+    first[i] = collect_chunks(store, &rays[i].ray, rays[i].hit.t, NULL);
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t n = first[i];
+    first[i] = total;
+    total += n;
+  }
+  first[count] = total;
+  ChunkEntry *by_ray = (ChunkEntry *)arena_alloc(scratch, total * sizeof(ChunkEntry));
+  QueueEntry *queues = (QueueEntry *)arena_alloc(scratch, total * sizeof(QueueEntry));
+  bool ok = by_ray != NULL && queues != NULL;
+  if (!ok) {
+    fprintf(stderr, "Memory allocation failed.\n");
+  } else {
+#pragma omp parallel for schedule(dynamic, 256)
+    for (size_t i = 0; i < count; i++) {
+      collect_chunks(store, &rays[i].ray, rays[i].hit.t, by_ray + first[i]);
+    }
+
+    // Regroup by chunk with a counting sort, so each queue keeps the rays
+    // in batch order.
+    for (size_t e = 0; e < total; e++) {
+      queue_start[by_ray[e].chunk + 1]++;
+      t_sum[by_ray[e].chunk] += by_ray[e].t;
+    }
+    size_t num_visits = 0;
+    for (size_t c = 0; c < store->num_chunks; c++) {
+      size_t n = queue_start[c + 1];
+      if (n > 0) {
+        visits[num_visits++] = (ChunkVisit){ (uint32_t)c, store->slots[c].mapping != NULL, (float)(t_sum[c] / n) };
+      }
+      queue_start[c + 1] += queue_start[c];
+      cursor[c] = queue_start[c];
+    }
+    for (size_t i = 0; i < count; i++) {
+      for (size_t e = first[i]; e < first[i + 1]; e++) {
+        queues[cursor[by_ray[e].chunk]++] = (QueueEntry){ (uint32_t)i, by_ray[e].t };
+      }
+    }
+    store->stats.queued += total;
+
+    qsort(visits, num_visits, sizeof(ChunkVisit), compare_visits);
+    for (size_t v = 0; v < num_visits && ok; v++) {
+      uint32_t chunk = visits[v].chunk;
+      ok = acquire_chunk(store, chunk);
+      if (ok) {
+        store->stats.skipped += trace_queue(store, chunk, queues + queue_start[chunk],
+                                            queue_start[chunk + 1] - queue_start[chunk], rays);
+      }
+    }
+  }
+
+  arena_release(scratch, mark);
+  return ok;
+}
+
+void chunks_report(const ChunkStore *store, FILE *out) {
+  const ChunkStats *stats = &store->stats;
+  fprintf(out,
+          "chunks: %llu batches, %llu loads (%.1f MB), %llu evictions, peak %.1f MB mapped of %.1f MB budget, "
+          "%llu ray/chunk pairs queued, %llu skipped\n",
+          (unsigned long long)stats->batches, (unsigned long long)stats->loads, stats->bytes_loaded / 1e6,
+          (unsigned long long)stats->evictions, stats->peak_bytes / 1e6, store->budget / 1e6,
+          (unsigned long long)stats->queued, (unsigned long long)stats->skipped);
+}
@@ -0,0 +1,187 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/environment.h"
+
+static float srgb_to_linear(float c) {
+  return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static inline float luminance(Vec3f c) {
+  return 0.2126f * c.data[0] + 0.7152f * c.data[1] + 0.0722f * c.data[2];
+}
+
+static inline float texel_theta(const Environment *environment, float y) {
+  return (float)M_PI * y / (float)environment->height;
+}
+
+static inline int clamp_i(int v, int lo, int hi) {
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+// Continuous image coordinates (x in [0, width), y in [0, height)) of a
+// direction.
+static void direction_to_image(const Environment *environment, Vec3f direction, float *x, float *y) {
+  float phi = atan2f(direction.data[0], -direction.data[2]);
+  float cos_theta = fmaxf(-1.0f, fminf(1.0f, direction.data[1]));
+  *x = (0.5f + phi / (2.0f * (float)M_PI)) * (float)environment->width;
+  *y = acosf(cos_theta) / (float)M_PI * (float)environment->height;
+}
+
+static inline uint32_t texel_at(const Environment *environment, float x, float y) {
+  int i = clamp_i((int)x, 0, environment->width - 1);
+  int j = clamp_i((int)y, 0, environment->height - 1);
+  return (uint32_t)j * (uint32_t)environment->width + (uint32_t)i;
+}
+
+// Vose's alias method: splits the weights into cells of equal mass, each
+// holding at most two texels.
+static bool build_alias_table(Environment *environment, const float *weights, uint32_t count, float total) {
+  uint32_t *small = (uint32_t *)malloc(count * sizeof(uint32_t));
+  uint32_t *large = (uint32_t *)malloc(count * sizeof(uint32_t));
+  float *scaled = (float *)malloc(count * sizeof(float));
+  if (small == NULL || large == NULL || scaled == NULL) {
+    free(small);
+    free(large);
+    free(scaled);
+    return false;
+  }
+
+  uint32_t num_small = 0;
+  uint32_t num_large = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    environment->pmf[i] = weights[i] / total;
+    scaled[i] = environment->pmf[i] * (float)count;
+    if (scaled[i] < 1.0f) {
+      small[num_small++] = i;
+    } else {
+      large[num_large++] = i;
+    }
+  }
+  while (num_small > 0 && num_large > 0) {
+    uint32_t s = small[--num_small];
+    uint32_t l = large[--num_large];
+    environment->probability[s] = scaled[s];
+    environment->alias[s] = l;
+    scaled[l] -= 1.0f - scaled[s];
+    if (scaled[l] < 1.0f) {
+      small[num_small++] = l;
+    } else {
+      large[num_large++] = l;
+    }
+  }
+  // Whatever is left is 1 up to rounding.
+  while (num_large > 0) {
+    uint32_t l = large[--num_large];
+    environment->probability[l] = 1.0f;
+    environment->alias[l] = l;
+  }
+  while (num_small > 0) {
+    uint32_t s = small[--num_small];
+    environment->probability[s] = 1.0f;
+    environment->alias[s] = s;
+  }
+
+  free(small);
+  free(large);
+  free(scaled);
+  return true;
+}
+
+bool environment_init(Environment *environment, const unsigned char *pixels, int width, int height, int channels) {
+  memset(environment, 0, sizeof(*environment));
+  if (width < 1 || height < 1 || channels < 3) {
+    return false;
+  }
+  uint32_t count = (uint32_t)width * (uint32_t)height;
+  environment->width = width;
+  environment->height = height;
+  environment->radiance = (Vec3f *)malloc(count * sizeof(Vec3f));
+  environment->probability = (float *)malloc(count * sizeof(float));
+  environment->alias = (uint32_t *)malloc(count * sizeof(uint32_t));
+  environment->pmf = (float *)malloc(count * sizeof(float));
+  float *weights = (float *)malloc(count * sizeof(float));
+  if (environment->radiance == NULL || environment->probability == NULL || environment->alias == NULL ||
+      environment->pmf == NULL || weights == NULL) {
+    free(weights);
+    environment_free(environment);
+    return false;
+  }
+
+  float to_linear[256];
+  for (int v = 0; v < 256; v++) {
+    to_linear[v] = srgb_to_linear(v / 255.0f);
+  }
+
+  // Weights are summed per row in double so that large maps don't lose the
+  // dim texels to rounding.
+  double total = 0.0;
+  for (int j = 0; j < height; j++) {
+    float sin_theta = sinf(texel_theta(environment, j + 0.5f));
+    double row = 0.0;
+    for (int i = 0; i < width; i++) {
+      uint32_t t = (uint32_t)j * (uint32_t)width + (uint32_t)i;
+      const unsigned char *p = &pixels[(size_t)t * channels];
+      environment->radiance[t] = vec3f_init_values(to_linear[p[0]], to_linear[p[1]], to_linear[p[2]]);
+      weights[t] = luminance(environment->radiance[t]) * sin_theta;
+      row += weights[t];
+    }
+    total += row;
+  }
+
+  bool built = total > 0.0 && build_alias_table(environment, weights, count, (float)total);
+  free(weights);
+  if (!built) {
+    environment_free(environment);
+  }
+  return built;
+}
+
+void environment_free(Environment *environment) {
+  free(environment->radiance);
+  free(environment->probability);
+  free(environment->alias);
+  free(environment->pmf);
+  memset(environment, 0, sizeof(*environment));
+}
+
+Vec3f environment_radiance(const Environment *environment, Vec3f direction) {
+  float x, y;
+  direction_to_image(environment, direction, &x, &y);
+  return environment->radiance[texel_at(environment, x, y)];
+}
+
+// Converts the per-texel probability into a density over solid angle: a
+// texel spans (2 pi / width) * (pi / height) in (phi, theta), and
+// d(omega) = sin(theta) d(theta) d(phi).
+static inline float texel_density(const Environment *environment, float pmf, float sin_theta) {
+  if (sin_theta <= 0.0f) {
+    return 0.0f;
+  }
+  float texels = (float)environment->width * (float)environment->height;
+  return pmf * texels / (2.0f * (float)M_PI * (float)M_PI * sin_theta);
+}
+
+Vec3f environment_sample(const Environment *environment, Rng *rng, Vec3f *direction, float *pdf) {
+  uint32_t count = (uint32_t)environment->width * (uint32_t)environment->height;
+  uint32_t t = rng_bounded(rng, count);
+  if (rng_next_float(rng) >= environment->probability[t]) {
+    t = environment->alias[t];
+  }
+
+  float x = (float)(t % (uint32_t)environment->width) + rng_next_float(rng);
+  float y = (float)(t / (uint32_t)environment->width) + rng_next_float(rng);
+  float phi = 2.0f * (float)M_PI * (x / (float)environment->width - 0.5f);
+  float theta = texel_theta(environment, y);
+  float sin_theta = sinf(theta);
+  *direction = vec3f_init_values(sin_theta * sinf(phi), cosf(theta), -sin_theta * cosf(phi));
+  *pdf = texel_density(environment, environment->pmf[t], sin_theta);
+  return environment->radiance[t];
+}
+
+float environment_pdf(const Environment *environment, Vec3f direction) {
+  float x, y;
+  direction_to_image(environment, direction, &x, &y);
+  float sin_theta = sinf(texel_theta(environment, y));
+  return texel_density(environment, environment->pmf[texel_at(environment, x, y)], sin_theta);
+}
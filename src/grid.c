@@ -0,0 +1,266 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/grid.h"
+
+// Most cells a hashed grid may have along an axis; only the int32 cell
+// coordinates limit it, since empty cells take no memory.
+#define GRID_HASHED_MAX_CELLS_PER_AXIS (1 << 20)
+
+void grid_free(Grid *grid) {
+  free(grid->cell_start);
+  free(grid->refs);
+  memset(grid, 0, sizeof(*grid));
+}
+
+size_t grid_bytes(const Grid *grid) {
+  size_t lists = grid->num_buckets > 0 ? grid->num_buckets
+                                       : (size_t)grid->dims[0] * (size_t)grid->dims[1] * (size_t)grid->dims[2];
+  return grid_built(grid) ? (lists + 1) * sizeof(uint32_t) + grid->num_refs * sizeof(uint32_t) : 0;
+}
+
+// Hash of the cell coordinates (the primes of Teschner et al., "Optimized
+// Spatial Hashing for Collision Detection of Deformable Objects", 2003),
+// finished with the lowbias32 mixer so the low bits used as the bucket are
+// well spread.
+static inline uint32_t cell_hash(int32_t x, int32_t y, int32_t z) {
+  uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// Index of the list holding cell (x, y, z).
+static inline size_t cell_list(const Grid *grid, int32_t x, int32_t y, int32_t z) {
+  if (grid->num_buckets > 0) {
+    return cell_hash(x, y, z) & (grid->num_buckets - 1);
+  }
+  return (size_t)x + (size_t)grid->dims[0] * ((size_t)y + (size_t)grid->dims[1] * (size_t)z);
+}
+
+static inline int32_t clamp_cell(float position, int32_t dims) {
+  float cell = floorf(position);
+  return cell < 0.0f ? 0 : cell >= (float)dims ? dims - 1 : (int32_t)cell;
+}
+
+// The cells a sphere's box overlaps, inclusive.
+static void sphere_cells(const Grid *grid, const Sphere *sphere, int32_t lo[3], int32_t hi[3]) {
+  float inv_cell = 1.0f / grid->cell_size;
+  for (int k = 0; k < 3; k++) {
+    float c = sphere->center.data[k] - grid->min[k];
+    lo[k] = clamp_cell((c - sphere->radius) * inv_cell, grid->dims[k]);
+    hi[k] = clamp_cell((c + sphere->radius) * inv_cell, grid->dims[k]);
+  }
+}
+
+static void size_cells(Grid *grid, const float extent[3], float cell_size, int32_t max_per_axis) {
+  for (int k = 0; k < 3; k++) {
+    cell_size = fmaxf(cell_size, extent[k] / (float)max_per_axis);
+  }
+  grid->cell_size = cell_size;
+  for (int k = 0; k < 3; k++) {
+    float cells = ceilf(extent[k] / cell_size);
+    grid->dims[k] = cells < 1.0f ? 1 : cells > (float)max_per_axis ? max_per_axis : (int32_t)cells;
+  }
+}
+
+// Sets grid->min to the spheres' box and extent to its size, at least a
+// sliver deep along every axis so flat scenes still get cells; returns the
+// mean diameter.
+static float sphere_bounds(Grid *grid, const Sphere *spheres, size_t num_spheres, float extent[3]) {
+  float lo[3] = { INFINITY, INFINITY, INFINITY };
+  float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+  double radius_sum = 0.0;
+  for (size_t i = 0; i < num_spheres; i++) {
+    for (int k = 0; k < 3; k++) {
+      lo[k] = fminf(lo[k], spheres[i].center.data[k] - spheres[i].radius);
+      hi[k] = fmaxf(hi[k], spheres[i].center.data[k] + spheres[i].radius);
+    }
+    radius_sum += spheres[i].radius;
+  }
+  float largest = 0.0f;
+  for (int k = 0; k < 3; k++) {
+    if (num_spheres == 0) {
+      lo[k] = hi[k] = 0.0f;
+    }
+    grid->min[k] = lo[k];
+    extent[k] = hi[k] - lo[k];
+    largest = fmaxf(largest, extent[k]);
+  }
+  for (int k = 0; k < 3; k++) {
+    extent[k] = fmaxf(extent[k], fmaxf(largest * 1e-3f, 1e-6f));
+  }
+  return num_spheres > 0 ? (float)(2.0 * radius_sum / (double)num_spheres) : 1.0f;
+}
+
+// Cubic cells, about num_cells of them over the box; grows them until
+// rounding up to whole cells stays within twice that.
+static void size_cells_by_count(Grid *grid, const float extent[3], double num_cells) {
+  num_cells = fmax(num_cells, 1.0);
+  float cell_size = (float)cbrt((double)extent[0] * extent[1] * extent[2] / num_cells);
+  for (;;) {
+    size_cells(grid, extent, cell_size, GRID_MAX_CELLS_PER_AXIS);
+    if ((double)grid->dims[0] * grid->dims[1] * grid->dims[2] <= 2.0 * num_cells) {
+      return;
+    }
+    cell_size = grid->cell_size * 1.25f;
+  }
+}
+
+double grid_occupancy(const Sphere *spheres, size_t num_spheres) {
+  Grid grid = { 0 };
+  float extent[3];
+  sphere_bounds(&grid, spheres, num_spheres, extent);
+  size_cells_by_count(&grid, extent, (double)num_spheres / GRID_OCCUPANCY_SPHERES_PER_CELL);
+  size_t cells = (size_t)grid.dims[0] * (size_t)grid.dims[1] * (size_t)grid.dims[2];
+  uint8_t *occupied = (uint8_t *)calloc(cells, 1);
+  if (occupied == NULL) {
+    return 0.0;
+  }
+  float inv_cell = 1.0f / grid.cell_size;
+  size_t count = 0;
+  for (size_t i = 0; i < num_spheres; i++) {
+    int32_t c[3];
+    for (int k = 0; k < 3; k++) {
+      c[k] = clamp_cell((spheres[i].center.data[k] - grid.min[k]) * inv_cell, grid.dims[k]);
+    }
+    uint8_t *cell = &occupied[cell_list(&grid, c[0], c[1], c[2])];
+    count += *cell == 0;
+    *cell = 1;
+  }
+  free(occupied);
+  return (double)count / (double)cells;
+}
+
+bool grid_build(Grid *grid, const Sphere *spheres, size_t num_spheres, bool hashed) {
+  grid_free(grid);
+
+  float extent[3];
+  float mean_diameter = sphere_bounds(grid, spheres, num_spheres, extent);
+  if (hashed) {
+    float largest = fmaxf(extent[0], fmaxf(extent[1], extent[2]));
+    size_cells(grid, extent, fmaxf(GRID_HASHED_CELL_DIAMETERS * mean_diameter, largest * 1e-6f),
+               GRID_HASHED_MAX_CELLS_PER_AXIS);
+  } else {
+    size_cells_by_count(grid, extent, (double)GRID_CELLS_PER_SPHERE * (double)num_spheres);
+  }
+
+  // Pass 1: references in total, which sizes the hash table.
+  uint64_t total = 0;
+  for (size_t i = 0; i < num_spheres; i++) {
+    int32_t a[3], b[3];
+    sphere_cells(grid, &spheres[i], a, b);
+    total += (uint64_t)(b[0] - a[0] + 1) * (uint64_t)(b[1] - a[1] + 1) * (uint64_t)(b[2] - a[2] + 1);
+  }
+  if (total > UINT32_MAX) {
+    fprintf(stderr, "Too many grid references (%llu).\n", (unsigned long long)total);
+    return false;
+  }
+  size_t lists;
+  if (hashed) {
+    // At most one occupied cell per reference, so the table's load stays
+    // at or below one.
+    uint32_t buckets = 1;
+    while (buckets < total && buckets < 0x80000000u) {
+      buckets <<= 1;
+    }
+    grid->num_buckets = buckets;
+    lists = buckets;
+  } else {
+    lists = (size_t)grid->dims[0] * (size_t)grid->dims[1] * (size_t)grid->dims[2];
+  }
+  grid->num_refs = (uint32_t)total;
+  grid->cell_start = (uint32_t *)calloc(lists + 1, sizeof(uint32_t));
+  grid->refs = (uint32_t *)malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+  if (grid->cell_start == NULL || grid->refs == NULL) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    grid_free(grid);
+    return false;
+  }
+
+  // Pass 2 counts per list; a running sum turns the counts into list ends,
+  // and pass 3 fills each list from its end, leaving cell_start[i] at the
+  // list's start.
+  for (size_t i = 0; i < num_spheres; i++) {
+    int32_t a[3], b[3];
+    sphere_cells(grid, &spheres[i], a, b);
+    for (int32_t z = a[2]; z <= b[2]; z++) {
+      for (int32_t y = a[1]; y <= b[1]; y++) {
+        for (int32_t x = a[0]; x <= b[0]; x++) {
+          grid->cell_start[cell_list(grid, x, y, z)]++;
+        }
+      }
+    }
+  }
+  uint32_t running = 0;
+  for (size_t i = 0; i < lists; i++) {
+    running += grid->cell_start[i];
+    grid->cell_start[i] = running;
+  }
+  grid->cell_start[lists] = running;
+  for (size_t i = num_spheres; i-- > 0;) {
+    int32_t a[3], b[3];
+    sphere_cells(grid, &spheres[i], a, b);
+    for (int32_t z = a[2]; z <= b[2]; z++) {
+      for (int32_t y = a[1]; y <= b[1]; y++) {
+        for (int32_t x = a[0]; x <= b[0]; x++) {
+          grid->refs[--grid->cell_start[cell_list(grid, x, y, z)]] = (uint32_t)i;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool grid_intersect(const Grid *grid, const Sphere *spheres, const Ray *ray, Hit *hit) {
+  const float *o = ray->origin.data;
+  const float *d = ray->direction.data;
+  float t_enter = 0.0f;
+  float t_exit = hit->t;
+  float inv[3];
+  for (int k = 0; k < 3; k++) {
+    inv[k] = 1.0f / d[k];
+    float t0 = (grid->min[k] - o[k]) * inv[k];
+    float t1 = (grid->min[k] + (float)grid->dims[k] * grid->cell_size - o[k]) * inv[k];
+    t_enter = fmaxf(t_enter, fminf(t0, t1));
+    t_exit = fminf(t_exit, fmaxf(t0, t1));
+  }
+  if (!(t_enter <= t_exit)) {
+    return false;
+  }
+
+  int32_t cell[3], step[3];
+  float t_next[3], t_delta[3];
+  for (int k = 0; k < 3; k++) {
+    cell[k] = clamp_cell((o[k] + d[k] * t_enter - grid->min[k]) / grid->cell_size, grid->dims[k]);
+    step[k] = d[k] < 0.0f ? -1 : 1;
+    float boundary = grid->min[k] + (float)(cell[k] + (d[k] < 0.0f ? 0 : 1)) * grid->cell_size;
+    t_next[k] = d[k] != 0.0f ? (boundary - o[k]) * inv[k] : INFINITY;
+    t_delta[k] = d[k] != 0.0f ? grid->cell_size * fabsf(inv[k]) : INFINITY;
+  }
+
+  // Spheres span cells, so a hit may lie beyond the cell it was found
+  // from; the walk ends only once the next cell starts past the closest
+  // hit (or the grid).
+  bool found = false;
+  for (;;) {
+    size_t list = cell_list(grid, cell[0], cell[1], cell[2]);
+    for (uint32_t r = grid->cell_start[list]; r < grid->cell_start[list + 1]; r++) {
+      uint32_t index = grid->refs[r];
+      found |= sphere_intersect_closer(&spheres[index], ray, index, hit);
+    }
+    int k = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+    if (t_next[k] > t_exit || t_next[k] >= hit->t) {
+      return found;
+    }
+    cell[k] += step[k];
+    if (cell[k] < 0 || cell[k] >= grid->dims[k]) {
+      return found;
+    }
+    t_next[k] += t_delta[k];
+  }
+}
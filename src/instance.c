@@ -0,0 +1,235 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/instance.h"
+
+void scene_object_free(SceneObject *object) {
+  bvh_free(&object->bvh);
+  mesh_free(&object->mesh); // no-op for a mapped mesh
+  if (object->sphere_capacity > 0) {
+    free(object->spheres);
+  }
+  memset(object, 0, sizeof(*object));
+}
+
+bool scene_object_build(SceneObject *object) {
+  bvh_free(&object->bvh);
+  if (!bvh_build(&object->bvh, object->spheres, object->num_spheres, NULL, &object->mesh)) {
+    return false;
+  }
+  // The root bounds everything; an empty object becomes a point at its
+  // origin, which rays may enter but never hit anything in.
+  memset(object->bounds, 0, sizeof(object->bounds));
+  if (object->bvh.num_nodes > 0) {
+    memcpy(object->bounds, object->bvh.nodes[0].bounds_min, 3 * sizeof(float));
+    memcpy(object->bounds + 3, object->bvh.nodes[0].bounds_max, 3 * sizeof(float));
+  }
+  return true;
+}
+
+size_t scene_object_bytes(const SceneObject *object) {
+  const Mesh *mesh = &object->mesh;
+  const BVH *bvh = &object->bvh;
+  return object->num_spheres * sizeof(Sphere) + mesh->num_vertices * sizeof(Vec3f) * (mesh->normals != NULL ? 2 : 1) +
+         mesh->num_triangles * sizeof(Triangle) + bvh->num_nodes * sizeof(BVHNode) +
+         bvh->num_prims * sizeof(uint32_t) + bvh->num_packets * sizeof(TrianglePacket);
+}
+
+bool geometry_intersect_all(const Sphere *spheres, size_t num_spheres, const Vec3f *motion, const Mesh *mesh,
+                            const Ray *ray, Hit *hit) {
+  bool found = false;
+  if (motion == NULL) {
+    found = scene_intersect(ray, spheres, num_spheres, hit);
+  } else {
+    for (size_t i = 0; i < num_spheres; i++) {
+      Sphere moved = sphere_at(&spheres[i], motion[i], ray->time);
+      found |= sphere_intersect_closer(&moved, ray, (uint32_t)i, hit);
+    }
+  }
+  if (mesh == NULL || mesh->num_triangles == 0) {
+    return found;
+  }
+  TriangleRay tray;
+  triangle_ray_init(&tray, ray);
+  for (size_t i = 0; i < mesh->num_triangles; i++) {
+    const uint32_t *v = mesh->triangles[i].v;
+    if (triangle_intersect(&tray, mesh->vertices[v[0]], mesh->vertices[v[1]], mesh->vertices[v[2]], hit->t, &hit->t,
+                           NULL)) {
+      hit->prim_id = (uint32_t)(num_spheres + i);
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool scene_object_intersect(const SceneObject *object, const Ray *ray, Hit *hit) {
+  if (object->bvh.num_nodes > 0) {
+    return bvh_intersect(&object->bvh, object->spheres, NULL, ray, hit);
+  }
+  return geometry_intersect_all(object->spheres, object->num_spheres, NULL, &object->mesh, ray, hit);
+}
+
+static void mat3_mul(float a[3][3], float b[3][3], float out[3][3]) {
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+    }
+  }
+}
+
+void instance_transform(float matrix[3][4], float scale, const float rotate_degrees[3], const float translate[3]) {
+  float c[3], s[3];
+  for (int k = 0; k < 3; k++) {
+    float radians = rotate_degrees[k] * (float)M_PI / 180.0f;
+    c[k] = cosf(radians);
+    s[k] = sinf(radians);
+  }
+  float rx[3][3] = { { 1.0f, 0.0f, 0.0f }, { 0.0f, c[0], -s[0] }, { 0.0f, s[0], c[0] } };
+  float ry[3][3] = { { c[1], 0.0f, s[1] }, { 0.0f, 1.0f, 0.0f }, { -s[1], 0.0f, c[1] } };
+  float rz[3][3] = { { c[2], -s[2], 0.0f }, { s[2], c[2], 0.0f }, { 0.0f, 0.0f, 1.0f } };
+  float ryx[3][3], rotation[3][3];
+  mat3_mul(ry, rx, ryx);
+  mat3_mul(rz, ryx, rotation);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      matrix[i][j] = rotation[i][j] * scale;
+    }
+    matrix[i][3] = translate[i];
+  }
+}
+
+bool instance_init(Instance *instance, uint32_t object, const float object_to_world[3][4]) {
+  // The columns of the inverse are the cross products of the rows over the
+  // determinant. Doubles keep nearly singular matrices usable.
+  double r[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      r[i][j] = object_to_world[i][j];
+    }
+  }
+  double columns[3][3];
+  for (int j = 0; j < 3; j++) {
+    const double *a = r[(j + 1) % 3];
+    const double *b = r[(j + 2) % 3];
+    columns[j][0] = a[1] * b[2] - a[2] * b[1];
+    columns[j][1] = a[2] * b[0] - a[0] * b[2];
+    columns[j][2] = a[0] * b[1] - a[1] * b[0];
+  }
+  double det = r[0][0] * columns[0][0] + r[0][1] * columns[0][1] + r[0][2] * columns[0][2];
+  if (!(fabs(det) > 1e-30) || !isfinite(det)) {
+    return false;
+  }
+
+  memcpy(instance->object_to_world, object_to_world, sizeof(instance->object_to_world));
+  for (int i = 0; i < 3; i++) {
+    double translate = 0.0;
+    for (int j = 0; j < 3; j++) {
+      double value = columns[j][i] / det;
+      instance->world_to_object[i][j] = (float)value;
+      translate -= value * object_to_world[j][3];
+    }
+    instance->world_to_object[i][3] = (float)translate;
+  }
+  instance->object = object;
+  return true;
+}
+
+float instance_ray_to_object(const Instance *instance, const Ray *ray, Ray *local) {
+  const float(*m)[4] = instance->world_to_object;
+  const float *o = ray->origin.data;
+  const float *d = ray->direction.data;
+  float length2 = 0.0f;
+  for (int i = 0; i < 3; i++) {
+    local->origin.data[i] = m[i][0] * o[0] + m[i][1] * o[1] + m[i][2] * o[2] + m[i][3];
+    local->direction.data[i] = m[i][0] * d[0] + m[i][1] * d[1] + m[i][2] * d[2];
+    length2 += local->direction.data[i] * local->direction.data[i];
+  }
+  local->time = ray->time;
+  float length = sqrtf(length2);
+  float inv_length = 1.0f / length;
+  for (int i = 0; i < 3; i++) {
+    local->direction.data[i] *= inv_length;
+  }
+  return length;
+}
+
+Vec3f instance_normal_to_world(const Instance *instance, Vec3f normal) {
+  const float(*m)[4] = instance->world_to_object;
+  Vec3f world;
+  for (int i = 0; i < 3; i++) {
+    world.data[i] = m[0][i] * normal.data[0] + m[1][i] * normal.data[1] + m[2][i] * normal.data[2];
+  }
+  return vec3f_normalize(world);
+}
+
+bool instances_build_bvh(BVH *bvh, const Instance *instances, size_t num_instances, const SceneObject *objects) {
+  float(*bounds)[6] = (float(*)[6])malloc((num_instances > 0 ? num_instances : 1) * sizeof(*bounds));
+  if (bounds == NULL) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    return false;
+  }
+  // World box of the transformed object box (Arvo, "Transforming
+  // Axis-Aligned Bounding Boxes", Graphics Gems 1990): per axis, the
+  // translation plus the smaller and larger end of every matrix term.
+  for (size_t i = 0; i < num_instances; i++) {
+    const float(*m)[4] = instances[i].object_to_world;
+    const float *object_bounds = objects[instances[i].object].bounds;
+    for (int k = 0; k < 3; k++) {
+      float lo = m[k][3];
+      float hi = m[k][3];
+      for (int j = 0; j < 3; j++) {
+        float a = m[k][j] * object_bounds[j];
+        float b = m[k][j] * object_bounds[3 + j];
+        lo += a < b ? a : b;
+        hi += a < b ? b : a;
+      }
+      bounds[i][k] = lo;
+      bounds[i][3 + k] = hi;
+    }
+  }
+  bool ok = bvh_build_boxes(bvh, (const float(*)[6])bounds, num_instances);
+  free(bounds);
+  return ok;
+}
+
+typedef struct {
+  const Instance *instances;
+  const SceneObject *objects;
+} InstanceSet;
+
+static bool instance_intersect(const void *context, uint32_t index, const Ray *ray, Hit *hit) {
+  const InstanceSet *set = (const InstanceSet *)context;
+  const Instance *instance = &set->instances[index];
+  Ray local;
+  float scale = instance_ray_to_object(instance, ray, &local);
+  Hit local_hit;
+  local_hit.t = hit->t * scale;
+  local_hit.prim_id = 0;
+  local_hit.instance_id = HIT_NO_INSTANCE;
+  if (!scene_object_intersect(&set->objects[instance->object], &local, &local_hit)) {
+    return false;
+  }
+  // Converting back can round onto the current hit; keep that one.
+  float t = local_hit.t / scale;
+  if (!(t < hit->t)) {
+    return false;
+  }
+  hit->t = t;
+  hit->prim_id = local_hit.prim_id;
+  hit->instance_id = index;
+  return true;
+}
+
+bool instances_intersect(const BVH *bvh, const Instance *instances, size_t num_instances, const SceneObject *objects,
+                         const Ray *ray, Hit *hit) {
+  InstanceSet set = { instances, objects };
+  if (bvh->num_nodes > 0) {
+    return bvh_intersect_leaves(bvh, instance_intersect, &set, ray, hit);
+  }
+  bool found = false;
+  for (size_t i = 0; i < num_instances; i++) {
+    found |= instance_intersect(&set, (uint32_t)i, ray, hit);
+  }
+  return found;
+}
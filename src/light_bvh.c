@@ -0,0 +1,390 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/light_bvh.h"
+
+static inline float min_f(float a, float b) { return a < b ? a : b; }
+static inline float max_f(float a, float b) { return a > b ? a : b; }
+
+// Bound on the irradiance from lights of total `power` inside a sphere (and,
+// for nodes, a box), seen from a surface point. See light_bvh.h.
+static float cluster_bound(const float center[3], float radius, const float *box_min, const float *box_max, float power,
+                           float range, Vec3f point, Vec3f normal) {
+  float to[3];
+  float distance2 = 0.0f;
+  for (int k = 0; k < 3; k++) {
+    to[k] = center[k] - point.data[k];
+    distance2 += to[k] * to[k];
+  }
+  float distance = sqrtf(distance2);
+
+  // Nearest a light can be: from the sphere, tightened by the box.
+  float nearest = max_f(distance - radius, 0.0f);
+  if (box_min != NULL) {
+    float box2 = 0.0f;
+    for (int k = 0; k < 3; k++) {
+      float d = max_f(max_f(box_min[k] - point.data[k], point.data[k] - box_max[k]), 0.0f);
+      box2 += d * d;
+    }
+    nearest = max_f(nearest, sqrtf(box2));
+  }
+  float falloff = light_falloff(range, nearest);
+  if (falloff <= 0.0f) {
+    return 0.0f;
+  }
+  if (distance <= radius) {
+    return power * falloff;
+  }
+
+  // cos(max(theta - alpha, 0)), theta being the angle between the normal and
+  // the sphere's center and alpha the half-angle the sphere subtends.
+  float cos_axis = (to[0] * normal.data[0] + to[1] * normal.data[1] + to[2] * normal.data[2]) / distance;
+  float sin_alpha = radius / distance;
+  float cos_alpha = sqrtf(1.0f - sin_alpha * sin_alpha);
+  float cos_bound = 1.0f;
+  if (cos_axis < cos_alpha) {
+    float sin_axis = sqrtf(max_f(0.0f, 1.0f - cos_axis * cos_axis));
+    cos_bound = cos_axis * cos_alpha + sin_axis * sin_alpha;
+    if (cos_bound <= 0.0f) {
+      return 0.0f;
+    }
+  }
+  return power * falloff * cos_bound;
+}
+
+static inline float node_bound(const LightNode *node, Vec3f point, Vec3f normal) {
+  return cluster_bound(node->center, node->radius, node->bounds_min, node->bounds_max, node->power, node->range, point,
+                       normal);
+}
+
+float light_bound(const Light *light, Vec3f point, Vec3f normal) {
+  return cluster_bound(light->position.data, light->radius, NULL, NULL, light->intensity, light->range, point, normal);
+}
+
+// Distance between the nearest points of two boxes.
+static float box_gap(const float a_min[3], const float a_max[3], const float b_min[3], const float b_max[3]) {
+  float gap2 = 0.0f;
+  for (int k = 0; k < 3; k++) {
+    float d = max_f(max_f(a_min[k] - b_max[k], b_min[k] - a_max[k]), 0.0f);
+    gap2 += d * d;
+  }
+  return sqrtf(gap2);
+}
+
+float light_box_bound(const Light *light, const float box_min[3], const float box_max[3]) {
+  const float *p = light->position.data;
+  return light->intensity * light_falloff(light->range, box_gap(p, p, box_min, box_max));
+}
+
+typedef struct {
+  LightBVH *tree;
+  const Light *lights;
+} BuildContext;
+
+static void init_node(BuildContext *ctx, LightNode *node, uint32_t first, uint32_t count) {
+  float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+  float hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  bool fades = true;
+  node->power = 0.0f;
+  node->range = 0.0f;
+  for (uint32_t i = first; i < first + count; i++) {
+    const Light *light = &ctx->lights[ctx->tree->light_indices[i]];
+    for (int k = 0; k < 3; k++) {
+      lo[k] = min_f(lo[k], light->position.data[k] - light->radius);
+      hi[k] = max_f(hi[k], light->position.data[k] + light->radius);
+    }
+    node->power += light->intensity;
+    fades = fades && light->range > 0.0f;
+    node->range = max_f(node->range, light->range);
+  }
+  if (!fades) {
+    node->range = 0.0f;
+  }
+
+  for (int k = 0; k < 3; k++) {
+    node->center[k] = 0.5f * (lo[k] + hi[k]);
+    node->bounds_min[k] = lo[k];
+    node->bounds_max[k] = hi[k];
+  }
+  node->radius = 0.0f;
+  for (uint32_t i = first; i < first + count; i++) {
+    const Light *light = &ctx->lights[ctx->tree->light_indices[i]];
+    float d2 = 0.0f;
+    for (int k = 0; k < 3; k++) {
+      float d = light->position.data[k] - node->center[k];
+      d2 += d * d;
+    }
+    node->radius = max_f(node->radius, sqrtf(d2) + light->radius);
+  }
+  node->left_first = first;
+  node->count = count;
+}
+
+// Reorders indices[first, first + count) so the k-th smallest along axis is
+// in place, smaller ones before it and larger ones after (quickselect).
+static void select_median(BuildContext *ctx, uint32_t first, uint32_t count, uint32_t k, int axis) {
+  uint32_t *indices = ctx->tree->light_indices;
+  uint32_t lo = first;
+  uint32_t hi = first + count - 1;
+  while (lo < hi) {
+    float pivot = ctx->lights[indices[lo + (hi - lo) / 2]].position.data[axis];
+    uint32_t i = lo;
+    uint32_t j = hi;
+    while (i <= j) {
+      while (ctx->lights[indices[i]].position.data[axis] < pivot) {
+        i++;
+      }
+      while (ctx->lights[indices[j]].position.data[axis] > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        uint32_t tmp = indices[i];
+        indices[i] = indices[j];
+        indices[j] = tmp;
+        i++;
+        if (j == 0) {
+          break;
+        }
+        j--;
+      }
+    }
+    if (k <= j) {
+      hi = j;
+    } else if (k >= i) {
+      lo = i;
+    } else {
+      break;
+    }
+  }
+}
+
+static void subdivide(BuildContext *ctx, uint32_t node_index, uint32_t depth) {
+  LightBVH *tree = ctx->tree;
+  LightNode *node = &tree->nodes[node_index];
+  uint32_t first = node->left_first;
+  uint32_t count = node->count;
+  if (count <= LIGHT_BVH_MAX_LEAF_SIZE || depth >= LIGHT_BVH_STACK_SIZE - 2) {
+    for (uint32_t i = first; i < first + count; i++) {
+      tree->light_leaf[tree->light_indices[i]] = node_index;
+    }
+    return;
+  }
+
+  // Median split along the longest axis of the light positions.
+  float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+  float hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  for (uint32_t i = first; i < first + count; i++) {
+    const float *p = ctx->lights[tree->light_indices[i]].position.data;
+    for (int k = 0; k < 3; k++) {
+      lo[k] = min_f(lo[k], p[k]);
+      hi[k] = max_f(hi[k], p[k]);
+    }
+  }
+  int axis = 0;
+  for (int k = 1; k < 3; k++) {
+    if (hi[k] - lo[k] > hi[axis] - lo[axis]) {
+      axis = k;
+    }
+  }
+  uint32_t half = count / 2;
+  select_median(ctx, first, count, first + half, axis);
+
+  uint32_t left = tree->num_nodes;
+  tree->num_nodes += 2;
+  init_node(ctx, &tree->nodes[left], first, half);
+  init_node(ctx, &tree->nodes[left + 1], first + half, count - half);
+  tree->parents[left] = node_index;
+  tree->parents[left + 1] = node_index;
+  node->left_first = left;
+  node->count = 0;
+
+  subdivide(ctx, left, depth + 1);
+  subdivide(ctx, left + 1, depth + 1);
+}
+
+bool light_bvh_build(LightBVH *tree, const Light *lights, size_t num_lights) {
+  memset(tree, 0, sizeof(*tree));
+  if (num_lights == 0) {
+    return true;
+  }
+  if (num_lights > UINT32_MAX / 2) {
+    return false;
+  }
+
+  size_t max_nodes = 2 * num_lights - 1;
+  tree->nodes = (LightNode *)malloc(max_nodes * sizeof(LightNode));
+  tree->parents = (uint32_t *)malloc(max_nodes * sizeof(uint32_t));
+  tree->light_indices = (uint32_t *)malloc(num_lights * sizeof(uint32_t));
+  tree->light_leaf = (uint32_t *)malloc(num_lights * sizeof(uint32_t));
+  tree->area_lights = (uint32_t *)malloc(num_lights * sizeof(uint32_t));
+  if (tree->nodes == NULL || tree->parents == NULL || tree->light_indices == NULL || tree->light_leaf == NULL ||
+      tree->area_lights == NULL) {
+    light_bvh_free(tree);
+    return false;
+  }
+
+  tree->num_lights = (uint32_t)num_lights;
+  for (uint32_t i = 0; i < tree->num_lights; i++) {
+    tree->light_indices[i] = i;
+    if (lights[i].radius > 0.0f) {
+      tree->area_lights[tree->num_area_lights++] = i;
+    }
+  }
+
+  BuildContext ctx = { tree, lights };
+  tree->num_nodes = 1;
+  tree->parents[0] = UINT32_MAX;
+  init_node(&ctx, &tree->nodes[0], 0, tree->num_lights);
+  subdivide(&ctx, 0, 0);
+  return true;
+}
+
+void light_bvh_free(LightBVH *tree) {
+  free(tree->nodes);
+  free(tree->parents);
+  free(tree->light_indices);
+  free(tree->light_leaf);
+  free(tree->area_lights);
+  memset(tree, 0, sizeof(*tree));
+}
+
+size_t light_bvh_cull(const LightBVH *tree, const Light *lights, Vec3f point, Vec3f normal, float threshold,
+                      LightVisitor visit, void *user) {
+  if (tree->num_nodes == 0) {
+    return 0;
+  }
+  uint32_t stack[LIGHT_BVH_STACK_SIZE];
+  uint32_t stack_size = 0;
+  size_t visited = 0;
+  stack[stack_size++] = 0;
+
+  while (stack_size > 0) {
+    const LightNode *node = &tree->nodes[stack[--stack_size]];
+    float bound = node_bound(node, point, normal);
+    if (bound <= 0.0f || bound < threshold) {
+      continue;
+    }
+    if (node->count == 0) {
+      stack[stack_size++] = node->left_first;
+      stack[stack_size++] = node->left_first + 1;
+      continue;
+    }
+    for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+      uint32_t light_index = tree->light_indices[i];
+      float light = light_bound(&lights[light_index], point, normal);
+      if (light > 0.0f && light >= threshold) {
+        visit(light_index, 1.0f, user);
+        visited++;
+      }
+    }
+  }
+  return visited;
+}
+
+size_t light_bvh_collect_box(const LightBVH *tree, const Light *lights, const float box_min[3], const float box_max[3],
+                             float threshold, uint32_t *light_indices) {
+  if (tree->num_nodes == 0) {
+    return 0;
+  }
+  uint32_t stack[LIGHT_BVH_STACK_SIZE];
+  uint32_t stack_size = 0;
+  size_t count = 0;
+  stack[stack_size++] = 0;
+
+  while (stack_size > 0) {
+    const LightNode *node = &tree->nodes[stack[--stack_size]];
+    float bound = node->power * light_falloff(node->range, box_gap(node->bounds_min, node->bounds_max, box_min, box_max));
+    if (bound <= 0.0f || bound < threshold) {
+      continue;
+    }
+    if (node->count == 0) {
+      stack[stack_size++] = node->left_first;
+      stack[stack_size++] = node->left_first + 1;
+      continue;
+    }
+    for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+      uint32_t light_index = tree->light_indices[i];
+      float light = light_box_bound(&lights[light_index], box_min, box_max);
+      if (light > 0.0f && light >= threshold) {
+        light_indices[count++] = light_index;
+      }
+    }
+  }
+  return count;
+}
+
+bool light_bvh_sample(const LightBVH *tree, const Light *lights, Vec3f point, Vec3f normal, Rng *rng,
+                      uint32_t *light_index, float *pmf) {
+  if (tree->num_nodes == 0) {
+    return false;
+  }
+  const LightNode *node = &tree->nodes[0];
+  float probability = 1.0f;
+  while (node->count == 0) {
+    const LightNode *left = &tree->nodes[node->left_first];
+    float left_bound = node_bound(left, point, normal);
+    float right_bound = node_bound(left + 1, point, normal);
+    float total = left_bound + right_bound;
+    if (total <= 0.0f) {
+      return false;
+    }
+    float p_left = left_bound / total;
+    if (rng_next_float(rng) < p_left) {
+      node = left;
+      probability *= p_left;
+    } else {
+      node = left + 1;
+      probability *= 1.0f - p_left;
+    }
+  }
+
+  float bounds[LIGHT_BVH_MAX_LEAF_SIZE];
+  float total = 0.0f;
+  for (uint32_t i = 0; i < node->count; i++) {
+    bounds[i] = light_bound(&lights[tree->light_indices[node->left_first + i]], point, normal);
+    total += bounds[i];
+  }
+  if (total <= 0.0f) {
+    return false;
+  }
+  float u = rng_next_float(rng) * total;
+  uint32_t pick = 0;
+  while (pick + 1 < node->count && (u >= bounds[pick] || bounds[pick] <= 0.0f)) {
+    u -= bounds[pick];
+    pick++;
+  }
+  *light_index = tree->light_indices[node->left_first + pick];
+  *pmf = probability * bounds[pick] / total;
+  return *pmf > 0.0f;
+}
+
+float light_bvh_pmf(const LightBVH *tree, const Light *lights, Vec3f point, Vec3f normal, uint32_t light_index) {
+  if (light_index >= tree->num_lights) {
+    return 0.0f;
+  }
+  uint32_t node_index = tree->light_leaf[light_index];
+  const LightNode *leaf = &tree->nodes[node_index];
+  float total = 0.0f;
+  for (uint32_t i = leaf->left_first; i < leaf->left_first + leaf->count; i++) {
+    total += light_bound(&lights[tree->light_indices[i]], point, normal);
+  }
+  if (total <= 0.0f) {
+    return 0.0f;
+  }
+  float probability = light_bound(&lights[light_index], point, normal) / total;
+
+  while (tree->parents[node_index] != UINT32_MAX) {
+    uint32_t parent = tree->parents[node_index];
+    uint32_t left = tree->nodes[parent].left_first;
+    float left_bound = node_bound(&tree->nodes[left], point, normal);
+    float right_bound = node_bound(&tree->nodes[left + 1], point, normal);
+    float sum = left_bound + right_bound;
+    if (sum <= 0.0f) {
+      return 0.0f;
+    }
+    probability *= (node_index == left ? left_bound : right_bound) / sum;
+    node_index = parent;
+  }
+  return probability;
+}
@@ -1,156 +1,409 @@
-#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include "../include/sphere.h"
+#include <string.h>
+#include "../include/path_tracer.h"
+#include "../include/perf.h"
+#include "../include/render.h"
+#include "../include/scene_io.h"
+#include "../include/stream.h"
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "../lib/stb_image.h"
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  --perf              report render time, rays/s and hardware counters\n");
+    fprintf(stderr, "  --output FILE       output image path (default out.ppm)\n");
+    fprintf(stderr, "  --scene FILE        load a text or binary scene instead of the demo scene\n");
+    fprintf(stderr, "  --save-scene FILE   write the scene as text and exit without rendering\n");
+    fprintf(stderr, "  --save-binary FILE  write the scene (with its BVH) as a binary scene and exit\n");
+    fprintf(stderr, "  --integrator <whitted|path>\n"
+                    "                      override the scene's integrator\n");
+    fprintf(stderr, "  --spp N             path tracer samples per pixel; the output is rewritten\n"
+                    "                      after 1, 2, 4, ... samples as a progressive preview\n");
+    fprintf(stderr, "  --light-sampling <exact|cull|sample|tiled>\n"
+                    "                      override how shading points pick lights\n");
+    fprintf(stderr, "  --environment S     light the scene with the background image at strength S\n");
+    fprintf(stderr, "  --shutter S         fraction of the frame moving spheres blur over; 0 = sharp\n");
+    fprintf(stderr, "  --accel <auto|bvh|grid|hashgrid|qbvh|compact>\n"
+                    "                      override what the scene is traced through; grids take\n"
+                    "                      still spheres only, qbvh (quantized nodes) and compact\n"
+                    "                      (qbvh with packed spheres) still geometry\n");
+    fprintf(stderr, "  --alloc <malloc|huge|numa>\n"
+                    "                      how the BVH and frame buffer are allocated: huge maps\n"
+                    "                      them for transparent huge pages (BVHs from the cache\n"
+                    "                      or a binary scene are copied in), placed by the\n"
+                    "                      threads that first write them; numa also copies the\n"
+                    "                      BVH to every NUMA node\n");
+    fprintf(stderr, "  --threads N         render on N worker threads (0: one per usable CPU) in\n"
+                    "                      place of OpenMP's team (OMP_NUM_THREADS); streamed\n"
+                    "                      frames (--stream) still use OpenMP\n");
+    fprintf(stderr, "  --pin               pin the worker threads to CPUs by topology, a core each\n"
+                    "                      before SMT siblings, siblings on neighbouring tiles;\n"
+                    "                      --perf then reports rays/s per worker and core\n");
+    fprintf(stderr, "  --save-chunks FILE  write the scene's spheres as a chunk file and exit\n");
+    fprintf(stderr, "  --chunk-spheres N   spheres per chunk for --save-chunks (default %d)\n", CHUNKS_DEFAULT_SPHERES);
+    fprintf(stderr, "  --stream FILE       stream the spheres from a chunk file, in place of the\n"
+                    "                      scene's own; Whitted integrator only\n");
+    fprintf(stderr, "  --stream-budget MB  most chunk data mapped at once (default %d)\n", CHUNKS_DEFAULT_BUDGET_MB);
+    fprintf(stderr, "  --no-bvh            intersect every primitive instead of building a BVH\n");
+    fprintf(stderr, "  --no-bvh-cache      always rebuild the BVH instead of using the on-disk cache\n");
+    fprintf(stderr, "  --generate <uniform|clustered|nested> [--spheres N] [--lights N]\n"
+                    "             [--light-range D] [--materials N] [--seed S] [--motion D]\n"
+                    "                      render a seeded random scene instead of the demo scene\n");
+}
 
-#define WIDTH 1024
-#define HEIGHT 768
-#define SUPER_SAMPLING 4  // Adjust this for anti-aliasing level
+// Parses a whole decimal argument in [min, max]; trailing text, overflow and
+// values out of range are rejected.
+static bool parse_long(const char *text, long min, long max, long *value) {
+    char *end;
+    errno = 0;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < min || parsed > max) {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
 
-int bg_width, bg_height, bg_channels;
-unsigned char *background_image;
+typedef struct {
+    const char *path;
+    Vec3f *frame_buffer;
+    double start_time;
+    bool written;
+} ProgressiveOutput;
 
-Vec3f background_color; // vec3f_init_values(0.2f, 0.7f, 0.8f);
+// Rewrites the output image with the current estimate, so a preview is
+// available after the first sample per pixel.
+static void write_progress(const Accumulator *accumulator, void *user) {
+    ProgressiveOutput *output = (ProgressiveOutput *)user;
+    accumulator_resolve(accumulator, output->frame_buffer);
+    output->written = write_ppm(output->path, output->frame_buffer, accumulator->width, accumulator->height) && output->written;
+    fprintf(stderr, "%u spp after %.1f s -> %s\n", accumulator->samples, perf_now_seconds() - output->start_time,
+            output->path);
+}
 
-void render(const Sphere *spheres, size_t num_spheres, Light *lights, size_t num_lights) {
-    background_color = vec3f_init_values(0.2f, 0.7f, 0.8f);
-    float fov = M_PI / 2.0f; // Set the field of view to 90 degrees
-    Vec3f *frame_buffer = (Vec3f *)malloc(WIDTH * HEIGHT * sizeof(Vec3f));
-    if (frame_buffer == NULL) {
-        fprintf(stderr, "Memory allocation failed.\n");
-        return;
-    }
+int main(int argc, char **argv) {
+    bool report_perf = false;
+    const char *output_path = "out.ppm";
+    const char *scene_path = NULL;
+    const char *save_scene_path = NULL;
+    const char *save_binary_path = NULL;
+    const char *save_chunks_path = NULL;
+    const char *stream_path = NULL;
+    long chunk_spheres = CHUNKS_DEFAULT_SPHERES;
+    long stream_budget_mb = CHUNKS_DEFAULT_BUDGET_MB;
+    int integrator = -1;
+    int samples = 0;
+    int light_sampling = -1;
+    float environment = -1.0f;
+    float shutter = -1.0f;
+    int accel = -1;
+    int threads = -1;
+    bool pin = false;
+    bool huge_pages = false;
+    bool replicate_bvh = false;
+    bool use_bvh = true;
+    bool use_bvh_cache = true;
+    SceneGenParams gen_params;
+    bool generate = false;
+    scene_gen_params_default(&gen_params);
 
-    // Load background image and get its dimensions
-    int bg_width, bg_height, bg_channels;
-    unsigned char *background_image = stbi_load("../doc/background.jpg", &bg_width, &bg_height, &bg_channels, 0);
-
-#pragma omp parallel for
-    for (int j = 0; j < HEIGHT; j++) {
-        for (int i = 0; i < WIDTH; i++) {
-            Vec3f pixel_color = vec3f_init(); // Initialize pixel color to black
-
-            // Supersampling loop (sub-pixels for anti-aliasing)
-            for (int s = 0; s < SUPER_SAMPLING; s++) {
-                for (int t = 0; t < SUPER_SAMPLING; t++) {
-                    float x = (2 * (i + (s + 0.5) / SUPER_SAMPLING) / (float)WIDTH - 1) * tanf(fov / 2) * WIDTH / (float)HEIGHT;
-                    float y = -(2 * (j + (t + 0.5) / SUPER_SAMPLING) / (float)HEIGHT - 1) * tanf(fov / 2);
-
-                    // Ray direction calculation
-                    Vec3f dir = vec3f_normalize(vec3f_init_values(x, y, -1.0f));
-
-                    // Ray origin (camera position)
-                    Vec3f ray_origin = vec3f_init_values(0.0f, 0.0f, 0.0f);
-
-                    // Check for intersections with spheres
-                    Vec3f hit_point;
-                    Vec3f surface_normal;
-                    Material intersected_material;
-
-                    if (scene_intersect(&ray_origin, &dir, spheres, num_spheres, &hit_point, &surface_normal, &intersected_material)) {
-                        // Intersection occurred, calculate lighting
-                        Vec3f diffuse_reflection = calculate_diffuse_reflection(hit_point, surface_normal, intersected_material, lights, num_lights);
-                        pixel_color = diffuse_reflection;
-                    } else {
-                        // No intersection, set pixel color from the stretched background image
-                        // Calculate the background image coordinates (stretching)
-                        float bg_x = ((WIDTH - i) / (float)WIDTH) * bg_width;
-                        float bg_y = (j / (float)HEIGHT) * bg_height;
-                        int bg_i = (int)bg_x;
-                        int bg_j = (int)bg_y;
-                        unsigned char r, g, b;
-
-                        // Check if within background image bounds
-                        if (bg_i >= 0 && bg_i < bg_width && bg_j >= 0 && bg_j < bg_height) {
-                            int bg_index = bg_i + bg_j * bg_width;
-                            r = background_image[bg_index * bg_channels];
-                            g = background_image[bg_index * bg_channels + 1];
-                            b = background_image[bg_index * bg_channels + 2];
-                        } else {
-                            // Use the background color if outside background image bounds
-                            r = (unsigned char)(background_color.data[0] * 255);
-                            g = (unsigned char)(background_color.data[1] * 255);
-                            b = (unsigned char)(background_color.data[2] * 255);
-                        }
-                        pixel_color = vec3f_init_values(r / 255.0, g / 255.0, b / 255.0);
-                    }
-
-                    // Accumulate pixel color from multiple rays
-                    frame_buffer[i + j * WIDTH] = vec3f_add(frame_buffer[i + j * WIDTH], pixel_color);
-                }
+    for (int i = 1; i < argc; i++) {
+        if (scene_gen_parse_option(&gen_params, &generate, argc, argv, &i)) {
+            continue;
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            report_perf = true;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            scene_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-scene") == 0 && i + 1 < argc) {
+            save_scene_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-binary") == 0 && i + 1 < argc) {
+            save_binary_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-chunks") == 0 && i + 1 < argc) {
+            save_chunks_path = argv[++i];
+        } else if (strcmp(argv[i], "--chunk-spheres") == 0 && i + 1 < argc) {
+            if (!parse_long(argv[++i], 1, INT_MAX, &chunk_spheres)) {
+                print_usage(argv[0]);
+                return 1;
             }
-
-            // Average the accumulated pixel color
-            frame_buffer[i + j * WIDTH].data[0] /= (SUPER_SAMPLING * SUPER_SAMPLING);
-            frame_buffer[i + j * WIDTH].data[1] /= (SUPER_SAMPLING * SUPER_SAMPLING);
-            frame_buffer[i + j * WIDTH].data[2] /= (SUPER_SAMPLING * SUPER_SAMPLING);
+        } else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            stream_path = argv[++i];
+        } else if (strcmp(argv[i], "--stream-budget") == 0 && i + 1 < argc) {
+            // The budget is shifted to bytes, so it must fit size_t after the shift.
+            long max_mb = SIZE_MAX >> 20 < LONG_MAX ? (long)(SIZE_MAX >> 20) : LONG_MAX;
+            if (!parse_long(argv[++i], 1, max_mb, &stream_budget_mb)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "whitted") == 0) {
+                integrator = INTEGRATOR_WHITTED;
+            } else if (strcmp(argv[i], "path") == 0) {
+                integrator = INTEGRATOR_PATH;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--light-sampling") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "exact") == 0) {
+                light_sampling = LIGHTS_EXACT;
+            } else if (strcmp(argv[i], "cull") == 0) {
+                light_sampling = LIGHTS_CULL;
+            } else if (strcmp(argv[i], "sample") == 0) {
+                light_sampling = LIGHTS_SAMPLE;
+            } else if (strcmp(argv[i], "tiled") == 0) {
+                light_sampling = LIGHTS_TILED;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+            if (samples < 1) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--environment") == 0 && i + 1 < argc) {
+            environment = (float)atof(argv[++i]);
+            if (!(environment >= 0.0f)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--shutter") == 0 && i + 1 < argc) {
+            shutter = (float)atof(argv[++i]);
+            if (!(shutter >= 0.0f && shutter <= 1.0f)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--accel") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "auto") == 0) {
+                accel = ACCEL_AUTO;
+            } else if (strcmp(argv[i], "bvh") == 0) {
+                accel = ACCEL_BVH;
+            } else if (strcmp(argv[i], "grid") == 0) {
+                accel = ACCEL_GRID;
+            } else if (strcmp(argv[i], "hashgrid") == 0) {
+                accel = ACCEL_HASHED_GRID;
+            } else if (strcmp(argv[i], "qbvh") == 0) {
+                accel = ACCEL_QBVH;
+            } else if (strcmp(argv[i], "compact") == 0) {
+                accel = ACCEL_COMPACT;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            long value;
+            if (!parse_long(argv[++i], 0, INT_MAX, &value)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            threads = (int)value;
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pin = true;
+        } else if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "malloc") == 0) {
+                huge_pages = false;
+                replicate_bvh = false;
+            } else if (strcmp(argv[i], "huge") == 0) {
+                huge_pages = true;
+                replicate_bvh = false;
+            } else if (strcmp(argv[i], "numa") == 0) {
+                huge_pages = true;
+                replicate_bvh = true;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--no-bvh") == 0) {
+            use_bvh = false;
+        } else if (strcmp(argv[i], "--no-bvh-cache") == 0) {
+            use_bvh_cache = false;
+        } else {
+            print_usage(argv[0]);
+            return 1;
         }
     }
 
-    FILE *ofs = fopen("out.ppm", "wb");
-    if (ofs == NULL) {
-        fprintf(stderr, "Failed to open output file.\n");
-        free(frame_buffer);
-        return;
+    Scene scene;
+    bool loaded;
+    if (scene_path != NULL) {
+        loaded = scene_load(&scene, scene_path);
+    } else if (generate) {
+        loaded = scene_generate(&scene, &gen_params);
+    } else {
+        loaded = scene_init_demo(&scene);
+    }
+    if (!loaded) {
+        return 1;
     }
 
-    fprintf(ofs, "P6\n%d %d\n255\n", WIDTH, HEIGHT);
-
-    for (int j = 0; j < HEIGHT; j++) {
-        for (int i = 0; i < WIDTH; i++) {
-            int index = i + j * WIDTH;
+    if (integrator >= 0) {
+        scene.settings.integrator = (Integrator)integrator;
+    }
+    if (samples > 0) {
+        scene.settings.samples = samples;
+    }
+    if (light_sampling >= 0) {
+        scene.settings.light_sampling = (LightSampling)light_sampling;
+    }
+    if (environment >= 0.0f) {
+        scene.settings.environment = environment;
+    }
+    if (shutter >= 0.0f) {
+        scene.settings.shutter = shutter;
+    }
+    if (accel >= 0) {
+        scene.settings.accel = (Accel)accel;
+    }
 
-            // Convert the pixel color to the 0-255 range
-            unsigned char r = (unsigned char)(frame_buffer[index].data[0] * 255);
-            unsigned char g = (unsigned char)(frame_buffer[index].data[1] * 255);
-            unsigned char b = (unsigned char)(frame_buffer[index].data[2] * 255);
+    if (save_scene_path != NULL) {
+        bool saved = scene_save_text(&scene, save_scene_path);
+        scene_free(&scene);
+        return saved ? 0 : 1;
+    }
+    if (save_chunks_path != NULL) {
+        bool saved = chunks_save(scene.spheres, scene.num_spheres, (size_t)chunk_spheres, save_chunks_path);
+        scene_free(&scene);
+        return saved ? 0 : 1;
+    }
 
-            // Write to the file (note the reversed order for j)
-            fwrite(&r, 1, 1, ofs);
-            fwrite(&g, 1, 1, ofs);
-            fwrite(&b, 1, 1, ofs);
+    if (stream_path != NULL) {
+        if (scene.num_spheres > 0) {
+            fprintf(stderr, "Streaming %s in place of the scene's %zu spheres.\n", stream_path, scene.num_spheres);
+            // The arrays stay with the scene until scene_free.
+            scene.num_spheres = 0;
+        }
+        if (scene.settings.integrator != INTEGRATOR_WHITTED) {
+            fprintf(stderr, "Streaming renders with the Whitted integrator.\n");
+            scene.settings.integrator = INTEGRATOR_WHITTED;
         }
     }
 
-    fclose(ofs);
-    free(frame_buffer);
-    stbi_image_free(background_image);
-}
+    scene.arena.huge_pages = huge_pages;
+    if (use_bvh && !scene_build_accel(&scene, use_bvh_cache)) {
+        scene_free(&scene);
+        return 1;
+    }
+    if (!use_bvh) {
+        bvh_free(&scene.bvh);
+    }
+    if (replicate_bvh && !scene_replicate_bvh(&scene)) {
+        scene_free(&scene);
+        return 1;
+    }
+    if (!scene_build_light_bvh(&scene)) {
+        scene_free(&scene);
+        return 1;
+    }
 
-int main() {
-    const int num_spheres = 11;
-    const int num_lights = 1;
+    if (save_binary_path != NULL) {
+        bool saved = scene_save_binary(&scene, save_binary_path);
+        scene_free(&scene);
+        return saved ? 0 : 1;
+    }
 
-    Sphere spheres[num_spheres];
-    Material red_velvet;
-    Material ivory;
-    Material radio;
+    const int width = scene.settings.width;
+    const int height = scene.settings.height;
+    // What lives as long as the frame; it is freed at once at the end.
+    Arena frame;
+    arena_init(&frame, "frame", 0);
+    frame.huge_pages = huge_pages;
+    Vec3f *frame_buffer = (Vec3f *)arena_calloc(&frame, (size_t)width * height, sizeof(Vec3f));
+    if (frame_buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        scene_free(&scene);
+        return 1;
+    }
 
+    ChunkStore store;
+    if (stream_path != NULL && !chunks_open(&store, stream_path, (size_t)stream_budget_mb << 20)) {
+        arena_free(&frame);
+        scene_free(&scene);
+        return 1;
+    }
 
-    red_velvet.material_color = vec3f_init_values(0.3, 0.1, 0.1);
-    ivory.material_color = vec3f_init_values(0.4, 0.4, 0.3);
-    radio.material_color = vec3f_init_values(0.5, 0.5, 0.5);
+    // Load background image and get its dimensions
+    render_load_background("../doc/background.jpg");
+
+    PerfCounters counters;
+    perf_counters_init(&counters, report_perf);
+    RenderStats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint64_t rays;
+    bool written;
+    Workers workers;
+    bool use_workers = stream_path == NULL && (threads >= 0 || pin);
+    if (use_workers && !workers_init(&workers, threads, pin)) {
+        fprintf(stderr, "Memory allocation failed; rendering without workers.\n");
+        use_workers = false;
+    }
+    if (use_workers) {
+        render_set_workers(&workers);
+    }
 
-    spheres[0] = sphere_init(vec3f_init_values(4.0f, 3.0f, -10.0f), 2.0f, red_velvet);
-    spheres[1] = sphere_init(vec3f_init_values(6.0f, 1.5f, -8.0f), 1.5f, ivory);
-    spheres[2] = sphere_init(vec3f_init_values(2.5f, 2.0f, -15.0f), 2.0f, ivory);
-    spheres[3] = sphere_init(vec3f_init_values(0.0f, -2.0f, -12.0f), 1.0f, red_velvet);
-    spheres[4] = sphere_init(vec3f_init_values(-7.0f, 8.0f, -10.0f), 2.0f, red_velvet);
-    spheres[5] = sphere_init(vec3f_init_values(-5.0f, 5.0f, -13.0f), 2.0f, ivory);
-    spheres[6] = sphere_init(vec3f_init_values(-5.0f, 3.0f, -13.0f), 2.0f, ivory);
-    spheres[7] = sphere_init(vec3f_init_values(-3.0f, 5.0f, -13.0f), 1.5f, red_velvet);
-    spheres[8] = sphere_init(vec3f_init_values(-5.0f, 5.0f, -13.0f), 1.5f, red_velvet);
-    spheres[9] = sphere_init(vec3f_init_values(-4.3f, -5.0f, -13.0f), 1.5f, ivory);
-    spheres[10] = sphere_init(vec3f_init_values(-5.0f, -5.0f, -13.0f), 1.5f, radio);
+    if (stream_path != NULL) {
+        perf_counters_start(&counters);
+        rays = stream_render_frame(&scene, &store, frame_buffer, &stats);
+        perf_counters_stop(&counters);
+        written = rays > 0 && write_ppm(output_path, frame_buffer, width, height);
+        chunks_report(&store, stderr);
+    } else if (scene.settings.integrator == INTEGRATOR_PATH) {
+        Accumulator accumulator;
+        if (!accumulator_init(&accumulator, &frame, width, height)) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            if (use_workers) {
+                render_set_workers(NULL);
+                workers_free(&workers);
+            }
+            arena_free(&frame);
+            scene_free(&scene);
+            return 1;
+        }
+        ProgressiveOutput progress = { output_path, frame_buffer, perf_now_seconds(), true };
+        perf_counters_start(&counters);
+        rays = path_trace_progressive(&scene, &accumulator, &stats, write_progress, &progress);
+        perf_counters_stop(&counters);
+        written = progress.written;
+        accumulator_free(&accumulator);
+    } else {
+        perf_counters_start(&counters);
+        rays = render_frame(&scene, frame_buffer, &stats);
+        perf_counters_stop(&counters);
+        written = write_ppm(output_path, frame_buffer, width, height);
+    }
+    if (use_workers) {
+        if (report_perf) {
+            workers_report(&workers, "rays", stderr);
+        }
+        render_set_workers(NULL);
+        workers_free(&workers);
+    }
+    if ((threads >= 0 || pin) && stream_path != NULL) {
+        fprintf(stderr, "Worker threads don't render streamed frames; this one used OpenMP.\n");
+    }
 
-    Light lights[num_lights];
-    lights[0].position = vec3f_init_values(-50, 20, 20);
-    lights[0].intensity = 1.5f;
+    if (report_perf) {
+        perf_counters_report(&counters, "render", rays, stderr);
+        render_stats_report(&stats, stderr);
+        arena_report(&scene.arena, stderr);
+        arena_report(&frame, stderr);
+    }
+    perf_counters_close(&counters);
 
-    render(spheres, num_spheres, lights, num_lights);
+    arena_free(&frame);
+    render_free_background();
+    if (stream_path != NULL) {
+        chunks_close(&store);
+    }
+    scene_free(&scene);
 
-    return 0;
+    return written ? 0 : 1;
 }
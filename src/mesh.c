@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/mesh.h"
+
+void mesh_free(Mesh *mesh) {
+  if (mesh->vertex_capacity > 0 || mesh->triangle_capacity > 0) {
+    free(mesh->vertices);
+    free(mesh->normals);
+    free(mesh->triangles);
+  }
+  memset(mesh, 0, sizeof(*mesh));
+}
+
+// Doubles the vertex arrays (normals too, once they exist) when full.
+static bool reserve_vertex(Mesh *mesh) {
+  if (mesh->num_vertices < mesh->vertex_capacity) {
+    return true;
+  }
+  size_t capacity = mesh->vertex_capacity ? mesh->vertex_capacity * 2 : 64;
+  Vec3f *vertices = (Vec3f *)realloc(mesh->vertices, capacity * sizeof(Vec3f));
+  if (vertices == NULL) {
+    return false;
+  }
+  mesh->vertices = vertices;
+  if (mesh->normals != NULL) {
+    Vec3f *normals = (Vec3f *)realloc(mesh->normals, capacity * sizeof(Vec3f));
+    if (normals == NULL) {
+      return false;
+    }
+    mesh->normals = normals;
+  }
+  mesh->vertex_capacity = capacity;
+  return true;
+}
+
+bool mesh_add_vertex(Mesh *mesh, Vec3f position, const Vec3f *normal) {
+  if (!reserve_vertex(mesh)) {
+    return false;
+  }
+  if (normal != NULL && mesh->normals == NULL) {
+    // First vertex with a normal: the ones before it use the face normal.
+    mesh->normals = (Vec3f *)calloc(mesh->vertex_capacity, sizeof(Vec3f));
+    if (mesh->normals == NULL) {
+      return false;
+    }
+  }
+  mesh->vertices[mesh->num_vertices] = position;
+  if (mesh->normals != NULL) {
+    mesh->normals[mesh->num_vertices] = normal != NULL ? *normal : vec3f_init();
+  }
+  mesh->num_vertices++;
+  return true;
+}
+
+bool mesh_add_triangle(Mesh *mesh, uint32_t a, uint32_t b, uint32_t c, uint32_t material_index) {
+  if (mesh->num_triangles == mesh->triangle_capacity) {
+    size_t capacity = mesh->triangle_capacity ? mesh->triangle_capacity * 2 : 64;
+    Triangle *triangles = (Triangle *)realloc(mesh->triangles, capacity * sizeof(Triangle));
+    if (triangles == NULL) {
+      return false;
+    }
+    mesh->triangles = triangles;
+    mesh->triangle_capacity = capacity;
+  }
+  Triangle *triangle = &mesh->triangles[mesh->num_triangles++];
+  triangle->v[0] = a;
+  triangle->v[1] = b;
+  triangle->v[2] = c;
+  triangle->material_index = material_index;
+  return true;
+}
+
+// OBJ position/normal pairs already turned into mesh vertices. Open
+// addressing over a power-of-two capacity; a key of 0 marks an empty slot,
+// which no real key can be since positions are 1-based in the key.
+typedef struct {
+  uint64_t *keys;
+  uint32_t *values;
+  size_t capacity;
+  size_t count;
+} CornerTable;
+
+static inline size_t corner_slot(uint64_t key, size_t mask) {
+  return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+static bool corner_table_grow(CornerTable *table) {
+  size_t capacity = table->capacity ? table->capacity * 2 : 1024;
+  uint64_t *keys = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+  uint32_t *values = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+  if (keys == NULL || values == NULL) {
+    free(keys);
+    free(values);
+    return false;
+  }
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->keys[i] != 0) {
+      size_t slot = corner_slot(table->keys[i], capacity - 1);
+      while (keys[slot] != 0) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      keys[slot] = table->keys[i];
+      values[slot] = table->values[i];
+    }
+  }
+  free(table->keys);
+  free(table->values);
+  table->keys = keys;
+  table->values = values;
+  table->capacity = capacity;
+  return true;
+}
+
+typedef struct {
+  const char *path;
+  size_t line;
+  Vec3f *positions; // as read, before transforming
+  size_t num_positions, position_capacity;
+  Vec3f *normals;
+  size_t num_normals, normal_capacity;
+  CornerTable corners;
+  float scale;
+  Vec3f translate;
+} ObjReader;
+
+static bool obj_error(const ObjReader *reader, const char *message) {
+  fprintf(stderr, "%s:%zu: %s\n", reader->path, reader->line, message);
+  return false;
+}
+
+static bool push_vec3(Vec3f **array, size_t *count, size_t *capacity, Vec3f value) {
+  if (*count == *capacity) {
+    size_t grown = *capacity ? *capacity * 2 : 1024;
+    Vec3f *resized = (Vec3f *)realloc(*array, grown * sizeof(Vec3f));
+    if (resized == NULL) {
+      return false;
+    }
+    *array = resized;
+    *capacity = grown;
+  }
+  (*array)[(*count)++] = value;
+  return true;
+}
+
+static bool parse_vec3(const char *text, Vec3f *value) {
+  char *end;
+  for (int k = 0; k < 3; k++) {
+    value->data[k] = strtof(text, &end);
+    if (end == text) {
+      return false;
+    }
+    text = end;
+  }
+  return true;
+}
+
+// 1-based OBJ index, negative counting back from the end; 0 when absent
+// or out of range.
+static size_t resolve_index(long index, size_t count) {
+  if (index > 0 && (size_t)index <= count) {
+    return (size_t)index;
+  }
+  if (index < 0 && (size_t)-index <= count) {
+    return count + 1 - (size_t)-index;
+  }
+  return 0;
+}
+
+// Parses one face corner ("v", "v/vt", "v//vn" or "v/vt/vn") and returns
+// the mesh vertex for it, adding one if this pair hasn't been seen.
+static bool obj_corner(ObjReader *reader, Mesh *mesh, const char **text, uint32_t *vertex) {
+  char *end;
+  long position = strtol(*text, &end, 10);
+  if (end == *text) {
+    return obj_error(reader, "bad face corner");
+  }
+  long normal = 0;
+  if (*end == '/') {
+    end++;
+    if (*end != '/') {
+      strtol(end, &end, 10); // texture coordinate, unused
+    }
+    if (*end == '/') {
+      end++;
+      const char *start = end;
+      normal = strtol(start, &end, 10);
+      if (end == start) {
+        return obj_error(reader, "bad face corner");
+      }
+    }
+  }
+  *text = end;
+
+  size_t p = resolve_index(position, reader->num_positions);
+  size_t n = resolve_index(normal, reader->num_normals);
+  if (p == 0 || (normal != 0 && n == 0)) {
+    return obj_error(reader, "face index out of range");
+  }
+
+  CornerTable *table = &reader->corners;
+  if ((table->count + 1) * 2 > table->capacity && !corner_table_grow(table)) {
+    return obj_error(reader, "out of memory");
+  }
+  uint64_t key = (uint64_t)p | ((uint64_t)n << 32);
+  size_t mask = table->capacity - 1;
+  size_t slot = corner_slot(key, mask);
+  while (table->keys[slot] != 0) {
+    if (table->keys[slot] == key) {
+      *vertex = table->values[slot];
+      return true;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (mesh->num_vertices >= UINT32_MAX) {
+    return obj_error(reader, "too many vertices");
+  }
+  Vec3f source = reader->positions[p - 1];
+  Vec3f placed;
+  for (int k = 0; k < 3; k++) {
+    placed.data[k] = source.data[k] * reader->scale + reader->translate.data[k];
+  }
+  *vertex = (uint32_t)mesh->num_vertices;
+  if (!mesh_add_vertex(mesh, placed, n > 0 ? &reader->normals[n - 1] : NULL)) {
+    return obj_error(reader, "out of memory");
+  }
+  table->keys[slot] = key;
+  table->values[slot] = *vertex;
+  table->count++;
+  return true;
+}
+
+static bool obj_face(ObjReader *reader, Mesh *mesh, const char *text, uint32_t material_index) {
+  uint32_t first = 0, previous = 0;
+  int corners = 0;
+  for (;;) {
+    while (*text == ' ' || *text == '\t') {
+      text++;
+    }
+    if (*text == '\0' || *text == '\n' || *text == '\r' || *text == '#') {
+      break;
+    }
+    uint32_t vertex;
+    if (!obj_corner(reader, mesh, &text, &vertex)) {
+      return false;
+    }
+    // Fan around the first corner.
+    if (corners >= 2 && !mesh_add_triangle(mesh, first, previous, vertex, material_index)) {
+      return obj_error(reader, "out of memory");
+    }
+    if (corners == 0) {
+      first = vertex;
+    }
+    previous = vertex;
+    corners++;
+  }
+  return corners >= 3 || obj_error(reader, "face with fewer than three corners");
+}
+
+bool mesh_load_obj(Mesh *mesh, const char *path, uint32_t material_index, float scale, Vec3f translate) {
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    fprintf(stderr, "Failed to open mesh file %s.\n", path);
+    return false;
+  }
+
+  ObjReader reader;
+  memset(&reader, 0, sizeof(reader));
+  reader.path = path;
+  reader.scale = scale;
+  reader.translate = translate;
+  size_t first_triangle = mesh->num_triangles;
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+  bool ok = true;
+  while (ok && getline(&line, &line_capacity, in) >= 0) {
+    reader.line++;
+    const char *text = line;
+    while (*text == ' ' || *text == '\t') {
+      text++;
+    }
+    if (text[0] == 'v' && (text[1] == ' ' || text[1] == '\t')) {
+      Vec3f position;
+      ok = (parse_vec3(text + 2, &position) || obj_error(&reader, "bad vertex")) &&
+           (push_vec3(&reader.positions, &reader.num_positions, &reader.position_capacity, position) ||
+            obj_error(&reader, "out of memory"));
+    } else if (text[0] == 'v' && text[1] == 'n' && (text[2] == ' ' || text[2] == '\t')) {
+      // A zero normal stays zero and falls back to the face normal.
+      Vec3f normal;
+      ok = (parse_vec3(text + 3, &normal) || obj_error(&reader, "bad normal")) &&
+           (push_vec3(&reader.normals, &reader.num_normals, &reader.normal_capacity, vec3f_normalize(normal)) ||
+            obj_error(&reader, "out of memory"));
+    } else if (text[0] == 'f' && (text[1] == ' ' || text[1] == '\t')) {
+      ok = obj_face(&reader, mesh, text + 2, material_index);
+    }
+  }
+  if (ok && ferror(in)) {
+    ok = obj_error(&reader, "read error");
+  }
+
+  free(line);
+  fclose(in);
+  free(reader.positions);
+  free(reader.normals);
+  free(reader.corners.keys);
+  free(reader.corners.values);
+  if (ok) {
+    fprintf(stderr, "Loaded %s: %zu vertices, %zu triangles\n", path, reader.corners.count,
+            mesh->num_triangles - first_triangle);
+  }
+  return ok;
+}
@@ -0,0 +1,419 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/path_tracer.h"
+#include "../include/scatter.h"
+
+#define RNG_STREAM_PATH 0x9a7du
+
+static inline float power_heuristic(float pdf, float other_pdf) {
+    float a = pdf * pdf;
+    return a / (a + other_pdf * other_pdf);
+}
+
+// Solid angle a spherical light subtends from point, or 0 from inside it.
+static float light_solid_angle(const Light *light, Vec3f point, float *cos_max) {
+    Vec3f to_light = vec3f_sub(light->position, point);
+    float distance2 = vec3f_dot(to_light, to_light);
+    float radius2 = light->radius * light->radius;
+    if (distance2 <= radius2) {
+        return 0.0f;
+    }
+    *cos_max = sqrtf(1.0f - radius2 / distance2);
+    return 2.0f * (float)M_PI * (1.0f - *cos_max);
+}
+
+typedef struct {
+    const Scene *scene;
+    RenderContext *context;
+    Vec3f point;
+    Vec3f normal;
+    Vec3f origin;
+    float time; // of the ray that found the point
+    float irradiance;
+} LightSample;
+
+// Next-event estimation for one selected light: a shadow ray toward it and,
+// for spherical lights, the MIS weight against BSDF sampling.
+static void sample_light(uint32_t light_index, float pmf, void *user) {
+    LightSample *sample = (LightSample *)user;
+    const Light *light = &sample->scene->lights[light_index];
+    Vec3f point = sample->point;
+    Vec3f normal = sample->normal;
+
+    Vec3f to_light = vec3f_sub(light->position, point);
+    float distance2 = vec3f_dot(to_light, to_light);
+    float distance = sqrtf(distance2);
+    Vec3f axis = scatter_scale(to_light, 1.0f / distance);
+    Vec3f direction = axis;
+    float max_t = distance;
+    float weight = 1.0f / pmf;
+
+    if (light->radius > 0.0f) {
+        // Uniform direction in the cone the light subtends, ending on its
+        // near side.
+        float cos_max;
+        float solid_angle = light_solid_angle(light, point, &cos_max);
+        if (solid_angle <= 0.0f) {
+            return;
+        }
+        float cos_theta = 1.0f - rng_next_float(&sample->context->rng) * (1.0f - cos_max);
+        direction = scatter_around(axis, cos_theta, 2.0f * (float)M_PI * rng_next_float(&sample->context->rng));
+        float radius2 = light->radius * light->radius;
+        max_t = distance * cos_theta - sqrtf(fmaxf(0.0f, radius2 - distance2 * (1.0f - cos_theta * cos_theta)));
+        weight *= power_heuristic(pmf / solid_angle, fmaxf(0.0f, vec3f_dot(normal, direction)) / (float)M_PI);
+    }
+
+    float cos_n = vec3f_dot(normal, direction);
+    if (cos_n <= 0.0f) {
+        return;
+    }
+    sample->context->stats->shadow_rays++;
+    Ray shadow = ray_init_at(sample->origin, direction, sample->time);
+    if (scene_occluded(sample->scene, &shadow, max_t - RAY_EPSILON)) {
+        return;
+    }
+    sample->irradiance += light->intensity * cos_n * light_falloff(light->range, distance) * weight;
+}
+
+// Irradiance at a diffuse point from the lights render_select_lights picks.
+static float sample_lights(const Scene *scene, Vec3f point, Vec3f normal, float time, RenderContext *context) {
+    LightSample sample = { scene, context, point, normal, scatter_offset(point, normal, RAY_EPSILON), time, 0.0f };
+    render_select_lights(scene, point, normal, context, sample_light, &sample);
+    return sample.irradiance;
+}
+
+// Next-event estimation for the environment: one direction from its table
+// and a shadow ray, weighted against the cosine-sampled bounce finding the
+// same direction. Like sample_lights, the result still has to be multiplied
+// by the albedo.
+static Vec3f sample_environment(const Scene *scene, const Environment *env, Vec3f point, Vec3f normal, float time,
+                                RenderContext *context) {
+    Vec3f direction;
+    float pdf;
+    Vec3f radiance = environment_sample(env, &context->rng, &direction, &pdf);
+    float cos_n = vec3f_dot(normal, direction);
+    if (pdf <= 0.0f || cos_n <= 0.0f) {
+        return vec3f_init();
+    }
+    context->stats->shadow_rays++;
+    Ray shadow = ray_init_at(scatter_offset(point, normal, RAY_EPSILON), direction, time);
+    if (scene_occluded(scene, &shadow, SCENE_MAX_DISTANCE)) {
+        return vec3f_init();
+    }
+    float weight = power_heuristic(pdf, cos_n / (float)M_PI);
+    return scatter_scale(radiance, scene->settings.environment * cos_n / ((float)M_PI * pdf) * weight);
+}
+
+// Closest spherical light along the ray before max_t, with the solid angle
+// it subtends from the ray origin. Returns the light index or -1.
+static long hit_light(const Scene *scene, const Ray *ray, float max_t, float *solid_angle) {
+    const LightBVH *tree = &scene->light_bvh;
+    size_t count = tree->num_nodes > 0 ? tree->num_area_lights : scene->num_lights;
+    long closest = -1;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t light_index = tree->num_nodes > 0 ? tree->area_lights[i] : (uint32_t)i;
+        const Light *light = &scene->lights[light_index];
+        if (light->radius <= 0.0f) {
+            continue;
+        }
+        Vec3f to_light = vec3f_sub(light->position, ray->origin);
+        float tca = vec3f_dot(to_light, ray->direction);
+        float d2 = vec3f_dot(to_light, to_light) - tca * tca;
+        float radius2 = light->radius * light->radius;
+        if (tca <= 0.0f || d2 > radius2) {
+            continue;
+        }
+        float t = tca - sqrtf(radius2 - d2);
+        float cos_max;
+        float omega = light_solid_angle(light, ray->origin, &cos_max);
+        if (t > 0.0f && t < max_t && omega > 0.0f) {
+            closest = (long)light_index;
+            max_t = t;
+            *solid_angle = omega;
+        }
+    }
+    return closest;
+}
+
+// Radiance along a camera ray that hit the scene.
+static Vec3f path_radiance(const Scene *scene, Ray ray, Hit hit, RenderContext *context) {
+    Vec3f radiance = vec3f_init();
+    Vec3f throughput = vec3f_init_values(1.0f, 1.0f, 1.0f);
+    const Environment *env = render_environment(scene);
+
+    for (int depth = 0;;) {
+        HitRecord record;
+        scene_resolve_hit(scene, &ray, &hit, &record);
+        const Material *material = record.material;
+        radiance = vec3f_add(radiance, scatter_mul(throughput, material->emission));
+        SurfaceLobes lobes;
+        scatter_lobes(material, ray.direction, record.normal, &lobes);
+
+        // Pick one lobe in proportion to its weight; dividing by the pick
+        // probability leaves the sum of the weights on the throughput.
+        float total = lobes.diffuse + lobes.reflect + lobes.refract;
+        if (total <= 0.0f) {
+            break;
+        }
+        throughput = scatter_scale(throughput, total);
+        float pick = rng_next_float(&context->rng) * total;
+
+        Vec3f origin;
+        Vec3f direction;
+        float bsdf_pdf = 0.0f; // stays 0 for specular lobes
+        Vec3f shading_point = record.point;
+        Vec3f shading_normal = lobes.normal;
+        if (pick < lobes.diffuse) {
+            throughput = scatter_mul(throughput, material->material_color);
+            float direct = sample_lights(scene, record.point, lobes.normal, ray.time, context);
+            radiance = vec3f_add(radiance, scatter_scale(throughput, direct));
+            if (env != NULL) {
+                Vec3f sky = sample_environment(scene, env, record.point, lobes.normal, ray.time, context);
+                radiance = vec3f_add(radiance, scatter_mul(throughput, sky));
+            }
+
+            direction = scatter_cosine_hemisphere(lobes.normal, &context->rng);
+            bsdf_pdf = fmaxf(vec3f_dot(direction, lobes.normal), 0.0f) / (float)M_PI;
+            origin = scatter_offset(record.point, lobes.normal, RAY_EPSILON);
+        } else if (pick < lobes.diffuse + lobes.reflect) {
+            direction = scatter_reflect(material, ray.direction, &lobes, &context->rng);
+            origin = scatter_offset(record.point, lobes.normal, RAY_EPSILON);
+        } else {
+            direction = lobes.refracted;
+            origin = scatter_offset(record.point, lobes.normal, -RAY_EPSILON);
+        }
+
+        depth++;
+        if (depth > scene->settings.max_depth || depth > RENDER_MAX_DEPTH_LIMIT) {
+            context->stats->depth_terminated++;
+            break;
+        }
+        if (depth >= scene->settings.rr_depth) {
+            float survive = scatter_max_component(throughput);
+            if (survive < 1.0f) {
+                if (rng_next_float(&context->rng) >= survive) {
+                    context->stats->roulette_terminated++;
+                    break;
+                }
+                throughput = scatter_scale(throughput, 1.0f / survive);
+            }
+        }
+
+        ray = ray_init_at(origin, direction, ray.time);
+        context->stats->rays[depth]++;
+        bool found = scene_trace(scene, &ray, &hit);
+
+        float solid_angle;
+        long light_index = hit_light(scene, &ray, found ? hit.t : SCENE_MAX_DISTANCE, &solid_angle);
+        if (light_index >= 0) {
+            // Radiance that makes the light's irradiance pi * intensity (times
+            // its falloff), as in sample_light; after a diffuse bounce,
+            // weighted against the chance that next-event estimation picked
+            // the same direction.
+            const Light *light = &scene->lights[light_index];
+            float falloff = light_falloff(light->range, vec3f_norm(vec3f_sub(light->position, shading_point)));
+            float emitted = (float)M_PI * light->intensity * falloff / solid_angle;
+            float weight = 1.0f;
+            if (bsdf_pdf > 0.0f) {
+                float light_pdf = render_light_pmf(scene, shading_point, shading_normal, (uint32_t)light_index) / solid_angle;
+                weight = power_heuristic(bsdf_pdf, light_pdf);
+            }
+            radiance = vec3f_add(radiance, scatter_scale(throughput, emitted * weight));
+            break;
+        }
+        if (!found) {
+            // After a diffuse bounce the environment was also sampled
+            // directly; weight this hit against that.
+            float weight = 1.0f;
+            if (env != NULL && bsdf_pdf > 0.0f) {
+                weight = power_heuristic(bsdf_pdf, environment_pdf(env, ray.direction));
+            }
+            radiance = vec3f_add(radiance, scatter_scale(scatter_mul(throughput, render_miss_color(scene, &ray)), weight));
+            break;
+        }
+    }
+    return radiance;
+}
+
+bool accumulator_init(Accumulator *accumulator, Arena *arena, int width, int height) {
+    accumulator->sum = (Vec3f *)arena_calloc(arena, (size_t)width * height, sizeof(Vec3f));
+    accumulator->width = width;
+    accumulator->height = height;
+    accumulator->samples = 0;
+    return accumulator->sum != NULL;
+}
+
+void accumulator_free(Accumulator *accumulator) {
+    accumulator->sum = NULL;
+    accumulator->samples = 0;
+}
+
+static void resolve_row(const Accumulator *accumulator, Vec3f *frame_buffer, int j) {
+    float inv = accumulator->samples > 0 ? 1.0f / (float)accumulator->samples : 0.0f;
+    size_t first = (size_t)j * accumulator->width;
+    for (size_t p = first; p < first + (size_t)accumulator->width; p++) {
+        frame_buffer[p] = scatter_scale(accumulator->sum[p], inv);
+    }
+}
+
+typedef struct {
+    const Accumulator *accumulator;
+    Vec3f *frame_buffer;
+    Workers *workers;
+} WorkerResolve;
+
+static uint64_t resolve_worker(int worker, void *arg) {
+    WorkerResolve *job = (WorkerResolve *)arg;
+    uint32_t row;
+    while (workers_next_item(job->workers, worker, &row)) {
+        resolve_row(job->accumulator, job->frame_buffer, (int)row);
+    }
+    return 0;
+}
+
+void accumulator_resolve(const Accumulator *accumulator, Vec3f *frame_buffer) {
+    // Spread over the render threads like the passes: the first resolve is
+    // what first writes the frame buffer, which places its pages (see
+    // arena.h) on the nodes of the threads that render.
+    Workers *workers = render_get_workers();
+    WorkerResolve job = { accumulator, frame_buffer, workers };
+    if (workers == NULL || workers_run(workers, (uint32_t)accumulator->height, resolve_worker, &job) == 0) {
+#pragma omp parallel for schedule(static)
+        for (int j = 0; j < accumulator->height; j++) {
+            resolve_row(accumulator, frame_buffer, j);
+        }
+    }
+}
+
+// What the threads tracing a pass share.
+typedef struct {
+    const Scene *scene;
+    Accumulator *accumulator;
+    CameraFrame camera;
+    uint32_t pass;
+} Pass;
+
+// Adds one sample to every pixel of row j, tracing through scene (the
+// thread's view of pass->scene).
+static void trace_row(const Pass *pass, const Scene *scene, int j, RenderContext *context) {
+    Accumulator *accumulator = pass->accumulator;
+    const int width = accumulator->width;
+    const int height = accumulator->height;
+    for (int i = 0; i < width; i++) {
+        // One stream per pass, seeded per pixel: passes are independent
+        // and the image doesn't depend on scheduling.
+        rng_seed(&context->rng, (uint64_t)j * width + i, ((uint64_t)RNG_STREAM_PATH << 32) + pass->pass);
+        float dx = rng_next_float(&context->rng);
+        float dy = rng_next_float(&context->rng);
+        // Passes step through the shutter, so motion blur converges with
+        // the image rather than costing passes of its own.
+        float time = render_time_sample(scene, i, j, pass->pass);
+        Ray ray = ray_init_at(pass->camera.origin, camera_frame_direction(&pass->camera, i + dx, j + dy), time);
+
+        Hit hit;
+        Vec3f color;
+        context->stats->rays[0]++;
+        if (scene_trace(scene, &ray, &hit)) {
+            color = path_radiance(scene, ray, hit, context);
+        } else {
+            color = render_screen_background(i, j, width, height);
+        }
+        accumulator->sum[i + j * width] = vec3f_add(accumulator->sum[i + j * width], color);
+    }
+}
+
+typedef struct {
+    const Pass *pass;
+    Workers *workers;
+    RenderStats *stats; // per worker
+} WorkerPass;
+
+// Rows are the workers' items.
+static uint64_t pass_worker(int worker, void *arg) {
+    WorkerPass *job = (WorkerPass *)arg;
+    RenderContext context;
+    context.stats = &job->stats[worker];
+    Scene view;
+    const Scene *local = scene_for_thread(job->pass->scene, &view);
+    uint32_t row;
+    while (workers_next_item(job->workers, worker, &row)) {
+        trace_row(job->pass, local, (int)row, &context);
+    }
+    return render_stats_total(context.stats);
+}
+
+// The pass on the render workers (see render_set_workers); false, with
+// nothing traced, when not one of them could be started.
+static bool path_trace_pass_workers(const Pass *pass, Workers *workers, RenderStats *total) {
+    RenderStats *stats = (RenderStats *)calloc(workers->num_workers, sizeof(RenderStats));
+    if (stats == NULL) {
+        return false;
+    }
+    WorkerPass job = { pass, workers, stats };
+    int ran = workers_run(workers, (uint32_t)pass->accumulator->height, pass_worker, &job);
+    if (ran > 0 && ran < workers->num_workers) {
+        fprintf(stderr, "Started %d of %d render workers.\n", ran, workers->num_workers);
+    }
+    for (int w = 0; w < ran; w++) {
+        render_stats_add(total, &stats[w]);
+    }
+    free(stats);
+    return ran > 0;
+}
+
+uint64_t path_trace_pass(const Scene *scene, Accumulator *accumulator, RenderStats *stats) {
+    Pass pass;
+    pass.scene = scene;
+    pass.accumulator = accumulator;
+    camera_frame_init(&pass.camera, &scene->camera, accumulator->width, accumulator->height);
+    pass.pass = accumulator->samples;
+
+    RenderStats total;
+    memset(&total, 0, sizeof(total));
+
+    Workers *workers = render_get_workers();
+    if (workers == NULL || !path_trace_pass_workers(&pass, workers, &total)) {
+#pragma omp parallel for
+        for (int j = 0; j < accumulator->height; j++) {
+            RenderStats row_stats;
+            memset(&row_stats, 0, sizeof(row_stats));
+            RenderContext context;
+            context.stats = &row_stats;
+            // With the BVH replicated, the copy on this thread's node;
+            // copying the Scene costs nothing next to tracing the row.
+            Scene view;
+            const Scene *local = scene_for_thread(scene, &view);
+            trace_row(&pass, local, j, &context);
+
+#pragma omp critical
+            render_stats_add(&total, &row_stats);
+        }
+    }
+
+    accumulator->samples++;
+    if (stats != NULL) {
+        render_stats_add(stats, &total);
+    }
+    return render_stats_total(&total);
+}
+
+uint64_t path_trace_progressive(const Scene *scene, Accumulator *accumulator, RenderStats *stats,
+                                PathTraceProgress progress, void *user) {
+    const uint32_t samples = (uint32_t)scene->settings.samples;
+    uint32_t next_report = 1;
+    uint64_t rays = 0;
+
+    while (accumulator->samples < samples) {
+        rays += path_trace_pass(scene, accumulator, stats);
+        if (accumulator->samples >= next_report || accumulator->samples == samples) {
+            while (next_report <= accumulator->samples) {
+                next_report *= 2;
+            }
+            if (progress != NULL) {
+                progress(accumulator, user);
+            }
+        }
+    }
+    return rays;
+}
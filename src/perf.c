@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include "../include/perf.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char *counter_names[PERF_COUNTER_COUNT] = {
+  "cycles", "instructions", "L1d-misses", "LLC-misses", "branch-misses"
+};
+
+double perf_now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  // Count this process (pid 0) on any cpu (-1), no group leader.
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+void perf_counters_init(PerfCounters *counters, bool enable_hardware) {
+  memset(counters, 0, sizeof(*counters));
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    counters->fds[i] = -1;
+  }
+
+#ifdef __linux__
+  if (!enable_hardware) {
+    return;
+  }
+
+  counters->fds[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  counters->fds[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  counters->fds[PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  counters->fds[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  counters->fds[PERF_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    counters->available[i] = counters->fds[i] >= 0;
+  }
+#else
+  (void)enable_hardware;
+#endif
+}
+
+void perf_counters_start(PerfCounters *counters) {
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    counters->values[i] = 0;
+#ifdef __linux__
+    if (counters->available[i]) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+  counters->start_time = perf_now_seconds();
+}
+
+void perf_counters_stop(PerfCounters *counters) {
+  counters->elapsed_seconds = perf_now_seconds() - counters->start_time;
+
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (!counters->available[i]) {
+      continue;
+    }
+    ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t value = 0;
+    if (read(counters->fds[i], &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+      counters->values[i] = value;
+    } else {
+      counters->available[i] = false;
+    }
+  }
+#endif
+}
+
+void perf_counters_close(PerfCounters *counters) {
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (counters->fds[i] >= 0) {
+      close(counters->fds[i]);
+    }
+    counters->fds[i] = -1;
+    counters->available[i] = false;
+  }
+#else
+  (void)counters;
+#endif
+}
+
+void perf_counters_report(const PerfCounters *counters, const char *label, uint64_t rays, FILE *out) {
+  fprintf(out, "%-24s %10.3f ms", label, counters->elapsed_seconds * 1e3);
+  if (rays > 0 && counters->elapsed_seconds > 0.0) {
+    fprintf(out, "  %10.4g Mrays/s", (double)rays / counters->elapsed_seconds * 1e-6);
+  }
+
+  bool any = false;
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (!counters->available[i]) {
+      continue;
+    }
+    any = true;
+    fprintf(out, "  %s=%llu", counter_names[i], (unsigned long long)counters->values[i]);
+    if (rays > 0) {
+      fprintf(out, " (%.2f/ray)", (double)counters->values[i] / (double)rays);
+    }
+  }
+
+  if (counters->available[PERF_CYCLES] && counters->available[PERF_INSTRUCTIONS] && counters->values[PERF_CYCLES] > 0) {
+    fprintf(out, "  IPC=%.2f", (double)counters->values[PERF_INSTRUCTIONS] / (double)counters->values[PERF_CYCLES]);
+  }
+  if (!any) {
+    fprintf(out, "  (hw counters unavailable)");
+  }
+  fprintf(out, "\n");
+}
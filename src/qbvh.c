@@ -0,0 +1,421 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/qbvh.h"
+
+static inline float min_f(float a, float b) { return a < b ? a : b; }
+static inline float max_f(float a, float b) { return a > b ? a : b; }
+
+// Decoding, shared by the encoder and traversal so that both round alike
+// (qbvh.c is built with -ffp-contract=off for the same reason). Per axis,
+// a step is 1/QBVH_STEPS of the parent's extent; a min is decoded upward
+// from the parent's min, a max downward from its max. Code 0 thus gives
+// the parent's plane exactly and larger codes move inward monotonically,
+// which is all the encoder's search below needs.
+static inline void plane_steps(const float *parent, float *step) {
+  for (int k = 0; k < 3; k++) {
+    step[k] = (parent[3 + k] - parent[k]) * (1.0f / QBVH_STEPS);
+    step[3 + k] = -step[k];
+  }
+}
+
+static inline float decode_plane(const float *parent, const float *step, int i, int code) {
+  return parent[i] + (float)code * step[i];
+}
+
+static inline void decode(const float *parent, const float *step, const QBVHNode *node, float *box) {
+  for (int i = 0; i < 6; i++) {
+    box[i] = decode_plane(parent, step, i, node->planes[i]);
+  }
+}
+
+// The largest code whose decoded plane still lies at or outside value: an
+// estimate from the step, corrected by decoding.
+static uint8_t encode_plane(const float *parent, const float *step, int i, float value) {
+  bool max = i >= 3;
+  float estimate = step[i] != 0.0f ? (value - parent[i]) / step[i] : 0.0f;
+  int code = estimate > 0.0f ? (estimate < QBVH_STEPS ? (int)estimate : QBVH_STEPS) : 0;
+  while (code > 0 && (max ? decode_plane(parent, step, i, code) < value : decode_plane(parent, step, i, code) > value)) {
+    code--;
+  }
+  while (code < QBVH_STEPS && (max ? decode_plane(parent, step, i, code + 1) >= value
+                                   : decode_plane(parent, step, i, code + 1) <= value)) {
+    code++;
+  }
+  return (uint8_t)code;
+}
+
+// Encodes the node within its parent's decoded box, then its children
+// within its own. The decoded parent holds the true parent, which holds
+// the node, so code 0 always fits.
+static void encode_node(QBVH *qbvh, const BVH *bvh, uint32_t index, const float *parent) {
+  const BVHNode *node = &bvh->nodes[index];
+  QBVHNode *out = &qbvh->nodes[index];
+  float step[6];
+  plane_steps(parent, step);
+  for (int k = 0; k < 3; k++) {
+    out->planes[k] = encode_plane(parent, step, k, node->bounds_min[k]);
+    out->planes[3 + k] = encode_plane(parent, step, 3 + k, node->bounds_max[k]);
+  }
+  out->left_first = node->left_first;
+  out->count = (uint16_t)(node->count & BVH_LEAF_TRIANGLES ? (node->count & ~BVH_LEAF_TRIANGLES) | QBVH_LEAF_TRIANGLES
+                                                           : node->count);
+  if (node->count == 0) {
+    float box[6];
+    decode(parent, step, out, box);
+    encode_node(qbvh, bvh, node->left_first, box);
+    encode_node(qbvh, bvh, node->left_first + 1, box);
+  }
+}
+
+bool qbvh_fits(const BVH *bvh) {
+  for (uint32_t i = 0; i < bvh->num_nodes; i++) {
+    if ((bvh->nodes[i].count & ~BVH_LEAF_TRIANGLES) >= QBVH_LEAF_TRIANGLES) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool qbvh_build(QBVH *qbvh, const BVH *bvh) {
+  memset(qbvh, 0, sizeof(*qbvh));
+  if (bvh->num_nodes == 0) {
+    return true;
+  }
+  if (bvh->end_bounds != NULL) {
+    fprintf(stderr, "Quantized BVHs hold still geometry only.\n");
+    return false;
+  }
+  if (!qbvh_fits(bvh)) {
+    fprintf(stderr, "BVH has a leaf too large to quantize.\n");
+    return false;
+  }
+
+  qbvh->nodes = (QBVHNode *)malloc(bvh->num_nodes * sizeof(QBVHNode));
+  qbvh->prim_indices = (uint32_t *)malloc(bvh->num_prims * sizeof(uint32_t));
+  qbvh->packets = bvh->num_packets > 0 ? (TrianglePacket *)malloc(bvh->num_packets * sizeof(TrianglePacket)) : NULL;
+  if (qbvh->nodes == NULL || qbvh->prim_indices == NULL || (bvh->num_packets > 0 && qbvh->packets == NULL)) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    qbvh_free(qbvh);
+    return false;
+  }
+  qbvh->num_nodes = bvh->num_nodes;
+  qbvh->num_prims = bvh->num_prims;
+  qbvh->num_packets = bvh->num_packets;
+  memcpy(qbvh->prim_indices, bvh->prim_indices, bvh->num_prims * sizeof(uint32_t));
+  if (bvh->num_packets > 0) {
+    memcpy(qbvh->packets, bvh->packets, bvh->num_packets * sizeof(TrianglePacket));
+  }
+
+  memcpy(qbvh->bounds, bvh->nodes[0].bounds_min, 3 * sizeof(float));
+  memcpy(qbvh->bounds + 3, bvh->nodes[0].bounds_max, 3 * sizeof(float));
+  encode_node(qbvh, bvh, 0, qbvh->bounds);
+  return true;
+}
+
+void qbvh_free(QBVH *qbvh) {
+  free(qbvh->nodes);
+  free(qbvh->prim_indices);
+  free(qbvh->packed);
+  free(qbvh->packed_leaves);
+  free(qbvh->packets);
+  memset(qbvh, 0, sizeof(*qbvh));
+}
+
+size_t qbvh_bytes(const QBVH *qbvh) {
+  return qbvh->num_nodes * sizeof(QBVHNode) + (qbvh->prim_indices != NULL ? qbvh->num_prims * sizeof(uint32_t) : 0) +
+         qbvh->num_packed * sizeof(PackedSphere) + qbvh->num_packed_leaves * sizeof(uint32_t) +
+         qbvh->num_packets * sizeof(TrianglePacket);
+}
+
+// Packed spheres. Radii are halves with a biased exponent of 1 to 30 (no
+// zeros, subnormals or infinities), which widen to floats by shifting and
+// rebiasing.
+static inline float half_to_float(uint16_t half) {
+  uint32_t bits = ((uint32_t)half << 13) + ((uint32_t)(127 - 15) << 23);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// The nearest half (ties to even); 0 outside the range half_to_float takes.
+static uint16_t float_to_half(float value) {
+  if (!(value >= 0x1p-14f && value <= 65504.0f)) {
+    return 0;
+  }
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  bits -= (uint32_t)(127 - 15) << 23;
+  return (uint16_t)((bits + 0x0fffu + ((bits >> 13) & 1u)) >> 13);
+}
+
+static inline void center_steps(const float *box, float *scale) {
+  for (int k = 0; k < 3; k++) {
+    scale[k] = (box[3 + k] - box[k]) * (1.0f / QBVH_CENTER_STEPS);
+  }
+}
+
+static inline Sphere unpack(const PackedSphere *packed, const float *box, const float *scale) {
+  Sphere sphere;
+  for (int k = 0; k < 3; k++) {
+    sphere.center.data[k] = box[k] + (float)packed->center[k] * scale[k];
+  }
+  sphere.radius = half_to_float(packed->radius);
+  sphere.material_index = packed->material;
+  return sphere;
+}
+
+// The code whose decoded coordinate is nearest value: an estimate, checked
+// against its neighbours by decoding.
+static uint16_t encode_center(float min, float scale, float value) {
+  if (scale == 0.0f) {
+    return 0;
+  }
+  float estimate = (value - min) / scale + 0.5f;
+  int code = estimate > 0.0f ? (estimate < QBVH_CENTER_STEPS ? (int)estimate : QBVH_CENTER_STEPS) : 0;
+  int best = code;
+  for (int c = code - 1; c <= code + 1; c++) {
+    if (c >= 0 && c <= QBVH_CENTER_STEPS &&
+        fabsf(min + (float)c * scale - value) < fabsf(min + (float)best * scale - value)) {
+      best = c;
+    }
+  }
+  return (uint16_t)best;
+}
+
+// Whether the nodes under index are numbered as bvh_build numbers them:
+// each pair of children next in the order a depth-first walk meets their
+// parents. qbvh_packed_sphere finds its way down by it.
+static bool in_build_order(const QBVH *qbvh, uint32_t index, uint32_t *next_pair) {
+  const QBVHNode *node = &qbvh->nodes[index];
+  if (node->count != 0) {
+    return true;
+  }
+  if (node->left_first != *next_pair) {
+    return false;
+  }
+  *next_pair += 2;
+  return in_build_order(qbvh, node->left_first, next_pair) && in_build_order(qbvh, node->left_first + 1, next_pair);
+}
+
+// Packs the spheres of the leaves under the node, against the boxes
+// traversal decodes, points the leaves at their new slots and lists them,
+// all in depth-first order.
+static void pack_node(QBVH *qbvh, const Sphere *spheres, uint32_t index, const float *parent, uint32_t *next) {
+  QBVHNode *node = &qbvh->nodes[index];
+  float box[6], step[6];
+  plane_steps(parent, step);
+  decode(parent, step, node, box);
+  if (node->count == 0) {
+    pack_node(qbvh, spheres, node->left_first, box, next);
+    pack_node(qbvh, spheres, node->left_first + 1, box, next);
+    return;
+  }
+  if (node->count & QBVH_LEAF_TRIANGLES) {
+    return;
+  }
+  float scale[3];
+  center_steps(box, scale);
+  for (uint32_t i = 0; i < node->count; i++) {
+    const Sphere *sphere = &spheres[qbvh->prim_indices[node->left_first + i]];
+    PackedSphere *out = &qbvh->packed[*next + i];
+    for (int k = 0; k < 3; k++) {
+      out->center[k] = encode_center(box[k], scale[k], sphere->center.data[k]);
+    }
+    out->radius = float_to_half(sphere->radius);
+    out->material = (uint16_t)sphere->material_index;
+  }
+  node->left_first = *next;
+  *next += node->count;
+  qbvh->packed_leaves[qbvh->num_packed_leaves++] = index;
+}
+
+bool qbvh_pack_spheres(QBVH *qbvh, const Sphere *spheres, size_t num_spheres) {
+  if (qbvh->packed != NULL || num_spheres == 0) {
+    return true;
+  }
+  for (size_t i = 0; i < num_spheres; i++) {
+    if (float_to_half(spheres[i].radius) == 0) {
+      fprintf(stderr, "Sphere %zu: radius %g is outside what packed spheres hold.\n", i, spheres[i].radius);
+      return false;
+    }
+    if (spheres[i].material_index > UINT16_MAX) {
+      fprintf(stderr, "Sphere %zu: material %u is beyond what packed spheres index.\n", i,
+              spheres[i].material_index);
+      return false;
+    }
+  }
+  uint32_t next_pair = 1;
+  if (!in_build_order(qbvh, 0, &next_pair)) {
+    fprintf(stderr, "Quantized BVH nodes are not in build order; spheres stay unpacked.\n");
+    return false;
+  }
+  uint32_t leaves = 0;
+  for (uint32_t i = 0; i < qbvh->num_nodes; i++) {
+    leaves += qbvh->nodes[i].count > 0 && !(qbvh->nodes[i].count & QBVH_LEAF_TRIANGLES);
+  }
+  qbvh->packed = (PackedSphere *)malloc(num_spheres * sizeof(PackedSphere));
+  qbvh->packed_leaves = (uint32_t *)malloc(leaves * sizeof(uint32_t));
+  if (qbvh->packed == NULL || qbvh->packed_leaves == NULL) {
+    fprintf(stderr, "Memory allocation failed.\n");
+    free(qbvh->packed);
+    free(qbvh->packed_leaves);
+    qbvh->packed = NULL;
+    qbvh->packed_leaves = NULL;
+    return false;
+  }
+  uint32_t next = 0;
+  pack_node(qbvh, spheres, 0, qbvh->bounds, &next);
+  qbvh->num_packed = next;
+  free(qbvh->prim_indices);
+  qbvh->prim_indices = NULL;
+  return true;
+}
+
+// bvh.c's slab test, on a decoded box.
+static inline float ray_box(const float *box, const float *origin, const float *inv_dir, float t_max) {
+  float t_near = 0.0f;
+  float t_far = t_max;
+  for (int k = 0; k < 3; k++) {
+    bool negative = inv_dir[k] < 0.0f;
+    float t0 = ((negative ? box[3 + k] : box[k]) - origin[k]) * inv_dir[k];
+    float t1 = ((negative ? box[k] : box[3 + k]) - origin[k]) * inv_dir[k];
+    t_near = max_f(t0, t_near);
+    t_far = min_f(t1, t_far);
+  }
+  return t_near <= t_far * BVH_ROBUST_SCALE ? t_near : FLT_MAX;
+}
+
+// A deferred node, with the box it decodes to.
+typedef struct {
+  uint32_t node;
+  float t;
+  float box[6];
+} StackEntry;
+
+bool qbvh_intersect(const QBVH *qbvh, const Sphere *spheres, const Ray *ray, Hit *hit) {
+  if (qbvh->num_nodes == 0) {
+    return false;
+  }
+
+  float inv_dir[3];
+  for (int k = 0; k < 3; k++) {
+    float d = ray->direction.data[k];
+    inv_dir[k] = 1.0f / (d == 0.0f ? 0.0f : d);
+  }
+  const float *origin = ray->origin.data;
+  TriangleRay tray;
+  if (qbvh->num_packets > 0) {
+    triangle_ray_init(&tray, ray);
+  }
+
+  bool found = false;
+  StackEntry stack[BVH_STACK_SIZE];
+  int stack_size = 0;
+  const QBVHNode *node = &qbvh->nodes[0];
+  float box[6], step[6];
+  plane_steps(qbvh->bounds, step);
+  decode(qbvh->bounds, step, node, box);
+  if (ray_box(box, origin, inv_dir, hit->t) == FLT_MAX) {
+    return false;
+  }
+
+  for (;;) {
+    if (node->count & QBVH_LEAF_TRIANGLES) {
+      uint32_t end = node->left_first + (node->count & ~QBVH_LEAF_TRIANGLES);
+      for (uint32_t p = node->left_first; p < end; p++) {
+        found |= triangle_packet_intersect(&qbvh->packets[p], &tray, hit);
+      }
+    } else if (node->count > 0 && qbvh->packed != NULL) {
+      float scale[3];
+      center_steps(box, scale);
+      for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+        Sphere sphere = unpack(&qbvh->packed[i], box, scale);
+        found |= sphere_intersect_closer(&sphere, ray, i, hit);
+      }
+    } else if (node->count > 0) {
+      for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+        uint32_t index = qbvh->prim_indices[i];
+        found |= sphere_intersect_closer(&spheres[index], ray, index, hit);
+      }
+    } else {
+      // Visit the nearer child first and defer the other, with its box.
+      uint32_t left = node->left_first;
+      float boxes[2][6];
+      plane_steps(box, step);
+      decode(box, step, &qbvh->nodes[left], boxes[0]);
+      decode(box, step, &qbvh->nodes[left + 1], boxes[1]);
+      float t_near = ray_box(boxes[0], origin, inv_dir, hit->t);
+      float t_far = ray_box(boxes[1], origin, inv_dir, hit->t);
+      int first = 0;
+      if (t_near > t_far) {
+        float tmp = t_near;
+        t_near = t_far;
+        t_far = tmp;
+        first = 1;
+      }
+      if (t_near != FLT_MAX) {
+        // Same tree as the BVH, so at most BVH_MAX_DEPTH deep.
+        if (t_far != FLT_MAX) {
+          StackEntry *entry = &stack[stack_size++];
+          entry->node = left + 1 - first;
+          entry->t = t_far;
+          memcpy(entry->box, boxes[1 - first], sizeof(entry->box));
+        }
+        node = &qbvh->nodes[left + first];
+        memcpy(box, boxes[first], sizeof(box));
+        continue;
+      }
+    }
+
+    // Pop, skipping nodes the current closest hit already rules out.
+    for (;;) {
+      if (stack_size == 0) {
+        return found;
+      }
+      const StackEntry *entry = &stack[--stack_size];
+      if (entry->t < hit->t) {
+        node = &qbvh->nodes[entry->node];
+        memcpy(box, entry->box, sizeof(box));
+        break;
+      }
+    }
+  }
+}
+
+Sphere qbvh_packed_sphere(const QBVH *qbvh, uint32_t slot) {
+  // The leaf: the last whose first slot is at most slot.
+  uint32_t lo = 0, hi = qbvh->num_packed_leaves;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (qbvh->nodes[qbvh->packed_leaves[mid]].left_first <= slot) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  uint32_t leaf = qbvh->packed_leaves[lo];
+
+  // Down to it from the root, decoding boxes on the way. In build order a
+  // subtree's nodes follow its root's pair, and come before the nodes of
+  // the pair after that, so the leaf lies under the right child exactly
+  // when it is numbered from the right child's own children on.
+  float box[6], step[6];
+  plane_steps(qbvh->bounds, step);
+  decode(qbvh->bounds, step, &qbvh->nodes[0], box);
+  uint32_t index = 0;
+  while (index != leaf) {
+    uint32_t left = qbvh->nodes[index].left_first;
+    const QBVHNode *right = &qbvh->nodes[left + 1];
+    index = leaf == left + 1 || (right->count == 0 && leaf >= right->left_first) ? left + 1 : left;
+    float child[6];
+    plane_steps(box, step);
+    decode(box, step, &qbvh->nodes[index], child);
+    memcpy(box, child, sizeof(box));
+  }
+  float scale[3];
+  center_steps(box, scale);
+  return unpack(&qbvh->packed[slot], box, scale);
+}
@@ -0,0 +1,605 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/render.h"
+#include "../include/scatter.h"
+#include "../include/shading.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../lib/stb_image.h"
+
+static int bg_width, bg_height, bg_channels;
+static unsigned char *background_image;
+static Environment environment;
+
+static const Vec3f background_color = { { 0.2f, 0.7f, 0.8f } };
+
+bool render_load_background(const char *path) {
+    render_free_background();
+    background_image = stbi_load(path, &bg_width, &bg_height, &bg_channels, 0);
+    if (background_image == NULL) {
+        bg_width = bg_height = bg_channels = 0;
+        return false;
+    }
+    if (!environment_init(&environment, background_image, bg_width, bg_height, bg_channels)) {
+        fprintf(stderr, "Background image can't be used as an environment light.\n");
+    }
+    return true;
+}
+
+void render_free_background(void) {
+    if (background_image != NULL) {
+        stbi_image_free(background_image);
+        background_image = NULL;
+    }
+    environment_free(&environment);
+}
+
+const Environment *render_environment(const Scene *scene) {
+    return scene->settings.environment > 0.0f && environment.radiance != NULL ? &environment : NULL;
+}
+
+#define RNG_STREAM_RENDER 0x5eedu
+
+float render_time_sample(const Scene *scene, int x, int y, uint32_t index) {
+    // Integer hash (the "lowbias32" finalizer) of the pixel coordinates.
+    uint32_t h = (uint32_t)x * 0x9e3779b1u ^ (uint32_t)y * 0x85ebca77u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    // Reversing the bits of the index gives its radical inverse in base 2.
+    uint32_t r = index;
+    r = (r << 16) | (r >> 16);
+    r = ((r & 0x00ff00ffu) << 8) | ((r & 0xff00ff00u) >> 8);
+    r = ((r & 0x0f0f0f0fu) << 4) | ((r & 0xf0f0f0f0u) >> 4);
+    r = ((r & 0x33333333u) << 2) | ((r & 0xccccccccu) >> 2);
+    r = ((r & 0x55555555u) << 1) | ((r & 0xaaaaaaaau) >> 1);
+    // Adding in 32-bit fixed point wraps around the frame for free.
+    return scene->settings.shutter * (float)((r + h) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Spawns the next ray of a path carrying `weight` of the current one, at
+// the time of the ray it continues, and returns its weighted contribution.
+static Vec3f trace_secondary(const Scene *scene, Vec3f origin, Vec3f direction, float time, int depth,
+                             Vec3f throughput, float weight, RenderContext *context) {
+    int next_depth = depth + 1;
+    if (next_depth > scene->settings.max_depth || next_depth > RENDER_MAX_DEPTH_LIMIT) {
+        context->stats->depth_terminated++;
+        return vec3f_init();
+    }
+
+    Vec3f next_throughput = scatter_scale(throughput, weight);
+    if (next_depth >= scene->settings.rr_depth) {
+        float survive = scatter_max_component(next_throughput);
+        if (survive < 1.0f) {
+            if (rng_next_float(&context->rng) >= survive) {
+                context->stats->roulette_terminated++;
+                return vec3f_init();
+            }
+            weight /= survive;
+            next_throughput = scatter_scale(next_throughput, 1.0f / survive);
+        }
+    }
+
+    Ray ray = ray_init_at(origin, direction, time);
+    return scatter_scale(cast_ray(scene, &ray, next_depth, next_throughput, context), weight);
+}
+
+void render_select_lights(const Scene *scene, Vec3f point, Vec3f normal, RenderContext *context,
+                          LightVisitor visit, void *user) {
+    const LightBVH *tree = &scene->light_bvh;
+    LightSampling mode = tree->num_nodes > 0 ? scene->settings.light_sampling : LIGHTS_EXACT;
+    size_t visited = 0;
+
+    if (mode == LIGHTS_CULL || mode == LIGHTS_TILED) {
+        visited = light_bvh_cull(tree, scene->lights, point, normal, scene->settings.light_threshold, visit, user);
+    } else if (mode == LIGHTS_SAMPLE) {
+        uint32_t light_index;
+        float pmf;
+        if (light_bvh_sample(tree, scene->lights, point, normal, &context->rng, &light_index, &pmf)) {
+            visit(light_index, pmf, user);
+            visited = 1;
+        }
+    } else {
+        for (size_t i = 0; i < scene->num_lights; i++) {
+            visit((uint32_t)i, 1.0f, user);
+        }
+        visited = scene->num_lights;
+    }
+
+    context->stats->shading_points++;
+    context->stats->lights_evaluated += visited;
+}
+
+float render_light_pmf(const Scene *scene, Vec3f point, Vec3f normal, uint32_t light_index) {
+    const LightBVH *tree = &scene->light_bvh;
+    if (tree->num_nodes == 0 || scene->settings.light_sampling == LIGHTS_EXACT) {
+        return 1.0f;
+    }
+    if (scene->settings.light_sampling == LIGHTS_SAMPLE) {
+        return light_bvh_pmf(tree, scene->lights, point, normal, light_index);
+    }
+    // A light that passes the cull test has ancestors that pass it too.
+    float bound = light_bound(&scene->lights[light_index], point, normal);
+    return bound > 0.0f && bound >= scene->settings.light_threshold ? 1.0f : 0.0f;
+}
+
+typedef struct {
+    const Light *lights;
+    Vec3f point;
+    Vec3f normal;
+    Vec3f view;
+    float exponent;
+    LightTerms terms;
+} DirectLighting;
+
+static void add_light(uint32_t light_index, float pmf, void *user) {
+    DirectLighting *direct = (DirectLighting *)user;
+    LightTerms terms = shading_light_terms(&direct->lights[light_index], direct->point, direct->normal, direct->view,
+                                           direct->exponent);
+    direct->terms.irradiance += terms.irradiance / pmf;
+    direct->terms.highlight += terms.highlight / pmf;
+}
+
+static inline bool needs_lights(const Material *material) {
+    return material_diffuse_weight(material) > 0.0f || material_has_specular(material);
+}
+
+static inline Vec3f toward_viewer(const Ray *ray) {
+    return scatter_scale(vec3f_normalize(ray->direction), -1.0f);
+}
+
+Vec3f render_direct_color(const Scene *scene, const Ray *ray, const HitRecord *record, RenderContext *context) {
+    const Material *material = record->material;
+    DirectLighting direct = { scene->lights, record->point, record->normal, toward_viewer(ray),
+                              material->specular_exponent, { 0.0f, 0.0f } };
+    if (needs_lights(material)) {
+        render_select_lights(scene, record->point, record->normal, context, add_light, &direct);
+    }
+    return shading_combine(material, direct.terms);
+}
+
+// Adds the mirror and glass contributions of a hit to its direct color.
+static Vec3f shade_surface(const Scene *scene, const Ray *ray, const HitRecord *record, Vec3f direct, int depth,
+                           Vec3f throughput, RenderContext *context) {
+    const Material *material = record->material;
+    Vec3f color = direct;
+    if (material->reflectivity <= 0.0f && material->transparency <= 0.0f) {
+        return color;
+    }
+
+    SurfaceLobes lobes;
+    scatter_lobes(material, ray->direction, record->normal, &lobes);
+    if (lobes.reflect > 0.0f) {
+        Vec3f reflected = scatter_reflect(material, ray->direction, &lobes, &context->rng);
+        color = vec3f_add(color, trace_secondary(scene, scatter_offset(record->point, lobes.normal, RAY_EPSILON), reflected,
+                                                 ray->time, depth, throughput, lobes.reflect, context));
+    }
+    if (lobes.refract > 0.0f) {
+        color = vec3f_add(color, trace_secondary(scene, scatter_offset(record->point, lobes.normal, -RAY_EPSILON),
+                                                 lobes.refracted, ray->time, depth, throughput, lobes.refract, context));
+    }
+    return color;
+}
+
+static Vec3f shade(const Scene *scene, const Ray *ray, const Hit *hit, int depth, Vec3f throughput, RenderContext *context) {
+    HitRecord record;
+    scene_resolve_hit(scene, ray, hit, &record);
+    return shade_surface(scene, ray, &record, render_direct_color(scene, ray, &record, context), depth, throughput,
+                         context);
+}
+
+Vec3f render_miss_color(const Scene *scene, const Ray *ray) {
+    const Environment *env = render_environment(scene);
+    if (env == NULL) {
+        return background_color;
+    }
+    return scatter_scale(environment_radiance(env, vec3f_normalize(ray->direction)), scene->settings.environment);
+}
+
+Vec3f render_screen_background(int x, int y, int width, int height) {
+    // Calculate the background image coordinates (stretching)
+    float bg_x = ((width - x) / (float)width) * bg_width;
+    float bg_y = (y / (float)height) * bg_height;
+    int bg_i = (int)bg_x;
+    int bg_j = (int)bg_y;
+    unsigned char r, g, b;
+
+    // Check if within background image bounds
+    if (background_image != NULL && bg_i >= 0 && bg_i < bg_width && bg_j >= 0 && bg_j < bg_height) {
+        int bg_index = bg_i + bg_j * bg_width;
+        r = background_image[bg_index * bg_channels];
+        g = background_image[bg_index * bg_channels + 1];
+        b = background_image[bg_index * bg_channels + 2];
+    } else {
+        // Use the background color if outside background image bounds
+        r = (unsigned char)(background_color.data[0] * 255);
+        g = (unsigned char)(background_color.data[1] * 255);
+        b = (unsigned char)(background_color.data[2] * 255);
+    }
+    return vec3f_init_values(r / 255.0, g / 255.0, b / 255.0);
+}
+
+Vec3f cast_ray(const Scene *scene, const Ray *ray, int depth, Vec3f throughput, RenderContext *context) {
+    Hit hit;
+    context->stats->rays[depth]++;
+
+    if (scene_trace(scene, ray, &hit)) {
+        return shade(scene, ray, &hit, depth, throughput, context);
+    }
+
+    // No intersection, return background color
+    return render_miss_color(scene, ray);
+}
+
+// Per-thread buffers for one tile: its primary hits in the order they are
+// traced, their batch slots, the tile's light list and the shading batch.
+typedef struct {
+    Hit *hits;
+    bool *found;
+    HitRecord *records;
+    uint32_t *slots; // UINT32_MAX for hits shaded one at a time
+    uint32_t *lights;
+    ShadingBatch batch;
+} TileScratch;
+
+// The buffers come from the thread's arena and go with it.
+static bool tile_scratch_init(TileScratch *scratch, Arena *arena, size_t samples, size_t num_lights) {
+    size_t lights = num_lights > 0 ? num_lights : 1;
+    scratch->hits = (Hit *)arena_alloc(arena, samples * sizeof(Hit));
+    scratch->found = (bool *)arena_alloc(arena, samples * sizeof(bool));
+    scratch->records = (HitRecord *)arena_alloc(arena, samples * sizeof(HitRecord));
+    scratch->slots = (uint32_t *)arena_alloc(arena, samples * sizeof(uint32_t));
+    scratch->lights = (uint32_t *)arena_alloc(arena, lights * sizeof(uint32_t));
+    bool batch = shading_batch_init_in(&scratch->batch, arena, samples);
+    return scratch->hits != NULL && scratch->found != NULL && scratch->records != NULL && scratch->slots != NULL &&
+           scratch->lights != NULL && batch;
+}
+
+// Renders pixels [x0, x1) x [y0, y1) in three steps: trace every primary
+// ray; light the hits, as one batch when they share a light list (the
+// tile's list with LIGHTS_TILED, every light with LIGHTS_EXACT) and one at
+// a time otherwise; then add mirror and glass rays per pixel.
+static void render_tile(const Scene *scene, const CameraFrame *camera, int x0, int y0, int x1, int y1,
+                        TileScratch *scratch, Vec3f *frame_buffer, RenderContext *context) {
+    const int width = scene->settings.width;
+    const int height = scene->settings.height;
+    const int super_sampling = scene->settings.super_sampling;
+    const Vec3f one = vec3f_init_values(1.0f, 1.0f, 1.0f);
+    const LightSampling mode = scene->light_bvh.num_nodes > 0 ? scene->settings.light_sampling : LIGHTS_EXACT;
+
+    float box_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float box_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    size_t sample = 0;
+    for (int j = y0; j < y1; j++) {
+        for (int i = x0; i < x1; i++) {
+            for (int s = 0; s < super_sampling; s++) {
+                for (int t = 0; t < super_sampling; t++) {
+                    Ray ray = render_primary_ray(scene, camera, i, j, s, t, super_sampling);
+                    Hit *hit = &scratch->hits[sample];
+                    context->stats->rays[0]++;
+                    scratch->found[sample] = scene_trace(scene, &ray, hit);
+                    if (scratch->found[sample]) {
+                        Vec3f point = ray_at(&ray, hit->t);
+                        for (int k = 0; k < 3; k++) {
+                            box_min[k] = fminf(box_min[k], point.data[k]);
+                            box_max[k] = fmaxf(box_max[k], point.data[k]);
+                        }
+                    }
+                    sample++;
+                }
+            }
+        }
+    }
+
+    // The light list every hit of the tile shares, if any.
+    const uint32_t *list = NULL;
+    size_t list_size = 0;
+    bool batched = false;
+    if (mode == LIGHTS_TILED && box_min[0] <= box_max[0]) {
+        list = scratch->lights;
+        list_size = light_bvh_collect_box(&scene->light_bvh, scene->lights, box_min, box_max,
+                                          scene->settings.light_threshold, scratch->lights);
+        context->stats->tiles++;
+        context->stats->tile_lights += list_size;
+        batched = true;
+    } else if (mode == LIGHTS_EXACT) {
+        list_size = scene->num_lights;
+        batched = true;
+    }
+
+    ShadingBatch *batch = &scratch->batch;
+    shading_batch_reset(batch);
+    sample = 0;
+    for (int j = y0; j < y1; j++) {
+        for (int i = x0; i < x1; i++) {
+            for (int s = 0; s < super_sampling; s++) {
+                for (int t = 0; t < super_sampling; t++) {
+                    scratch->slots[sample] = UINT32_MAX;
+                    if (scratch->found[sample]) {
+                        Ray ray = render_primary_ray(scene, camera, i, j, s, t, super_sampling);
+                        HitRecord *record = &scratch->records[sample];
+                        scene_resolve_hit(scene, &ray, &scratch->hits[sample], record);
+                        if (batched && needs_lights(record->material)) {
+                            scratch->slots[sample] = (uint32_t)shading_batch_add(batch, record->point, record->normal,
+                                                                                 toward_viewer(&ray), record->material);
+                        }
+                    }
+                    sample++;
+                }
+            }
+        }
+    }
+    if (batch->count > 0) {
+        shading_batch_lights(batch, scene->lights, list, list_size);
+        context->stats->shading_points += batch->count;
+        context->stats->lights_evaluated += batch->count * list_size;
+    }
+
+    sample = 0;
+    for (int j = y0; j < y1; j++) {
+        for (int i = x0; i < x1; i++) {
+            // Seeded per pixel so the image doesn't depend on scheduling.
+            rng_seed(&context->rng, (uint64_t)j * width + i, RNG_STREAM_RENDER);
+            Vec3f *pixel = &frame_buffer[i + j * width];
+
+            // Supersampling loop (sub-pixels for anti-aliasing)
+            for (int s = 0; s < super_sampling; s++) {
+                for (int t = 0; t < super_sampling; t++) {
+                    Vec3f sample_color;
+                    if (scratch->found[sample]) {
+                        Ray ray = render_primary_ray(scene, camera, i, j, s, t, super_sampling);
+                        const HitRecord *record = &scratch->records[sample];
+                        Vec3f direct;
+                        if (scratch->slots[sample] != UINT32_MAX) {
+                            direct = shading_combine(record->material, shading_batch_terms(batch, scratch->slots[sample]));
+                        } else if (batched) {
+                            direct = record->material->emission; // nothing for the lights to act on
+                        } else {
+                            direct = render_direct_color(scene, &ray, record, context);
+                        }
+                        sample_color = shade_surface(scene, &ray, record, direct, 0, one, context);
+                    } else {
+                        // No intersection, use the stretched background image
+                        sample_color = render_screen_background(i, j, width, height);
+                    }
+                    *pixel = vec3f_add(*pixel, sample_color);
+                    sample++;
+                }
+            }
+
+            // Average the accumulated pixel color
+            pixel->data[0] /= (super_sampling * super_sampling);
+            pixel->data[1] /= (super_sampling * super_sampling);
+            pixel->data[2] /= (super_sampling * super_sampling);
+        }
+    }
+}
+
+// What the threads rendering a frame share.
+typedef struct {
+    const Scene *scene;
+    CameraFrame camera;
+    Vec3f *frame_buffer;
+    size_t tile_samples;
+    int tiles_x;
+} Frame;
+
+// One thread's state for a frame: its counters, its view of the scene and
+// its tile scratch.
+typedef struct {
+    RenderStats stats;
+    RenderContext context;
+    Scene view;
+    const Scene *scene;
+    Arena arena;
+    TileScratch scratch;
+    bool ready;
+} FrameThread;
+
+static void frame_thread_begin(FrameThread *thread, const Frame *frame) {
+    memset(&thread->stats, 0, sizeof(thread->stats));
+    thread->context.stats = &thread->stats;
+    thread->scene = scene_for_thread(frame->scene, &thread->view);
+    arena_init(&thread->arena, "tile scratch", 0);
+    thread->ready = tile_scratch_init(&thread->scratch, &thread->arena, frame->tile_samples, frame->scene->num_lights);
+    if (!thread->ready) {
+        fprintf(stderr, "Failed to allocate tile buffers.\n");
+    }
+}
+
+static void frame_thread_tile(FrameThread *thread, const Frame *frame, int tile) {
+    if (!thread->ready) {
+        return;
+    }
+    const int width = frame->scene->settings.width;
+    const int height = frame->scene->settings.height;
+    int x0 = (tile % frame->tiles_x) * RENDER_TILE_SIZE;
+    int y0 = (tile / frame->tiles_x) * RENDER_TILE_SIZE;
+    int x1 = x0 + RENDER_TILE_SIZE < width ? x0 + RENDER_TILE_SIZE : width;
+    int y1 = y0 + RENDER_TILE_SIZE < height ? y0 + RENDER_TILE_SIZE : height;
+    render_tile(thread->scene, &frame->camera, x0, y0, x1, y1, &thread->scratch, frame->frame_buffer,
+                &thread->context);
+}
+
+static void frame_thread_end(FrameThread *thread) {
+    thread->stats.scratch_peak = thread->arena.peak;
+    arena_free(&thread->arena);
+}
+
+// Set by render_set_workers; NULL for OpenMP.
+static Workers *render_workers;
+
+void render_set_workers(Workers *workers) {
+    render_workers = workers;
+}
+
+Workers *render_get_workers(void) {
+    return render_workers;
+}
+
+typedef struct {
+    const Frame *frame;
+    Workers *workers;
+    RenderStats *stats; // per worker
+} WorkerFrame;
+
+static uint64_t render_worker(int worker, void *arg) {
+    WorkerFrame *job = (WorkerFrame *)arg;
+    FrameThread thread;
+    frame_thread_begin(&thread, job->frame);
+    uint32_t tile;
+    while (workers_next_item(job->workers, worker, &tile)) {
+        frame_thread_tile(&thread, job->frame, (int)tile);
+    }
+    frame_thread_end(&thread);
+    job->stats[worker] = thread.stats;
+    return render_stats_total(&thread.stats);
+}
+
+// The frame on render_workers; false, with nothing rendered, when not one
+// of them could be started.
+static bool render_frame_workers(const Frame *frame, int num_tiles, RenderStats *total) {
+    Workers *workers = render_workers;
+    RenderStats *stats = (RenderStats *)calloc(workers->num_workers, sizeof(RenderStats));
+    if (stats == NULL) {
+        return false;
+    }
+    WorkerFrame job = { frame, workers, stats };
+    int ran = workers_run(workers, (uint32_t)num_tiles, render_worker, &job);
+    if (ran > 0 && ran < workers->num_workers) {
+        fprintf(stderr, "Started %d of %d render workers.\n", ran, workers->num_workers);
+    }
+    for (int w = 0; w < ran; w++) {
+        render_stats_add(total, &stats[w]);
+    }
+    free(stats);
+    return ran > 0;
+}
+
+uint64_t render_frame(const Scene *scene, Vec3f *frame_buffer, RenderStats *stats) {
+    const int width = scene->settings.width;
+    const int height = scene->settings.height;
+    const int super_sampling = scene->settings.super_sampling;
+    const int tiles_x = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    const int tiles_y = (height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+
+    Frame frame;
+    frame.scene = scene;
+    camera_frame_init(&frame.camera, &scene->camera, width, height);
+    frame.frame_buffer = frame_buffer;
+    frame.tile_samples = (size_t)RENDER_TILE_SIZE * RENDER_TILE_SIZE * super_sampling * super_sampling;
+    frame.tiles_x = tiles_x;
+
+    RenderStats total;
+    memset(&total, 0, sizeof(total));
+
+    if (render_workers == NULL || !render_frame_workers(&frame, tiles_x * tiles_y, &total)) {
+#pragma omp parallel
+        {
+            FrameThread thread;
+            frame_thread_begin(&thread, &frame);
+
+#pragma omp for schedule(dynamic)
+            for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+                frame_thread_tile(&thread, &frame, tile);
+            }
+
+            frame_thread_end(&thread);
+#pragma omp critical
+            render_stats_add(&total, &thread.stats);
+        }
+    }
+
+    if (stats != NULL) {
+        *stats = total;
+    }
+    return render_stats_total(&total);
+}
+
+void render_stats_add(RenderStats *into, const RenderStats *from) {
+    for (int d = 0; d <= RENDER_MAX_DEPTH_LIMIT; d++) {
+        into->rays[d] += from->rays[d];
+    }
+    into->shadow_rays += from->shadow_rays;
+    into->shading_points += from->shading_points;
+    into->lights_evaluated += from->lights_evaluated;
+    into->tiles += from->tiles;
+    into->tile_lights += from->tile_lights;
+    into->roulette_terminated += from->roulette_terminated;
+    into->depth_terminated += from->depth_terminated;
+    if (from->scratch_peak > into->scratch_peak) {
+        into->scratch_peak = from->scratch_peak;
+    }
+}
+
+uint64_t render_stats_total(const RenderStats *stats) {
+    uint64_t rays = stats->shadow_rays;
+    for (int d = 0; d <= RENDER_MAX_DEPTH_LIMIT; d++) {
+        rays += stats->rays[d];
+    }
+    return rays;
+}
+
+void render_stats_report(const RenderStats *stats, FILE *out) {
+    fprintf(out, "rays by depth:");
+    for (int d = 0; d <= RENDER_MAX_DEPTH_LIMIT && stats->rays[d] > 0; d++) {
+        fprintf(out, " %d=%llu", d, (unsigned long long)stats->rays[d]);
+    }
+    if (stats->shadow_rays > 0) {
+        fprintf(out, " shadow=%llu", (unsigned long long)stats->shadow_rays);
+    }
+    if (stats->shading_points > 0) {
+        fprintf(out, "  lights/shade=%.2f", (double)stats->lights_evaluated / (double)stats->shading_points);
+    }
+    if (stats->tiles > 0) {
+        fprintf(out, "  lights/tile=%.2f", (double)stats->tile_lights / (double)stats->tiles);
+    }
+    fprintf(out, "  (roulette stopped %llu, max depth stopped %llu)",
+            (unsigned long long)stats->roulette_terminated, (unsigned long long)stats->depth_terminated);
+    if (stats->scratch_peak > 0) {
+        fprintf(out, "  scratch peak=%.1f KB", stats->scratch_peak / 1e3);
+    }
+    fprintf(out, "\n");
+}
+
+static unsigned char to_byte(float value) {
+    if (!(value > 0.0f)) {
+        return 0;
+    }
+    return value >= 1.0f ? 255 : (unsigned char)(value * 255);
+}
+
+bool write_ppm(const char *path, const Vec3f *frame_buffer, int width, int height) {
+    FILE *ofs = fopen(path, "wb");
+    if (ofs == NULL) {
+        fprintf(stderr, "Failed to open output file.\n");
+        return false;
+    }
+
+    fprintf(ofs, "P6\n%d %d\n255\n", width, height);
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            int index = i + j * width;
+
+            // Convert the pixel color to the 0-255 range; reflections can
+            // push a pixel past 1.
+            unsigned char r = to_byte(frame_buffer[index].data[0]);
+            unsigned char g = to_byte(frame_buffer[index].data[1]);
+            unsigned char b = to_byte(frame_buffer[index].data[2]);
+
+            // Write to the file (note the reversed order for j)
+            fwrite(&r, 1, 1, ofs);
+            fwrite(&g, 1, 1, ofs);
+            fwrite(&b, 1, 1, ofs);
+        }
+    }
+
+    fclose(ofs);
+    return true;
+}
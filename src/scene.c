@@ -0,0 +1,512 @@
+#include "../include/render.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "../include/bvh_cache.h"
+#include "../include/perf.h"
+#include "../include/topology.h"
+
+void scene_set_defaults(Scene *scene) {
+    scene->camera = camera_default();
+    scene->settings.width = WIDTH;
+    scene->settings.height = HEIGHT;
+    scene->settings.super_sampling = SUPER_SAMPLING;
+    scene->settings.max_depth = MAX_DEPTH;
+    scene->settings.rr_depth = RR_DEPTH;
+    scene->settings.integrator = INTEGRATOR_WHITTED;
+    scene->settings.samples = PATH_SAMPLES;
+    scene->settings.light_sampling = LIGHTS_CULL;
+    scene->settings.light_threshold = LIGHT_THRESHOLD;
+    scene->settings.environment = 0.0f;
+    scene->settings.shutter = 1.0f;
+    scene->settings.accel = ACCEL_AUTO;
+    arena_init(&scene->arena, "scene", 0);
+}
+
+static void free_replicas(Scene *scene) {
+    for (uint32_t n = 0; n < scene->num_replicas; n++) {
+        arena_free(&scene->replica_arenas[n]);
+    }
+    free(scene->bvh_replicas);
+    free(scene->replica_arenas);
+    scene->bvh_replicas = NULL;
+    scene->replica_arenas = NULL;
+    scene->num_replicas = 0;
+}
+
+// The scene's BVH, with the arena its arrays live in when scene_build_bvh
+// built it there, and its copies.
+static void free_bvh(Scene *scene) {
+    free_replicas(scene);
+    bvh_free(&scene->bvh);
+    arena_free(&scene->arena);
+}
+
+bool scene_init_demo(Scene *scene) {
+    const size_t num_spheres = 11;
+    const size_t num_lights = 1;
+
+    const size_t num_materials = 3;
+
+    memset(scene, 0, sizeof(*scene));
+    scene_set_defaults(scene);
+    scene->spheres = (Sphere *)malloc(num_spheres * sizeof(Sphere));
+    scene->materials = (Material *)malloc(num_materials * sizeof(Material));
+    scene->lights = (Light *)malloc(num_lights * sizeof(Light));
+    if (scene->spheres == NULL || scene->materials == NULL || scene->lights == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        scene_free(scene);
+        return false;
+    }
+    scene->num_spheres = num_spheres;
+    scene->num_materials = num_materials;
+    scene->num_lights = num_lights;
+
+    Sphere *spheres = scene->spheres;
+    const uint32_t red_velvet = 0;
+    const uint32_t ivory = 1;
+    const uint32_t radio = 2;
+
+    scene->materials[red_velvet] = material_diffuse(vec3f_init_values(0.3, 0.1, 0.1));
+    scene->materials[ivory] = material_diffuse(vec3f_init_values(0.4, 0.4, 0.3));
+    scene->materials[radio] = material_diffuse(vec3f_init_values(0.5, 0.5, 0.5));
+    scene->materials[red_velvet].specular_color = vec3f_init_values(0.1, 0.1, 0.1);
+    scene->materials[red_velvet].specular_exponent = 10.0f;
+    scene->materials[ivory].specular_color = vec3f_init_values(0.3, 0.3, 0.3);
+    scene->materials[ivory].specular_exponent = 50.0f;
+
+    spheres[0] = sphere_init(vec3f_init_values(4.0f, 3.0f, -10.0f), 2.0f, red_velvet);
+    spheres[1] = sphere_init(vec3f_init_values(6.0f, 1.5f, -8.0f), 1.5f, ivory);
+    spheres[2] = sphere_init(vec3f_init_values(2.5f, 2.0f, -15.0f), 2.0f, ivory);
+    spheres[3] = sphere_init(vec3f_init_values(0.0f, -2.0f, -12.0f), 1.0f, red_velvet);
+    spheres[4] = sphere_init(vec3f_init_values(-7.0f, 8.0f, -10.0f), 2.0f, red_velvet);
+    spheres[5] = sphere_init(vec3f_init_values(-5.0f, 5.0f, -13.0f), 2.0f, ivory);
+    spheres[6] = sphere_init(vec3f_init_values(-5.0f, 3.0f, -13.0f), 2.0f, ivory);
+    spheres[7] = sphere_init(vec3f_init_values(-3.0f, 5.0f, -13.0f), 1.5f, red_velvet);
+    spheres[8] = sphere_init(vec3f_init_values(-5.0f, 5.0f, -13.0f), 1.5f, red_velvet);
+    spheres[9] = sphere_init(vec3f_init_values(-4.3f, -5.0f, -13.0f), 1.5f, ivory);
+    spheres[10] = sphere_init(vec3f_init_values(-5.0f, -5.0f, -13.0f), 1.5f, radio);
+
+    scene->lights[0].position = vec3f_init_values(-50, 20, 20);
+    scene->lights[0].intensity = 1.5f;
+    scene->lights[0].radius = 0.0f;
+    scene->lights[0].range = 0.0f;
+
+    return true;
+}
+
+void scene_free(Scene *scene) {
+    free_bvh(scene);
+    grid_free(&scene->grid);
+    qbvh_free(&scene->qbvh);
+    light_bvh_free(&scene->light_bvh);
+    bvh_free(&scene->instance_bvh);
+    mesh_free(&scene->mesh); // no-op for a mapped mesh
+    shapes_free(&scene->shapes); // only the BVHs for mapped shapes
+    for (size_t i = 0; i < scene->num_objects; i++) {
+        scene_object_free(&scene->objects[i]);
+    }
+    free(scene->objects); // allocated even for a mapped scene
+    if (scene->mapping != NULL) {
+        munmap(scene->mapping, scene->mapping_size);
+    } else {
+        free(scene->spheres);
+        free(scene->sphere_motion);
+        free(scene->materials);
+        free(scene->lights);
+        free(scene->instances);
+    }
+    memset(scene, 0, sizeof(*scene));
+    scene_set_defaults(scene);
+}
+
+bool scene_build_bvh(Scene *scene, bool use_cache) {
+    free_bvh(scene);
+    bvh_free(&scene->instance_bvh);
+    for (int kind = 0; kind < SHAPE_KINDS; kind++) {
+        bvh_free(&scene->shapes.bvh[kind]);
+    }
+    if (use_cache && scene->sphere_motion == NULL &&
+        scene->num_spheres + scene->mesh.num_triangles >= BVH_CACHE_MIN_PRIMS) {
+        if (!bvh_cache_load_or_build_in(&scene->bvh, &scene->arena, scene->spheres, scene->num_spheres,
+                                        &scene->mesh)) {
+            return false;
+        }
+        return scene_build_instances(scene) && scene_build_shapes(scene);
+    }
+    double start = perf_now_seconds();
+    if (!bvh_build_in(&scene->bvh, &scene->arena, scene->spheres, scene->num_spheres, scene->sphere_motion,
+                      &scene->mesh)) {
+        return false;
+    }
+    fprintf(stderr, "Built BVH: %u nodes over %zu %sspheres and %zu triangles in %.1f ms\n", scene->bvh.num_nodes,
+            scene->num_spheres, scene->sphere_motion != NULL ? "moving " : "", scene->mesh.num_triangles,
+            (perf_now_seconds() - start) * 1e3);
+    return scene_build_instances(scene) && scene_build_shapes(scene);
+}
+
+typedef struct {
+    BVH *copy;
+    Arena *arena;
+    const BVH *bvh;
+    bool copied;
+} ReplicaCopy;
+
+static void copy_replica(void *arg) {
+    ReplicaCopy *replica = (ReplicaCopy *)arg;
+    replica->copied = bvh_copy_in(replica->copy, replica->arena, replica->bvh);
+}
+
+bool scene_replicate_bvh(Scene *scene) {
+    free_replicas(scene);
+    const Topology *topology = topology_get();
+    if (scene->bvh.num_nodes == 0 || topology->num_nodes < 2) {
+        fprintf(stderr, "Not replicating the BVH: %s.\n",
+                scene->bvh.num_nodes == 0 ? "the scene is not traced through one" : "a single NUMA node");
+        return true;
+    }
+    double start = perf_now_seconds();
+    scene->bvh_replicas = (BVH *)calloc(topology->num_nodes, sizeof(BVH));
+    scene->replica_arenas = (Arena *)calloc(topology->num_nodes, sizeof(Arena));
+    if (scene->bvh_replicas == NULL || scene->replica_arenas == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free_replicas(scene);
+        return false;
+    }
+    scene->num_replicas = topology->num_nodes;
+    for (uint32_t n = 0; n < topology->num_nodes; n++) {
+        arena_init(&scene->replica_arenas[n], "BVH replica", 0);
+        scene->replica_arenas[n].huge_pages = scene->arena.huge_pages;
+        ReplicaCopy replica = { &scene->bvh_replicas[n], &scene->replica_arenas[n], &scene->bvh, false };
+        if (!topology_run_on_node(topology, n, copy_replica, &replica) || !replica.copied) {
+            fprintf(stderr, "Failed to copy the BVH to NUMA node %u.\n", n);
+            free_replicas(scene);
+            return false;
+        }
+    }
+    fprintf(stderr, "Replicated the BVH on %u NUMA nodes, %.1f MB each, in %.1f ms\n", scene->num_replicas,
+            scene->replica_arenas[0].used / 1e6, (perf_now_seconds() - start) * 1e3);
+    return true;
+}
+
+const Scene *scene_for_thread(const Scene *scene, Scene *view) {
+    if (scene->num_replicas == 0) {
+        return scene;
+    }
+    *view = *scene;
+    view->bvh = scene->bvh_replicas[topology_current_node(topology_get())];
+    return view;
+}
+
+Accel scene_select_accel(const Scene *scene) {
+    Accel accel = scene->settings.accel;
+    if (scene->sphere_motion != NULL) {
+        return ACCEL_BVH;
+    }
+    if (accel == ACCEL_QBVH || accel == ACCEL_COMPACT) {
+        return accel;
+    }
+    if (scene->mesh.num_triangles > 0) {
+        return ACCEL_BVH;
+    }
+    if (accel != ACCEL_AUTO) {
+        return accel;
+    }
+    if (scene->num_spheres < GRID_AUTO_MIN_SPHERES) {
+        return ACCEL_BVH;
+    }
+    double sum = 0.0, sum2 = 0.0;
+    for (size_t i = 0; i < scene->num_spheres; i++) {
+        double r = scene->spheres[i].radius;
+        sum += r;
+        sum2 += r * r;
+    }
+    double mean = sum / (double)scene->num_spheres;
+    double variance = fmax(sum2 / (double)scene->num_spheres - mean * mean, 0.0);
+    if (sqrt(variance) > GRID_AUTO_MAX_RADIUS_SPREAD * mean) {
+        return ACCEL_BVH;
+    }
+    return grid_occupancy(scene->spheres, scene->num_spheres) >= GRID_AUTO_MIN_OCCUPANCY ? ACCEL_GRID : ACCEL_BVH;
+}
+
+bool scene_build_accel(Scene *scene, bool use_cache) {
+    Accel accel = scene_select_accel(scene);
+    if (accel == ACCEL_BVH && (scene->settings.accel == ACCEL_QBVH || scene->settings.accel == ACCEL_COMPACT)) {
+        fprintf(stderr, "Quantized BVHs hold still geometry only; using the BVH.\n");
+    } else if (accel == ACCEL_BVH && scene->settings.accel != ACCEL_AUTO && scene->settings.accel != ACCEL_BVH) {
+        fprintf(stderr, "Grids hold still spheres only; using the BVH.\n");
+    }
+    grid_free(&scene->grid);
+    qbvh_free(&scene->qbvh);
+    if (accel == ACCEL_BVH || accel == ACCEL_QBVH || accel == ACCEL_COMPACT) {
+        if (scene->bvh.num_nodes == 0 && !scene_build_bvh(scene, use_cache)) {
+            return false;
+        }
+        if (accel != ACCEL_BVH && !qbvh_fits(&scene->bvh)) {
+            fprintf(stderr, "BVH has a leaf too large to quantize; using the BVH.\n");
+            accel = ACCEL_BVH;
+        }
+        if (scene->arena.huge_pages && scene->arena.head == NULL && accel == ACCEL_BVH) {
+            // From a binary load: mapped from the file, in small pages.
+            BVH mapped = scene->bvh;
+            if (!bvh_copy_in(&scene->bvh, &scene->arena, &mapped)) {
+                fprintf(stderr, "Memory allocation failed.\n");
+                scene->bvh = mapped;
+                return false;
+            }
+            bvh_free(&mapped); // leaves the scene's mapping alone
+        }
+        if (accel == ACCEL_BVH) {
+            return scene_build_instances(scene) && scene_build_shapes(scene);
+        }
+        // Quantized from the full BVH, which is then dropped.
+        double start = perf_now_seconds();
+        if (!qbvh_build(&scene->qbvh, &scene->bvh)) {
+            return false;
+        }
+        fprintf(stderr, "Quantized BVH: %u nodes, %.1f MB (%.1f MB at full precision) in %.1f ms\n",
+                scene->qbvh.num_nodes, scene->qbvh.num_nodes * sizeof(QBVHNode) / 1e6,
+                scene->bvh.num_nodes * sizeof(BVHNode) / 1e6, (perf_now_seconds() - start) * 1e3);
+        free_bvh(scene);
+        if (accel == ACCEL_COMPACT) {
+            start = perf_now_seconds();
+            if (qbvh_pack_spheres(&scene->qbvh, scene->spheres, scene->num_spheres)) {
+                fprintf(stderr, "Packed %zu spheres: %.1f MB (%.1f MB with their prim indices in full) in %.1f ms\n",
+                        scene->num_spheres, scene->num_spheres * sizeof(PackedSphere) / 1e6,
+                        scene->num_spheres * (sizeof(Sphere) + sizeof(uint32_t)) / 1e6,
+                        (perf_now_seconds() - start) * 1e3);
+                if (scene->mapping == NULL) {
+                    free(scene->spheres);
+                }
+                scene->spheres = NULL;
+            } else {
+                fprintf(stderr, "Keeping the spheres in full.\n");
+            }
+        }
+        return scene_build_instances(scene) && scene_build_shapes(scene);
+    }
+
+    free_bvh(scene);
+    double start = perf_now_seconds();
+    const Grid *grid = &scene->grid;
+    if (!grid_build(&scene->grid, scene->spheres, scene->num_spheres, accel == ACCEL_HASHED_GRID)) {
+        return false;
+    }
+    fprintf(stderr, "Built %s grid: %dx%dx%d cells, %u references over %zu spheres, %.1f MB in %.1f ms\n",
+            accel == ACCEL_HASHED_GRID ? "hashed" : "uniform", grid->dims[0], grid->dims[1], grid->dims[2],
+            grid->num_refs, scene->num_spheres, grid_bytes(grid) / 1e6, (perf_now_seconds() - start) * 1e3);
+    return scene_build_instances(scene) && scene_build_shapes(scene);
+}
+
+bool scene_build_shapes(Scene *scene) {
+    const Shapes *shapes = &scene->shapes;
+    for (int kind = 0; kind < SHAPE_KINDS; kind++) {
+        if (shapes->bvh[kind].num_nodes > 0) {
+            return true;
+        }
+    }
+    return shapes_build(&scene->shapes);
+}
+
+bool scene_build_instances(Scene *scene) {
+    if (scene->num_instances == 0 || scene->instance_bvh.num_nodes > 0) {
+        return true;
+    }
+    double start = perf_now_seconds();
+    size_t unique = scene->num_instances * sizeof(Instance);
+    for (size_t i = 0; i < scene->num_objects; i++) {
+        if (!scene_object_build(&scene->objects[i])) {
+            return false;
+        }
+        unique += scene_object_bytes(&scene->objects[i]);
+    }
+    if (!instances_build_bvh(&scene->instance_bvh, scene->instances, scene->num_instances, scene->objects)) {
+        return false;
+    }
+    // What the same scene would take with every instance copied into the
+    // scene's own arrays and BVH.
+    size_t flattened = 0;
+    size_t primitives = 0;
+    for (size_t i = 0; i < scene->num_instances; i++) {
+        const SceneObject *object = &scene->objects[scene->instances[i].object];
+        flattened += scene_object_bytes(object);
+        primitives += object->num_spheres + object->mesh.num_triangles;
+    }
+    const BVH *top = &scene->instance_bvh;
+    unique += top->num_nodes * sizeof(BVHNode) + top->num_prims * sizeof(uint32_t);
+    fprintf(stderr, "Built instance BVHs: %zu objects, %zu instances (%zu primitives) in %.1f ms, %.1f MB"
+            " (%.1f MB flattened)\n", scene->num_objects, scene->num_instances, primitives,
+            (perf_now_seconds() - start) * 1e3, unique / 1e6, flattened / 1e6);
+    return true;
+}
+
+bool scene_build_light_bvh(Scene *scene) {
+    light_bvh_free(&scene->light_bvh);
+    double start = perf_now_seconds();
+    if (!light_bvh_build(&scene->light_bvh, scene->lights, scene->num_lights)) {
+        fprintf(stderr, "Failed to build the light BVH.\n");
+        return false;
+    }
+    if (scene->num_lights > LIGHT_BVH_MAX_LEAF_SIZE) {
+        fprintf(stderr, "Built light BVH: %u nodes over %zu lights in %.1f ms\n",
+                scene->light_bvh.num_nodes, scene->num_lights, (perf_now_seconds() - start) * 1e3);
+    }
+    return true;
+}
+
+// The scene's own geometry, through its grid or BVH or by brute force, then the
+// instances and the shapes.
+static bool intersect_all(const Scene *scene, const Ray *ray, Hit *hit) {
+    bool found;
+    if (grid_built(&scene->grid)) {
+        found = grid_intersect(&scene->grid, scene->spheres, ray, hit);
+    } else if (scene->qbvh.num_nodes > 0) {
+        found = qbvh_intersect(&scene->qbvh, scene->spheres, ray, hit);
+    } else if (scene->bvh.num_nodes == 0) {
+        found = geometry_intersect_all(scene->spheres, scene->num_spheres, scene->sphere_motion, &scene->mesh, ray,
+                                       hit);
+    } else {
+        found = bvh_intersect(&scene->bvh, scene->spheres, scene->sphere_motion, ray, hit);
+    }
+    if (scene->num_instances > 0) {
+        found |= instances_intersect(&scene->instance_bvh, scene->instances, scene->num_instances, scene->objects,
+                                     ray, hit);
+    }
+    if (shapes_total(&scene->shapes) > 0) {
+        uint32_t first_shape = (uint32_t)(scene->num_spheres + scene->mesh.num_triangles);
+        found |= shapes_intersect(&scene->shapes, first_shape, ray, hit);
+    }
+    return found;
+}
+
+bool scene_trace(const Scene *scene, const Ray *ray, Hit *hit) {
+    hit->t = SCENE_MAX_DISTANCE;
+    hit->instance_id = HIT_NO_INSTANCE;
+    return intersect_all(scene, ray, hit);
+}
+
+bool scene_occluded(const Scene *scene, const Ray *ray, float max_t) {
+    Hit hit;
+    hit.t = max_t;
+    hit.instance_id = HIT_NO_INSTANCE;
+    return intersect_all(scene, ray, &hit);
+}
+
+// Spheres, mesh and material table a hit's prim_id refers to: the scene's
+// own, or those of the instanced object.
+typedef struct {
+    const Sphere *spheres;
+    size_t num_spheres;
+    const Vec3f *motion;
+    const Mesh *mesh;
+    const Material *materials;
+} Geometry;
+
+static void resolve_triangle(const Geometry *geometry, const Ray *ray, const Hit *hit, HitRecord *record) {
+    const Mesh *mesh = geometry->mesh;
+    const Triangle *triangle = &mesh->triangles[hit->prim_id - geometry->num_spheres];
+    Vec3f a = mesh->vertices[triangle->v[0]];
+    Vec3f b = mesh->vertices[triangle->v[1]];
+    Vec3f c = mesh->vertices[triangle->v[2]];
+    record->material = &geometry->materials[triangle->material_index];
+    record->point = ray_at(ray, hit->t);
+
+    Vec3f face = vec3f_normalize(vec3f_cross(vec3f_sub(b, a), vec3f_sub(c, a)));
+    Vec3f normal = face;
+    if (mesh->normals != NULL) {
+        // Traversal keeps no barycentrics; recover them with the same test.
+        TriangleRay tray;
+        float t, weights[3];
+        triangle_ray_init(&tray, ray);
+        if (triangle_intersect(&tray, a, b, c, INFINITY, &t, weights)) {
+            Vec3f smooth = vec3f_init();
+            for (int corner = 0; corner < 3; corner++) {
+                Vec3f n = mesh->normals[triangle->v[corner]];
+                for (int k = 0; k < DIMENSION; k++) {
+                    smooth.data[k] += weights[corner] * n.data[k];
+                }
+            }
+            if (vec3f_dot(smooth, smooth) > 0.0f) {
+                normal = vec3f_normalize(smooth);
+            }
+        }
+    }
+    if (record->material->transparency <= 0.0f && vec3f_dot(face, ray->direction) > 0.0f) {
+        for (int k = 0; k < DIMENSION; k++) {
+            normal.data[k] = -normal.data[k];
+        }
+    }
+    record->normal = normal;
+}
+
+// record->point is set already.
+static void resolve_sphere(const Sphere *sphere, const Material *materials, HitRecord *record) {
+    // |point - center| is the radius, so scaling beats a normalize.
+    float inv_radius = 1.0f / sphere->radius;
+    for (int k = 0; k < DIMENSION; k++) {
+        record->normal.data[k] = (record->point.data[k] - sphere->center.data[k]) * inv_radius;
+    }
+    record->material = &materials[sphere->material_index];
+}
+
+static void resolve_geometry(const Geometry *geometry, const Ray *ray, const Hit *hit, HitRecord *record) {
+    if (hit->prim_id >= geometry->num_spheres) {
+        resolve_triangle(geometry, ray, hit, record);
+        return;
+    }
+    Sphere sphere = geometry->spheres[hit->prim_id];
+    if (geometry->motion != NULL) {
+        sphere = sphere_at(&sphere, geometry->motion[hit->prim_id], ray->time);
+    }
+    record->point = ray_at(ray, hit->t);
+    resolve_sphere(&sphere, geometry->materials, record);
+}
+
+// Shapes follow the triangle rule: opaque surfaces face the ray, glass
+// keeps its outward (or stored) normal. Field spheres shade like spheres,
+// always with the outward normal.
+static void resolve_shape(const Scene *scene, const Ray *ray, const Hit *hit, HitRecord *record) {
+    const Shapes *shapes = &scene->shapes;
+    uint32_t index = hit->prim_id - (uint32_t)(scene->num_spheres + scene->mesh.num_triangles);
+    uint32_t material_index;
+    record->point = ray_at(ray, hit->t);
+    shapes_resolve(shapes, index, record->point, &record->normal, &material_index);
+    record->material = &scene->materials[material_index];
+    bool field = index >= shapes_total(shapes) - shapes->count[SHAPE_FIELD];
+    if (!field && record->material->transparency <= 0.0f && vec3f_dot(record->normal, ray->direction) > 0.0f) {
+        for (int k = 0; k < DIMENSION; k++) {
+            record->normal.data[k] = -record->normal.data[k];
+        }
+    }
+}
+
+void scene_resolve_hit(const Scene *scene, const Ray *ray, const Hit *hit, HitRecord *record) {
+    if (hit->instance_id == HIT_NO_INSTANCE && hit->prim_id >= scene->num_spheres + scene->mesh.num_triangles) {
+        resolve_shape(scene, ray, hit, record);
+        return;
+    }
+    if (hit->instance_id == HIT_NO_INSTANCE && hit->prim_id < scene->num_spheres && scene->qbvh.packed != NULL) {
+        Sphere sphere = qbvh_packed_sphere(&scene->qbvh, hit->prim_id);
+        record->point = ray_at(ray, hit->t);
+        resolve_sphere(&sphere, scene->materials, record);
+        return;
+    }
+    if (hit->instance_id == HIT_NO_INSTANCE) {
+        Geometry geometry = { scene->spheres, scene->num_spheres, scene->sphere_motion, &scene->mesh,
+                              scene->materials };
+        resolve_geometry(&geometry, ray, hit, record);
+        return;
+    }
+    // Resolve along the object space ray, at the object space distance, then
+    // take the point from the world ray so it sits exactly where traversal
+    // found it.
+    const Instance *instance = &scene->instances[hit->instance_id];
+    const SceneObject *object = &scene->objects[instance->object];
+    Geometry geometry = { object->spheres, object->num_spheres, NULL, &object->mesh, scene->materials };
+    Ray local;
+    Hit local_hit = *hit;
+    local_hit.t = hit->t * instance_ray_to_object(instance, ray, &local);
+    resolve_geometry(&geometry, &local, &local_hit, record);
+    record->point = ray_at(ray, hit->t);
+    record->normal = instance_normal_to_world(instance, record->normal);
+}
@@ -0,0 +1,641 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/perf.h"
+#include "../include/render.h"
+#include "../include/scene_io.h"
+
+#define SCENE_BINARY_MAGIC "RTSCENE"
+#define SCENE_BINARY_BYTE_ORDER 0x01020304u
+#define SCENE_BINARY_ALIGNMENT 64
+#define SCENE_BINARY_MAX_SECTIONS 32
+
+typedef enum {
+    SECTION_SPHERES = 1,
+    SECTION_LIGHTS,
+    SECTION_BVH_NODES,
+    SECTION_BVH_INDICES,
+    SECTION_MATERIALS,
+    SECTION_MESH_VERTICES,
+    SECTION_MESH_NORMALS,
+    SECTION_MESH_TRIANGLES,
+    SECTION_BVH_PACKETS,
+    SECTION_OBJECTS,
+    SECTION_OBJECT_SPHERES,
+    SECTION_OBJECT_VERTICES,
+    SECTION_OBJECT_NORMALS,
+    SECTION_OBJECT_TRIANGLES,
+    SECTION_INSTANCES,
+    SECTION_SPHERE_MOTION,
+    SECTION_BVH_END_BOUNDS,
+    SECTION_PLANES,
+    SECTION_BOXES,
+    SECTION_DISCS,
+    SECTION_CYLINDERS,
+    SECTION_SPHERE_FIELDS
+} SectionId;
+
+// Where one object's geometry lies in the OBJECT_* sections. Object BVHs
+// and the instance BVH are not stored; scene_build_instances rebuilds them.
+typedef struct {
+    uint64_t first_sphere;
+    uint64_t num_spheres;
+    uint64_t first_vertex;
+    uint64_t num_vertices;
+    uint64_t first_triangle;
+    uint64_t num_triangles;
+} ObjectRecord;
+
+// Every object's arrays gathered into the OBJECT_* sections' layout.
+typedef struct {
+    ObjectRecord *records;
+    Sphere *spheres;
+    Vec3f *vertices;
+    Vec3f *normals; // NULL when no object has normals
+    Triangle *triangles;
+    size_t num_spheres, num_vertices, num_triangles;
+} ObjectArrays;
+
+static void object_arrays_free(ObjectArrays *arrays) {
+    free(arrays->records);
+    free(arrays->spheres);
+    free(arrays->vertices);
+    free(arrays->normals);
+    free(arrays->triangles);
+}
+
+static bool object_arrays_gather(ObjectArrays *arrays, const Scene *scene) {
+    memset(arrays, 0, sizeof(*arrays));
+    bool any_normals = false;
+    for (size_t i = 0; i < scene->num_objects; i++) {
+        const SceneObject *object = &scene->objects[i];
+        arrays->num_spheres += object->num_spheres;
+        arrays->num_vertices += object->mesh.num_vertices;
+        arrays->num_triangles += object->mesh.num_triangles;
+        any_normals = any_normals || object->mesh.normals != NULL;
+    }
+    // One element at least, so that an empty array isn't mistaken for a
+    // failed allocation.
+    arrays->records = (ObjectRecord *)malloc((scene->num_objects + 1) * sizeof(ObjectRecord));
+    arrays->spheres = (Sphere *)malloc((arrays->num_spheres + 1) * sizeof(Sphere));
+    arrays->vertices = (Vec3f *)malloc((arrays->num_vertices + 1) * sizeof(Vec3f));
+    arrays->normals = any_normals ? (Vec3f *)calloc(arrays->num_vertices + 1, sizeof(Vec3f)) : NULL;
+    arrays->triangles = (Triangle *)malloc((arrays->num_triangles + 1) * sizeof(Triangle));
+    if (arrays->records == NULL || arrays->spheres == NULL || arrays->vertices == NULL ||
+        (any_normals && arrays->normals == NULL) || arrays->triangles == NULL) {
+        object_arrays_free(arrays);
+        return false;
+    }
+
+    size_t spheres = 0, vertices = 0, triangles = 0;
+    for (size_t i = 0; i < scene->num_objects; i++) {
+        const SceneObject *object = &scene->objects[i];
+        const Mesh *mesh = &object->mesh;
+        arrays->records[i] = (ObjectRecord){ spheres, object->num_spheres, vertices, mesh->num_vertices, triangles,
+                                             mesh->num_triangles };
+        if (object->num_spheres > 0) {
+            memcpy(arrays->spheres + spheres, object->spheres, object->num_spheres * sizeof(Sphere));
+        }
+        if (mesh->num_vertices > 0) {
+            memcpy(arrays->vertices + vertices, mesh->vertices, mesh->num_vertices * sizeof(Vec3f));
+        }
+        if (mesh->normals != NULL) {
+            memcpy(arrays->normals + vertices, mesh->normals, mesh->num_vertices * sizeof(Vec3f));
+        }
+        if (mesh->num_triangles > 0) {
+            memcpy(arrays->triangles + triangles, mesh->triangles, mesh->num_triangles * sizeof(Triangle));
+        }
+        spheres += object->num_spheres;
+        vertices += mesh->num_vertices;
+        triangles += mesh->num_triangles;
+    }
+    return true;
+}
+
+typedef struct {
+    uint32_t id;
+    uint32_t element_size;
+    uint64_t offset;
+    uint64_t count;
+} SectionEntry;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t num_sections;
+    float camera_position[3];
+    float camera_look_at[3];
+    float camera_fov;
+    int32_t width;
+    int32_t height;
+    int32_t super_sampling;
+    int32_t max_depth;
+    int32_t rr_depth;
+    int32_t integrator;
+    int32_t samples;
+    int32_t light_sampling;
+    float light_threshold;
+    float environment;
+    float shutter;
+    int32_t accel;
+    SectionEntry sections[SCENE_BINARY_MAX_SECTIONS];
+} SceneBinaryHeader;
+
+typedef struct {
+    uint32_t id;
+    uint32_t element_size;
+    uint64_t count;
+    const void *data;
+} SectionSource;
+
+static uint64_t align_up(uint64_t value) {
+    return (value + SCENE_BINARY_ALIGNMENT - 1) & ~(uint64_t)(SCENE_BINARY_ALIGNMENT - 1);
+}
+
+bool scene_save_binary(const Scene *scene, const char *path) {
+    if (scene->spheres == NULL && scene->num_spheres > 0) {
+        fprintf(stderr, "Cannot save %s: the scene's spheres were packed into its quantized BVH.\n", path);
+        return false;
+    }
+    SectionSource sources[SCENE_BINARY_MAX_SECTIONS];
+    uint32_t num_sources = 0;
+    sources[num_sources++] = (SectionSource){ SECTION_SPHERES, sizeof(Sphere), scene->num_spheres, scene->spheres };
+    if (scene->sphere_motion != NULL) {
+        sources[num_sources++] = (SectionSource){ SECTION_SPHERE_MOTION, sizeof(Vec3f), scene->num_spheres, scene->sphere_motion };
+    }
+    sources[num_sources++] = (SectionSource){ SECTION_MATERIALS, sizeof(Material), scene->num_materials, scene->materials };
+    sources[num_sources++] = (SectionSource){ SECTION_LIGHTS, sizeof(Light), scene->num_lights, scene->lights };
+    const Mesh *mesh = &scene->mesh;
+    if (mesh->num_triangles > 0) {
+        sources[num_sources++] = (SectionSource){ SECTION_MESH_VERTICES, sizeof(Vec3f), mesh->num_vertices, mesh->vertices };
+        sources[num_sources++] = (SectionSource){ SECTION_MESH_TRIANGLES, sizeof(Triangle), mesh->num_triangles, mesh->triangles };
+        if (mesh->normals != NULL) {
+            sources[num_sources++] = (SectionSource){ SECTION_MESH_NORMALS, sizeof(Vec3f), mesh->num_vertices, mesh->normals };
+        }
+    }
+    ObjectArrays objects;
+    if (!object_arrays_gather(&objects, scene)) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return false;
+    }
+    if (scene->num_objects > 0) {
+        sources[num_sources++] = (SectionSource){ SECTION_OBJECTS, sizeof(ObjectRecord), scene->num_objects, objects.records };
+        sources[num_sources++] = (SectionSource){ SECTION_OBJECT_SPHERES, sizeof(Sphere), objects.num_spheres, objects.spheres };
+        sources[num_sources++] = (SectionSource){ SECTION_OBJECT_VERTICES, sizeof(Vec3f), objects.num_vertices, objects.vertices };
+        sources[num_sources++] = (SectionSource){ SECTION_OBJECT_TRIANGLES, sizeof(Triangle), objects.num_triangles, objects.triangles };
+        if (objects.normals != NULL) {
+            sources[num_sources++] = (SectionSource){ SECTION_OBJECT_NORMALS, sizeof(Vec3f), objects.num_vertices, objects.normals };
+        }
+        sources[num_sources++] = (SectionSource){ SECTION_INSTANCES, sizeof(Instance), scene->num_instances, scene->instances };
+    }
+    if (scene->bvh.num_nodes > 0) {
+        sources[num_sources++] = (SectionSource){ SECTION_BVH_NODES, sizeof(BVHNode), scene->bvh.num_nodes, scene->bvh.nodes };
+        sources[num_sources++] = (SectionSource){ SECTION_BVH_INDICES, sizeof(uint32_t), scene->bvh.num_prims, scene->bvh.prim_indices };
+        if (scene->bvh.num_packets > 0) {
+            sources[num_sources++] = (SectionSource){ SECTION_BVH_PACKETS, sizeof(TrianglePacket), scene->bvh.num_packets, scene->bvh.packets };
+        }
+        if (scene->bvh.end_bounds != NULL) {
+            sources[num_sources++] = (SectionSource){ SECTION_BVH_END_BOUNDS, sizeof(BVHBounds), scene->bvh.num_nodes, scene->bvh.end_bounds };
+        }
+    }
+    // Shape BVHs are cheap to rebuild and not stored.
+    const Shapes *shapes = &scene->shapes;
+    if (shapes->count[SHAPE_PLANE] > 0) {
+        sources[num_sources++] = (SectionSource){ SECTION_PLANES, sizeof(Plane), shapes->count[SHAPE_PLANE], shapes->planes };
+    }
+    if (shapes->count[SHAPE_BOX] > 0) {
+        sources[num_sources++] = (SectionSource){ SECTION_BOXES, sizeof(Box), shapes->count[SHAPE_BOX], shapes->boxes };
+    }
+    if (shapes->count[SHAPE_DISC] > 0) {
+        sources[num_sources++] = (SectionSource){ SECTION_DISCS, sizeof(Disc), shapes->count[SHAPE_DISC], shapes->discs };
+    }
+    if (shapes->count[SHAPE_CYLINDER] > 0) {
+        sources[num_sources++] = (SectionSource){ SECTION_CYLINDERS, sizeof(Cylinder), shapes->count[SHAPE_CYLINDER], shapes->cylinders };
+    }
+    if (shapes->count[SHAPE_FIELD] > 0) {
+        sources[num_sources++] = (SectionSource){ SECTION_SPHERE_FIELDS, sizeof(SphereField), shapes->count[SHAPE_FIELD], shapes->fields };
+    }
+
+    SceneBinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_BINARY_MAGIC, sizeof(SCENE_BINARY_MAGIC));
+    header.version = SCENE_BINARY_VERSION;
+    header.byte_order = SCENE_BINARY_BYTE_ORDER;
+    header.header_size = sizeof(header);
+    header.num_sections = num_sources;
+    for (int k = 0; k < 3; k++) {
+        header.camera_position[k] = scene->camera.position.data[k];
+        header.camera_look_at[k] = scene->camera.look_at.data[k];
+    }
+    header.camera_fov = scene->camera.fov;
+    header.width = scene->settings.width;
+    header.height = scene->settings.height;
+    header.super_sampling = scene->settings.super_sampling;
+    header.max_depth = scene->settings.max_depth;
+    header.rr_depth = scene->settings.rr_depth;
+    header.integrator = (int32_t)scene->settings.integrator;
+    header.samples = scene->settings.samples;
+    header.light_sampling = (int32_t)scene->settings.light_sampling;
+    header.light_threshold = scene->settings.light_threshold;
+    header.environment = scene->settings.environment;
+    header.shutter = scene->settings.shutter;
+    header.accel = (int32_t)scene->settings.accel;
+
+    uint64_t offset = align_up(sizeof(header));
+    for (uint32_t i = 0; i < num_sources; i++) {
+        header.sections[i].id = sources[i].id;
+        header.sections[i].element_size = sources[i].element_size;
+        header.sections[i].count = sources[i].count;
+        header.sections[i].offset = offset;
+        offset = align_up(offset + sources[i].count * sources[i].element_size);
+    }
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open output file %s.\n", path);
+        object_arrays_free(&objects);
+        return false;
+    }
+
+    static const char padding[SCENE_BINARY_ALIGNMENT] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    uint64_t written = sizeof(header);
+    for (uint32_t i = 0; i < num_sources && ok; i++) {
+        uint64_t pad = header.sections[i].offset - written;
+        size_t bytes = (size_t)(sources[i].count * sources[i].element_size);
+        ok = fwrite(padding, 1, (size_t)pad, out) == pad &&
+             (bytes == 0 || fwrite(sources[i].data, 1, bytes, out) == bytes);
+        written = header.sections[i].offset + bytes;
+    }
+    if (fclose(out) != 0) {
+        ok = false;
+    }
+    object_arrays_free(&objects);
+    if (!ok) {
+        fprintf(stderr, "Failed to write scene file %s.\n", path);
+        return false;
+    }
+    fprintf(stderr, "Wrote %s: %zu spheres, %zu triangles, %zu shapes, %zu instances, %zu materials, %zu lights%s, %.1f MB\n", path,
+            scene->num_spheres, mesh->num_triangles, shapes_total(shapes), scene->num_instances, scene->num_materials, scene->num_lights, scene->bvh.num_nodes > 0 ? ", BVH" : "", written / 1e6);
+    return true;
+}
+
+static const SectionEntry *find_section(const SceneBinaryHeader *header, uint32_t id) {
+    for (uint32_t i = 0; i < header->num_sections; i++) {
+        if (header->sections[i].id == id) {
+            return &header->sections[i];
+        }
+    }
+    return NULL;
+}
+
+static bool validate_header(const SceneBinaryHeader *header, size_t file_size, const char *path) {
+    if (memcmp(header->magic, SCENE_BINARY_MAGIC, sizeof(SCENE_BINARY_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a binary scene.\n", path);
+        return false;
+    }
+    if (header->byte_order != SCENE_BINARY_BYTE_ORDER) {
+        fprintf(stderr, "%s: written on a machine with a different byte order.\n", path);
+        return false;
+    }
+    if (header->version != SCENE_BINARY_VERSION || header->header_size != sizeof(*header)) {
+        fprintf(stderr, "%s: binary scene version %u, expected %u; re-convert it from text.\n",
+                path, header->version, SCENE_BINARY_VERSION);
+        return false;
+    }
+    if (header->num_sections > SCENE_BINARY_MAX_SECTIONS || header->width < 1 || header->height < 1 ||
+        (int64_t)header->width * header->height > RENDER_MAX_PIXELS ||
+        header->super_sampling < 1 || header->max_depth < 0 || header->max_depth > RENDER_MAX_DEPTH_LIMIT ||
+        header->rr_depth < 0 || (header->integrator != INTEGRATOR_WHITTED && header->integrator != INTEGRATOR_PATH) ||
+        header->samples < 1 || header->light_sampling < LIGHTS_EXACT || header->light_sampling > LIGHTS_TILED ||
+        !(header->light_threshold >= 0.0f) || !(header->environment >= 0.0f) ||
+        !(header->shutter >= 0.0f && header->shutter <= 1.0f) || header->accel < ACCEL_AUTO ||
+        header->accel > ACCEL_COMPACT) {
+        fprintf(stderr, "%s: corrupt header.\n", path);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->num_sections; i++) {
+        const SectionEntry *section = &header->sections[i];
+        uint32_t expected_size;
+        switch (section->id) {
+        case SECTION_SPHERES: expected_size = sizeof(Sphere); break;
+        case SECTION_MATERIALS: expected_size = sizeof(Material); break;
+        case SECTION_LIGHTS: expected_size = sizeof(Light); break;
+        case SECTION_BVH_NODES: expected_size = sizeof(BVHNode); break;
+        case SECTION_BVH_INDICES: expected_size = sizeof(uint32_t); break;
+        case SECTION_MESH_VERTICES: expected_size = sizeof(Vec3f); break;
+        case SECTION_MESH_NORMALS: expected_size = sizeof(Vec3f); break;
+        case SECTION_MESH_TRIANGLES: expected_size = sizeof(Triangle); break;
+        case SECTION_BVH_PACKETS: expected_size = sizeof(TrianglePacket); break;
+        case SECTION_OBJECTS: expected_size = sizeof(ObjectRecord); break;
+        case SECTION_OBJECT_SPHERES: expected_size = sizeof(Sphere); break;
+        case SECTION_OBJECT_VERTICES: expected_size = sizeof(Vec3f); break;
+        case SECTION_OBJECT_NORMALS: expected_size = sizeof(Vec3f); break;
+        case SECTION_OBJECT_TRIANGLES: expected_size = sizeof(Triangle); break;
+        case SECTION_INSTANCES: expected_size = sizeof(Instance); break;
+        case SECTION_SPHERE_MOTION: expected_size = sizeof(Vec3f); break;
+        case SECTION_BVH_END_BOUNDS: expected_size = sizeof(BVHBounds); break;
+        case SECTION_PLANES: expected_size = sizeof(Plane); break;
+        case SECTION_BOXES: expected_size = sizeof(Box); break;
+        case SECTION_DISCS: expected_size = sizeof(Disc); break;
+        case SECTION_CYLINDERS: expected_size = sizeof(Cylinder); break;
+        case SECTION_SPHERE_FIELDS: expected_size = sizeof(SphereField); break;
+        default: expected_size = 0; break; // unknown sections are skipped
+        }
+        if (expected_size != 0 && section->element_size != expected_size) {
+            fprintf(stderr, "%s: section %u has element size %u, expected %u.\n",
+                    path, section->id, section->element_size, expected_size);
+            return false;
+        }
+        if (section->offset % SCENE_BINARY_ALIGNMENT != 0 || section->offset > file_size ||
+            (section->element_size > 0 && section->count > (file_size - section->offset) / section->element_size)) {
+            fprintf(stderr, "%s: section %u lies outside the file.\n", path, section->id);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Points the scene's objects and instances into the OBJECT_* and INSTANCES
+// sections, after checking every range and object index against them.
+static bool map_objects(Scene *scene, const SceneBinaryHeader *header, char *base, const char *path) {
+    const SectionEntry *records = find_section(header, SECTION_OBJECTS);
+    const SectionEntry *spheres = find_section(header, SECTION_OBJECT_SPHERES);
+    const SectionEntry *vertices = find_section(header, SECTION_OBJECT_VERTICES);
+    const SectionEntry *normals = find_section(header, SECTION_OBJECT_NORMALS);
+    const SectionEntry *triangles = find_section(header, SECTION_OBJECT_TRIANGLES);
+    const SectionEntry *instances = find_section(header, SECTION_INSTANCES);
+    if (records == NULL) {
+        return true;
+    }
+    if (spheres == NULL || vertices == NULL || triangles == NULL || instances == NULL ||
+        (normals != NULL && normals->count != vertices->count) || records->count > UINT32_MAX) {
+        fprintf(stderr, "%s: missing or inconsistent object sections.\n", path);
+        return false;
+    }
+
+    const ObjectRecord *record = (const ObjectRecord *)(base + records->offset);
+    scene->objects = (SceneObject *)calloc(records->count + 1, sizeof(SceneObject));
+    if (scene->objects == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return false;
+    }
+    scene->num_objects = (size_t)records->count;
+    for (size_t i = 0; i < scene->num_objects; i++, record++) {
+        if (record->first_sphere > spheres->count || record->num_spheres > spheres->count - record->first_sphere ||
+            record->first_vertex > vertices->count || record->num_vertices > vertices->count - record->first_vertex ||
+            record->first_triangle > triangles->count ||
+            record->num_triangles > triangles->count - record->first_triangle) {
+            fprintf(stderr, "%s: object %zu lies outside its sections.\n", path, i);
+            return false;
+        }
+        // Mapped arrays have no capacity, so scene_object_free leaves them.
+        SceneObject *object = &scene->objects[i];
+        object->spheres = (Sphere *)(base + spheres->offset) + record->first_sphere;
+        object->num_spheres = (size_t)record->num_spheres;
+        object->mesh.vertices = (Vec3f *)(base + vertices->offset) + record->first_vertex;
+        object->mesh.normals = normals != NULL ? (Vec3f *)(base + normals->offset) + record->first_vertex : NULL;
+        object->mesh.num_vertices = (size_t)record->num_vertices;
+        object->mesh.triangles = (Triangle *)(base + triangles->offset) + record->first_triangle;
+        object->mesh.num_triangles = (size_t)record->num_triangles;
+    }
+
+    scene->instances = instances->count > 0 ? (Instance *)(base + instances->offset) : NULL;
+    scene->num_instances = (size_t)instances->count;
+    for (size_t i = 0; i < scene->num_instances; i++) {
+        if (scene->instances[i].object >= scene->num_objects) {
+            fprintf(stderr, "%s: instance %zu of a missing object.\n", path, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool spheres_valid(const Sphere *spheres, size_t count, size_t num_materials) {
+    for (size_t i = 0; i < count; i++) {
+        if (spheres[i].material_index >= num_materials) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool triangles_valid(const Mesh *mesh, size_t num_materials) {
+    for (size_t i = 0; i < mesh->num_triangles; i++) {
+        const Triangle *triangle = &mesh->triangles[i];
+        if (triangle->v[0] >= mesh->num_vertices || triangle->v[1] >= mesh->num_vertices ||
+            triangle->v[2] >= mesh->num_vertices || triangle->material_index >= num_materials) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool shapes_valid(const Shapes *shapes, size_t num_materials) {
+    for (size_t i = 0; i < shapes->count[SHAPE_PLANE]; i++) {
+        if (shapes->planes[i].material_index >= num_materials) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < shapes->count[SHAPE_BOX]; i++) {
+        if (shapes->boxes[i].material_index >= num_materials) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < shapes->count[SHAPE_DISC]; i++) {
+        if (shapes->discs[i].material_index >= num_materials) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < shapes->count[SHAPE_CYLINDER]; i++) {
+        if (shapes->cylinders[i].material_index >= num_materials) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < shapes->count[SHAPE_FIELD]; i++) {
+        const SphereField *field = &shapes->fields[i];
+        if (field->material_count < 1 || field->material_index >= num_materials ||
+            field->material_count > num_materials - field->material_index) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// What the header and section checks can't see: every material and vertex
+// index the geometry holds, and the prebuilt BVH's tree (see bvh_validate).
+// Checked once here so rendering can index the mapped arrays unchecked.
+static bool validate_contents(const Scene *scene, const char *path) {
+    if (!spheres_valid(scene->spheres, scene->num_spheres, scene->num_materials) ||
+        !triangles_valid(&scene->mesh, scene->num_materials) || !shapes_valid(&scene->shapes, scene->num_materials)) {
+        fprintf(stderr, "%s: geometry refers to a missing material or vertex.\n", path);
+        return false;
+    }
+    for (size_t i = 0; i < scene->num_objects; i++) {
+        const SceneObject *object = &scene->objects[i];
+        if (!spheres_valid(object->spheres, object->num_spheres, scene->num_materials) ||
+            !triangles_valid(&object->mesh, scene->num_materials)) {
+            fprintf(stderr, "%s: object %zu refers to a missing material or vertex.\n", path, i);
+            return false;
+        }
+    }
+    if (scene->bvh.num_nodes > 0 && !bvh_validate(&scene->bvh, scene->num_spheres, scene->mesh.num_triangles)) {
+        fprintf(stderr, "%s: corrupt prebuilt BVH.\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool scene_load_binary(Scene *scene, const char *path) {
+    memset(scene, 0, sizeof(*scene));
+    scene_set_defaults(scene);
+    double start = perf_now_seconds();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open scene file %s.\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SceneBinaryHeader)) {
+        fprintf(stderr, "%s: too small to be a binary scene.\n", path);
+        close(fd);
+        return false;
+    }
+
+    // Private writable mapping: the arrays are used in place, and anything
+    // that touches them (there is nothing today) gets copy-on-write pages
+    // rather than modifying the file.
+    size_t size = (size_t)st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Failed to map scene file %s.\n", path);
+        return false;
+    }
+
+    const SceneBinaryHeader *header = (const SceneBinaryHeader *)mapping;
+    if (!validate_header(header, size, path)) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    char *base = (char *)mapping;
+    const SectionEntry *spheres = find_section(header, SECTION_SPHERES);
+    const SectionEntry *materials = find_section(header, SECTION_MATERIALS);
+    const SectionEntry *lights = find_section(header, SECTION_LIGHTS);
+    const SectionEntry *nodes = find_section(header, SECTION_BVH_NODES);
+    const SectionEntry *indices = find_section(header, SECTION_BVH_INDICES);
+    const SectionEntry *vertices = find_section(header, SECTION_MESH_VERTICES);
+    const SectionEntry *normals = find_section(header, SECTION_MESH_NORMALS);
+    const SectionEntry *triangles = find_section(header, SECTION_MESH_TRIANGLES);
+    const SectionEntry *packets = find_section(header, SECTION_BVH_PACKETS);
+    const SectionEntry *motion = find_section(header, SECTION_SPHERE_MOTION);
+    const SectionEntry *end_bounds = find_section(header, SECTION_BVH_END_BOUNDS);
+    uint64_t num_triangles = triangles != NULL ? triangles->count : 0;
+    // A BVH over moving spheres must come with its end of frame bounds.
+    if (spheres == NULL || materials == NULL || lights == NULL || (nodes == NULL) != (indices == NULL) ||
+        (indices != NULL && indices->count != spheres->count + num_triangles) ||
+        (nodes != NULL && (nodes->count > UINT32_MAX || indices->count > UINT32_MAX)) ||
+        (packets != NULL && packets->count > UINT32_MAX) ||
+        (vertices == NULL) != (triangles == NULL) || (normals != NULL && (vertices == NULL || normals->count != vertices->count)) ||
+        (packets != NULL && nodes == NULL) || (motion != NULL && motion->count != spheres->count) ||
+        (end_bounds != NULL && (nodes == NULL || end_bounds->count != nodes->count)) ||
+        (nodes != NULL && nodes->count > 0 && (motion != NULL && motion->count > 0) != (end_bounds != NULL))) {
+        fprintf(stderr, "%s: missing or inconsistent sections.\n", path);
+        munmap(mapping, size);
+        return false;
+    }
+
+    scene->mapping = mapping;
+    scene->mapping_size = size;
+    scene->spheres = spheres->count > 0 ? (Sphere *)(base + spheres->offset) : NULL;
+    scene->num_spheres = (size_t)spheres->count;
+    scene->sphere_motion = motion != NULL && motion->count > 0 ? (Vec3f *)(base + motion->offset) : NULL;
+    scene->materials = materials->count > 0 ? (Material *)(base + materials->offset) : NULL;
+    scene->num_materials = (size_t)materials->count;
+    scene->lights = lights->count > 0 ? (Light *)(base + lights->offset) : NULL;
+    scene->num_lights = (size_t)lights->count;
+    if (triangles != NULL && triangles->count > 0) {
+        scene->mesh.vertices = (Vec3f *)(base + vertices->offset);
+        scene->mesh.num_vertices = (size_t)vertices->count;
+        scene->mesh.normals = normals != NULL ? (Vec3f *)(base + normals->offset) : NULL;
+        scene->mesh.triangles = (Triangle *)(base + triangles->offset);
+        scene->mesh.num_triangles = (size_t)triangles->count;
+    }
+    if (nodes != NULL && nodes->count > 0) {
+        scene->bvh.nodes = (BVHNode *)(base + nodes->offset);
+        scene->bvh.num_nodes = (uint32_t)nodes->count;
+        scene->bvh.prim_indices = (uint32_t *)(base + indices->offset);
+        scene->bvh.num_prims = (uint32_t)indices->count;
+        if (packets != NULL && packets->count > 0) {
+            scene->bvh.packets = (TrianglePacket *)(base + packets->offset);
+            scene->bvh.num_packets = (uint32_t)packets->count;
+        }
+        if (end_bounds != NULL) {
+            scene->bvh.end_bounds = (BVHBounds *)(base + end_bounds->offset);
+        }
+        scene->bvh.owns_memory = false;
+    }
+    // Mapped arrays have no capacity, so shapes_free leaves them.
+    static const uint32_t shape_sections[SHAPE_KINDS] = { SECTION_PLANES, SECTION_BOXES, SECTION_DISCS,
+                                                          SECTION_CYLINDERS, SECTION_SPHERE_FIELDS };
+    void **shape_arrays[SHAPE_KINDS] = { (void **)&scene->shapes.planes, (void **)&scene->shapes.boxes,
+                                         (void **)&scene->shapes.discs, (void **)&scene->shapes.cylinders,
+                                         (void **)&scene->shapes.fields };
+    for (int kind = 0; kind < SHAPE_KINDS; kind++) {
+        const SectionEntry *section = find_section(header, shape_sections[kind]);
+        if (section != NULL && section->count > 0) {
+            *shape_arrays[kind] = base + section->offset;
+            scene->shapes.count[kind] = (size_t)section->count;
+        }
+    }
+    if (!map_objects(scene, header, base, path) || !validate_contents(scene, path)) {
+        scene_free(scene);
+        return false;
+    }
+
+    scene->camera.position = vec3f_init_values(header->camera_position[0], header->camera_position[1], header->camera_position[2]);
+    scene->camera.look_at = vec3f_init_values(header->camera_look_at[0], header->camera_look_at[1], header->camera_look_at[2]);
+    scene->camera.fov = header->camera_fov;
+    scene->settings.width = header->width;
+    scene->settings.height = header->height;
+    scene->settings.super_sampling = header->super_sampling;
+    scene->settings.max_depth = header->max_depth;
+    scene->settings.rr_depth = header->rr_depth;
+    scene->settings.integrator = (Integrator)header->integrator;
+    scene->settings.samples = header->samples;
+    scene->settings.light_sampling = (LightSampling)header->light_sampling;
+    scene->settings.light_threshold = header->light_threshold;
+    scene->settings.environment = header->environment;
+    scene->settings.shutter = header->shutter;
+    scene->settings.accel = (Accel)header->accel;
+
+    fprintf(stderr, "Mapped %s: %zu spheres, %zu triangles, %zu shapes, %zu instances, %zu materials, %zu lights%s, %.1f MB in %.3f ms\n", path,
+            scene->num_spheres, scene->mesh.num_triangles, shapes_total(&scene->shapes), scene->num_instances, scene->num_materials, scene->num_lights, scene->bvh.num_nodes > 0 ? ", prebuilt BVH" : "", size / 1e6,
+            (perf_now_seconds() - start) * 1e3);
+    return true;
+}
+
+bool scene_load(Scene *scene, const char *path) {
+    char magic[sizeof(SCENE_BINARY_MAGIC)] = { 0 };
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Failed to open scene file %s.\n", path);
+        return false;
+    }
+    size_t read = fread(magic, 1, sizeof(magic), in);
+    fclose(in);
+
+    if (read == sizeof(magic) && memcmp(magic, SCENE_BINARY_MAGIC, sizeof(magic)) == 0) {
+        return scene_load_binary(scene, path);
+    }
+    return scene_load_text(scene, path);
+}
@@ -0,0 +1,317 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/rng.h"
+#include "../include/render.h"
+
+// All generated geometry lives in a fixed box in front of the default camera,
+// so the image stays comparable while the sphere count grows. Sphere radii
+// shrink with the count to keep the volume fraction roughly constant.
+#define GEN_MIN_X -20.0f
+#define GEN_MAX_X 20.0f
+#define GEN_MIN_Y -15.0f
+#define GEN_MAX_Y 15.0f
+#define GEN_MIN_Z -60.0f
+#define GEN_MAX_Z -20.0f
+#define GEN_FILL_FRACTION 0.15f
+#define GEN_NESTED_BRANCHING 8
+
+// Independent streams so changing e.g. the light count doesn't move spheres.
+// STREAM_MOTION stays clear of the nested levels' STREAM_CLUSTERS + level.
+enum { STREAM_MATERIALS = 1, STREAM_SPHERES, STREAM_LIGHTS, STREAM_CLUSTERS, STREAM_MOTION = 64 };
+
+void scene_gen_params_default(SceneGenParams *params) {
+    params->seed = 1;
+    params->num_spheres = 1000;
+    params->num_lights = 1;
+    params->light_range = 0.0f;
+    params->motion = 0.0f;
+    params->num_materials = 8;
+    params->distribution = SCENE_DIST_UNIFORM;
+}
+
+static float gaussian(Rng *rng) {
+    // Box-Muller; one of the pair is thrown away to keep the stream simple.
+    float u1 = fmaxf(rng_next_float(rng), 1e-7f);
+    float u2 = rng_next_float(rng);
+    return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2);
+}
+
+static Vec3f random_point_in_box(Rng *rng) {
+    return vec3f_init_values(rng_range(rng, GEN_MIN_X, GEN_MAX_X),
+                             rng_range(rng, GEN_MIN_Y, GEN_MAX_Y),
+                             rng_range(rng, GEN_MIN_Z, GEN_MAX_Z));
+}
+
+static float base_radius(size_t num_spheres) {
+    float volume = (GEN_MAX_X - GEN_MIN_X) * (GEN_MAX_Y - GEN_MIN_Y) * (GEN_MAX_Z - GEN_MIN_Z);
+    float per_sphere = volume * GEN_FILL_FRACTION / (float)num_spheres;
+    return cbrtf(per_sphere * 3.0f / (4.0f * (float)M_PI));
+}
+
+static void generate_materials(Material *materials, size_t count, uint64_t seed) {
+    Rng rng;
+    rng_seed(&rng, seed, STREAM_MATERIALS);
+    for (size_t i = 0; i < count; i++) {
+        materials[i] = material_diffuse(vec3f_init_values(rng_range(&rng, 0.1f, 0.9f),
+                                                          rng_range(&rng, 0.1f, 0.9f),
+                                                          rng_range(&rng, 0.1f, 0.9f)));
+        // Roughly one material in eight is a (possibly glossy) mirror and
+        // one in eight is glass, so secondary rays get exercised too. The
+        // rest get a Blinn-Phong highlight of random size.
+        uint32_t kind = rng_bounded(&rng, 8);
+        if (kind == 0) {
+            materials[i].reflectivity = rng_range(&rng, 0.5f, 0.9f);
+            materials[i].roughness = rng_range(&rng, 0.0f, 0.2f);
+        } else if (kind == 1) {
+            materials[i].reflectivity = 0.1f;
+            materials[i].transparency = 0.8f;
+            materials[i].refractive_index = 1.5f;
+        } else {
+            float specular = rng_range(&rng, 0.0f, 0.4f);
+            materials[i].specular_color = vec3f_init_values(specular, specular, specular);
+            materials[i].specular_exponent = rng_range(&rng, 5.0f, 100.0f);
+        }
+    }
+}
+
+static void generate_uniform(Scene *scene, const SceneGenParams *params) {
+    Rng rng;
+    rng_seed(&rng, params->seed, STREAM_SPHERES);
+    float radius = base_radius(params->num_spheres);
+    for (size_t i = 0; i < params->num_spheres; i++) {
+        Vec3f center = random_point_in_box(&rng);
+        float r = radius * rng_range(&rng, 0.5f, 1.5f);
+        uint32_t m = rng_bounded(&rng, (uint32_t)params->num_materials);
+        scene->spheres[i] = sphere_init(center, r, m);
+    }
+}
+
+static void generate_clustered(Scene *scene, const SceneGenParams *params) {
+    // Roughly sqrt(N) spheres per cluster, so both the cluster count and the
+    // cluster population grow with N.
+    size_t num_clusters = (size_t)sqrt((double)params->num_spheres);
+    if (num_clusters < 1) {
+        num_clusters = 1;
+    }
+
+    Vec3f *centers = (Vec3f *)malloc(num_clusters * sizeof(Vec3f));
+    if (centers == NULL) {
+        generate_uniform(scene, params);
+        return;
+    }
+    Rng cluster_rng;
+    rng_seed(&cluster_rng, params->seed, STREAM_CLUSTERS);
+    for (size_t c = 0; c < num_clusters; c++) {
+        centers[c] = random_point_in_box(&cluster_rng);
+    }
+
+    Rng rng;
+    rng_seed(&rng, params->seed, STREAM_SPHERES);
+    float sigma = (GEN_MAX_X - GEN_MIN_X) / (4.0f * cbrtf((float)num_clusters));
+    float radius = base_radius(params->num_spheres) * 0.5f;
+    for (size_t i = 0; i < params->num_spheres; i++) {
+        Vec3f c = centers[rng_bounded(&rng, (uint32_t)num_clusters)];
+        Vec3f center = vec3f_init_values(c.data[0] + gaussian(&rng) * sigma,
+                                         c.data[1] + gaussian(&rng) * sigma,
+                                         c.data[2] + gaussian(&rng) * sigma);
+        float r = radius * rng_range(&rng, 0.5f, 1.5f);
+        uint32_t m = rng_bounded(&rng, (uint32_t)params->num_materials);
+        scene->spheres[i] = sphere_init(center, r, m);
+    }
+    free(centers);
+}
+
+// Offset of child `digit` of hierarchy node `node` at `level`, derived from a
+// hash so it doesn't depend on the order spheres are generated in.
+static Vec3f nested_offset(uint64_t seed, uint64_t node, int level, float scale) {
+    Rng rng;
+    rng_seed(&rng, seed ^ (node * 0x9E3779B97F4A7C15ULL), STREAM_CLUSTERS + (uint64_t)level);
+    return vec3f_init_values(rng_range(&rng, -scale, scale),
+                             rng_range(&rng, -scale, scale),
+                             rng_range(&rng, -scale, scale));
+}
+
+static void generate_nested(Scene *scene, const SceneGenParams *params) {
+    // Sphere i sits at the end of a path through a GEN_NESTED_BRANCHING-ary
+    // hierarchy given by the digits of i; every level shrinks its spread by
+    // the branching factor's cube root, giving clusters of clusters.
+    int levels = 1;
+    for (size_t n = GEN_NESTED_BRANCHING; n < params->num_spheres; n *= GEN_NESTED_BRANCHING) {
+        levels++;
+    }
+    float shrink = 1.0f / cbrtf((float)GEN_NESTED_BRANCHING) * 0.8f;
+    float root_scale = (GEN_MAX_Y - GEN_MIN_Y) * 0.5f;
+    Vec3f root = vec3f_init_values(0.5f * (GEN_MIN_X + GEN_MAX_X), 0.5f * (GEN_MIN_Y + GEN_MAX_Y), 0.5f * (GEN_MIN_Z + GEN_MAX_Z));
+    float leaf_scale = root_scale * powf(shrink, (float)(levels - 1));
+
+    Rng rng;
+    rng_seed(&rng, params->seed, STREAM_SPHERES);
+    for (size_t i = 0; i < params->num_spheres; i++) {
+        Vec3f center = root;
+        uint64_t node = 1;
+        size_t digits = i;
+        float scale = root_scale;
+        for (int level = 0; level < levels; level++) {
+            node = node * GEN_NESTED_BRANCHING + digits % GEN_NESTED_BRANCHING;
+            digits /= GEN_NESTED_BRANCHING;
+            center = vec3f_add(center, nested_offset(params->seed, node, level, scale));
+            scale *= shrink;
+        }
+        float r = leaf_scale * rng_range(&rng, 0.2f, 0.5f);
+        uint32_t m = rng_bounded(&rng, (uint32_t)params->num_materials);
+        scene->spheres[i] = sphere_init(center, r, m);
+    }
+}
+
+// Particles in flight: a uniformly random direction and a length up to
+// params->motion, from a stream of their own so the still scene is the same.
+static void generate_motion(Scene *scene, const SceneGenParams *params) {
+    Rng rng;
+    rng_seed(&rng, params->seed, STREAM_MOTION);
+    for (size_t i = 0; i < params->num_spheres; i++) {
+        float z = rng_range(&rng, -1.0f, 1.0f);
+        float phi = 2.0f * (float)M_PI * rng_next_float(&rng);
+        float length = params->motion * rng_next_float(&rng);
+        float planar = sqrtf(fmaxf(0.0f, 1.0f - z * z)) * length;
+        scene->sphere_motion[i] = vec3f_init_values(planar * cosf(phi), planar * sinf(phi), z * length);
+    }
+}
+
+static void generate_lights(Scene *scene, const SceneGenParams *params) {
+    Rng rng;
+    rng_seed(&rng, params->seed, STREAM_LIGHTS);
+    // Keep total intensity equal to the demo scene's single light. Lights
+    // with a range are scattered among the spheres instead (think of a
+    // venue full of small fixtures), and only the ones in reach count.
+    float intensity = 1.5f / (float)params->num_lights;
+    float range = params->light_range;
+    if (range > 0.0f) {
+        float volume = (GEN_MAX_X - GEN_MIN_X) * (GEN_MAX_Y - GEN_MIN_Y) * (GEN_MAX_Z - GEN_MIN_Z);
+        float reach = (float)params->num_lights * fminf(1.0f, 4.0f / 3.0f * (float)M_PI * range * range * range / volume);
+        intensity = 1.5f / fmaxf(1.0f, reach);
+    }
+    for (size_t i = 0; i < params->num_lights; i++) {
+        if (range > 0.0f) {
+            scene->lights[i].position = random_point_in_box(&rng);
+        } else {
+            scene->lights[i].position = vec3f_init_values(rng_range(&rng, 2.0f * GEN_MIN_X, 2.0f * GEN_MAX_X),
+                                                          rng_range(&rng, GEN_MAX_Y, 3.0f * GEN_MAX_Y),
+                                                          rng_range(&rng, GEN_MIN_Z, 20.0f));
+        }
+        scene->lights[i].intensity = intensity;
+        scene->lights[i].radius = 0.0f;
+        scene->lights[i].range = range;
+    }
+}
+
+bool scene_generate(Scene *scene, const SceneGenParams *params) {
+    memset(scene, 0, sizeof(*scene));
+    scene_set_defaults(scene);
+    if (params->num_spheres == 0 || params->num_materials == 0 || params->num_materials > UINT32_MAX) {
+        fprintf(stderr, "Scene generator needs at least one sphere and one material.\n");
+        return false;
+    }
+
+    scene->materials = (Material *)malloc(params->num_materials * sizeof(Material));
+    scene->spheres = (Sphere *)malloc(params->num_spheres * sizeof(Sphere));
+    scene->lights = (Light *)malloc((params->num_lights > 0 ? params->num_lights : 1) * sizeof(Light));
+    if (params->motion > 0.0f) {
+        scene->sphere_motion = (Vec3f *)malloc(params->num_spheres * sizeof(Vec3f));
+    }
+    if (scene->materials == NULL || scene->spheres == NULL || scene->lights == NULL ||
+        (params->motion > 0.0f && scene->sphere_motion == NULL)) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        scene_free(scene);
+        return false;
+    }
+    scene->num_spheres = params->num_spheres;
+    scene->num_materials = params->num_materials;
+    scene->num_lights = params->num_lights;
+
+    generate_materials(scene->materials, params->num_materials, params->seed);
+    switch (params->distribution) {
+    case SCENE_DIST_CLUSTERED:
+        generate_clustered(scene, params);
+        break;
+    case SCENE_DIST_NESTED:
+        generate_nested(scene, params);
+        break;
+    case SCENE_DIST_UNIFORM:
+    default:
+        generate_uniform(scene, params);
+        break;
+    }
+    if (scene->sphere_motion != NULL) {
+        generate_motion(scene, params);
+    }
+    generate_lights(scene, params);
+
+    return true;
+}
+
+static bool parse_size(const char *text, size_t *value) {
+    char *end;
+    double v = strtod(text, &end);
+    if (end == text || v < 0) {
+        return false;
+    }
+    // Allow suffixes so "10M" spheres is easy to type.
+    if (*end == 'k' || *end == 'K') {
+        v *= 1e3;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        v *= 1e6;
+        end++;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    *value = (size_t)v;
+    return true;
+}
+
+bool scene_gen_parse_option(SceneGenParams *params, bool *enabled, int argc, char **argv, int *i) {
+    const char *option = argv[*i];
+    if (*i + 1 >= argc) {
+        return false;
+    }
+    const char *value = argv[*i + 1];
+    size_t number;
+
+    if (strcmp(option, "--generate") == 0) {
+        if (strcmp(value, "uniform") == 0) {
+            params->distribution = SCENE_DIST_UNIFORM;
+        } else if (strcmp(value, "clustered") == 0) {
+            params->distribution = SCENE_DIST_CLUSTERED;
+        } else if (strcmp(value, "nested") == 0) {
+            params->distribution = SCENE_DIST_NESTED;
+        } else {
+            return false;
+        }
+        *enabled = true;
+    } else if (strcmp(option, "--spheres") == 0 && parse_size(value, &number)) {
+        params->num_spheres = number;
+    } else if (strcmp(option, "--lights") == 0 && parse_size(value, &number)) {
+        params->num_lights = number;
+    } else if (strcmp(option, "--materials") == 0 && parse_size(value, &number)) {
+        params->num_materials = number;
+    } else if (strcmp(option, "--light-range") == 0) {
+        params->light_range = strtof(value, NULL);
+        if (!(params->light_range >= 0.0f)) {
+            return false;
+        }
+    } else if (strcmp(option, "--motion") == 0) {
+        params->motion = strtof(value, NULL);
+        if (!(params->motion >= 0.0f)) {
+            return false;
+        }
+    } else if (strcmp(option, "--seed") == 0) {
+        params->seed = strtoull(value, NULL, 0);
+    } else {
+        return false;
+    }
+
+    (*i)++;
+    return true;
+}
@@ -0,0 +1,1170 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/perf.h"
+#include "../include/render.h"
+#include "../include/scene_io.h"
+
+typedef struct {
+    const char *cur;
+    const char *end;
+    const char *path;
+    size_t line;
+} Lexer;
+
+typedef struct {
+    const char *name; // points into the mapped file, not NUL terminated
+    uint32_t length;
+    uint32_t hash;
+    uint32_t index; // into scene->materials or scene->objects
+} NamedIndex;
+
+// Open addressing, power-of-two capacity. Scenes have a handful of materials
+// and millions of lookups, so lookups must not touch the allocator.
+typedef struct {
+    NamedIndex *entries;
+    size_t capacity;
+    size_t count;
+} NameTable;
+
+static uint32_t hash_name(const char *name, size_t length) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static NamedIndex *name_table_find(const NameTable *table, const char *name, size_t length, uint32_t hash) {
+    if (table->capacity == 0) {
+        return NULL;
+    }
+    size_t mask = table->capacity - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        NamedIndex *entry = &table->entries[slot];
+        if (entry->name == NULL) {
+            return NULL;
+        }
+        if (entry->hash == hash && entry->length == length && memcmp(entry->name, name, length) == 0) {
+            return entry;
+        }
+    }
+}
+
+static bool name_table_insert(NameTable *table, const NamedIndex *entry) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 16;
+        NamedIndex *entries = (NamedIndex *)calloc(capacity, sizeof(NamedIndex));
+        if (entries == NULL) {
+            return false;
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (table->entries[i].name != NULL) {
+                size_t slot = table->entries[i].hash & (capacity - 1);
+                while (entries[slot].name != NULL) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                entries[slot] = table->entries[i];
+            }
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+
+    size_t mask = table->capacity - 1;
+    size_t slot = entry->hash & mask;
+    while (table->entries[slot].name != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    table->entries[slot] = *entry;
+    table->count++;
+    return true;
+}
+
+static void lex_skip_blanks(Lexer *lex) {
+    while (lex->cur < lex->end && (*lex->cur == ' ' || *lex->cur == '\t' || *lex->cur == '\r')) {
+        lex->cur++;
+    }
+    if (lex->cur < lex->end && *lex->cur == '#') {
+        while (lex->cur < lex->end && *lex->cur != '\n') {
+            lex->cur++;
+        }
+    }
+}
+
+static bool lex_at_eol(Lexer *lex) {
+    lex_skip_blanks(lex);
+    return lex->cur >= lex->end || *lex->cur == '\n';
+}
+
+static void lex_next_line(Lexer *lex) {
+    while (lex->cur < lex->end && *lex->cur != '\n') {
+        lex->cur++;
+    }
+    if (lex->cur < lex->end) {
+        lex->cur++;
+    }
+    lex->line++;
+}
+
+static size_t lex_word(Lexer *lex, const char **word) {
+    lex_skip_blanks(lex);
+    *word = lex->cur;
+    while (lex->cur < lex->end && *lex->cur != ' ' && *lex->cur != '\t' && *lex->cur != '\r' &&
+           *lex->cur != '\n' && *lex->cur != '#') {
+        lex->cur++;
+    }
+    return (size_t)(lex->cur - *word);
+}
+
+static bool word_is(const char *word, size_t length, const char *keyword) {
+    return strlen(keyword) == length && memcmp(word, keyword, length) == 0;
+}
+
+// Decimal float parser: [sign] digits [. digits] [e [sign] digits]. strtod is
+// locale aware and needs a terminated string, and is several times slower.
+static bool lex_float(Lexer *lex, float *value) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    lex_skip_blanks(lex);
+    const char *p = lex->cur;
+    const char *end = lex->end;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (mantissa < 1000000000000000000ULL) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        } else {
+            exponent++;
+        }
+        p++;
+        digits++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (mantissa < 1000000000000000000ULL) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                exponent--;
+            }
+            p++;
+            digits++;
+        }
+    }
+    if (digits == 0) {
+        return false;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negative_exponent = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative_exponent = *p == '-';
+            p++;
+        }
+        if (p >= end || *p < '0' || *p > '9') {
+            return false;
+        }
+        int e = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (e < 10000) {
+                e = e * 10 + (*p - '0');
+            }
+            p++;
+        }
+        exponent += negative_exponent ? -e : e;
+    }
+    if (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#') {
+        return false;
+    }
+
+    double result = (double)mantissa;
+    if (exponent < 0) {
+        result = (-exponent <= 22) ? result / powers[-exponent] : result * pow(10.0, exponent);
+    } else if (exponent > 0) {
+        result = (exponent <= 22) ? result * powers[exponent] : result * pow(10.0, exponent);
+    }
+    *value = (float)(negative ? -result : result);
+    lex->cur = p;
+    return true;
+}
+
+static bool lex_floats(Lexer *lex, float *values, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!lex_float(lex, &values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Unsigned decimal integer, e.g. a vertex index.
+static bool lex_index(Lexer *lex, uint32_t *value) {
+    lex_skip_blanks(lex);
+    const char *p = lex->cur;
+    uint64_t result = 0;
+    while (p < lex->end && *p >= '0' && *p <= '9' && result <= UINT32_MAX) {
+        result = result * 10 + (uint64_t)(*p - '0');
+        p++;
+    }
+    if (p == lex->cur || result > UINT32_MAX ||
+        (p < lex->end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#')) {
+        return false;
+    }
+    *value = (uint32_t)result;
+    lex->cur = p;
+    return true;
+}
+
+static bool parse_error(const Lexer *lex, const char *message) {
+    fprintf(stderr, "%s:%zu: %s\n", lex->path, lex->line, message);
+    return false;
+}
+
+// Grows *array to hold at least one more element; capacity doubles.
+static bool reserve_one(void **array, size_t *capacity, size_t count, size_t element_size) {
+    if (count < *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc(*array, new_capacity * element_size);
+    if (grown == NULL) {
+        return false;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+static bool parse_render(Lexer *lex, Scene *scene) {
+    while (!lex_at_eol(lex)) {
+        const char *key;
+        size_t length = lex_word(lex, &key);
+        if (word_is(key, length, "integrator")) {
+            const char *name;
+            size_t name_length = lex_word(lex, &name);
+            if (word_is(name, name_length, "whitted")) {
+                scene->settings.integrator = INTEGRATOR_WHITTED;
+            } else if (word_is(name, name_length, "path")) {
+                scene->settings.integrator = INTEGRATOR_PATH;
+            } else {
+                return parse_error(lex, "integrator must be whitted or path");
+            }
+            continue;
+        }
+        if (word_is(key, length, "lights")) {
+            const char *name;
+            size_t name_length = lex_word(lex, &name);
+            if (word_is(name, name_length, "exact")) {
+                scene->settings.light_sampling = LIGHTS_EXACT;
+            } else if (word_is(name, name_length, "cull")) {
+                scene->settings.light_sampling = LIGHTS_CULL;
+            } else if (word_is(name, name_length, "sample")) {
+                scene->settings.light_sampling = LIGHTS_SAMPLE;
+            } else if (word_is(name, name_length, "tiled")) {
+                scene->settings.light_sampling = LIGHTS_TILED;
+            } else {
+                return parse_error(lex, "lights must be exact, cull, sample or tiled");
+            }
+            continue;
+        }
+        if (word_is(key, length, "accel")) {
+            const char *name;
+            size_t name_length = lex_word(lex, &name);
+            if (word_is(name, name_length, "auto")) {
+                scene->settings.accel = ACCEL_AUTO;
+            } else if (word_is(name, name_length, "bvh")) {
+                scene->settings.accel = ACCEL_BVH;
+            } else if (word_is(name, name_length, "grid")) {
+                scene->settings.accel = ACCEL_GRID;
+            } else if (word_is(name, name_length, "hashgrid")) {
+                scene->settings.accel = ACCEL_HASHED_GRID;
+            } else if (word_is(name, name_length, "qbvh")) {
+                scene->settings.accel = ACCEL_QBVH;
+            } else if (word_is(name, name_length, "compact")) {
+                scene->settings.accel = ACCEL_COMPACT;
+            } else {
+                return parse_error(lex, "accel must be auto, bvh, grid, hashgrid, qbvh or compact");
+            }
+            continue;
+        }
+        float value;
+        if (!lex_float(lex, &value) || value < 0.0f) {
+            return parse_error(lex, "expected a number after render setting");
+        }
+        if (word_is(key, length, "light_threshold")) {
+            scene->settings.light_threshold = value;
+            continue;
+        }
+        if (word_is(key, length, "environment")) {
+            scene->settings.environment = value;
+            continue;
+        }
+        if (word_is(key, length, "shutter")) {
+            if (value > 1.0f) {
+                return parse_error(lex, "shutter must be between 0 and 1");
+            }
+            scene->settings.shutter = value;
+            continue;
+        }
+        bool is_depth = word_is(key, length, "max_depth") || word_is(key, length, "rr_depth");
+        if (is_depth ? value > RENDER_MAX_DEPTH_LIMIT : (value < 1.0f || value >= (float)INT_MAX)) {
+            return parse_error(lex, "render setting out of range");
+        }
+        if ((float)(int)value != value) {
+            return parse_error(lex, "render setting must be a whole number");
+        }
+        if (word_is(key, length, "width")) {
+            scene->settings.width = (int)value;
+        } else if (word_is(key, length, "height")) {
+            scene->settings.height = (int)value;
+        } else if (word_is(key, length, "samples")) {
+            scene->settings.super_sampling = (int)value;
+        } else if (word_is(key, length, "max_depth")) {
+            scene->settings.max_depth = (int)value;
+        } else if (word_is(key, length, "rr_depth")) {
+            scene->settings.rr_depth = (int)value;
+        } else if (word_is(key, length, "spp")) {
+            scene->settings.samples = (int)value;
+        } else {
+            return parse_error(lex, "unknown render setting");
+        }
+    }
+    if ((int64_t)scene->settings.width * scene->settings.height > RENDER_MAX_PIXELS) {
+        return parse_error(lex, "render width * height too large");
+    }
+    return true;
+}
+
+static bool parse_camera(Lexer *lex, Scene *scene) {
+    while (!lex_at_eol(lex)) {
+        const char *key;
+        size_t length = lex_word(lex, &key);
+        float v[3];
+        if (word_is(key, length, "position") && lex_floats(lex, v, 3)) {
+            scene->camera.position = vec3f_init_values(v[0], v[1], v[2]);
+        } else if (word_is(key, length, "look_at") && lex_floats(lex, v, 3)) {
+            scene->camera.look_at = vec3f_init_values(v[0], v[1], v[2]);
+        } else if (word_is(key, length, "fov") && lex_float(lex, &v[0]) && v[0] > 0.0f && v[0] < 180.0f) {
+            scene->camera.fov = v[0] * (float)M_PI / 180.0f;
+        } else {
+            return parse_error(lex, "bad camera setting");
+        }
+    }
+    return true;
+}
+
+// Optional keyword/value pairs after a material's color.
+static bool parse_material_options(Lexer *lex, Material *material) {
+    while (!lex_at_eol(lex)) {
+        const char *key;
+        size_t length = lex_word(lex, &key);
+        bool is_specular = word_is(key, length, "specular");
+        if (is_specular || word_is(key, length, "emission")) {
+            float v[3];
+            if (!lex_floats(lex, v, 3) || v[0] < 0.0f || v[1] < 0.0f || v[2] < 0.0f) {
+                return parse_error(lex, "expected <r> <g> <b> after specular or emission");
+            }
+            Vec3f color = vec3f_init_values(v[0], v[1], v[2]);
+            if (is_specular) {
+                material->specular_color = color;
+            } else {
+                material->emission = color;
+            }
+            continue;
+        }
+        float value;
+        if (!lex_float(lex, &value) || value < 0.0f) {
+            return parse_error(lex, "expected a non-negative number after material option");
+        }
+        if (word_is(key, length, "reflect")) {
+            material->reflectivity = value;
+        } else if (word_is(key, length, "transparency")) {
+            material->transparency = value;
+        } else if (word_is(key, length, "ior") && value > 0.0f) {
+            material->refractive_index = value;
+        } else if (word_is(key, length, "roughness")) {
+            material->roughness = value;
+        } else if (word_is(key, length, "exponent")) {
+            material->specular_exponent = value;
+        } else {
+            return parse_error(lex, "bad material option");
+        }
+    }
+    if (material->reflectivity + material->transparency > 1.0f) {
+        return parse_error(lex, "material reflect + transparency exceeds 1");
+    }
+    return true;
+}
+
+// Reads a material or object name and looks it up; NULL if undeclared.
+static NamedIndex *lex_name(Lexer *lex, const NameTable *table) {
+    const char *name;
+    size_t name_length = lex_word(lex, &name);
+    return name_table_find(table, name, name_length, hash_name(name, name_length));
+}
+
+static bool parse_vertex(Lexer *lex, Mesh *mesh) {
+    float v[3], n[3] = { 0.0f, 0.0f, 0.0f };
+    if (!lex_floats(lex, v, 3)) {
+        return parse_error(lex, "vertex expects <x> <y> <z> [normal <nx> <ny> <nz>]");
+    }
+    bool has_normal = false;
+    if (!lex_at_eol(lex)) {
+        const char *key;
+        size_t length = lex_word(lex, &key);
+        if (!word_is(key, length, "normal") || !lex_floats(lex, n, 3)) {
+            return parse_error(lex, "vertex expects <x> <y> <z> [normal <nx> <ny> <nz>]");
+        }
+        has_normal = true;
+    }
+    Vec3f normal = vec3f_normalize(vec3f_init_values(n[0], n[1], n[2]));
+    if (mesh->num_vertices >= UINT32_MAX ||
+        !mesh_add_vertex(mesh, vec3f_init_values(v[0], v[1], v[2]), has_normal ? &normal : NULL)) {
+        return parse_error(lex, "out of memory");
+    }
+    return true;
+}
+
+static bool parse_triangle(Lexer *lex, Mesh *mesh, const NameTable *materials) {
+    uint32_t v[3];
+    for (int corner = 0; corner < 3; corner++) {
+        if (!lex_index(lex, &v[corner])) {
+            return parse_error(lex, "triangle expects <a> <b> <c> <material>");
+        }
+        if (v[corner] >= mesh->num_vertices) {
+            return parse_error(lex, "triangle uses an undeclared vertex");
+        }
+    }
+    NamedIndex *material = lex_name(lex, materials);
+    if (material == NULL) {
+        return parse_error(lex, "triangle uses an undeclared material");
+    }
+    if (!mesh_add_triangle(mesh, v[0], v[1], v[2], material->index)) {
+        return parse_error(lex, "out of memory");
+    }
+    return true;
+}
+
+// mesh <file.obj> <material> [scale S] [translate X Y Z]; a relative path is
+// taken from the scene file's directory.
+static bool parse_mesh(Lexer *lex, Mesh *mesh, const NameTable *materials) {
+    const char *file;
+    size_t file_length = lex_word(lex, &file);
+    if (file_length == 0) {
+        return parse_error(lex, "mesh expects <file.obj> <material> [scale S] [translate X Y Z]");
+    }
+    char path[PATH_MAX];
+    const char *slash = strrchr(lex->path, '/');
+    int dir_length = (file[0] != '/' && slash != NULL) ? (int)(slash - lex->path + 1) : 0;
+    int n = snprintf(path, sizeof(path), "%.*s%.*s", dir_length, lex->path, (int)file_length, file);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        return parse_error(lex, "mesh path too long");
+    }
+
+    NamedIndex *material = lex_name(lex, materials);
+    if (material == NULL) {
+        return parse_error(lex, "mesh uses an undeclared material");
+    }
+    float scale = 1.0f;
+    float translate[3] = { 0.0f, 0.0f, 0.0f };
+    while (!lex_at_eol(lex)) {
+        const char *key;
+        size_t length = lex_word(lex, &key);
+        if (word_is(key, length, "scale") && lex_float(lex, &scale) && scale > 0.0f) {
+            continue;
+        }
+        if (!word_is(key, length, "translate") || !lex_floats(lex, translate, 3)) {
+            return parse_error(lex, "mesh expects <file.obj> <material> [scale S] [translate X Y Z]");
+        }
+    }
+    if (!mesh_load_obj(mesh, path, material->index, scale,
+                       vec3f_init_values(translate[0], translate[1], translate[2]))) {
+        return parse_error(lex, "failed to load mesh");
+    }
+    return true;
+}
+
+// plane <x> <y> <z> <nx> <ny> <nz> <material>: through a point, facing
+// along the normal.
+static bool parse_plane(Lexer *lex, Shapes *shapes, const NameTable *materials) {
+    float v[6];
+    if (!lex_floats(lex, v, 6)) {
+        return parse_error(lex, "plane expects <x> <y> <z> <nx> <ny> <nz> <material>");
+    }
+    NamedIndex *material = lex_name(lex, materials);
+    if (material == NULL) {
+        return parse_error(lex, "plane uses an undeclared material");
+    }
+    Vec3f normal = vec3f_init_values(v[3], v[4], v[5]);
+    if (!(vec3f_norm(normal) > 0.0f)) {
+        return parse_error(lex, "plane needs a nonzero normal");
+    }
+    Plane plane;
+    plane.normal = vec3f_normalize(normal);
+    plane.offset = vec3f_dot(plane.normal, vec3f_init_values(v[0], v[1], v[2]));
+    plane.material_index = material->index;
+    if (!shapes_add_plane(shapes, &plane)) {
+        return parse_error(lex, "out of memory");
+    }
+    return true;
+}
+
+// box <min x y z> <max x y z> <material>
+static bool parse_box(Lexer *lex, Shapes *shapes, const NameTable *materials) {
+    float v[6];
+    if (!lex_floats(lex, v, 6)) {
+        return parse_error(lex, "box expects <min x> <min y> <min z> <max x> <max y> <max z> <material>");
+    }
+    NamedIndex *material = lex_name(lex, materials);
+    if (material == NULL) {
+        return parse_error(lex, "box uses an undeclared material");
+    }
+    Box box;
+    for (int k = 0; k < 3; k++) {
+        if (!(v[k] <= v[3 + k])) {
+            return parse_error(lex, "box min exceeds its max");
+        }
+        box.min[k] = v[k];
+        box.max[k] = v[3 + k];
+    }
+    box.material_index = material->index;
+    if (!shapes_add_box(shapes, &box)) {
+        return parse_error(lex, "out of memory");
+    }
+    return true;
+}
+
+// disc <x> <y> <z> <nx> <ny> <nz> <radius> <material>
+static bool parse_disc(Lexer *lex, Shapes *shapes, const NameTable *materials) {
+    float v[7];
+    if (!lex_floats(lex, v, 7)) {
+        return parse_error(lex, "disc expects <x> <y> <z> <nx> <ny> <nz> <radius> <material>");
+    }
+    NamedIndex *material = lex_name(lex, materials);
+    if (material == NULL) {
+        return parse_error(lex, "disc uses an undeclared material");
+    }
+    Vec3f normal = vec3f_init_values(v[3], v[4], v[5]);
+    if (!(vec3f_norm(normal) > 0.0f) || !(v[6] > 0.0f)) {
+        return parse_error(lex, "disc needs a nonzero normal and a positive radius");
+    }
+    Disc disc;
+    disc.center = vec3f_init_values(v[0], v[1], v[2]);
+    disc.normal = vec3f_normalize(normal);
+    disc.radius = v[6];
+    disc.material_index = material->index;
+    if (!shapes_add_disc(shapes, &disc)) {
+        return parse_error(lex, "out of memory");
+    }
+    return true;
+}
+
+// cylinder <x0> <y0> <z0> <x1> <y1> <z1> <radius> <material>: capped, from
+// one end's center to the other's.
+static bool parse_cylinder(Lexer *lex, Shapes *shapes, const NameTable *materials) {
+    float v[7];
+    if (!lex_floats(lex, v, 7)) {
+        return parse_error(lex, "cylinder expects <x0> <y0> <z0> <x1> <y1> <z1> <radius> <material>");
+    }
+    NamedIndex *material = lex_name(lex, materials);
+    if (material == NULL) {
+        return parse_error(lex, "cylinder uses an undeclared material");
+    }
+    Cylinder cylinder;
+    cylinder.base = vec3f_init_values(v[0], v[1], v[2]);
+    Vec3f axis = vec3f_sub(vec3f_init_values(v[3], v[4], v[5]), cylinder.base);
+    cylinder.height = vec3f_norm(axis);
+    if (!(cylinder.height > 0.0f) || !(v[6] > 0.0f)) {
+        return parse_error(lex, "cylinder needs distinct ends and a positive radius");
+    }
+    cylinder.axis = vec3f_normalize(axis);
+    cylinder.radius = v[6];
+    cylinder.material_index = material->index;
+    if (!shapes_add_cylinder(shapes, &cylinder)) {
+        return parse_error(lex, "out of memory");
+    }
+    return true;
+}
+
+// field <x> <y> <z> <cells x> <cells y> <cells z> <spacing> <radius> <material>
+//       [variation V] [jitter J] [fill F] [materials N] [seed S]
+static bool parse_field(Lexer *lex, Scene *scene, const NameTable *materials) {
+    static const char *usage = "field expects <x> <y> <z> <cells x> <cells y> <cells z> <spacing> <radius> <material>"
+                               " [variation V] [jitter J] [fill F] [materials N] [seed S]";
+    SphereField field;
+    uint32_t cells[3];
+    float size[2];
+    if (!lex_floats(lex, field.min, 3) || !lex_index(lex, &cells[0]) || !lex_index(lex, &cells[1]) ||
+        !lex_index(lex, &cells[2]) || !lex_floats(lex, size, 2)) {
+        return parse_error(lex, usage);
+    }
+    NamedIndex *material = lex_name(lex, materials);
+    if (material == NULL) {
+        return parse_error(lex, "field uses an undeclared material");
+    }
+    for (int k = 0; k < 3; k++) {
+        if (cells[k] < 1 || cells[k] > SPHERE_FIELD_MAX_CELLS) {
+            return parse_error(lex, "field needs 1 to 2^24 cells per axis");
+        }
+        field.cells[k] = (int32_t)cells[k];
+    }
+    field.spacing = size[0];
+    field.radius = size[1];
+    if (!(field.spacing > 0.0f) || !(field.radius > 0.0f) || !(field.radius < 0.5f * field.spacing)) {
+        return parse_error(lex, "field needs a radius between 0 and half the spacing");
+    }
+    field.radius_variation = 0.0f;
+    field.jitter = 0.0f;
+    field.fill = 1.0f;
+    field.seed = 0;
+    field.material_index = material->index;
+    field.material_count = 1;
+    while (!lex_at_eol(lex)) {
+        const char *key;
+        size_t length = lex_word(lex, &key);
+        float *fraction = word_is(key, length, "variation") ? &field.radius_variation
+                          : word_is(key, length, "jitter")  ? &field.jitter
+                          : word_is(key, length, "fill")    ? &field.fill
+                                                            : NULL;
+        if (fraction != NULL) {
+            if (!lex_float(lex, fraction) || !(*fraction >= 0.0f && *fraction <= 1.0f)) {
+                return parse_error(lex, "field variation, jitter and fill go from 0 to 1");
+            }
+        } else if (word_is(key, length, "materials")) {
+            if (!lex_index(lex, &field.material_count) || field.material_count < 1 ||
+                field.material_count > scene->num_materials - field.material_index) {
+                return parse_error(lex, "field materials must be declared, one after another, before the field");
+            }
+        } else if (!word_is(key, length, "seed") || !lex_index(lex, &field.seed)) {
+            return parse_error(lex, usage);
+        }
+    }
+    if (!shapes_add_field(&scene->shapes, &field)) {
+        return parse_error(lex, "out of memory");
+    }
+    return true;
+}
+
+// object <name>: opens a block whose geometry statements go to a new
+// object instead of the scene.
+static bool parse_object(Lexer *lex, Scene *scene, NameTable *objects, size_t *object_capacity) {
+    NamedIndex object;
+    size_t length = lex_word(lex, &object.name);
+    if (length == 0) {
+        return parse_error(lex, "object expects <name>");
+    }
+    object.length = (uint32_t)length;
+    object.hash = hash_name(object.name, length);
+    if (name_table_find(objects, object.name, length, object.hash) != NULL) {
+        return parse_error(lex, "object redeclared");
+    }
+    object.index = (uint32_t)scene->num_objects;
+    if (scene->num_objects >= UINT32_MAX ||
+        !reserve_one((void **)&scene->objects, object_capacity, scene->num_objects, sizeof(SceneObject)) ||
+        !name_table_insert(objects, &object)) {
+        return parse_error(lex, "out of memory");
+    }
+    memset(&scene->objects[scene->num_objects++], 0, sizeof(SceneObject));
+    return true;
+}
+
+// instance <object> [scale S] [rotate X Y Z] [translate X Y Z], or
+// instance <object> matrix <3x4 row-major>.
+static bool parse_instance(Lexer *lex, Scene *scene, const NameTable *objects, size_t *instance_capacity) {
+    static const char *usage = "instance expects <object> [scale S] [rotate X Y Z] [translate X Y Z] or <object> matrix <12 numbers>";
+    NamedIndex *object = lex_name(lex, objects);
+    if (object == NULL) {
+        return parse_error(lex, "instance of an undeclared object");
+    }
+    float scale = 1.0f;
+    float rotate[3] = { 0.0f, 0.0f, 0.0f };
+    float translate[3] = { 0.0f, 0.0f, 0.0f };
+    float matrix[3][4];
+    bool has_matrix = false;
+    bool has_transform = false;
+    while (!lex_at_eol(lex)) {
+        const char *key;
+        size_t length = lex_word(lex, &key);
+        if (word_is(key, length, "scale") && lex_float(lex, &scale) && scale > 0.0f) {
+            has_transform = true;
+        } else if (word_is(key, length, "rotate") && lex_floats(lex, rotate, 3)) {
+            has_transform = true;
+        } else if (word_is(key, length, "translate") && lex_floats(lex, translate, 3)) {
+            has_transform = true;
+        } else if (word_is(key, length, "matrix") && lex_floats(lex, &matrix[0][0], 12)) {
+            has_matrix = true;
+        } else {
+            return parse_error(lex, usage);
+        }
+    }
+    if (has_matrix && has_transform) {
+        return parse_error(lex, usage);
+    }
+    if (!has_matrix) {
+        instance_transform(matrix, scale, rotate, translate);
+    }
+    if (!reserve_one((void **)&scene->instances, instance_capacity, scene->num_instances, sizeof(Instance))) {
+        return parse_error(lex, "out of memory");
+    }
+    if (!instance_init(&scene->instances[scene->num_instances], object->index, (const float(*)[4])matrix)) {
+        return parse_error(lex, "instance matrix is not invertible");
+    }
+    scene->num_instances++;
+    return true;
+}
+
+// Sets the motion of the scene's newest sphere. The array is created at the
+// first moving sphere, with the spheres before it standing still, and
+// filled for every sphere after it.
+static bool push_sphere_motion(Scene *scene, size_t *capacity, Vec3f motion) {
+    size_t index = scene->num_spheres - 1;
+    if (scene->sphere_motion == NULL) {
+        scene->sphere_motion = (Vec3f *)calloc(scene->num_spheres, sizeof(Vec3f));
+        if (scene->sphere_motion == NULL) {
+            return false;
+        }
+        *capacity = scene->num_spheres;
+    }
+    if (!reserve_one((void **)&scene->sphere_motion, capacity, index, sizeof(Vec3f))) {
+        return false;
+    }
+    scene->sphere_motion[index] = motion;
+    return true;
+}
+
+static bool parse_buffer(Lexer *lex, Scene *scene, NameTable *materials, NameTable *objects) {
+    size_t sphere_capacity = 0;
+    size_t motion_capacity = 0;
+    size_t material_capacity = 0;
+    size_t light_capacity = 0;
+    size_t object_capacity = 0;
+    size_t instance_capacity = 0;
+    SceneObject *object = NULL; // the open object block, if any
+
+    // A sphere statement is rarely shorter than ~24 bytes, so this reserves
+    // roughly the right amount up front and avoids most regrowth.
+    size_t estimate = (size_t)(lex->end - lex->cur) / 24 + 16;
+    scene->spheres = (Sphere *)malloc(estimate * sizeof(Sphere));
+    if (scene->spheres == NULL) {
+        return parse_error(lex, "out of memory");
+    }
+    sphere_capacity = estimate;
+
+    while (lex->cur < lex->end) {
+        if (lex_at_eol(lex)) {
+            lex_next_line(lex);
+            continue;
+        }
+
+        const char *keyword;
+        size_t length = lex_word(lex, &keyword);
+        Mesh *mesh = object != NULL ? &object->mesh : &scene->mesh;
+        if (word_is(keyword, length, "sphere")) {
+            static const char *usage = "sphere expects <x> <y> <z> <radius> <material> [to <x> <y> <z>]";
+            float v[4];
+            if (!lex_floats(lex, v, 4)) {
+                return parse_error(lex, usage);
+            }
+            NamedIndex *material = lex_name(lex, materials);
+            if (material == NULL) {
+                return parse_error(lex, "sphere uses an undeclared material");
+            }
+            if (!(v[3] > 0.0f)) {
+                return parse_error(lex, "sphere needs a positive radius");
+            }
+            Vec3f motion = vec3f_init();
+            bool moving = false;
+            if (!lex_at_eol(lex)) {
+                const char *key;
+                size_t key_length = lex_word(lex, &key);
+                float end[3];
+                if (!word_is(key, key_length, "to") || !lex_floats(lex, end, 3)) {
+                    return parse_error(lex, usage);
+                }
+                if (object != NULL) {
+                    return parse_error(lex, "spheres in an object can't move");
+                }
+                motion = vec3f_init_values(end[0] - v[0], end[1] - v[1], end[2] - v[2]);
+                moving = true;
+            }
+            Sphere **spheres = object != NULL ? &object->spheres : &scene->spheres;
+            size_t *count = object != NULL ? &object->num_spheres : &scene->num_spheres;
+            size_t *capacity = object != NULL ? &object->sphere_capacity : &sphere_capacity;
+            if (!reserve_one((void **)spheres, capacity, *count, sizeof(Sphere))) {
+                return parse_error(lex, "out of memory");
+            }
+            (*spheres)[(*count)++] = sphere_init(vec3f_init_values(v[0], v[1], v[2]), v[3], material->index);
+            if ((moving || (object == NULL && scene->sphere_motion != NULL)) &&
+                !push_sphere_motion(scene, &motion_capacity, motion)) {
+                return parse_error(lex, "out of memory");
+            }
+        } else if (word_is(keyword, length, "material")) {
+            NamedIndex material;
+            float v[3];
+            length = lex_word(lex, &material.name);
+            if (length == 0 || !lex_floats(lex, v, 3)) {
+                return parse_error(lex, "material expects <name> <r> <g> <b>");
+            }
+            material.length = (uint32_t)length;
+            material.hash = hash_name(material.name, length);
+            NamedIndex *existing = name_table_find(materials, material.name, length, material.hash);
+            material.index = (uint32_t)scene->num_materials;
+            if (!reserve_one((void **)&scene->materials, &material_capacity, scene->num_materials, sizeof(Material))) {
+                return parse_error(lex, "out of memory");
+            }
+            if (existing != NULL) {
+                // Redeclaring a name affects later spheres only; earlier
+                // ones keep the material they were declared with.
+                existing->index = material.index;
+            } else if (!name_table_insert(materials, &material)) {
+                return parse_error(lex, "out of memory");
+            }
+            Material *declared = &scene->materials[scene->num_materials++];
+            *declared = material_diffuse(vec3f_init_values(v[0], v[1], v[2]));
+            if (!parse_material_options(lex, declared)) {
+                return false;
+            }
+        } else if (object != NULL && !word_is(keyword, length, "vertex") && !word_is(keyword, length, "triangle") &&
+                   !word_is(keyword, length, "mesh") && !word_is(keyword, length, "end")) {
+            return parse_error(lex, "only sphere, material, vertex, triangle and mesh statements go in an object");
+        } else if (word_is(keyword, length, "light")) {
+            float v[4];
+            if (!lex_floats(lex, v, 4)) {
+                return parse_error(lex, "light expects <x> <y> <z> <intensity>");
+            }
+            if (!(v[3] >= 0.0f)) {
+                return parse_error(lex, "light needs a non-negative intensity");
+            }
+            if (!reserve_one((void **)&scene->lights, &light_capacity, scene->num_lights, sizeof(Light))) {
+                return parse_error(lex, "out of memory");
+            }
+            Light *light = &scene->lights[scene->num_lights++];
+            light->position = vec3f_init_values(v[0], v[1], v[2]);
+            light->intensity = v[3];
+            light->radius = 0.0f;
+            light->range = 0.0f;
+            while (!lex_at_eol(lex)) {
+                const char *key;
+                size_t key_length = lex_word(lex, &key);
+                float value;
+                if (!lex_float(lex, &value) || value < 0.0f) {
+                    return parse_error(lex, "light expects <x> <y> <z> <intensity> [radius R] [range D]");
+                }
+                if (word_is(key, key_length, "radius")) {
+                    light->radius = value;
+                } else if (word_is(key, key_length, "range")) {
+                    light->range = value;
+                } else {
+                    return parse_error(lex, "light expects <x> <y> <z> <intensity> [radius R] [range D]");
+                }
+            }
+        } else if (word_is(keyword, length, "vertex")) {
+            if (!parse_vertex(lex, mesh)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "triangle")) {
+            if (!parse_triangle(lex, mesh, materials)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "mesh")) {
+            if (!parse_mesh(lex, mesh, materials)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "plane")) {
+            if (!parse_plane(lex, &scene->shapes, materials)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "box")) {
+            if (!parse_box(lex, &scene->shapes, materials)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "disc")) {
+            if (!parse_disc(lex, &scene->shapes, materials)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "cylinder")) {
+            if (!parse_cylinder(lex, &scene->shapes, materials)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "field")) {
+            if (!parse_field(lex, scene, materials)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "object")) {
+            if (!parse_object(lex, scene, objects, &object_capacity)) {
+                return false;
+            }
+            object = &scene->objects[scene->num_objects - 1];
+        } else if (word_is(keyword, length, "end")) {
+            if (object == NULL) {
+                return parse_error(lex, "end without an object");
+            }
+            object = NULL;
+        } else if (word_is(keyword, length, "instance")) {
+            if (!parse_instance(lex, scene, objects, &instance_capacity)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "render")) {
+            if (!parse_render(lex, scene)) {
+                return false;
+            }
+        } else if (word_is(keyword, length, "camera")) {
+            if (!parse_camera(lex, scene)) {
+                return false;
+            }
+        } else {
+            return parse_error(lex, "unknown statement");
+        }
+
+        if (!lex_at_eol(lex)) {
+            return parse_error(lex, "unexpected trailing text");
+        }
+        lex_next_line(lex);
+    }
+    if (object != NULL) {
+        return parse_error(lex, "object without end");
+    }
+
+    // Give back the over-estimate.
+    if (scene->num_spheres > 0 && scene->num_spheres < sphere_capacity) {
+        Sphere *shrunk = (Sphere *)realloc(scene->spheres, scene->num_spheres * sizeof(Sphere));
+        if (shrunk != NULL) {
+            scene->spheres = shrunk;
+        }
+    }
+    if (scene->sphere_motion != NULL && scene->num_spheres < motion_capacity) {
+        Vec3f *shrunk = (Vec3f *)realloc(scene->sphere_motion, scene->num_spheres * sizeof(Vec3f));
+        if (shrunk != NULL) {
+            scene->sphere_motion = shrunk;
+        }
+    }
+    return true;
+}
+
+bool scene_load_text(Scene *scene, const char *path) {
+    memset(scene, 0, sizeof(*scene));
+    scene_set_defaults(scene);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open scene file %s.\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to stat scene file %s.\n", path);
+        close(fd);
+        return false;
+    }
+
+    double start = perf_now_seconds();
+    size_t size = (size_t)st.st_size;
+    const char *data = NULL;
+    if (size > 0) {
+        data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Failed to map scene file %s.\n", path);
+            close(fd);
+            return false;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    Lexer lex = { data, data + size, path, 1 };
+    NameTable materials = { NULL, 0, 0 };
+    NameTable objects = { NULL, 0, 0 };
+    bool ok = parse_buffer(&lex, scene, &materials, &objects);
+
+    if (size > 0) {
+        munmap((void *)data, size);
+    }
+    free(materials.entries);
+    free(objects.entries);
+    if (!ok) {
+        scene_free(scene);
+        return false;
+    }
+
+    double seconds = perf_now_seconds() - start;
+    fprintf(stderr, "Loaded %s: %zu spheres, %zu triangles, %zu shapes, %zu materials, %zu lights, %.1f MB in %.1f ms"
+            " (%.1f MB/s)\n",
+            path, scene->num_spheres, scene->mesh.num_triangles, shapes_total(&scene->shapes), scene->num_materials,
+            scene->num_lights, size / 1e6, seconds * 1e3,
+            seconds > 0.0 ? size / 1e6 / seconds : 0.0);
+    return true;
+}
+
+// Spheres (with where the moving ones end up), then the mesh as inline
+// vertex and triangle statements.
+static void write_geometry(FILE *out, const Sphere *spheres, size_t num_spheres, const Vec3f *motion,
+                           const Mesh *mesh) {
+    for (size_t i = 0; i < num_spheres; i++) {
+        const Sphere *sphere = &spheres[i];
+        fprintf(out, "sphere %.9g %.9g %.9g %.9g m%u",
+                sphere->center.data[0], sphere->center.data[1], sphere->center.data[2], sphere->radius,
+                sphere->material_index);
+        const Vec3f *m = motion != NULL ? &motion[i] : NULL;
+        if (m != NULL && (m->data[0] != 0.0f || m->data[1] != 0.0f || m->data[2] != 0.0f)) {
+            Sphere end = sphere_at(sphere, *m, 1.0f);
+            fprintf(out, " to %.9g %.9g %.9g", end.center.data[0], end.center.data[1], end.center.data[2]);
+        }
+        fputc('\n', out);
+    }
+
+    for (size_t i = 0; i < mesh->num_vertices; i++) {
+        const Vec3f *v = &mesh->vertices[i];
+        fprintf(out, "vertex %.9g %.9g %.9g", v->data[0], v->data[1], v->data[2]);
+        const Vec3f *n = mesh->normals != NULL ? &mesh->normals[i] : NULL;
+        if (n != NULL && (n->data[0] != 0.0f || n->data[1] != 0.0f || n->data[2] != 0.0f)) {
+            fprintf(out, " normal %.9g %.9g %.9g", n->data[0], n->data[1], n->data[2]);
+        }
+        fputc('\n', out);
+    }
+    for (size_t i = 0; i < mesh->num_triangles; i++) {
+        const Triangle *triangle = &mesh->triangles[i];
+        fprintf(out, "triangle %u %u %u m%u\n", triangle->v[0], triangle->v[1], triangle->v[2],
+                triangle->material_index);
+    }
+}
+
+static void write_shapes(FILE *out, const Shapes *shapes) {
+    for (size_t i = 0; i < shapes->count[SHAPE_PLANE]; i++) {
+        const Plane *plane = &shapes->planes[i];
+        const float *n = plane->normal.data;
+        fprintf(out, "plane %.9g %.9g %.9g %.9g %.9g %.9g m%u\n", n[0] * plane->offset, n[1] * plane->offset,
+                n[2] * plane->offset, n[0], n[1], n[2], plane->material_index);
+    }
+    for (size_t i = 0; i < shapes->count[SHAPE_BOX]; i++) {
+        const Box *box = &shapes->boxes[i];
+        fprintf(out, "box %.9g %.9g %.9g %.9g %.9g %.9g m%u\n", box->min[0], box->min[1], box->min[2], box->max[0],
+                box->max[1], box->max[2], box->material_index);
+    }
+    for (size_t i = 0; i < shapes->count[SHAPE_DISC]; i++) {
+        const Disc *disc = &shapes->discs[i];
+        const float *c = disc->center.data;
+        const float *n = disc->normal.data;
+        fprintf(out, "disc %.9g %.9g %.9g %.9g %.9g %.9g %.9g m%u\n", c[0], c[1], c[2], n[0], n[1], n[2],
+                disc->radius, disc->material_index);
+    }
+    for (size_t i = 0; i < shapes->count[SHAPE_CYLINDER]; i++) {
+        const Cylinder *cylinder = &shapes->cylinders[i];
+        const float *b = cylinder->base.data;
+        const float *a = cylinder->axis.data;
+        float h = cylinder->height;
+        fprintf(out, "cylinder %.9g %.9g %.9g %.9g %.9g %.9g %.9g m%u\n", b[0], b[1], b[2], b[0] + a[0] * h,
+                b[1] + a[1] * h, b[2] + a[2] * h, cylinder->radius, cylinder->material_index);
+    }
+    for (size_t i = 0; i < shapes->count[SHAPE_FIELD]; i++) {
+        const SphereField *field = &shapes->fields[i];
+        fprintf(out, "field %.9g %.9g %.9g %d %d %d %.9g %.9g m%u variation %.9g jitter %.9g fill %.9g materials %u"
+                " seed %u\n", field->min[0], field->min[1], field->min[2], field->cells[0], field->cells[1],
+                field->cells[2], field->spacing, field->radius, field->material_index, field->radius_variation,
+                field->jitter, field->fill, field->material_count, field->seed);
+    }
+}
+
+bool scene_save_text(const Scene *scene, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open output file %s.\n", path);
+        return false;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    const Camera *camera = &scene->camera;
+    static const char *light_modes[] = { "exact", "cull", "sample", "tiled" };
+    static const char *accels[] = { "auto", "bvh", "grid", "hashgrid", "qbvh", "compact" };
+    fprintf(out, "render width %d height %d samples %d max_depth %d rr_depth %d integrator %s spp %d"
+            " lights %s light_threshold %.9g environment %.9g shutter %.9g accel %s\n",
+            scene->settings.width, scene->settings.height, scene->settings.super_sampling,
+            scene->settings.max_depth, scene->settings.rr_depth,
+            scene->settings.integrator == INTEGRATOR_PATH ? "path" : "whitted", scene->settings.samples,
+            light_modes[scene->settings.light_sampling], scene->settings.light_threshold, scene->settings.environment,
+            scene->settings.shutter, accels[scene->settings.accel]);
+    fprintf(out, "camera position %.9g %.9g %.9g look_at %.9g %.9g %.9g fov %.6g\n",
+            camera->position.data[0], camera->position.data[1], camera->position.data[2],
+            camera->look_at.data[0], camera->look_at.data[1], camera->look_at.data[2],
+            camera->fov * 180.0 / M_PI);
+
+    for (size_t i = 0; i < scene->num_lights; i++) {
+        const Light *light = &scene->lights[i];
+        fprintf(out, "light %.9g %.9g %.9g %.9g",
+                light->position.data[0], light->position.data[1], light->position.data[2], light->intensity);
+        if (light->radius > 0.0f) {
+            fprintf(out, " radius %.9g", light->radius);
+        }
+        if (light->range > 0.0f) {
+            fprintf(out, " range %.9g", light->range);
+        }
+        fputc('\n', out);
+    }
+
+    for (size_t i = 0; i < scene->num_materials; i++) {
+        const Material *material = &scene->materials[i];
+        const Vec3f *color = &material->material_color;
+        fprintf(out, "material m%zu %.9g %.9g %.9g", i, color->data[0], color->data[1], color->data[2]);
+        if (material->reflectivity > 0.0f) {
+            fprintf(out, " reflect %.9g", material->reflectivity);
+        }
+        if (material->transparency > 0.0f) {
+            fprintf(out, " transparency %.9g ior %.9g", material->transparency, material->refractive_index);
+        }
+        if (material->roughness > 0.0f) {
+            fprintf(out, " roughness %.9g", material->roughness);
+        }
+        if (material_has_specular(material)) {
+            const Vec3f *specular = &material->specular_color;
+            fprintf(out, " specular %.9g %.9g %.9g exponent %.9g", specular->data[0], specular->data[1],
+                    specular->data[2], material->specular_exponent);
+        }
+        const Vec3f *emission = &material->emission;
+        if (emission->data[0] > 0.0f || emission->data[1] > 0.0f || emission->data[2] > 0.0f) {
+            fprintf(out, " emission %.9g %.9g %.9g", emission->data[0], emission->data[1], emission->data[2]);
+        }
+        fputc('\n', out);
+    }
+
+    write_geometry(out, scene->spheres, scene->num_spheres, scene->sphere_motion, &scene->mesh);
+    write_shapes(out, &scene->shapes);
+    for (size_t i = 0; i < scene->num_objects; i++) {
+        const SceneObject *object = &scene->objects[i];
+        fprintf(out, "object o%zu\n", i);
+        write_geometry(out, object->spheres, object->num_spheres, NULL, &object->mesh);
+        fputs("end\n", out);
+    }
+    for (size_t i = 0; i < scene->num_instances; i++) {
+        const Instance *instance = &scene->instances[i];
+        const float(*m)[4] = instance->object_to_world;
+        fprintf(out, "instance o%u matrix", instance->object);
+        for (int row = 0; row < 3; row++) {
+            fprintf(out, " %.9g %.9g %.9g %.9g", m[row][0], m[row][1], m[row][2], m[row][3]);
+        }
+        fputc('\n', out);
+    }
+
+    bool ok = !ferror(out);
+    if (fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to write scene file %s.\n", path);
+    }
+    return ok;
+}
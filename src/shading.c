@@ -0,0 +1,151 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/shading.h"
+
+// shading_light_terms and the loops in shading_batch_lights evaluate the
+// same expressions in the same order, so a hit gets the same color whether
+// it was shaded alone or in a batch.
+
+LightTerms shading_light_terms(const Light *light, Vec3f point, Vec3f normal, Vec3f view, float exponent) {
+    LightTerms terms = { 0.0f, 0.0f };
+    const float *n = normal.data;
+    float dx = light->position.data[0] - point.data[0];
+    float dy = light->position.data[1] - point.data[1];
+    float dz = light->position.data[2] - point.data[2];
+    float d2 = dx * dx + dy * dy + dz * dz;
+    float inv = 1.0f / sqrtf(d2);
+    float cos_l = (dx * n[0] + dy * n[1] + dz * n[2]) * inv;
+    if (!(cos_l > 0.0f)) {
+        return terms;
+    }
+    float scale = light->intensity * light_falloff(light->range, d2 * inv);
+    if (scale <= 0.0f) {
+        return terms;
+    }
+    terms.irradiance = scale * cos_l;
+
+    float hx = dx * inv + view.data[0];
+    float hy = dy * inv + view.data[1];
+    float hz = dz * inv + view.data[2];
+    float cos_h = (hx * n[0] + hy * n[1] + hz * n[2]) / sqrtf(hx * hx + hy * hy + hz * hz);
+    if (cos_h > 0.0f) {
+        terms.highlight = scale * powf(cos_h, exponent);
+    }
+    return terms;
+}
+
+#define BATCH_ARRAYS 14
+
+// Carves the batch's arrays out of block, BATCH_ARRAYS * capacity floats.
+static bool batch_init_block(ShadingBatch *batch, float *block, size_t capacity) {
+    memset(batch, 0, sizeof(*batch));
+    if (block == NULL) {
+        return false;
+    }
+    float **arrays[BATCH_ARRAYS] = {
+        &batch->px, &batch->py, &batch->pz, &batch->nx, &batch->ny, &batch->nz, &batch->vx,
+        &batch->vy, &batch->vz, &batch->exponent, &batch->irradiance, &batch->highlight,
+        &batch->light_scale, &batch->cos_half,
+    };
+    for (int a = 0; a < BATCH_ARRAYS; a++) {
+        *arrays[a] = block + a * capacity;
+    }
+    batch->capacity = capacity;
+    return true;
+}
+
+bool shading_batch_init(ShadingBatch *batch, size_t capacity) {
+    return batch_init_block(batch, (float *)malloc(BATCH_ARRAYS * capacity * sizeof(float)), capacity);
+}
+
+bool shading_batch_init_in(ShadingBatch *batch, Arena *arena, size_t capacity) {
+    return batch_init_block(batch, (float *)arena_alloc(arena, BATCH_ARRAYS * capacity * sizeof(float)), capacity);
+}
+
+void shading_batch_free(ShadingBatch *batch) {
+    free(batch->px); // start of the block
+    memset(batch, 0, sizeof(*batch));
+}
+
+size_t shading_batch_add(ShadingBatch *batch, Vec3f point, Vec3f normal, Vec3f view, const Material *material) {
+    size_t slot = batch->count++;
+    batch->px[slot] = point.data[0];
+    batch->py[slot] = point.data[1];
+    batch->pz[slot] = point.data[2];
+    batch->nx[slot] = normal.data[0];
+    batch->ny[slot] = normal.data[1];
+    batch->nz[slot] = normal.data[2];
+    batch->vx[slot] = view.data[0];
+    batch->vy[slot] = view.data[1];
+    batch->vz[slot] = view.data[2];
+    batch->exponent[slot] = material->specular_exponent;
+    batch->irradiance[slot] = 0.0f;
+    batch->highlight[slot] = 0.0f;
+    batch->any_specular = batch->any_specular || material_has_specular(material);
+    return slot;
+}
+
+// One light against n hits: everything but the power, computed
+// unconditionally and then selected so that the loop has no branches and
+// vectorizes. Unlit hits (including a NaN cosine for a light at the point)
+// get a scale of 0. The restrict parameters spare the compiler run-time
+// alias checks between the arrays.
+static void light_pass(size_t n, const Light *light, const float *restrict px, const float *restrict py,
+                       const float *restrict pz, const float *restrict nx, const float *restrict ny,
+                       const float *restrict nz, const float *restrict vx, const float *restrict vy,
+                       const float *restrict vz, float *restrict irradiance, float *restrict light_scale,
+                       float *restrict cos_half) {
+    const float lx = light->position.data[0];
+    const float ly = light->position.data[1];
+    const float lz = light->position.data[2];
+    const float intensity = light->intensity;
+    // A light without a range divides by infinity, giving x = 0 and a window
+    // of 1 as in light_falloff.
+    const float range = light->range > 0.0f ? light->range : INFINITY;
+
+    for (size_t i = 0; i < n; i++) {
+        float dx = lx - px[i];
+        float dy = ly - py[i];
+        float dz = lz - pz[i];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        float inv = 1.0f / sqrtf(d2);
+        float cos_l = (dx * nx[i] + dy * ny[i] + dz * nz[i]) * inv;
+        float x = d2 * inv / range;
+        float x2 = x * x;
+        float window = 1.0f - x2 * x2;
+        window = window > 0.0f ? window : 0.0f;
+        float lit = intensity * (window * window);
+        float scale = cos_l > 0.0f ? lit : 0.0f;
+        float term = scale * cos_l;
+        irradiance[i] += scale > 0.0f ? term : 0.0f;
+        light_scale[i] = scale;
+
+        float hx = dx * inv + vx[i];
+        float hy = dy * inv + vy[i];
+        float hz = dz * inv + vz[i];
+        cos_half[i] = (hx * nx[i] + hy * ny[i] + hz * nz[i]) / sqrtf(hx * hx + hy * hy + hz * hz);
+    }
+}
+
+static void highlight_pass(size_t n, const float *restrict light_scale, const float *restrict cos_half,
+                           const float *restrict exponent, float *restrict highlight) {
+    for (size_t i = 0; i < n; i++) {
+        if (light_scale[i] > 0.0f && cos_half[i] > 0.0f) {
+            highlight[i] += light_scale[i] * powf(cos_half[i], exponent[i]);
+        }
+    }
+}
+
+void shading_batch_lights(ShadingBatch *batch, const Light *lights, const uint32_t *indices, size_t count) {
+    for (size_t k = 0; k < count; k++) {
+        const Light *light = &lights[indices != NULL ? indices[k] : k];
+        light_pass(batch->count, light, batch->px, batch->py, batch->pz, batch->nx, batch->ny, batch->nz, batch->vx,
+                   batch->vy, batch->vz, batch->irradiance, batch->light_scale, batch->cos_half);
+        // powf has no vector version without a vector math library, so the
+        // highlight gets its own scalar loop, skipped for matte batches.
+        if (batch->any_specular) {
+            highlight_pass(batch->count, batch->light_scale, batch->cos_half, batch->exponent, batch->highlight);
+        }
+    }
+}
@@ -0,0 +1,505 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/shapes.h"
+
+void shapes_free(Shapes *shapes) {
+  for (int kind = 0; kind < SHAPE_KINDS; kind++) {
+    bvh_free(&shapes->bvh[kind]);
+  }
+  bool owned = false;
+  for (int kind = 0; kind < SHAPE_KINDS; kind++) {
+    owned = owned || shapes->capacity[kind] > 0;
+  }
+  if (owned) {
+    free(shapes->planes);
+    free(shapes->boxes);
+    free(shapes->discs);
+    free(shapes->cylinders);
+    free(shapes->fields);
+  }
+  memset(shapes, 0, sizeof(*shapes));
+}
+
+size_t shapes_total(const Shapes *shapes) {
+  size_t total = 0;
+  for (int kind = 0; kind < SHAPE_KINDS; kind++) {
+    total += shapes->count[kind];
+  }
+  return total;
+}
+
+// Appends element (element_size bytes) to *array, doubling it when full.
+static bool push(void **array, size_t *count, size_t *capacity, const void *element, size_t element_size) {
+  if (*count == *capacity) {
+    size_t grown = *capacity ? *capacity * 2 : 16;
+    void *resized = realloc(*array, grown * element_size);
+    if (resized == NULL) {
+      return false;
+    }
+    *array = resized;
+    *capacity = grown;
+  }
+  memcpy((char *)*array + *count * element_size, element, element_size);
+  (*count)++;
+  return true;
+}
+
+bool shapes_add_plane(Shapes *shapes, const Plane *plane) {
+  return push((void **)&shapes->planes, &shapes->count[SHAPE_PLANE], &shapes->capacity[SHAPE_PLANE], plane,
+              sizeof(Plane));
+}
+
+bool shapes_add_box(Shapes *shapes, const Box *box) {
+  return push((void **)&shapes->boxes, &shapes->count[SHAPE_BOX], &shapes->capacity[SHAPE_BOX], box, sizeof(Box));
+}
+
+bool shapes_add_disc(Shapes *shapes, const Disc *disc) {
+  return push((void **)&shapes->discs, &shapes->count[SHAPE_DISC], &shapes->capacity[SHAPE_DISC], disc,
+              sizeof(Disc));
+}
+
+bool shapes_add_cylinder(Shapes *shapes, const Cylinder *cylinder) {
+  return push((void **)&shapes->cylinders, &shapes->count[SHAPE_CYLINDER], &shapes->capacity[SHAPE_CYLINDER],
+              cylinder, sizeof(Cylinder));
+}
+
+bool shapes_add_field(Shapes *shapes, const SphereField *field) {
+  return push((void **)&shapes->fields, &shapes->count[SHAPE_FIELD], &shapes->capacity[SHAPE_FIELD], field,
+              sizeof(SphereField));
+}
+
+// Half extent along each axis of a disc of radius r with normal n (of the
+// rim, the circle every cap and disc is): r * sqrt(1 - n_k^2).
+static void circle_extent(Vec3f n, float r, float extent[3]) {
+  for (int k = 0; k < 3; k++) {
+    extent[k] = r * sqrtf(fmaxf(0.0f, 1.0f - n.data[k] * n.data[k]));
+  }
+}
+
+static void shape_bounds(const Shapes *shapes, ShapeKind kind, size_t i, float bounds[6]) {
+  float extent[3];
+  if (kind == SHAPE_BOX) {
+    memcpy(bounds, shapes->boxes[i].min, 3 * sizeof(float));
+    memcpy(bounds + 3, shapes->boxes[i].max, 3 * sizeof(float));
+  } else if (kind == SHAPE_DISC) {
+    const Disc *disc = &shapes->discs[i];
+    circle_extent(disc->normal, disc->radius, extent);
+    for (int k = 0; k < 3; k++) {
+      bounds[k] = disc->center.data[k] - extent[k];
+      bounds[3 + k] = disc->center.data[k] + extent[k];
+    }
+  } else if (kind == SHAPE_FIELD) {
+    const SphereField *field = &shapes->fields[i];
+    for (int k = 0; k < 3; k++) {
+      bounds[k] = field->min[k];
+      bounds[3 + k] = field->min[k] + (float)field->cells[k] * field->spacing;
+    }
+  } else {
+    const Cylinder *cylinder = &shapes->cylinders[i];
+    circle_extent(cylinder->axis, cylinder->radius, extent);
+    for (int k = 0; k < 3; k++) {
+      float a = cylinder->base.data[k];
+      float b = a + cylinder->axis.data[k] * cylinder->height;
+      bounds[k] = fminf(a, b) - extent[k];
+      bounds[3 + k] = fmaxf(a, b) + extent[k];
+    }
+  }
+}
+
+bool shapes_build(Shapes *shapes) {
+  for (int kind = SHAPE_BOX; kind < SHAPE_KINDS; kind++) {
+    BVH *bvh = &shapes->bvh[kind];
+    bvh_free(bvh);
+    size_t count = shapes->count[kind];
+    if (count < SHAPES_BVH_MIN_COUNT) {
+      continue;
+    }
+    float(*bounds)[6] = (float(*)[6])malloc(count * sizeof(*bounds));
+    if (bounds == NULL) {
+      fprintf(stderr, "Memory allocation failed.\n");
+      return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+      shape_bounds(shapes, (ShapeKind)kind, i, bounds[i]);
+    }
+    bool ok = bvh_build_boxes(bvh, (const float(*)[6])bounds, count);
+    free(bounds);
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The "lowbias32" integer finalizer.
+static inline uint32_t mix(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// The next value of a cell's hash sequence, in [0, 1).
+static inline float next_unit(uint32_t *h) {
+  *h = mix(*h + 0x9e3779b9u);
+  return (float)(*h >> 8) * 0x1p-24f;
+}
+
+bool sphere_field_cell(const SphereField *field, int32_t x, int32_t y, int32_t z, Sphere *sphere) {
+  if (x < 0 || y < 0 || z < 0 || x >= field->cells[0] || y >= field->cells[1] || z >= field->cells[2]) {
+    return false;
+  }
+  uint32_t h = mix(mix(mix(field->seed ^ (uint32_t)x) ^ (uint32_t)y) ^ (uint32_t)z);
+  if (next_unit(&h) >= field->fill) {
+    return false;
+  }
+  float radius = field->radius * (1.0f - field->radius_variation * next_unit(&h));
+  // Room to move while staying inside the cell.
+  float room = (0.5f * field->spacing - radius) * field->jitter;
+  const int32_t cell[3] = { x, y, z };
+  for (int k = 0; k < 3; k++) {
+    float center = field->min[k] + ((float)cell[k] + 0.5f) * field->spacing;
+    sphere->center.data[k] = center + room * (2.0f * next_unit(&h) - 1.0f);
+  }
+  sphere->radius = radius;
+  uint32_t pick = field->material_count > 1 ? (uint32_t)(next_unit(&h) * (float)field->material_count) : 0;
+  sphere->material_index = field->material_index + (pick < field->material_count ? pick : 0);
+  return true;
+}
+
+// The kernels. Each tests one shape against the ray and, like
+// sphere_intersect_closer, only accepts hits in (0, hit->t). They share the
+// BVHLeafFn signature so they serve both as BVH leaves and in the loops.
+
+typedef struct {
+  const Shapes *shapes;
+  uint32_t first_id; // of this kind's first shape
+} KindSet;
+
+static inline void accept(Hit *hit, float t, uint32_t prim_id) {
+  hit->t = t;
+  hit->prim_id = prim_id;
+}
+
+static bool plane_intersect(const void *context, uint32_t index, const Ray *ray, Hit *hit) {
+  const KindSet *set = (const KindSet *)context;
+  const Plane *plane = &set->shapes->planes[index];
+  // Parallel rays divide by 0 into an infinity or NaN, which fails the test.
+  float t = (plane->offset - vec3f_dot(plane->normal, ray->origin)) / vec3f_dot(plane->normal, ray->direction);
+  if (!(t > 0.0f && t < hit->t)) {
+    return false;
+  }
+  accept(hit, t, set->first_id + index);
+  return true;
+}
+
+static bool box_intersect(const void *context, uint32_t index, const Ray *ray, Hit *hit) {
+  const KindSet *set = (const KindSet *)context;
+  const Box *box = &set->shapes->boxes[index];
+  float t_near = -INFINITY;
+  float t_far = INFINITY;
+  for (int k = 0; k < 3; k++) {
+    float inv = 1.0f / ray->direction.data[k];
+    float t0 = (box->min[k] - ray->origin.data[k]) * inv;
+    float t1 = (box->max[k] - ray->origin.data[k]) * inv;
+    t_near = fmaxf(t_near, fminf(t0, t1));
+    t_far = fminf(t_far, fmaxf(t0, t1));
+  }
+  // From inside the box, the exit is the hit.
+  float t = t_near > 0.0f ? t_near : t_far;
+  if (!(t_near <= t_far && t > 0.0f && t < hit->t)) {
+    return false;
+  }
+  accept(hit, t, set->first_id + index);
+  return true;
+}
+
+static bool disc_intersect(const void *context, uint32_t index, const Ray *ray, Hit *hit) {
+  const KindSet *set = (const KindSet *)context;
+  const Disc *disc = &set->shapes->discs[index];
+  float t = vec3f_dot(disc->normal, vec3f_sub(disc->center, ray->origin)) / vec3f_dot(disc->normal, ray->direction);
+  if (!(t > 0.0f && t < hit->t)) {
+    return false;
+  }
+  Vec3f offset = vec3f_sub(ray_at(ray, t), disc->center);
+  if (vec3f_dot(offset, offset) > disc->radius * disc->radius) {
+    return false;
+  }
+  accept(hit, t, set->first_id + index);
+  return true;
+}
+
+// The side is a quadratic in the components perpendicular to the axis,
+// limited to the height; each cap is a disc test at one end.
+static bool cylinder_intersect(const void *context, uint32_t index, const Ray *ray, Hit *hit) {
+  const KindSet *set = (const KindSet *)context;
+  const Cylinder *cylinder = &set->shapes->cylinders[index];
+  Vec3f oc = vec3f_sub(ray->origin, cylinder->base);
+  float o_axial = vec3f_dot(oc, cylinder->axis);
+  float d_axial = vec3f_dot(ray->direction, cylinder->axis);
+  Vec3f o_perp, d_perp;
+  for (int k = 0; k < 3; k++) {
+    o_perp.data[k] = oc.data[k] - o_axial * cylinder->axis.data[k];
+    d_perp.data[k] = ray->direction.data[k] - d_axial * cylinder->axis.data[k];
+  }
+  float radius2 = cylinder->radius * cylinder->radius;
+  float best = hit->t;
+
+  float a = vec3f_dot(d_perp, d_perp);
+  float half_b = vec3f_dot(o_perp, d_perp);
+  float c = vec3f_dot(o_perp, o_perp) - radius2;
+  float discriminant = half_b * half_b - a * c;
+  if (a > 0.0f && discriminant >= 0.0f) {
+    float root = sqrtf(discriminant);
+    float roots[2] = { (-half_b - root) / a, (-half_b + root) / a };
+    for (int r = 0; r < 2; r++) {
+      float axial = o_axial + roots[r] * d_axial;
+      if (roots[r] > 0.0f && roots[r] < best && axial >= 0.0f && axial <= cylinder->height) {
+        best = roots[r];
+        break;
+      }
+    }
+  }
+
+  if (d_axial != 0.0f) {
+    const float caps[2] = { 0.0f, cylinder->height };
+    for (int cap = 0; cap < 2; cap++) {
+      float t = (caps[cap] - o_axial) / d_axial;
+      if (!(t > 0.0f && t < best)) {
+        continue;
+      }
+      float r2 = 0.0f;
+      for (int k = 0; k < 3; k++) {
+        float p = o_perp.data[k] + t * d_perp.data[k];
+        r2 += p * p;
+      }
+      if (r2 <= radius2) {
+        best = t;
+      }
+    }
+  }
+
+  if (!(best < hit->t)) {
+    return false;
+  }
+  accept(hit, best, set->first_id + index);
+  return true;
+}
+
+// Clips the ray to the field's box, then steps from cell to cell in the
+// order the ray enters them until a sphere is hit or the next cell starts
+// beyond the box or the current closest hit.
+static bool field_intersect(const void *context, uint32_t index, const Ray *ray, Hit *hit) {
+  const KindSet *set = (const KindSet *)context;
+  const SphereField *field = &set->shapes->fields[index];
+  const float *o = ray->origin.data;
+  const float *d = ray->direction.data;
+  float t_enter = 0.0f;
+  float t_exit = hit->t;
+  float inv[3];
+  for (int k = 0; k < 3; k++) {
+    inv[k] = 1.0f / d[k];
+    float t0 = (field->min[k] - o[k]) * inv[k];
+    float t1 = (field->min[k] + (float)field->cells[k] * field->spacing - o[k]) * inv[k];
+    t_enter = fmaxf(t_enter, fminf(t0, t1));
+    t_exit = fminf(t_exit, fmaxf(t0, t1));
+  }
+  if (!(t_enter <= t_exit)) {
+    return false;
+  }
+
+  int32_t cell[3], step[3];
+  float t_next[3], t_delta[3];
+  for (int k = 0; k < 3; k++) {
+    float position = (o[k] + d[k] * t_enter - field->min[k]) / field->spacing;
+    float first = fminf(fmaxf(floorf(position), 0.0f), (float)(field->cells[k] - 1));
+    cell[k] = (int32_t)first;
+    step[k] = d[k] < 0.0f ? -1 : 1;
+    float boundary = field->min[k] + (first + (d[k] < 0.0f ? 0.0f : 1.0f)) * field->spacing;
+    // A ray parallel to the cell walls never crosses one (infinite steps).
+    t_next[k] = d[k] != 0.0f ? (boundary - o[k]) * inv[k] : INFINITY;
+    t_delta[k] = d[k] != 0.0f ? field->spacing * fabsf(inv[k]) : INFINITY;
+  }
+
+  for (;;) {
+    Sphere sphere;
+    if (sphere_field_cell(field, cell[0], cell[1], cell[2], &sphere) &&
+        sphere_intersect_closer(&sphere, ray, set->first_id + index, hit)) {
+      return true;
+    }
+    int k = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+    if (t_next[k] > t_exit) {
+      return false;
+    }
+    cell[k] += step[k];
+    if (cell[k] < 0 || cell[k] >= field->cells[k]) {
+      return false;
+    }
+    t_next[k] += t_delta[k];
+  }
+}
+
+static const BVHLeafFn kernels[SHAPE_KINDS] = { plane_intersect, box_intersect, disc_intersect, cylinder_intersect,
+                                                field_intersect };
+
+// Every shape of a kind without a BVH. The switch sits outside the loops,
+// so each loop calls (and inlines) a single kernel.
+static bool intersect_kind(const KindSet *set, ShapeKind kind, size_t count, const Ray *ray, Hit *hit) {
+  bool found = false;
+  switch (kind) {
+  case SHAPE_PLANE:
+    for (size_t i = 0; i < count; i++) {
+      found |= plane_intersect(set, (uint32_t)i, ray, hit);
+    }
+    break;
+  case SHAPE_BOX:
+    for (size_t i = 0; i < count; i++) {
+      found |= box_intersect(set, (uint32_t)i, ray, hit);
+    }
+    break;
+  case SHAPE_DISC:
+    for (size_t i = 0; i < count; i++) {
+      found |= disc_intersect(set, (uint32_t)i, ray, hit);
+    }
+    break;
+  case SHAPE_CYLINDER:
+    for (size_t i = 0; i < count; i++) {
+      found |= cylinder_intersect(set, (uint32_t)i, ray, hit);
+    }
+    break;
+  default:
+    for (size_t i = 0; i < count; i++) {
+      found |= field_intersect(set, (uint32_t)i, ray, hit);
+    }
+    break;
+  }
+  return found;
+}
+
+bool shapes_intersect(const Shapes *shapes, uint32_t first_id, const Ray *ray, Hit *hit) {
+  bool found = false;
+  KindSet set = { shapes, first_id };
+  for (int kind = 0; kind < SHAPE_KINDS; kind++) {
+    size_t count = shapes->count[kind];
+    if (count == 0) {
+      continue;
+    }
+    if (shapes->bvh[kind].num_nodes > 0) {
+      found |= bvh_intersect_leaves(&shapes->bvh[kind], kernels[kind], &set, ray, hit);
+    } else {
+      found |= intersect_kind(&set, (ShapeKind)kind, count, ray, hit);
+    }
+    set.first_id += (uint32_t)count;
+  }
+  return found;
+}
+
+static Vec3f box_normal(const Box *box, Vec3f point) {
+  // The face the point is nearest to, relative to the box's size along that
+  // axis, so thin boxes pick their broad faces.
+  int best_axis = 0;
+  float best_sign = 1.0f;
+  float best_distance = INFINITY;
+  for (int k = 0; k < 3; k++) {
+    float size = fmaxf(box->max[k] - box->min[k], 1e-20f);
+    float to_min = fabsf(point.data[k] - box->min[k]) / size;
+    float to_max = fabsf(point.data[k] - box->max[k]) / size;
+    if (to_min < best_distance) {
+      best_distance = to_min;
+      best_axis = k;
+      best_sign = -1.0f;
+    }
+    if (to_max < best_distance) {
+      best_distance = to_max;
+      best_axis = k;
+      best_sign = 1.0f;
+    }
+  }
+  Vec3f normal = vec3f_init();
+  normal.data[best_axis] = best_sign;
+  return normal;
+}
+
+static Vec3f cylinder_normal(const Cylinder *cylinder, Vec3f point) {
+  Vec3f offset = vec3f_sub(point, cylinder->base);
+  float axial = vec3f_dot(offset, cylinder->axis);
+  Vec3f radial;
+  for (int k = 0; k < 3; k++) {
+    radial.data[k] = offset.data[k] - axial * cylinder->axis.data[k];
+  }
+  float radial_length = vec3f_norm(radial);
+  // Whichever surface the point lies closer to: the side or a cap.
+  float to_side = fabsf(radial_length - cylinder->radius);
+  float to_cap = fminf(fabsf(axial), fabsf(axial - cylinder->height));
+  if (to_cap < to_side || radial_length == 0.0f) {
+    float sign = fabsf(axial) < fabsf(axial - cylinder->height) ? -1.0f : 1.0f;
+    return vec3f_init_values(sign * cylinder->axis.data[0], sign * cylinder->axis.data[1],
+                             sign * cylinder->axis.data[2]);
+  }
+  float inv = 1.0f / radial_length;
+  return vec3f_init_values(radial.data[0] * inv, radial.data[1] * inv, radial.data[2] * inv);
+}
+
+// Hits keep only the field, so the sphere is found again from the point:
+// of the spheres in its cell and the neighbours (the point may round across
+// a wall), the one whose surface it lies on.
+static void field_normal(const SphereField *field, Vec3f point, Vec3f *normal, uint32_t *material_index) {
+  int32_t cell[3];
+  for (int k = 0; k < 3; k++) {
+    cell[k] = (int32_t)floorf((point.data[k] - field->min[k]) / field->spacing);
+  }
+  Sphere best = { vec3f_init(), 1.0f, field->material_index };
+  float best_error = INFINITY;
+  for (int32_t dz = -1; dz <= 1; dz++) {
+    for (int32_t dy = -1; dy <= 1; dy++) {
+      for (int32_t dx = -1; dx <= 1; dx++) {
+        Sphere sphere;
+        if (!sphere_field_cell(field, cell[0] + dx, cell[1] + dy, cell[2] + dz, &sphere)) {
+          continue;
+        }
+        float error = fabsf(vec3f_norm(vec3f_sub(point, sphere.center)) - sphere.radius);
+        if (error < best_error) {
+          best_error = error;
+          best = sphere;
+        }
+      }
+    }
+  }
+  float inv_radius = 1.0f / best.radius;
+  for (int k = 0; k < 3; k++) {
+    normal->data[k] = (point.data[k] - best.center.data[k]) * inv_radius;
+  }
+  *material_index = best.material_index;
+}
+
+void shapes_resolve(const Shapes *shapes, uint32_t index, Vec3f point, Vec3f *normal, uint32_t *material_index) {
+  if (index < shapes->count[SHAPE_PLANE]) {
+    *normal = shapes->planes[index].normal;
+    *material_index = shapes->planes[index].material_index;
+    return;
+  }
+  index -= (uint32_t)shapes->count[SHAPE_PLANE];
+  if (index < shapes->count[SHAPE_BOX]) {
+    *normal = box_normal(&shapes->boxes[index], point);
+    *material_index = shapes->boxes[index].material_index;
+    return;
+  }
+  index -= (uint32_t)shapes->count[SHAPE_BOX];
+  if (index < shapes->count[SHAPE_DISC]) {
+    *normal = shapes->discs[index].normal;
+    *material_index = shapes->discs[index].material_index;
+    return;
+  }
+  index -= (uint32_t)shapes->count[SHAPE_DISC];
+  if (index < shapes->count[SHAPE_CYLINDER]) {
+    *normal = cylinder_normal(&shapes->cylinders[index], point);
+    *material_index = shapes->cylinders[index].material_index;
+    return;
+  }
+  index -= (uint32_t)shapes->count[SHAPE_CYLINDER];
+  field_normal(&shapes->fields[index], point, normal, material_index);
+}
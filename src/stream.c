@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include "../include/scatter.h"
+#include "../include/stream.h"
+
+#define RNG_STREAM_STREAMED 0x57e4u
+
+// What a ray of a wave carries besides what chunks_trace needs.
+typedef struct {
+    Vec3f throughput; // its weight in the sample, after roulette
+    uint32_t sample;  // index into the pass's sample colors
+    int depth;
+    uint64_t branch;  // 1, then a bit per bounce (0 reflected, 1 refracted); seeds the ray's random numbers
+    bool scene_hit;   // the scene's own geometry was hit (a chunk hit, if any, is nearer)
+} StreamPath;
+
+// One wave's rays, and room for the (at most two) rays each spawns.
+typedef struct {
+    ChunkRay *rays;
+    StreamPath *paths;
+    Vec3f *colors;   // per ray: what it adds to its sample
+    bool *spawned;   // per child slot
+    size_t count;
+    size_t capacity;
+} Wave;
+
+static void wave_free(Wave *wave) {
+    free(wave->rays);
+    free(wave->paths);
+    free(wave->colors);
+    free(wave->spawned);
+    memset(wave, 0, sizeof(*wave));
+}
+
+static bool wave_reserve(Wave *wave, size_t capacity) {
+    if (capacity <= wave->capacity) {
+        return true;
+    }
+    Wave grown = { (ChunkRay *)realloc(wave->rays, capacity * sizeof(ChunkRay)),
+                   (StreamPath *)realloc(wave->paths, capacity * sizeof(StreamPath)),
+                   (Vec3f *)realloc(wave->colors, capacity * sizeof(Vec3f)),
+                   (bool *)realloc(wave->spawned, capacity * sizeof(bool)), wave->count, capacity };
+    // realloc leaves the old block alone on failure; keep whichever is live.
+    wave->rays = grown.rays != NULL ? grown.rays : wave->rays;
+    wave->paths = grown.paths != NULL ? grown.paths : wave->paths;
+    wave->colors = grown.colors != NULL ? grown.colors : wave->colors;
+    wave->spawned = grown.spawned != NULL ? grown.spawned : wave->spawned;
+    if (grown.rays == NULL || grown.paths == NULL || grown.colors == NULL || grown.spawned == NULL) {
+        return false;
+    }
+    wave->capacity = capacity;
+    return true;
+}
+
+// trace_secondary for a wave: whether the bounce survives max_depth and
+// Russian roulette, and if so the child ray it becomes.
+static bool spawn(const Scene *scene, const StreamPath *parent, Vec3f origin, Vec3f direction, float time,
+                  float weight, uint64_t lobe, RenderContext *context, ChunkRay *child, StreamPath *child_path) {
+    int next_depth = parent->depth + 1;
+    if (next_depth > scene->settings.max_depth || next_depth > RENDER_MAX_DEPTH_LIMIT) {
+        context->stats->depth_terminated++;
+        return false;
+    }
+
+    Vec3f next_throughput = scatter_scale(parent->throughput, weight);
+    if (next_depth >= scene->settings.rr_depth) {
+        float survive = scatter_max_component(next_throughput);
+        if (survive < 1.0f) {
+            if (rng_next_float(&context->rng) >= survive) {
+                context->stats->roulette_terminated++;
+                return false;
+            }
+            next_throughput = scatter_scale(next_throughput, 1.0f / survive);
+        }
+    }
+
+    child->ray = ray_init_at(origin, direction, time);
+    *child_path = (StreamPath){ next_throughput, parent->sample, next_depth, parent->branch << 1 | lobe, false };
+    return true;
+}
+
+// Shades ray i of the wave: its contribution to its sample goes to
+// colors[i], the mirror and glass rays it spawns to next slots 2i and
+// 2i + 1.
+static void shade_ray(const Scene *scene, int first_row, uint64_t first_sample, Wave *wave, size_t i, Wave *next,
+                      RenderContext *context) {
+    const int width = scene->settings.width;
+    const int samples_per_pixel = scene->settings.super_sampling * scene->settings.super_sampling;
+    const ChunkRay *traced = &wave->rays[i];
+    const StreamPath *path = &wave->paths[i];
+    next->spawned[2 * i] = next->spawned[2 * i + 1] = false;
+
+    if (!traced->found && !path->scene_hit) {
+        if (path->depth > 0) {
+            wave->colors[i] = scatter_mul(path->throughput, render_miss_color(scene, &traced->ray));
+        } else {
+            // No intersection, use the stretched background image
+            int pixel = (int)(path->sample / samples_per_pixel);
+            wave->colors[i] = render_screen_background(pixel % width, first_row + pixel / width, width,
+                                                       scene->settings.height);
+        }
+        return;
+    }
+
+    HitRecord record;
+    if (traced->found) {
+        record.point = ray_at(&traced->ray, traced->hit.t);
+        record.normal = traced->normal;
+        record.material = &scene->materials[traced->material_index];
+    } else {
+        scene_resolve_hit(scene, &traced->ray, &traced->hit, &record);
+    }
+    // Seeded per ray so the image doesn't depend on scheduling.
+    rng_seed(&context->rng, first_sample + path->sample, RNG_STREAM_STREAMED + path->branch);
+    Vec3f direct = render_direct_color(scene, &traced->ray, &record, context);
+    wave->colors[i] = path->depth > 0 ? scatter_mul(path->throughput, direct) : direct;
+
+    const Material *material = record.material;
+    if (material->reflectivity <= 0.0f && material->transparency <= 0.0f) {
+        return;
+    }
+    SurfaceLobes lobes;
+    scatter_lobes(material, traced->ray.direction, record.normal, &lobes);
+    if (lobes.reflect > 0.0f) {
+        Vec3f reflected = scatter_reflect(material, traced->ray.direction, &lobes, &context->rng);
+        next->spawned[2 * i] = spawn(scene, path, scatter_offset(record.point, lobes.normal, RAY_EPSILON), reflected,
+                                     traced->ray.time, lobes.reflect, 0, context, &next->rays[2 * i],
+                                     &next->paths[2 * i]);
+    }
+    if (lobes.refract > 0.0f) {
+        next->spawned[2 * i + 1] = spawn(scene, path, scatter_offset(record.point, lobes.normal, -RAY_EPSILON),
+                                         lobes.refracted, traced->ray.time, lobes.refract, 1, context,
+                                         &next->rays[2 * i + 1], &next->paths[2 * i + 1]);
+    }
+}
+
+// Traces and shades the wave, adding its colors to the samples, and
+// leaves the rays it spawns in next. False on failure.
+static bool run_wave(const Scene *scene, ChunkStore *store, Arena *arena, int first_row, uint64_t first_sample,
+                     Wave *wave, Wave *next, Vec3f *samples, RenderStats *stats) {
+    const long count = (long)wave->count;
+    if (!wave_reserve(next, 2 * wave->count)) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return false;
+    }
+
+    // The scene's own geometry first, so its hits bound the chunk search.
+#pragma omp parallel for schedule(dynamic, 256)
+    for (long i = 0; i < count; i++) {
+        ChunkRay *traced = &wave->rays[i];
+        traced->found = false;
+        wave->paths[i].scene_hit = scene_trace(scene, &traced->ray, &traced->hit);
+    }
+    if (!chunks_trace(store, arena, wave->rays, wave->count)) {
+        return false;
+    }
+
+#pragma omp parallel
+    {
+        RenderStats thread_stats;
+        memset(&thread_stats, 0, sizeof(thread_stats));
+        RenderContext context;
+        context.stats = &thread_stats;
+
+#pragma omp for schedule(dynamic, 256)
+        for (long i = 0; i < count; i++) {
+            thread_stats.rays[wave->paths[i].depth]++;
+            shade_ray(scene, first_row, first_sample, wave, (size_t)i, next, &context);
+        }
+
+#pragma omp critical
+        render_stats_add(stats, &thread_stats);
+    }
+
+    // Rays of one sample may sit anywhere in the wave, so the colors are
+    // added here rather than by the threads that computed them.
+    size_t spawned = 0;
+    for (size_t i = 0; i < wave->count; i++) {
+        Vec3f *sample = &samples[wave->paths[i].sample];
+        *sample = vec3f_add(*sample, wave->colors[i]);
+    }
+    for (size_t slot = 0; slot < 2 * wave->count; slot++) {
+        if (next->spawned[slot]) {
+            next->rays[spawned] = next->rays[slot];
+            next->paths[spawned] = next->paths[slot];
+            spawned++;
+        }
+    }
+    next->count = spawned;
+    return true;
+}
+
+uint64_t stream_render_frame(const Scene *scene, ChunkStore *store, Vec3f *frame_buffer, RenderStats *stats) {
+    const int width = scene->settings.width;
+    const int height = scene->settings.height;
+    const int super_sampling = scene->settings.super_sampling;
+    const int samples_per_pixel = super_sampling * super_sampling;
+    const size_t row_samples = (size_t)width * samples_per_pixel;
+    const int rows_per_pass = row_samples >= STREAM_PASS_SAMPLES ? 1 : (int)(STREAM_PASS_SAMPLES / row_samples);
+
+    CameraFrame camera;
+    camera_frame_init(&camera, &scene->camera, width, height);
+
+    RenderStats total;
+    memset(&total, 0, sizeof(total));
+    // The pass's samples and chunks_trace's queues. The waves grow and
+    // shrink from one bounce to the next, which suits realloc better than
+    // an arena that would keep every size they went through.
+    Arena arena;
+    arena_init(&arena, "stream frame", 0);
+    Wave wave, next;
+    memset(&wave, 0, sizeof(wave));
+    memset(&next, 0, sizeof(next));
+    Vec3f *samples = (Vec3f *)arena_alloc(&arena, (size_t)rows_per_pass * row_samples * sizeof(Vec3f));
+    bool ok = samples != NULL;
+
+    for (int y0 = 0; ok && y0 < height; y0 += rows_per_pass) {
+        int y1 = y0 + rows_per_pass < height ? y0 + rows_per_pass : height;
+        const uint64_t first_sample = (uint64_t)y0 * row_samples;
+        const Vec3f one = vec3f_init_values(1.0f, 1.0f, 1.0f);
+        // The last wave of the previous pass may have left a smaller buffer
+        // here.
+        wave.count = (size_t)(y1 - y0) * row_samples;
+        if (!wave_reserve(&wave, wave.count)) {
+            ok = false;
+            break;
+        }
+#pragma omp parallel for schedule(static)
+        for (int j = y0; j < y1; j++) {
+            size_t sample = (size_t)(j - y0) * row_samples;
+            for (int i = 0; i < width; i++) {
+                for (int s = 0; s < super_sampling; s++) {
+                    for (int t = 0; t < super_sampling; t++) {
+                        wave.rays[sample].ray = render_primary_ray(scene, &camera, i, j, s, t, super_sampling);
+                        wave.paths[sample] = (StreamPath){ one, (uint32_t)sample, 0, 1, false };
+                        samples[sample] = vec3f_init();
+                        sample++;
+                    }
+                }
+            }
+        }
+
+        while (ok && wave.count > 0) {
+            ok = run_wave(scene, store, &arena, y0, first_sample, &wave, &next, samples, &total);
+            Wave swap = wave;
+            wave = next;
+            next = swap;
+        }
+
+        // Average the accumulated pixel colors, adding the samples in the
+        // order render_frame does.
+        for (int j = y0; ok && j < y1; j++) {
+            for (int i = 0; i < width; i++) {
+                const Vec3f *sample = &samples[((size_t)(j - y0) * width + i) * samples_per_pixel];
+                Vec3f *pixel = &frame_buffer[i + j * width];
+                for (int s = 0; s < samples_per_pixel; s++) {
+                    *pixel = vec3f_add(*pixel, sample[s]);
+                }
+                pixel->data[0] /= samples_per_pixel;
+                pixel->data[1] /= samples_per_pixel;
+                pixel->data[2] /= samples_per_pixel;
+            }
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Streaming render failed.\n");
+    }
+    total.scratch_peak = arena.peak;
+    arena_free(&arena);
+    wave_free(&wave);
+    wave_free(&next);
+    if (stats != NULL) {
+        *stats = total;
+    }
+    return ok ? render_stats_total(&total) : 0;
+}
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include "../include/topology.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+static Topology topology;
+static bool detected = false;
+
+#ifdef __linux__
+// Calls fn for every CPU of a list such as "0-3,8-11".
+static void parse_cpu_list(const char *list, void (*fn)(uint32_t cpu, void *arg), void *arg) {
+  const char *p = list;
+  while (*p != '\0' && *p != '\n') {
+    char *end;
+    unsigned long first = strtoul(p, &end, 10);
+    if (end == p) {
+      return;
+    }
+    unsigned long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtoul(p + 1, &end, 10);
+      p = end;
+    }
+    for (unsigned long cpu = first; cpu <= last; cpu++) {
+      fn((uint32_t)cpu, arg);
+    }
+    if (*p == ',') {
+      p++;
+    }
+  }
+}
+
+// Reads a one-line /sys file into buffer; false when it can't be read.
+static bool read_line(const char *path, char *buffer, size_t size) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return false;
+  }
+  bool read = fgets(buffer, (int)size, file) != NULL;
+  fclose(file);
+  return read;
+}
+
+typedef struct {
+  Topology *topology;
+  uint32_t node;
+} NodeCpus;
+
+static void set_cpu_node(uint32_t cpu, void *arg) {
+  NodeCpus *node_cpus = (NodeCpus *)arg;
+  if (cpu < node_cpus->topology->num_cpus) {
+    node_cpus->topology->cpu_node[cpu] = node_cpus->node;
+  }
+}
+
+static int compare_ids(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// The nodes listed under /sys that have CPUs, densely renumbered.
+static void read_nodes(Topology *topology) {
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (dir == NULL) {
+    return;
+  }
+  int ids[1024];
+  size_t num_ids = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL && num_ids < sizeof(ids) / sizeof(ids[0])) {
+    int id;
+    char rest;
+    if (sscanf(entry->d_name, "node%d%c", &id, &rest) == 1) {
+      ids[num_ids++] = id;
+    }
+  }
+  closedir(dir);
+  qsort(ids, num_ids, sizeof(int), compare_ids);
+
+  uint32_t num_nodes = 0;
+  for (size_t n = 0; n < num_ids; n++) {
+    char path[64];
+    char list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[n]);
+    // Memory-only nodes have an empty list; they get no number.
+    if (!read_line(path, list, sizeof(list)) || list[0] == '\n' || list[0] == '\0') {
+      continue;
+    }
+    NodeCpus node_cpus = { topology, num_nodes++ };
+    parse_cpu_list(list, set_cpu_node, &node_cpus);
+  }
+  if (num_nodes > 0) {
+    topology->num_nodes = num_nodes;
+  }
+}
+
+typedef struct {
+  long package;
+  long core;
+  uint32_t cpu;
+} CoreKey;
+
+static int compare_core_keys(const void *a, const void *b) {
+  const CoreKey *x = (const CoreKey *)a;
+  const CoreKey *y = (const CoreKey *)b;
+  if (x->package != y->package) {
+    return x->package < y->package ? -1 : 1;
+  }
+  if (x->core != y->core) {
+    return x->core < y->core ? -1 : 1;
+  }
+  return x->cpu < y->cpu ? -1 : x->cpu > y->cpu ? 1 : 0;
+}
+
+// Cores by (package, core id); a CPU whose ids can't be read is a core of
+// its own.
+static void read_cores(Topology *topology) {
+  CoreKey *keys = (CoreKey *)malloc(topology->num_cpus * sizeof(CoreKey));
+  if (keys == NULL) {
+    return;
+  }
+  for (uint32_t cpu = 0; cpu < topology->num_cpus; cpu++) {
+    char path[96];
+    char package[32];
+    char core[32];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+    bool known = read_line(path, package, sizeof(package));
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+    known = read_line(path, core, sizeof(core)) && known;
+    keys[cpu] = known ? (CoreKey){ strtol(package, NULL, 10), strtol(core, NULL, 10), cpu }
+                      : (CoreKey){ LONG_MAX, (long)cpu, cpu };
+  }
+  qsort(keys, topology->num_cpus, sizeof(CoreKey), compare_core_keys);
+  uint32_t num_cores = 0;
+  uint32_t thread = 0;
+  for (uint32_t k = 0; k < topology->num_cpus; k++) {
+    bool same = k > 0 && keys[k].package == keys[k - 1].package && keys[k].core == keys[k - 1].core;
+    if (!same) {
+      num_cores++;
+      thread = 0;
+    }
+    topology->cpu_core[keys[k].cpu] = num_cores - 1;
+    topology->cpu_thread[keys[k].cpu] = thread++;
+  }
+  topology->num_cores = num_cores;
+  free(keys);
+}
+#endif
+
+const Topology *topology_get(void) {
+  if (detected) {
+    return &topology;
+  }
+  detected = true;
+  topology.num_cpus = 1;
+  topology.num_nodes = 1;
+#ifdef __linux__
+  long cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (cpus > 1) {
+    topology.num_cpus = (uint32_t)cpus;
+  }
+#endif
+  topology.cpu_node = (uint32_t *)calloc(topology.num_cpus, sizeof(uint32_t));
+  topology.cpu_core = (uint32_t *)calloc(topology.num_cpus, sizeof(uint32_t));
+  topology.cpu_thread = (uint32_t *)calloc(topology.num_cpus, sizeof(uint32_t));
+  if (topology.cpu_node == NULL || topology.cpu_core == NULL || topology.cpu_thread == NULL) {
+    // Every lookup falls back to node 0, and no CPU is known.
+    free(topology.cpu_node);
+    free(topology.cpu_core);
+    free(topology.cpu_thread);
+    topology.cpu_node = topology.cpu_core = topology.cpu_thread = NULL;
+    topology.num_cpus = 0;
+    topology.num_cores = 0;
+    return &topology;
+  }
+  for (uint32_t cpu = 0; cpu < topology.num_cpus; cpu++) {
+    topology.cpu_core[cpu] = cpu;
+  }
+  topology.num_cores = topology.num_cpus;
+#ifdef __linux__
+  read_nodes(&topology);
+  read_cores(&topology);
+#endif
+  return &topology;
+}
+
+uint32_t topology_current_node(const Topology *topology) {
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  if (cpu >= 0 && (uint32_t)cpu < topology->num_cpus) {
+    return topology->cpu_node[cpu];
+  }
+#else
+  (void)topology;
+#endif
+  return 0;
+}
+
+static const Topology *sorted_topology; // for compare_worker_cpus; qsort takes no context
+
+static int compare_worker_cpus(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  const Topology *topology = sorted_topology;
+  uint32_t keys_x[3] = { topology->cpu_thread[x], topology->cpu_node[x], topology->cpu_core[x] };
+  uint32_t keys_y[3] = { topology->cpu_thread[y], topology->cpu_node[y], topology->cpu_core[y] };
+  for (int k = 0; k < 3; k++) {
+    if (keys_x[k] != keys_y[k]) {
+      return keys_x[k] < keys_y[k] ? -1 : 1;
+    }
+  }
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+uint32_t topology_worker_cpus(const Topology *topology, uint32_t *cpus, uint32_t max) {
+  uint32_t *usable = (uint32_t *)malloc((topology->num_cpus > 0 ? topology->num_cpus : 1) * sizeof(uint32_t));
+  if (usable == NULL) {
+    return 0;
+  }
+  uint32_t count = 0;
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    CPU_ZERO(&allowed);
+  }
+  for (uint32_t cpu = 0; cpu < topology->num_cpus && cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      usable[count++] = cpu;
+    }
+  }
+#else
+  for (uint32_t cpu = 0; cpu < topology->num_cpus; cpu++) {
+    usable[count++] = cpu;
+  }
+#endif
+  sorted_topology = topology;
+  qsort(usable, count, sizeof(uint32_t), compare_worker_cpus);
+  memcpy(cpus, usable, (count < max ? count : max) * sizeof(uint32_t));
+  free(usable);
+  return count;
+}
+
+bool topology_pin(uint32_t cpu) {
+#ifdef __linux__
+  if (cpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+bool topology_run_on_node(const Topology *topology, uint32_t node, void (*fn)(void *arg), void *arg) {
+#ifdef __linux__
+  cpu_set_t saved, on_node;
+  if (sched_getaffinity(0, sizeof(saved), &saved) != 0) {
+    return false;
+  }
+  CPU_ZERO(&on_node);
+  bool any = false;
+  for (uint32_t cpu = 0; cpu < topology->num_cpus && cpu < CPU_SETSIZE; cpu++) {
+    if (topology->cpu_node[cpu] == node && CPU_ISSET(cpu, &saved)) {
+      CPU_SET(cpu, &on_node);
+      any = true;
+    }
+  }
+  if (!any || sched_setaffinity(0, sizeof(on_node), &on_node) != 0) {
+    return false;
+  }
+  fn(arg);
+  sched_setaffinity(0, sizeof(saved), &saved);
+  return true;
+#else
+  (void)topology;
+  if (node != 0) {
+    return false;
+  }
+  fn(arg);
+  return true;
+#endif
+}
@@ -0,0 +1,166 @@
+#include <math.h>
+#include "../include/triangle.h"
+
+void triangle_ray_init(TriangleRay *tray, const Ray *ray) {
+  const float *d = ray->direction.data;
+  int kz = 0;
+  for (int k = 1; k < 3; k++) {
+    if (fabsf(d[k]) > fabsf(d[kz])) {
+      kz = k;
+    }
+  }
+  int kx = (kz + 1) % 3;
+  int ky = (kx + 1) % 3;
+  // Keep the winding of the projected triangles independent of the
+  // direction's sign.
+  if (d[kz] < 0.0f) {
+    int tmp = kx;
+    kx = ky;
+    ky = tmp;
+  }
+  tray->origin = ray->origin;
+  tray->kx = kx;
+  tray->ky = ky;
+  tray->kz = kz;
+  tray->sx = d[kx] / d[kz];
+  tray->sy = d[ky] / d[kz];
+  tray->sz = 1.0f / d[kz];
+}
+
+// Vertex relative to the ray origin, sheared so the ray runs along +z. The
+// z coordinate is left unscaled; the distance applies sz once.
+static inline void project(const TriangleRay *tray, Vec3f p, float out[3]) {
+  float x = p.data[tray->kx] - tray->origin.data[tray->kx];
+  float y = p.data[tray->ky] - tray->origin.data[tray->ky];
+  float z = p.data[tray->kz] - tray->origin.data[tray->kz];
+  out[0] = x - tray->sx * z;
+  out[1] = y - tray->sy * z;
+  out[2] = z;
+}
+
+bool triangle_intersect(const TriangleRay *tray, Vec3f a, Vec3f b, Vec3f c, float t_max, float *t,
+                        float barycentric[3]) {
+  float pa[3], pb[3], pc[3];
+  project(tray, a, pa);
+  project(tray, b, pb);
+  project(tray, c, pc);
+
+  // Signed areas of the origin with each edge; u belongs to a (edge bc).
+  float u = pc[0] * pb[1] - pc[1] * pb[0];
+  float v = pa[0] * pc[1] - pa[1] * pc[0];
+  float w = pb[0] * pa[1] - pb[1] * pa[0];
+  if (u == 0.0f || v == 0.0f || w == 0.0f) {
+    u = (float)((double)pc[0] * pb[1] - (double)pc[1] * pb[0]);
+    v = (float)((double)pa[0] * pc[1] - (double)pa[1] * pc[0]);
+    w = (float)((double)pb[0] * pa[1] - (double)pb[1] * pa[0]);
+  }
+  if (!((u >= 0.0f && v >= 0.0f && w >= 0.0f) || (u <= 0.0f && v <= 0.0f && w <= 0.0f))) {
+    return false;
+  }
+  float det = u + v + w;
+  if (det == 0.0f) {
+    return false;
+  }
+  // Same expression as packet_edges, so both paths agree on distances.
+  float distance = tray->sz * (u * pa[2] + v * pb[2] + w * pc[2]) / det;
+  if (!(distance > 0.0f && distance < t_max)) {
+    return false;
+  }
+  *t = distance;
+  if (barycentric != NULL) {
+    barycentric[0] = u / det;
+    barycentric[1] = v / det;
+    barycentric[2] = w / det;
+  }
+  return true;
+}
+
+void triangle_packet_clear(TrianglePacket *packet) {
+  for (int corner = 0; corner < 3; corner++) {
+    for (int k = 0; k < 3; k++) {
+      for (int lane = 0; lane < TRIANGLE_PACKET_WIDTH; lane++) {
+        packet->vertices[corner][k][lane] = NAN;
+      }
+    }
+  }
+  for (int lane = 0; lane < TRIANGLE_PACKET_WIDTH; lane++) {
+    packet->prim_ids[lane] = UINT32_MAX;
+  }
+}
+
+void triangle_packet_set(TrianglePacket *packet, int lane, Vec3f a, Vec3f b, Vec3f c, uint32_t prim_id) {
+  const Vec3f corners[3] = { a, b, c };
+  for (int corner = 0; corner < 3; corner++) {
+    for (int k = 0; k < 3; k++) {
+      packet->vertices[corner][k][lane] = corners[corner].data[k];
+    }
+  }
+  packet->prim_ids[lane] = prim_id;
+}
+
+static inline Vec3f lane_vertex(const TrianglePacket *packet, int corner, int lane) {
+  return vec3f_init_values(packet->vertices[corner][0][lane], packet->vertices[corner][1][lane],
+                           packet->vertices[corner][2][lane]);
+}
+
+// The arithmetic and acceptance test of triangle_intersect for every lane,
+// without branches so that it vectorizes: t is the distance, or infinity
+// for a miss. Lanes on an edge (an edge function of exactly 0) are flagged
+// for the scalar path and its double precision retest. The rows are the
+// packet's coordinate arrays already permuted into the ray's (x, y, z); the
+// restrict parameters spare the compiler alias checks against the outputs.
+static void packet_lanes(const float *restrict ax, const float *restrict ay, const float *restrict az,
+                         const float *restrict bx, const float *restrict by, const float *restrict bz,
+                         const float *restrict cx, const float *restrict cy, const float *restrict cz,
+                         const TriangleRay *tray, float *restrict t, int *restrict on_edge) {
+  const float ox = tray->origin.data[tray->kx];
+  const float oy = tray->origin.data[tray->ky];
+  const float oz = tray->origin.data[tray->kz];
+  const float sx = tray->sx;
+  const float sy = tray->sy;
+  const float sz = tray->sz;
+
+  for (int i = 0; i < TRIANGLE_PACKET_WIDTH; i++) {
+    float a_z = az[i] - oz;
+    float b_z = bz[i] - oz;
+    float c_z = cz[i] - oz;
+    float a_x = (ax[i] - ox) - sx * a_z;
+    float a_y = (ay[i] - oy) - sy * a_z;
+    float b_x = (bx[i] - ox) - sx * b_z;
+    float b_y = (by[i] - oy) - sy * b_z;
+    float c_x = (cx[i] - ox) - sx * c_z;
+    float c_y = (cy[i] - oy) - sy * c_z;
+    float u = c_x * b_y - c_y * b_x;
+    float v = a_x * c_y - a_y * c_x;
+    float w = b_x * a_y - b_y * a_x;
+    float distance = sz * (u * a_z + v * b_z + w * c_z) / (u + v + w);
+    // NaN lanes fail every comparison.
+    int inside = (u > 0.0f && v > 0.0f && w > 0.0f) | (u < 0.0f && v < 0.0f && w < 0.0f);
+    t[i] = (inside & (distance > 0.0f)) ? distance : INFINITY;
+    on_edge[i] = (u == 0.0f) | (v == 0.0f) | (w == 0.0f);
+  }
+}
+
+bool triangle_packet_intersect(const TrianglePacket *packet, const TriangleRay *tray, Hit *hit) {
+  float t[TRIANGLE_PACKET_WIDTH];
+  int on_edge[TRIANGLE_PACKET_WIDTH];
+  const int kx = tray->kx, ky = tray->ky, kz = tray->kz;
+  packet_lanes(packet->vertices[0][kx], packet->vertices[0][ky], packet->vertices[0][kz], packet->vertices[1][kx],
+               packet->vertices[1][ky], packet->vertices[1][kz], packet->vertices[2][kx], packet->vertices[2][ky],
+               packet->vertices[2][kz], tray, t, on_edge);
+
+  bool found = false;
+  for (int lane = 0; lane < TRIANGLE_PACKET_WIDTH; lane++) {
+    float distance = t[lane];
+    if (on_edge[lane] && !triangle_intersect(tray, lane_vertex(packet, 0, lane), lane_vertex(packet, 1, lane),
+                                             lane_vertex(packet, 2, lane), hit->t, &distance, NULL)) {
+      continue;
+    }
+    if (distance < hit->t) {
+      hit->t = distance;
+      hit->prim_id = packet->prim_ids[lane];
+      found = true;
+    }
+  }
+  return found;
+}
@@ -0,0 +1,186 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/perf.h"
+#include "../include/workers.h"
+
+// Adjacent items a group takes at once, per worker in it.
+#define WORKERS_RUN_PER_WORKER 2
+
+struct WorkerGroup {
+  pthread_mutex_t lock;
+  uint32_t next; // the group's run is [next, end)
+  uint32_t end;
+  uint32_t size; // workers in the group
+  uint32_t core; // topology core of its CPUs; unused when not pinned
+};
+
+bool workers_init(Workers *workers, int num_workers, bool pin) {
+  memset(workers, 0, sizeof(*workers));
+  const Topology *topology = topology_get();
+  uint32_t *cpus = (uint32_t *)malloc((topology->num_cpus > 0 ? topology->num_cpus : 1) * sizeof(uint32_t));
+  if (cpus == NULL) {
+    return false;
+  }
+  uint32_t num_cpus = topology_worker_cpus(topology, cpus, topology->num_cpus);
+  if (num_cpus > topology->num_cpus) {
+    num_cpus = topology->num_cpus;
+  }
+  if (num_workers <= 0) {
+    num_workers = num_cpus > 0 ? (int)num_cpus : 1;
+  }
+  pin = pin && num_cpus > 0;
+
+  workers->num_workers = num_workers;
+  workers->pinned = pin;
+  workers->cpus = (int *)malloc(num_workers * sizeof(int));
+  workers->group = (uint32_t *)malloc(num_workers * sizeof(uint32_t));
+  workers->groups = (WorkerGroup *)calloc(num_workers, sizeof(WorkerGroup));
+  workers->work = (uint64_t *)calloc(num_workers, sizeof(uint64_t));
+  workers->seconds = (double *)calloc(num_workers, sizeof(double));
+  if (workers->cpus == NULL || workers->group == NULL || workers->groups == NULL || workers->work == NULL ||
+      workers->seconds == NULL) {
+    free(cpus);
+    workers_free(workers);
+    return false;
+  }
+
+  // Pinned, workers on CPUs of one core share a group; groups are numbered
+  // in the order their first worker comes.
+  uint32_t max_run = 0;
+  for (int w = 0; w < num_workers; w++) {
+    workers->cpus[w] = pin ? (int)cpus[w % num_cpus] : -1;
+    uint32_t group = workers->num_groups;
+    if (pin) {
+      uint32_t core = topology->cpu_core[cpus[w % num_cpus]];
+      for (uint32_t g = 0; g < workers->num_groups; g++) {
+        if (workers->groups[g].core == core) {
+          group = g;
+          break;
+        }
+      }
+      workers->groups[group].core = core;
+    }
+    if (group == workers->num_groups) {
+      pthread_mutex_init(&workers->groups[group].lock, NULL);
+      workers->num_groups++;
+    }
+    workers->group[w] = group;
+    workers->groups[group].size++;
+    if (workers->groups[group].size > max_run) {
+      max_run = workers->groups[group].size;
+    }
+  }
+  workers->run_length = max_run * WORKERS_RUN_PER_WORKER;
+  free(cpus);
+  return true;
+}
+
+void workers_free(Workers *workers) {
+  for (uint32_t g = 0; g < workers->num_groups; g++) {
+    pthread_mutex_destroy(&workers->groups[g].lock);
+  }
+  free(workers->cpus);
+  free(workers->group);
+  free(workers->groups);
+  free(workers->work);
+  free(workers->seconds);
+  memset(workers, 0, sizeof(*workers));
+}
+
+bool workers_next_item(Workers *workers, int worker, uint32_t *item) {
+  WorkerGroup *group = &workers->groups[workers->group[worker]];
+  pthread_mutex_lock(&group->lock);
+  if (group->next >= group->end) {
+    uint32_t start = atomic_fetch_add(&workers->next_run, workers->run_length);
+    if (start < workers->num_items) {
+      uint32_t left = workers->num_items - start;
+      group->next = start;
+      group->end = start + (left < workers->run_length ? left : workers->run_length);
+    }
+  }
+  bool found = group->next < group->end;
+  if (found) {
+    *item = group->next++;
+  }
+  pthread_mutex_unlock(&group->lock);
+  return found;
+}
+
+typedef struct {
+  Workers *workers;
+  int worker;
+  uint64_t (*fn)(int worker, void *arg);
+  void *arg;
+} WorkerStart;
+
+static void *worker_main(void *data) {
+  WorkerStart *start = (WorkerStart *)data;
+  Workers *workers = start->workers;
+  int w = start->worker;
+  // A worker that can't be pinned still works, where the OS puts it.
+  if (workers->cpus[w] >= 0) {
+    topology_pin((uint32_t)workers->cpus[w]);
+  }
+  double begin = perf_now_seconds();
+  workers->work[w] += start->fn(w, start->arg);
+  workers->seconds[w] += perf_now_seconds() - begin;
+  return NULL;
+}
+
+int workers_run(Workers *workers, uint32_t num_items, uint64_t (*fn)(int worker, void *arg), void *arg) {
+  pthread_t *threads = (pthread_t *)malloc(workers->num_workers * sizeof(pthread_t));
+  WorkerStart *starts = (WorkerStart *)malloc(workers->num_workers * sizeof(WorkerStart));
+  if (threads == NULL || starts == NULL) {
+    free(threads);
+    free(starts);
+    return 0;
+  }
+  workers->num_items = num_items;
+  atomic_store(&workers->next_run, 0);
+  for (uint32_t g = 0; g < workers->num_groups; g++) {
+    workers->groups[g].next = workers->groups[g].end = 0;
+  }
+  int started = 0;
+  for (int w = 0; w < workers->num_workers; w++) {
+    starts[w] = (WorkerStart){ workers, w, fn, arg };
+    if (pthread_create(&threads[w], NULL, worker_main, &starts[w]) != 0) {
+      break;
+    }
+    started++;
+  }
+  for (int w = 0; w < started; w++) {
+    pthread_join(threads[w], NULL);
+  }
+  free(threads);
+  free(starts);
+  return started;
+}
+
+void workers_report(const Workers *workers, const char *label, FILE *out) {
+  const Topology *topology = topology_get();
+  for (int w = 0; w < workers->num_workers; w++) {
+    double rate = workers->seconds[w] > 0.0 ? workers->work[w] / workers->seconds[w] / 1e6 : 0.0;
+    if (workers->cpus[w] >= 0) {
+      uint32_t cpu = (uint32_t)workers->cpus[w];
+      fprintf(out, "worker %d: cpu %u (node %u, core %u, thread %u) %.3f M%s/s\n", w, cpu, topology->cpu_node[cpu],
+              topology->cpu_core[cpu], topology->cpu_thread[cpu], rate, label);
+    } else {
+      fprintf(out, "worker %d: unpinned %.3f M%s/s\n", w, rate, label);
+    }
+  }
+  if (!workers->pinned) {
+    return;
+  }
+  // A core's rate is the sum of its workers', each over its own time.
+  for (uint32_t g = 0; g < workers->num_groups; g++) {
+    double rate = 0.0;
+    for (int w = 0; w < workers->num_workers; w++) {
+      if (workers->group[w] == g && workers->seconds[w] > 0.0) {
+        rate += workers->work[w] / workers->seconds[w] / 1e6;
+      }
+    }
+    fprintf(out, "core %u: %u worker%s %.3f M%s/s\n", workers->groups[g].core, workers->groups[g].size,
+            workers->groups[g].size == 1 ? "" : "s", rate, label);
+  }
+}
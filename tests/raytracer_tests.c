@@ -0,0 +1,364 @@
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/bvh_cache.h"
+#include "../include/environment.h"
+#include "../include/scene_io.h"
+#include "../include/triangle.h"
+
+// Checks behavior the renderer relies on but the images don't show at a
+// glance: file formats that must reject corrupt input, the BVH cache, the
+// environment's alias table, watertight triangles, and the grid and
+// quantized BVH against brute force. Run by ctest: each test stops at its
+// first failed check, and the run fails if any test did.
+
+static int failures = 0;
+
+#define CHECK(condition)                                                            \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                             \
+            return;                                                                 \
+        }                                                                           \
+    } while (0)
+
+static char temp_dir[256];
+
+static void temp_path(char *buffer, size_t size, const char *name) {
+    snprintf(buffer, size, "%s/%s", temp_dir, name);
+}
+
+static bool copy_file(const char *from, const char *to, size_t truncate_to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    bool ok = in != NULL && out != NULL;
+    char buffer[4096];
+    size_t total = 0;
+    size_t n;
+    while (ok && total < truncate_to && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        n = n < truncate_to - total ? n : truncate_to - total;
+        ok = fwrite(buffer, 1, n, out) == n;
+        total += n;
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL) {
+        ok = fclose(out) == 0 && ok;
+    }
+    return ok;
+}
+
+static long file_size(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+// Overwrites size bytes at offset with value.
+static bool fill_bytes(const char *path, long offset, size_t size, unsigned char value) {
+    FILE *file = fopen(path, "r+b");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fseek(file, offset, SEEK_SET) == 0;
+    for (size_t i = 0; ok && i < size; i++) {
+        ok = fputc(value, file) != EOF;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+static void generate(Scene *scene, size_t num_spheres) {
+    SceneGenParams params;
+    scene_gen_params_default(&params);
+    params.num_spheres = num_spheres;
+    if (!scene_generate(scene, &params)) {
+        fprintf(stderr, "scene_generate failed\n");
+        exit(1);
+    }
+}
+
+static void test_binary_scene(void) {
+    char path[512], corrupt[512];
+    temp_path(path, sizeof(path), "scene.bin");
+    temp_path(corrupt, sizeof(corrupt), "corrupt.bin");
+
+    Scene scene, loaded;
+    generate(&scene, 2000);
+    CHECK(scene_build_bvh(&scene, false));
+    CHECK(scene_save_binary(&scene, path));
+    CHECK(scene_load_binary(&loaded, path));
+    CHECK(loaded.num_spheres == scene.num_spheres);
+    CHECK(memcmp(loaded.spheres, scene.spheres, scene.num_spheres * sizeof(Sphere)) == 0);
+    CHECK(loaded.num_materials == scene.num_materials && loaded.num_lights == scene.num_lights);
+    CHECK(loaded.bvh.num_nodes == scene.bvh.num_nodes);
+    CHECK(memcmp(loaded.bvh.nodes, scene.bvh.nodes, scene.bvh.num_nodes * sizeof(BVHNode)) == 0);
+    CHECK(memcmp(loaded.bvh.prim_indices, scene.bvh.prim_indices, scene.bvh.num_prims * sizeof(uint32_t)) == 0);
+    scene_free(&loaded);
+
+    long size = file_size(path);
+    CHECK(size > 0);
+
+    // Truncated: the sections run past the end of the file.
+    CHECK(copy_file(path, corrupt, (size_t)size / 2));
+    CHECK(!scene_load_binary(&loaded, corrupt));
+
+    // Not a binary scene.
+    CHECK(copy_file(path, corrupt, (size_t)size));
+    CHECK(fill_bytes(corrupt, 0, 1, 'X'));
+    CHECK(!scene_load_binary(&loaded, corrupt));
+
+    // The BVH nodes overwritten with garbage. The nodes come after the
+    // spheres, so find them by their contents.
+    CHECK(copy_file(path, corrupt, (size_t)size));
+    FILE *file = fopen(path, "rb");
+    CHECK(file != NULL);
+    unsigned char *bytes = (unsigned char *)malloc((size_t)size);
+    bool read = bytes != NULL && fread(bytes, 1, (size_t)size, file) == (size_t)size;
+    fclose(file);
+    long nodes_offset = -1;
+    for (long i = 0; read && i + (long)sizeof(BVHNode) <= size; i++) {
+        if (memcmp(bytes + i, scene.bvh.nodes, sizeof(BVHNode)) == 0) {
+            nodes_offset = i;
+            break;
+        }
+    }
+    free(bytes);
+    CHECK(nodes_offset >= 0);
+    CHECK(fill_bytes(corrupt, nodes_offset, 4 * sizeof(BVHNode), 0xff));
+    CHECK(!scene_load_binary(&loaded, corrupt));
+
+    scene_free(&scene);
+    unlink(path);
+    unlink(corrupt);
+}
+
+// The one cache file in the cache directory.
+static bool find_cache_file(char *buffer, size_t size) {
+    DIR *dir = opendir(temp_dir);
+    if (dir == NULL) {
+        return false;
+    }
+    bool found = false;
+    struct dirent *entry;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "bvh-", 4) == 0) {
+            snprintf(buffer, size, "%s/%s", temp_dir, entry->d_name);
+            found = true;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+// A hit maps the cache file and uses it in place; a miss builds and owns
+// its arrays.
+static void test_bvh_cache(void) {
+    Scene scene;
+    generate(&scene, BVH_CACHE_MIN_PRIMS);
+    BVH built, cached;
+    CHECK(bvh_build(&built, scene.spheres, scene.num_spheres, NULL, NULL));
+
+    CHECK(bvh_cache_load_or_build(&cached, scene.spheres, scene.num_spheres, NULL));
+    CHECK(cached.mapping == NULL);
+    bvh_free(&cached);
+
+    char path[512];
+    CHECK(find_cache_file(path, sizeof(path)));
+    long size = file_size(path);
+    CHECK(size > 0);
+
+    CHECK(bvh_cache_load_or_build(&cached, scene.spheres, scene.num_spheres, NULL));
+    CHECK(cached.mapping != NULL);
+    CHECK(cached.num_nodes == built.num_nodes);
+    CHECK(memcmp(cached.nodes, built.nodes, built.num_nodes * sizeof(BVHNode)) == 0);
+    CHECK(memcmp(cached.prim_indices, built.prim_indices, built.num_prims * sizeof(uint32_t)) == 0);
+    bvh_free(&cached);
+
+    // Everything after the header overwritten: a miss, and the file is
+    // rewritten.
+    CHECK(fill_bytes(path, 128, (size_t)size - 128, 0xff));
+    CHECK(bvh_cache_load_or_build(&cached, scene.spheres, scene.num_spheres, NULL));
+    CHECK(cached.mapping == NULL);
+    CHECK(memcmp(cached.nodes, built.nodes, built.num_nodes * sizeof(BVHNode)) == 0);
+    bvh_free(&cached);
+    CHECK(bvh_cache_load_or_build(&cached, scene.spheres, scene.num_spheres, NULL));
+    CHECK(cached.mapping != NULL);
+    bvh_free(&cached);
+
+    // Truncated: a miss as well.
+    CHECK(truncate(path, size / 2) == 0);
+    CHECK(bvh_cache_load_or_build(&cached, scene.spheres, scene.num_spheres, NULL));
+    CHECK(cached.mapping == NULL);
+    bvh_free(&cached);
+
+    bvh_free(&built);
+    scene_free(&scene);
+    unlink(path);
+}
+
+// Texels are picked in proportion to the table's pmf, and black ones never.
+static void test_environment_sampling(void) {
+    enum { WIDTH = 4, HEIGHT = 2, SAMPLES = 400000 };
+    const unsigned char grey[WIDTH * HEIGHT] = { 10, 40, 0, 160, 200, 255, 30, 120 };
+    unsigned char pixels[WIDTH * HEIGHT * 3];
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        pixels[3 * i] = pixels[3 * i + 1] = pixels[3 * i + 2] = grey[i];
+    }
+    Environment environment;
+    CHECK(environment_init(&environment, pixels, WIDTH, HEIGHT, 3));
+
+    int counts[WIDTH * HEIGHT] = { 0 };
+    Rng rng;
+    rng_seed(&rng, 1, 0);
+    for (int s = 0; s < SAMPLES; s++) {
+        Vec3f direction;
+        float pdf;
+        Vec3f radiance = environment_sample(&environment, &rng, &direction, &pdf);
+        // Every texel has its own grey level, so the radiance tells which
+        // one was picked.
+        int texel = -1;
+        for (int t = 0; t < WIDTH * HEIGHT; t++) {
+            if (radiance.data[0] == environment.radiance[t].data[0]) {
+                texel = t;
+            }
+        }
+        CHECK(texel >= 0 && pdf > 0.0f);
+        counts[texel]++;
+    }
+    for (int t = 0; t < WIDTH * HEIGHT; t++) {
+        CHECK(fabsf((float)counts[t] / SAMPLES - environment.pmf[t]) < 0.005f);
+    }
+    CHECK(environment.pmf[2] == 0.0f && counts[2] == 0);
+    environment_free(&environment);
+}
+
+// Two triangles share the diagonal of the unit square: rays through any
+// point of the diagonal, at any angle, must hit at least one of them.
+static void test_watertight_triangles(void) {
+    Vec3f a = vec3f_init_values(0.0f, 0.0f, 0.0f);
+    Vec3f b = vec3f_init_values(1.0f, 0.0f, 0.0f);
+    Vec3f c = vec3f_init_values(1.0f, 1.0f, 0.0f);
+    Vec3f d = vec3f_init_values(0.0f, 1.0f, 0.0f);
+    TriangleRay tray;
+    float t, barycentric[3];
+
+    Ray ray = ray_init(vec3f_init_values(0.25f, 0.25f, 1.0f), vec3f_init_values(0.0f, 0.0f, -1.0f));
+    triangle_ray_init(&tray, &ray);
+    CHECK(triangle_intersect(&tray, a, b, d, SCENE_MAX_DISTANCE, &t, barycentric));
+    CHECK(fabsf(t - 1.0f) < 1e-6f);
+    CHECK(fabsf(barycentric[0] - 0.5f) < 1e-6f && fabsf(barycentric[1] - 0.25f) < 1e-6f);
+    CHECK(!triangle_intersect(&tray, b, c, d, SCENE_MAX_DISTANCE, &t, NULL));
+    CHECK(!triangle_intersect(&tray, a, b, d, 0.5f, &t, NULL));
+
+    const Vec3f directions[] = {
+        vec3f_init_values(0.0f, 0.0f, -1.0f),
+        vec3f_normalize(vec3f_init_values(0.3f, 0.2f, -1.0f)),
+        vec3f_normalize(vec3f_init_values(-0.7f, 0.1f, -0.3f)),
+        vec3f_normalize(vec3f_init_values(0.1f, -0.9f, -0.2f)),
+    };
+    for (size_t k = 0; k < sizeof(directions) / sizeof(directions[0]); k++) {
+        for (int i = 1; i < 4096; i++) {
+            float x = i / 4096.0f;
+            Vec3f on_edge = vec3f_init_values(x, 1.0f - x, 0.0f);
+            Vec3f origin = vec3f_sub(on_edge, vec3f_init_values(directions[k].data[0] * 3.0f,
+                                                                directions[k].data[1] * 3.0f,
+                                                                directions[k].data[2] * 3.0f));
+            ray = ray_init(origin, directions[k]);
+            triangle_ray_init(&tray, &ray);
+            bool hit = triangle_intersect(&tray, a, b, d, SCENE_MAX_DISTANCE, &t, NULL) ||
+                       triangle_intersect(&tray, b, c, d, SCENE_MAX_DISTANCE, &t, NULL);
+            CHECK(hit);
+        }
+    }
+}
+
+// scene_trace through the given structure must find the same closest
+// sphere as testing every sphere.
+static void check_against_brute_force(Accel accel) {
+    Scene scene;
+    generate(&scene, 3000);
+    scene.settings.accel = accel;
+    CHECK(scene_build_accel(&scene, false));
+    CHECK(accel == ACCEL_GRID ? grid_built(&scene.grid) : scene.qbvh.num_nodes > 0);
+
+    float lo[3] = { INFINITY, INFINITY, INFINITY };
+    float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (size_t i = 0; i < scene.num_spheres; i++) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = fminf(lo[k], scene.spheres[i].center.data[k]);
+            hi[k] = fmaxf(hi[k], scene.spheres[i].center.data[k]);
+        }
+    }
+
+    Rng rng;
+    rng_seed(&rng, 7, (uint64_t)accel);
+    int hits = 0;
+    for (int r = 0; r < 20000; r++) {
+        Vec3f origin = vec3f_init_values(rng_range(&rng, lo[0], hi[0]), rng_range(&rng, lo[1], hi[1]),
+                                         rng_range(&rng, lo[2], hi[2]));
+        Vec3f direction = vec3f_normalize(vec3f_init_values(rng_range(&rng, -1.0f, 1.0f),
+                                                            rng_range(&rng, -1.0f, 1.0f),
+                                                            rng_range(&rng, -1.0f, 1.0f)));
+        Ray ray = ray_init(origin, direction);
+        Hit expected, hit;
+        expected.t = SCENE_MAX_DISTANCE;
+        expected.instance_id = HIT_NO_INSTANCE;
+        bool found = scene_intersect(&ray, scene.spheres, scene.num_spheres, &expected);
+        CHECK(scene_trace(&scene, &ray, &hit) == found);
+        if (found) {
+            CHECK(hit.prim_id == expected.prim_id);
+            CHECK(fabsf(hit.t - expected.t) <= 1e-5f * expected.t);
+            hits++;
+        }
+    }
+    CHECK(hits > 1000);
+    scene_free(&scene);
+}
+
+static void test_grid(void) {
+    check_against_brute_force(ACCEL_GRID);
+}
+
+static void test_qbvh(void) {
+    check_against_brute_force(ACCEL_QBVH);
+}
+
+int main(void) {
+    const char *tmp = getenv("TMPDIR");
+    snprintf(temp_dir, sizeof(temp_dir), "%s/raytracer-tests-XXXXXX", tmp != NULL ? tmp : "/tmp");
+    if (mkdtemp(temp_dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    setenv("RAYTRACER_CACHE_DIR", temp_dir, 1);
+
+    const struct {
+        const char *name;
+        void (*run)(void);
+    } tests[] = {
+        { "binary scene", test_binary_scene },
+        { "BVH cache", test_bvh_cache },
+        { "environment sampling", test_environment_sampling },
+        { "watertight triangles", test_watertight_triangles },
+        { "grid", test_grid },
+        { "quantized BVH", test_qbvh },
+    };
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int before = failures;
+        tests[i].run();
+        printf("%s: %s\n", tests[i].name, failures == before ? "ok" : "FAILED");
+    }
+
+    rmdir(temp_dir);
+    return failures == 0 ? 0 : 1;
+}